@@ -6,9 +6,704 @@
 
 #include <iostream>
 #include <numbers>
+#include <vector>
+#include <chrono>
+#include <limits>
+#include <string>
 #include "beepengine.h"
 #include "fft.h"
 
+// Self-checks against a running engine. Each test prints its name; a failed check prints its condition and line, and
+// main returns nonzero if any check failed.
+
+static int g_failures = 0;
+
+static void Check(bool condition, const wchar_t* text, int line)
+{
+	if (!condition)
+	{
+		std::wcout << L"  FAILED (line " << line << L"): " << text << L"\n";
+		++g_failures;
+	}
+}
+
+#define WIDEN2(text) L ## text
+#define WIDEN(text) WIDEN2(text)
+#define CHECK(condition) Check((condition), WIDEN(#condition), __LINE__)
+
+static double MillisecondsSince(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void TestBlockingBeep()
+{
+	std::wcout << L"TestBlockingBeep\n";
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	BeepEngineBeep(440.0f, 0.2f);
+	BeepEngineBeep(660.0f, 0.2f);
+	CHECK(MillisecondsSince(start) >= 350.0);
+
+	start = std::chrono::steady_clock::now();
+	BeepEngineBeepAsync(440.0f, 0.2f);
+	CHECK(MillisecondsSince(start) < 100.0);
+}
+
+static void TestEventWaits()
+{
+	std::wcout << L"TestEventWaits\n";
+	BeepScoreHandle score = BeepEngineCreateScore();
+	BeepEngineScoreAddEvent(score, 0.3f, 101u);
+	BeepEngineScoreAddEvent(score, 0.1f, 102u);
+	BeepEngineScoreAddEvent(score, 0.5f, 103u);
+	CHECK(BeepEngineScoreSubmit(score));
+
+	// a wait that times out leaves the event to later waits
+	CHECK(BeepEngineWaitForEventTimeout(101u, 10u) == BeepEventStatus_Timeout);
+
+	UINT32 ids[2] = { 101u, 102u };
+	UINT32 first = 0u;
+	CHECK(BeepEngineWaitForAnyEvent(ids, 2u, 5000u, &first) == BeepEventStatus_Occurred);
+	CHECK(first == 102u);
+	CHECK(BeepEngineWaitForEventTimeout(101u, 5000u) == BeepEventStatus_Occurred);
+	CHECK(BeepEngineWaitForEventTimeout(103u, 5000u) == BeepEventStatus_Occurred);
+	CHECK(BeepEngineWaitForEventTimeout(104u, 5000u) == BeepEventStatus_NotScheduled);
+	BeepEngineDestroyScore(score);
+}
+
+static BeepScoreFileRecord EventRecord(double startTime, UINT32 eventId)
+{
+	BeepScoreFileRecord record = {};
+	record.startTime = startTime;
+	record.kind = BeepScoreRecordKind_Event;
+	record.eventId = eventId;
+	return record;
+}
+
+// A record the engine cannot schedule ends a score file, and the events after it are never scheduled.
+static void TestScoreFile()
+{
+	std::wcout << L"TestScoreFile\n";
+	BeepScoreFileRecord records[4] =
+	{
+		EventRecord(0.05, 201u),
+		EventRecord(0.1, 202u),
+		EventRecord(-1.0, 203u),
+		EventRecord(0.2, 204u),
+	};
+	records[1].kind = BeepScoreRecordKind_Note;
+	records[1].frequency = 440.0f;
+	records[1].amplitude = 0.2f;
+	records[1].duration = 0.1f;
+
+	BeepScoreFileHeader header = {};
+	memcpy(header.magic, BEEP_SCORE_FILE_MAGIC, sizeof(header.magic));
+	header.version = BEEP_SCORE_FILE_VERSION;
+	header.recordSize = sizeof(BeepScoreFileRecord);
+	header.recordCount = 4u;
+	HANDLE hFile = CreateFile(L"selftest.beepscore", GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+	CHECK(hFile != INVALID_HANDLE_VALUE);
+	if (hFile == INVALID_HANDLE_VALUE) return;
+	DWORD written = 0u;
+	CHECK(WriteFile(hFile, &header, sizeof(header), &written, nullptr));
+	CHECK(WriteFile(hFile, records, sizeof(records), &written, nullptr));
+	CloseHandle(hFile);
+
+	CHECK(BeepEnginePlayScoreFile(L"selftest.beepscore", 0.1f));
+	CHECK(BeepEngineWaitForEventTimeout(201u, 5000u) == BeepEventStatus_Occurred);
+	CHECK(BeepEngineWaitForEventTimeout(203u, 5000u) == BeepEventStatus_NotScheduled);
+	CHECK(BeepEngineWaitForEventTimeout(204u, 5000u) == BeepEventStatus_NotScheduled);
+
+	// the file stays mapped until the housekeeper has destroyed the stream
+	Sleep(200);
+	DeleteFile(L"selftest.beepscore");
+}
+
+// Once it has faded in, a partial at the centre of an analyzer bin should read as a Hann-windowed cosine: its amplitude
+// in that bin, half of it in the bins on either side, and nothing anywhere else. The bin is between two bins of the
+// additive bank's frame, so the bank's kernel has to be interpolated.
+static void TestPartialSpectrum()
+{
+	std::wcout << L"TestPartialSpectrum\n";
+	UINT64 renderPosition = 0u;
+	UINT64 playPosition = 0u;
+	UINT32 sampleRate = 0u;
+	CHECK(BeepEngineGetClock(&renderPosition, &playPosition, &sampleRate));
+	UINT32 binCount = BeepEngineGetSpectrumBinCount();
+	UINT32 size = (binCount - 1u) * 2u;
+	const UINT32 bin = 41u;
+	const float amplitude = 0.5f;
+
+	BeepEngineEnableSpectrumAnalyzer(true);
+	BeepScoreHandle score = BeepEngineCreateScore();
+	BeepEngineScoreAddPartial(score, 0.0f, (float)bin * sampleRate / size, amplitude, 1.0f);
+	BeepEngineScoreAddEvent(score, 0.5f, 301u);
+	BeepEngineScoreAddEvent(score, 1.1f, 302u);
+	CHECK(BeepEngineScoreSubmit(score));
+	CHECK(BeepEngineWaitForEventTimeout(301u, 5000u) == BeepEventStatus_Occurred);
+
+	std::vector<float> magnitudes(binCount);
+	UINT64 sequence = 0u;
+	CHECK(BeepEngineGetSpectrum(magnitudes.data(), binCount, &sequence) == binCount);
+	float worst = 0.0f;
+	for (UINT32 k = 0; k < binCount; ++k)
+	{
+		float expected = (k == bin) ? amplitude : (k + 1u == bin || k == bin + 1u) ? amplitude * 0.5f : 0.0f;
+		worst = (std::max)(worst, fabsf(magnitudes[k] - expected));
+	}
+	CHECK(worst < 0.005f);
+
+	CHECK(BeepEngineWaitForEventTimeout(302u, 5000u) == BeepEventStatus_Occurred);
+	BeepEngineEnableSpectrumAnalyzer(false);
+	BeepEngineDestroyScore(score);
+}
+
+// A suspended engine keeps running but its clock stands still, and an event scheduled before the suspend happens after
+// the resume. An instance created suspended does not advance until it is resumed either.
+static void TestSuspendResume()
+{
+	std::wcout << L"TestSuspendResume\n";
+	BeepScoreHandle score = BeepEngineCreateScore();
+	BeepEngineScoreAddEvent(score, 0.3f, 321u);
+	CHECK(BeepEngineScoreSubmit(score));
+	CHECK(BeepEngineSuspend());
+	CHECK(BeepEngineIsSuspended());
+	CHECK(IsBeepEngineRunning());
+
+	UINT64 renderBefore = 0u;
+	UINT64 playBefore = 0u;
+	UINT64 renderAfter = 0u;
+	UINT64 playAfter = 0u;
+	UINT32 sampleRate = 0u;
+	CHECK(BeepEngineGetClock(&renderBefore, &playBefore, &sampleRate));
+	CHECK(BeepEngineWaitForEventTimeout(321u, 500u) == BeepEventStatus_Timeout);
+	CHECK(BeepEngineGetClock(&renderAfter, &playAfter, &sampleRate));
+	CHECK(renderAfter == renderBefore && playAfter == playBefore);
+
+	CHECK(BeepEngineResume());
+	CHECK(!BeepEngineIsSuspended());
+	CHECK(BeepEngineWaitForEventTimeout(321u, 2000u) == BeepEventStatus_Occurred);
+	BeepEngineDestroyScore(score);
+
+	BeepEngineHandle engine = BeepEngineCreateSuspendedInstance();
+	CHECK(engine != nullptr);
+	if (engine == nullptr) return;
+	CHECK(BeepEngineInstanceIsSuspended(engine));
+	Sleep(200);
+	CHECK(BeepEngineInstanceGetClock(engine, &renderBefore, &playBefore, &sampleRate));
+	CHECK(playBefore == 0u);
+	CHECK(BeepEngineInstanceResume(engine));
+	score = BeepEngineCreateScore();
+	BeepEngineScoreAddEvent(score, 0.1f, 322u);
+	CHECK(BeepEngineInstanceScoreSubmit(engine, score));
+	CHECK(BeepEngineInstanceWaitForEventTimeout(engine, 322u, 2000u) == BeepEventStatus_Occurred);
+	CHECK(BeepEngineInstanceGetClock(engine, &renderAfter, &playAfter, &sampleRate));
+	CHECK(playAfter > 0u);
+	BeepEngineDestroyScore(score);
+	BeepEngineDestroyInstance(engine);
+}
+
+// Plays two tones, each half a bin above a spectrum bin so that every buffer is the negation of the one before it, and
+// reads the spectrum at those bins once the tones are steady.
+static void MeasureHalfBinTones(const UINT32* bins, UINT32 eventId, float* magnitudesAtBins)
+{
+	UINT64 renderPosition = 0u;
+	UINT64 playPosition = 0u;
+	UINT32 sampleRate = 0u;
+	CHECK(BeepEngineGetClock(&renderPosition, &playPosition, &sampleRate));
+	UINT32 binCount = BeepEngineGetSpectrumBinCount();
+	UINT32 size = (binCount - 1u) * 2u;
+
+	BeepScoreHandle score = BeepEngineCreateScore();
+	for (UINT32 t = 0; t < 2u; ++t)
+	{
+		BeepEngineScoreAddPartial(score, 0.0f, (bins[t] + 0.5f) * sampleRate / size, 0.25f, 1.5f);
+	}
+	BeepEngineScoreAddEvent(score, 1.0f, eventId);
+	BeepEngineScoreAddEvent(score, 1.6f, eventId + 1u);
+	CHECK(BeepEngineScoreSubmit(score));
+	CHECK(BeepEngineWaitForEventTimeout(eventId, 5000u) == BeepEventStatus_Occurred);
+
+	std::vector<float> magnitudes(binCount);
+	UINT64 sequence = 0u;
+	CHECK(BeepEngineGetSpectrum(magnitudes.data(), binCount, &sequence) == binCount);
+	for (UINT32 t = 0; t < 2u; ++t)
+	{
+		magnitudesAtBins[t] = magnitudes[bins[t]];
+	}
+
+	CHECK(BeepEngineWaitForEventTimeout(eventId + 1u, 5000u) == BeepEventStatus_Occurred);
+	BeepEngineDestroyScore(score);
+}
+
+// A steady sine through a linear filter comes out scaled by the filter's response at its frequency, which is summed
+// here straight from the impulse response. The taps are spread over several partitions, and since the tones change
+// sign from one buffer to the next, each partition has to be paired with the right past buffer. A response longer
+// than the limit is refused.
+static void TestConvolution()
+{
+	std::wcout << L"TestConvolution\n";
+	UINT32 size = (BeepEngineGetSpectrumBinCount() - 1u) * 2u;
+	const UINT32 bins[2] = { 41u, 97u };
+
+	std::vector<float> tooLong(static_cast<size_t>(size) * 256u + 1u, 0.0f);
+	tooLong[0] = 1.0f;
+	CHECK(!BeepEngineSetImpulseResponse(tooLong.data(), static_cast<UINT32>(tooLong.size())));
+
+	BeepEngineEnableSpectrumAnalyzer(true);
+	float unfiltered[2] = { 0.0f, 0.0f };
+	MeasureHalfBinTones(bins, 311u, unfiltered);
+
+	std::vector<float> impulseResponse(static_cast<size_t>(size) * 3u + 17u, 0.0f);
+	impulseResponse[0] = 0.5f;
+	impulseResponse[size + 5u] = -0.3f;
+	impulseResponse[2u * size + 100u] = 0.25f;
+	impulseResponse[3u * size + 16u] = 0.1f;
+	CHECK(BeepEngineSetImpulseResponse(impulseResponse.data(), static_cast<UINT32>(impulseResponse.size())));
+	float filtered[2] = { 0.0f, 0.0f };
+	MeasureHalfBinTones(bins, 313u, filtered);
+
+	for (UINT32 t = 0; t < 2u; ++t)
+	{
+		double omega = 2.0 * std::numbers::pi * (bins[t] + 0.5) / size;
+		double re = 0.0;
+		double im = 0.0;
+		for (size_t n = 0; n < impulseResponse.size(); ++n)
+		{
+			re += impulseResponse[n] * cos(omega * n);
+			im -= impulseResponse[n] * sin(omega * n);
+		}
+		CHECK(fabs(filtered[t] - unfiltered[t] * sqrt(re * re + im * im)) < 0.002);
+	}
+
+	BeepEngineEnableSpectrumAnalyzer(false);
+	CHECK(BeepEngineSetImpulseResponse(nullptr, 0u));
+}
+
+// With a rectangular window, each STFT frame is one real FFT (DoRealFFT) of samples starting half a frame before the
+// frame's centre. The second frame is checked against a direct DFT at every size up to 4096.
+static void TestRealFFT()
+{
+	std::wcout << L"TestRealFFT\n";
+	for (int size = 4; size <= 4096; size *= 2)
+	{
+		std::vector<float> samples(size);
+		UINT32 seed = 12345u + size;
+		for (int i = 0; i < size; ++i)
+		{
+			seed = seed * 1664525u + 1013904223u;
+			samples[i] = (float)(seed >> 8) / (float)(1u << 24) - 0.5f;
+		}
+
+		int frameCount = STFTGetFrameCount(size, size, size);
+		CHECK(frameCount == 2);
+		int binCount = size / 2 + 1;
+		std::vector<float> spectra((size_t)frameCount * binCount * 2);
+		CHECK(STFT(samples.data(), size, size, size, FFTWindow_Rectangular, spectra.data(), 1));
+
+		const float* frame = spectra.data() + (size_t)binCount * 2;
+		double worst = 0.0;
+		double largest = 0.0;
+		for (int k = 0; k < binCount; ++k)
+		{
+			double real = 0.0;
+			double imag = 0.0;
+			for (int n = 0; n < size / 2; ++n)
+			{
+				double angle = -2.0 * std::numbers::pi * (double)k * n / size;
+				real += samples[size / 2 + n] * cos(angle);
+				imag += samples[size / 2 + n] * sin(angle);
+			}
+			worst = (std::max)(worst, hypot(frame[k * 2] - real, frame[k * 2 + 1] - imag));
+			largest = (std::max)(largest, hypot(real, imag));
+		}
+		CHECK(worst <= 1e-5 * largest);
+	}
+}
+
+// ISTFT undoes STFT on every thread count's split of the work, for each window and a hop that lets the windows
+// overlap. A Hann or Blackman window with no overlap leaves samples that no frame sees, so both calls refuse it.
+static void TestSTFTRoundTrip()
+{
+	std::wcout << L"TestSTFTRoundTrip\n";
+	const int sampleCount = 100000;
+	const int frameSize = 1024;
+	std::vector<float> samples(sampleCount);
+	UINT32 seed = 54321u;
+	for (int i = 0; i < sampleCount; ++i)
+	{
+		seed = seed * 1664525u + 1013904223u;
+		samples[i] = (float)(seed >> 8) / (float)(1u << 24) - 0.5f;
+	}
+
+	const int windows[4] = { FFTWindow_Rectangular, FFTWindow_Hann, FFTWindow_Hamming, FFTWindow_Blackman };
+	for (int window : windows)
+	{
+		for (int threadCount = 1; threadCount <= 4; threadCount += 3)
+		{
+			const int hopSize = frameSize / 4;
+			int frameCount = STFTGetFrameCount(sampleCount, frameSize, hopSize);
+			std::vector<float> spectra((size_t)frameCount * (frameSize / 2 + 1) * 2);
+			CHECK(STFT(samples.data(), sampleCount, frameSize, hopSize, window, spectra.data(), threadCount));
+			std::vector<float> restored(sampleCount);
+			CHECK(ISTFT(spectra.data(), frameCount, frameSize, hopSize, window, restored.data(), sampleCount, threadCount));
+			float worst = 0.0f;
+			for (int i = 0; i < sampleCount; ++i)
+			{
+				worst = (std::max)(worst, fabsf(restored[i] - samples[i]));
+			}
+			CHECK(worst < 1.0e-4f);
+		}
+
+		int frameCount = STFTGetFrameCount(sampleCount, frameSize, frameSize);
+		std::vector<float> spectra((size_t)frameCount * (frameSize / 2 + 1) * 2);
+		std::vector<float> restored(sampleCount);
+		bool isCovered = (window == FFTWindow_Rectangular || window == FFTWindow_Hamming);
+		CHECK(STFT(samples.data(), sampleCount, frameSize, frameSize, window, spectra.data(), 0) == isCovered);
+		CHECK(ISTFT(spectra.data(), frameCount, frameSize, frameSize, window, restored.data(), sampleCount, 0) == isCovered);
+	}
+}
+
+// Every kernel this CPU supports is forced in turn, through imported wisdom, and checked against FFT at every size
+// from 1 to 65536, forwards and back.
+static void TestFFTKernels()
+{
+	std::wcout << L"TestFFTKernels\n";
+	FFTForgetWisdom();
+	std::vector<char> header(FFTExportWisdom(nullptr, 0));
+	FFTExportWisdom(header.data(), (int)header.size());
+
+	int features = FFTGetCpuFeatures();
+	for (int kernel = FFTKernel_Radix2; kernel <= FFTKernel_Radix4Avx; ++kernel)
+	{
+		if ((kernel == FFTKernel_Radix2Sse3 || kernel == FFTKernel_Radix4Sse3) && (features & FFTCpuFeature_Sse3) == 0) continue;
+		if ((kernel == FFTKernel_Radix2Avx || kernel == FFTKernel_Radix4Avx) && (features & FFTCpuFeature_Avx) == 0) continue;
+
+		std::string wisdom(header.data());
+		for (int size = 1; size <= 65536; size *= 2)
+		{
+			wisdom += std::to_string(size) + " " + std::to_string(kernel) + "\n";
+		}
+		CHECK(FFTImportWisdom(wisdom.c_str()));
+
+		for (int size = 1; size <= 65536; size *= 2)
+		{
+			std::vector<float> input((size_t)size * 2);
+			UINT32 seed = 777u + size;
+			for (float& value : input)
+			{
+				seed = seed * 1664525u + 1013904223u;
+				value = (float)(seed >> 8) / (float)(1u << 24) - 0.5f;
+			}
+
+			FFTPlanHandle plan = FFTCreatePlan(size, FFTPlanMode_Estimate);
+			CHECK(plan != nullptr);
+			if (plan == nullptr) continue;
+			CHECK(FFTPlanGetKernel(plan) == kernel);
+
+			std::vector<float> expected(input.size());
+			std::vector<float> actual(input.size());
+			std::vector<float> roundTrip(input.size());
+			CHECK(FFT(input.data(), expected.data(), size, false));
+			CHECK(FFTExecutePlan(plan, input.data(), actual.data(), false));
+			CHECK(FFTExecutePlan(plan, actual.data(), roundTrip.data(), true));
+			FFTDestroyPlan(plan);
+
+			double worst = 0.0;
+			double largest = 0.0;
+			double worstRoundTrip = 0.0;
+			for (size_t i = 0; i < input.size(); ++i)
+			{
+				worst = (std::max)(worst, (double)fabs(actual[i] - expected[i]));
+				largest = (std::max)(largest, (double)fabs(expected[i]));
+				worstRoundTrip = (std::max)(worstRoundTrip, (double)fabs(roundTrip[i] - input[i]));
+			}
+			CHECK(worst <= 1e-5 * largest);
+			CHECK(worstRoundTrip <= 1e-5);
+		}
+	}
+	FFTForgetWisdom();
+}
+
+// A score heavier than the engine's fixed pools: more notes than the beep queue holds, more partials and voices than the
+// engine plays at once, and a loop that is cancelled while it plays. None of it may touch the heap on the audio thread.
+// The count is only kept in builds with the allocation tripwire (debug builds), and is zero otherwise.
+static void TestNoAudioThreadAllocation()
+{
+	std::wcout << L"TestNoAudioThreadAllocation\n";
+	BeepScoreHandle pattern = BeepEngineCreateScore();
+	BeepEngineScoreAddNote(pattern, 0.0f, 880.0f, 0.05f, 0.02f);
+	BeepEngineScoreAddEvent(pattern, 0.01f, 500u);
+	CHECK(!BeepEngineScoreSubmitLoop(pattern, 0.05f, 0u, 0u)); // endless and ungrouped, so nothing could stop it
+	CHECK(BeepEngineScoreSubmitLoop(pattern, 0.05f, 0u, 8u));
+	BeepEngineDestroyScore(pattern);
+
+	// the events go in first, because whatever does not fit in the beep queue is dropped
+	BeepScoreHandle score = BeepEngineCreateScore();
+	for (UINT32 i = 0; i < 100u; ++i)
+	{
+		BeepEngineScoreAddEvent(score, 0.02f * i, 400u + i);
+	}
+	for (int i = 0; i < 5000; ++i)
+	{
+		BeepEngineScoreAddPartial(score, 0.0001f * i, 300.0f + i, 0.00005f, 0.5f);
+	}
+	for (int i = 0; i < 70000; ++i)
+	{
+		BeepEngineScoreAddNote(score, 0.00003f * i, 200.0f + (i % 800), 0.00005f, 0.2f);
+	}
+	CHECK(BeepEngineScoreSubmitToGroup(score, 7u));
+	BeepEngineDestroyScore(score);
+
+	CHECK(BeepEngineWaitForEventTimeout(450u, 10000u) == BeepEventStatus_Occurred);
+	BeepEngineCancelGroup(8u);
+	CHECK(BeepEngineWaitForEventTimeout(499u, 10000u) == BeepEventStatus_Occurred);
+	BeepEngineCancelGroup(7u);
+	Sleep(200);
+
+	CHECK(BeepEngineGetAudioThreadAllocationCount() == 0u);
+}
+
+// A client connected to the engine's own ring in this process: records that fail validation are thrown away, and a
+// valid event scheduled on the engine clock comes back through the completion ring.
+static void TestSharedRing()
+{
+	std::wcout << L"TestSharedRing\n";
+	CHECK(!BeepEngineOpenSharedRing(L"BeepEngineTestCpp.SharedRing", 100u, 64u));
+	CHECK(!BeepEngineOpenSharedRing(L"BeepEngineTestCpp.SharedRing", 64u, 0u));
+	CHECK(BeepEngineOpenSharedRing(L"BeepEngineTestCpp.SharedRing", 64u, 64u));
+
+	BeepSharedRingHandle writer = BeepSharedRingConnect(L"BeepEngineTestCpp.SharedRing");
+	BeepSharedRingHandle reader = BeepSharedRingConnect(L"BeepEngineTestCpp.SharedRing");
+	CHECK(writer != nullptr && reader != nullptr);
+	if (writer == nullptr || reader == nullptr)
+	{
+		BeepSharedRingDisconnect(writer);
+		BeepSharedRingDisconnect(reader);
+		BeepEngineCloseSharedRing();
+		return;
+	}
+
+	UINT64 position = 0u;
+	UINT32 sampleRate = 0u;
+	CHECK(BeepSharedRingGetClock(reader, &position, &sampleRate));
+	CHECK(sampleRate != 0u);
+
+	BeepSharedCommandRecord records[5] = {};
+	UINT64 start = position + sampleRate / 10u;
+	records[0].startSample = start;
+	records[0].kind = 9u; // no such kind
+	records[0].eventId = 601u;
+	records[1].startSample = start;
+	records[1].kind = BeepScoreRecordKind_Note;
+	records[1].frequency = std::numeric_limits<float>::quiet_NaN();
+	records[1].amplitude = 0.1f;
+	records[1].durationSamples = sampleRate / 10u;
+	records[2] = records[1];
+	records[2].frequency = 440.0f;
+	records[2].durationSamples = 0u;
+	records[3] = records[2];
+	records[3].durationSamples = sampleRate / 10u;
+	records[4].startSample = start;
+	records[4].kind = BeepScoreRecordKind_Event;
+	records[4].eventId = 600u;
+	CHECK(BeepSharedRingPush(writer, records, 5u) == 5u);
+
+	UINT32 eventId = 0u;
+	BeepEventStatus status = BeepEventStatus_Timeout;
+	bool isCompleted = false;
+	for (int i = 0; i < 200 && !isCompleted; ++i)
+	{
+		while (BeepSharedRingPopCompletion(reader, &eventId, &status))
+		{
+			CHECK(eventId != 601u);
+			if (eventId == 600u)
+			{
+				CHECK(status == BeepEventStatus_Occurred);
+				isCompleted = true;
+			}
+		}
+		Sleep(10);
+	}
+	CHECK(isCompleted);
+
+	BeepSharedRingDisconnect(writer);
+	BeepSharedRingDisconnect(reader);
+	BeepEngineCloseSharedRing();
+}
+
+// Sources that partly overlap their destinations give the same result as separate buffers.
+static void TestFFTOverlap()
+{
+	std::wcout << L"TestFFTOverlap\n";
+	const int size = 64;
+	std::vector<float> input(size * 2);
+	for (int i = 0; i < size * 2; ++i)
+	{
+		input[i] = sinf(0.37f * i) + 0.25f * cosf(1.3f * i);
+	}
+
+	std::vector<float> expected(size * 2);
+	CHECK(FFT(input.data(), expected.data(), size, false));
+
+	// interleaved, with the destination one complex value past the source
+	std::vector<float> shared(size * 2 + 2);
+	std::copy(input.begin(), input.end(), shared.begin());
+	CHECK(FFT(shared.data(), shared.data() + 2, size, false));
+	float worst = 0.0f;
+	for (int i = 0; i < size * 2; ++i)
+	{
+		worst = (std::max)(worst, fabsf(shared[i + 2] - expected[i]));
+	}
+	CHECK(worst < 1e-4f);
+
+	// the same through a plan
+	FFTPlanHandle plan = FFTCreatePlan(size, FFTPlanMode_Estimate);
+	CHECK(plan != nullptr);
+	std::copy(input.begin(), input.end(), shared.begin());
+	CHECK(FFTExecutePlan(plan, shared.data(), shared.data() + 2, false));
+	worst = 0.0f;
+	for (int i = 0; i < size * 2; ++i)
+	{
+		worst = (std::max)(worst, fabsf(shared[i + 2] - expected[i]));
+	}
+	CHECK(worst < 1e-4f);
+	FFTDestroyPlan(plan);
+
+	// split, with the real output written over the imaginary input
+	std::vector<float> real(size);
+	std::vector<float> arrays(size * 2);
+	for (int i = 0; i < size; ++i)
+	{
+		real[i] = input[i * 2];
+		arrays[i] = input[i * 2 + 1];
+	}
+	CHECK(FFTSplit(real.data(), arrays.data(), arrays.data(), arrays.data() + size, size, false));
+	worst = 0.0f;
+	for (int i = 0; i < size; ++i)
+	{
+		worst = (std::max)(worst, fabsf(arrays[i] - expected[i * 2]));
+		worst = (std::max)(worst, fabsf(arrays[size + i] - expected[i * 2 + 1]));
+	}
+	CHECK(worst < 1e-4f);
+}
+
+// A 2-D transform large enough to run on several threads matches one-dimensional transforms of the rows and then the
+// columns, and the inverse, done in place, gives the input back.
+static void TestFFT2D()
+{
+	std::wcout << L"TestFFT2D\n";
+	const int rows = 128;
+	const int columns = 1024;
+	std::vector<float> input((size_t)rows * columns * 2);
+	UINT32 seed = 777u;
+	for (size_t i = 0; i < input.size(); ++i)
+	{
+		seed = seed * 1664525u + 1013904223u;
+		input[i] = (float)(seed >> 8) / (float)(1u << 24) - 0.5f;
+	}
+
+	std::vector<float> expected(input.size());
+	for (int r = 0; r < rows; ++r)
+	{
+		CHECK(FFT(input.data() + (size_t)r * columns * 2, expected.data() + (size_t)r * columns * 2, columns, false));
+	}
+	std::vector<float> column(rows * 2);
+	std::vector<float> transformed(rows * 2);
+	for (int c = 0; c < columns; ++c)
+	{
+		for (int r = 0; r < rows; ++r)
+		{
+			column[r * 2] = expected[((size_t)r * columns + c) * 2];
+			column[r * 2 + 1] = expected[((size_t)r * columns + c) * 2 + 1];
+		}
+		CHECK(FFT(column.data(), transformed.data(), rows, false));
+		for (int r = 0; r < rows; ++r)
+		{
+			expected[((size_t)r * columns + c) * 2] = transformed[r * 2];
+			expected[((size_t)r * columns + c) * 2 + 1] = transformed[r * 2 + 1];
+		}
+	}
+
+	std::vector<float> actual(input.size());
+	CHECK(FFT2D(input.data(), actual.data(), rows, columns, false, 4));
+	float worst = 0.0f;
+	for (size_t i = 0; i < actual.size(); ++i)
+	{
+		worst = (std::max)(worst, fabsf(actual[i] - expected[i]));
+	}
+	CHECK(worst < 1e-3f);
+
+	CHECK(FFT2D(actual.data(), actual.data(), rows, columns, true, 4));
+	worst = 0.0f;
+	for (size_t i = 0; i < actual.size(); ++i)
+	{
+		worst = (std::max)(worst, fabsf(actual[i] - input[i]));
+	}
+	CHECK(worst < 1e-5f);
+}
+
+// A score longer than one rendering chunk, with a note that sounds across the chunk boundary and one that starts
+// partway through, reads back as the tones that were written.
+static void TestDetectTones()
+{
+	std::wcout << L"TestDetectTones\n";
+	const UINT32 sampleRate = 8000u;
+	const UINT32 windowSize = 800u;
+	BeepScoreHandle score = BeepEngineCreateScore();
+	BeepEngineScoreAddNote(score, 0.0f, 440.0f, 0.5f, 140.0f);
+	BeepEngineScoreAddNote(score, 70.0f, 1000.0f, 0.25f, 70.0f);
+
+	const float frequencies[] = { 440.0f, 1000.0f, 2000.0f };
+	UINT64 frameCount = BeepEngineScoreDetectTones(score, sampleRate, frequencies, 3u, windowSize, windowSize, nullptr, 0u, 0u);
+	CHECK(frameCount == 1400u);
+
+	std::vector<float> amplitudes((size_t)frameCount * 3u);
+	CHECK(BeepEngineScoreDetectTones(score, sampleRate, frequencies, 3u, windowSize, windowSize, amplitudes.data(), frameCount, 4u) == frameCount);
+	BeepEngineDestroyScore(score);
+
+	// frame 700 starts exactly where the second note does; frame 1310 holds the first chunk boundary
+	float worst = 0.0f;
+	for (UINT64 frame = 0u; frame < frameCount; ++frame)
+	{
+		const float* a = amplitudes.data() + frame * 3u;
+		float expected1000 = frame >= 700u ? 0.25f : 0.0f;
+		worst = (std::max)(worst, fabsf(a[0] - 0.5f));
+		worst = (std::max)(worst, fabsf(a[1] - expected1000));
+		worst = (std::max)(worst, fabsf(a[2]));
+	}
+	CHECK(worst < 0.01f);
+}
+
+static int RunSelfTests()
+{
+	TestRealFFT();
+	TestSTFTRoundTrip();
+	TestFFTKernels();
+	TestFFTOverlap();
+	TestFFT2D();
+	TestDetectTones();
+
+	if (!StartBeepEngine())
+	{
+		std::wcout << L"Beep engine did not start.\n";
+		return 1;
+	}
+
+	TestBlockingBeep();
+	TestEventWaits();
+	TestSuspendResume();
+	TestScoreFile();
+	TestPartialSpectrum();
+	TestConvolution();
+	TestSharedRing();
+	TestNoAudioThreadAllocation();
+
+	StopBeepEngine();
+	std::wcout << (g_failures == 0 ? L"All checks passed.\n" : L"Some checks failed.\n");
+	return g_failures == 0 ? 0 : 1;
+}
+
 class FloatBuffer
 {
 public:
@@ -46,6 +741,8 @@ void WriteBuffer(std::unique_ptr<FloatBuffer> const& buf)
 
 int main()
 {
+	int result = RunSelfTests();
+
 #if 0
     bool b = StartBeepEngine();
     if (b)
@@ -111,7 +808,7 @@ int main()
 		std::wcout << buffer << L"\n";
 	}
 
-	return 0;
+	return result;
 }
 
 // Run program: Ctrl + F5 or Debug > Start Without Debugging menu
@@ -1,5 +1,61 @@
 ﻿#pragma once
 
 extern "C" __declspec(dllimport) bool FFT(const float* src, float* dest, int size, bool isInverse);
+extern "C" __declspec(dllimport) bool FFTInPlace(float* data, int size, bool isInverse);
+extern "C" __declspec(dllimport) bool FFTSplit(const float* srcReal, const float* srcImag, float* destReal, float* destImag, int size, bool isInverse);
+extern "C" __declspec(dllimport) bool FFT2D(const float* src, float* dest, int rows, int columns, bool isInverse, int threadCount);
+
+enum FFTCpuFeature
+{
+    FFTCpuFeature_Sse3 = 1,
+    FFTCpuFeature_Avx = 2,
+};
+
+enum FFTKernel
+{
+    FFTKernel_Radix2 = 0,
+    FFTKernel_Radix4 = 1,
+    FFTKernel_Radix2Sse3 = 2,
+    FFTKernel_Radix4Sse3 = 3,
+    FFTKernel_Radix2Avx = 4,
+    FFTKernel_Radix4Avx = 5,
+};
+
+enum FFTPlanMode
+{
+    FFTPlanMode_Estimate = 0,
+    FFTPlanMode_Measure = 1,
+};
+
+typedef void* FFTPlanHandle;
+
+extern "C" __declspec(dllimport) int FFTGetCpuFeatures();
+extern "C" __declspec(dllimport) FFTPlanHandle FFTCreatePlan(int size, int mode);
+extern "C" __declspec(dllimport) bool FFTExecutePlan(FFTPlanHandle plan, const float* src, float* dest, bool isInverse);
+extern "C" __declspec(dllimport) int FFTPlanGetKernel(FFTPlanHandle plan);
+extern "C" __declspec(dllimport) void FFTDestroyPlan(FFTPlanHandle plan);
+extern "C" __declspec(dllimport) int FFTExportWisdom(char* buffer, int bufferSize);
+extern "C" __declspec(dllimport) bool FFTImportWisdom(const char* wisdom);
+extern "C" __declspec(dllimport) void FFTForgetWisdom();
+
+enum FFTWindow
+{
+    FFTWindow_Rectangular = 0,
+    FFTWindow_Hann = 1,
+    FFTWindow_Hamming = 2,
+    FFTWindow_Blackman = 3,
+};
+
+extern "C" __declspec(dllimport) int STFTGetFrameCount(int sampleCount, int frameSize, int hopSize);
+extern "C" __declspec(dllimport) bool STFT(const float* samples, int sampleCount, int frameSize, int hopSize, int window, float* spectra, int threadCount);
+extern "C" __declspec(dllimport) bool ISTFT(const float* spectra, int frameCount, int frameSize, int hopSize, int window, float* samples, int sampleCount, int threadCount);
+
+typedef void* ToneDetectorHandle;
+
+extern "C" __declspec(dllimport) ToneDetectorHandle CreateToneDetector(const float* frequencies, int frequencyCount, float sampleRate, int windowSize, int hopSize);
+extern "C" __declspec(dllimport) int ToneDetectorProcess(ToneDetectorHandle detector, const float* samples, int sampleCount, float* amplitudes, int maxFrames, int* pSamplesConsumed);
+extern "C" __declspec(dllimport) void ToneDetectorReset(ToneDetectorHandle detector);
+extern "C" __declspec(dllimport) void DestroyToneDetector(ToneDetectorHandle detector);
+
 extern "C" __declspec(dllimport) int GetLogSize();
 extern "C" __declspec(dllimport) void GetLogEntry(int index, wchar_t* buffer, int bufferSize);
@@ -1,8 +1,301 @@
 ﻿#include "pch.h"
 
 #include "beepengine.h"
+#include "concurrency.h"
 #include "fft_internal.h"
 
+// Allocation tripwire. Once the audio thread (or a render worker) is running, it must not touch the heap: the heap can
+// be locked by a thread that is not real-time, and a render that waits for it misses its buffer. In debug builds, and
+// in any build that defines BEEP_ALLOCATION_TRIPWIRE to 1, the global operators new and delete check whether they are
+// running on such a thread. Each violation is counted, written to the debugger, and breaks into the debugger if one
+// is attached; BeepEngineGetAudioThreadAllocationCount lets a test check that the count stays at zero.
+
+#ifndef BEEP_ALLOCATION_TRIPWIRE
+#ifdef _DEBUG
+#define BEEP_ALLOCATION_TRIPWIRE 1
+#else
+#define BEEP_ALLOCATION_TRIPWIRE 0
+#endif
+#endif
+
+static thread_local bool t_isRealTimeThread = false;
+static std::atomic<UINT64> g_realTimeHeapUseCount(0u);
+
+// Marks the current thread as real-time for as long as the scope lasts.
+
+class RealTimeThreadScope
+{
+public:
+    RealTimeThreadScope()
+    {
+        t_isRealTimeThread = true;
+    }
+
+    ~RealTimeThreadScope()
+    {
+        t_isRealTimeThread = false;
+    }
+};
+
+#if BEEP_ALLOCATION_TRIPWIRE
+
+static void CheckRealTimeHeapUse()
+{
+    if (t_isRealTimeThread)
+    {
+        g_realTimeHeapUseCount.fetch_add(1u, std::memory_order_relaxed);
+        OutputDebugString(L"Heap used on the audio thread\n");
+        if (IsDebuggerPresent())
+        {
+            __debugbreak();
+        }
+    }
+}
+
+void* operator new(size_t size)
+{
+    CheckRealTimeHeapUse();
+    void* p = malloc(size == 0 ? 1 : size);
+    if (p == nullptr) throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    CheckRealTimeHeapUse();
+    return malloc(size == 0 ? 1 : size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t& tag) noexcept
+{
+    return operator new(size, tag);
+}
+
+void operator delete(void* p) noexcept
+{
+    if (p == nullptr) return;
+    CheckRealTimeHeapUse();
+    free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+    operator delete(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    operator delete(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+    operator delete(p);
+}
+
+#endif
+
+// There are never more than this many voices, or scheduled beeps waiting in the queue; further notes are dropped (and
+// counted as dropped). Containers that hold them are reserved to these sizes up front.
+const UINT32 VOICE_CAPACITY = 4096u;
+const UINT32 BEEP_QUEUE_CAPACITY = 65536u;
+
+// Fixed-size block arena for the small objects the audio thread creates and destroys while it plays: scheduled beeps,
+// voices, and the nodes of the event and note cache containers. Each size class is carved out of one allocation made
+// up front and handed out through a free list. The classes are sized for a full beep queue and a full set of voices,
+// with their bookkeeping. A request that is too big, or that finds every class it fits in exhausted, falls back to the
+// heap, so an undersized arena costs real-time safety (which the tripwire reports) rather than correctness.
+//
+// Only one thread at a time may use an arena.
+
+class AudioArena
+{
+public:
+    AudioArena()
+        : m_classes()
+        , m_fallbackCount(0u)
+    {
+    }
+
+    bool Initialize()
+    {
+        for (UINT32 c = 0; c < CLASS_COUNT; ++c)
+        {
+            SizeClass& sizeClass = m_classes[c];
+            sizeClass.blockSize = MIN_BLOCK_SIZE << c;
+            sizeClass.blockCount = BLOCK_COUNTS[c];
+            sizeClass.memory = std::unique_ptr<BYTE[]>(new BYTE[sizeClass.blockSize * sizeClass.blockCount]);
+            if (sizeClass.memory == nullptr) return false;
+
+            sizeClass.freeList = nullptr;
+            for (size_t i = sizeClass.blockCount; i-- > 0; )
+            {
+                FreeBlock* block = reinterpret_cast<FreeBlock*>(sizeClass.memory.get() + i * sizeClass.blockSize);
+                block->next = sizeClass.freeList;
+                sizeClass.freeList = block;
+            }
+        }
+        return true;
+    }
+
+    void* Allocate(size_t size)
+    {
+        for (UINT32 c = 0; c < CLASS_COUNT; ++c)
+        {
+            SizeClass& sizeClass = m_classes[c];
+            if (size <= sizeClass.blockSize && sizeClass.freeList != nullptr)
+            {
+                FreeBlock* block = sizeClass.freeList;
+                sizeClass.freeList = block->next;
+                return block;
+            }
+        }
+
+        ++m_fallbackCount;
+        BEEP_LOG(LOG_LEVEL_INFO, L"Audio arena used the heap for {} bytes", size);
+        return ::operator new(size);
+    }
+
+    void Free(void* p)
+    {
+        if (p == nullptr) return;
+
+        BYTE* bytes = reinterpret_cast<BYTE*>(p);
+        for (UINT32 c = 0; c < CLASS_COUNT; ++c)
+        {
+            SizeClass& sizeClass = m_classes[c];
+            if (bytes >= sizeClass.memory.get() && bytes < sizeClass.memory.get() + sizeClass.blockSize * sizeClass.blockCount)
+            {
+                FreeBlock* block = reinterpret_cast<FreeBlock*>(p);
+                block->next = sizeClass.freeList;
+                sizeClass.freeList = block;
+                return;
+            }
+        }
+
+        ::operator delete(p);
+    }
+
+    UINT64 FallbackCount() const { return m_fallbackCount; }
+
+private:
+    static const UINT32 CLASS_COUNT = 3u;
+    static const size_t MIN_BLOCK_SIZE = 32u;
+    static constexpr size_t BLOCK_COUNTS[CLASS_COUNT] = { BEEP_QUEUE_CAPACITY, BEEP_QUEUE_CAPACITY + 8u * VOICE_CAPACITY, 2u * VOICE_CAPACITY };
+
+    class FreeBlock
+    {
+    public:
+        FreeBlock* next;
+    };
+
+    class SizeClass
+    {
+    public:
+        SizeClass()
+            : blockSize(0u)
+            , blockCount(0u)
+            , memory(nullptr)
+            , freeList(nullptr)
+        {
+        }
+
+        size_t blockSize;
+        size_t blockCount;
+        std::unique_ptr<BYTE[]> memory;
+        FreeBlock* freeList;
+    };
+
+    SizeClass m_classes[CLASS_COUNT];
+    UINT64 m_fallbackCount;
+};
+
+// Deleter for objects made by MakeInArena. A null arena means the object is on the heap.
+
+class ArenaDelete
+{
+public:
+    ArenaDelete()
+        : arena(nullptr)
+    {
+    }
+
+    ArenaDelete(AudioArena* arena)
+        : arena(arena)
+    {
+    }
+
+    template<typename T>
+    void operator()(T* p) const
+    {
+        p->~T();
+        if (arena != nullptr)
+        {
+            arena->Free(p);
+        }
+        else
+        {
+            ::operator delete(p);
+        }
+    }
+
+    AudioArena* arena;
+};
+
+template<typename T>
+using ArenaPtr = std::unique_ptr<T, ArenaDelete>;
+
+// Creates an object in the arena, or on the heap if arena is nullptr (for callers that are not the audio thread).
+template<typename T, typename... Args>
+ArenaPtr<T> MakeInArena(AudioArena* arena, Args&&... args)
+{
+    void* memory = (arena != nullptr) ? arena->Allocate(sizeof(T)) : ::operator new(sizeof(T));
+    return ArenaPtr<T>(new (memory) T(std::forward<Args>(args)...), ArenaDelete(arena));
+}
+
+// Standard allocator over an arena, for node-based containers owned by the audio thread.
+
+template<typename T>
+class ArenaAllocator
+{
+public:
+    typedef T value_type;
+
+    ArenaAllocator(AudioArena* arena)
+        : arena(arena)
+    {
+    }
+
+    template<typename U>
+    ArenaAllocator(ArenaAllocator<U> const & other)
+        : arena(other.arena)
+    {
+    }
+
+    T* allocate(size_t n)
+    {
+        return static_cast<T*>(arena->Allocate(n * sizeof(T)));
+    }
+
+    void deallocate(T* p, size_t)
+    {
+        arena->Free(p);
+    }
+
+    template<typename U>
+    bool operator==(ArenaAllocator<U> const & other) const { return arena == other.arena; }
+
+    template<typename U>
+    bool operator!=(ArenaAllocator<U> const & other) const { return arena != other.arena; }
+
+    AudioArena* arena;
+};
+
 class BufferData
 {
 public:
@@ -111,17 +404,275 @@ public:
     void STDMETHODCALLTYPE OnVoiceError(void*, HRESULT) override {}
 };
 
-class BeepCommand
+// Copies bytes out of a view of a mapped file. When a page cannot be read (the file is on a network share or a drive
+// that has gone away), the read raises EXCEPTION_IN_PAGE_ERROR rather than failing, so it is caught here and reported
+// as false. There must be no objects with destructors in this function, because of __try.
+
+static bool CopyFromMappedView(void* dest, const void* source, size_t byteCount)
+{
+    __try
+    {
+        memcpy(dest, source, byteCount);
+        return true;
+    }
+    __except (GetExceptionCode() == EXCEPTION_IN_PAGE_ERROR ? EXCEPTION_EXECUTE_HANDLER : EXCEPTION_CONTINUE_SEARCH)
+    {
+        return false;
+    }
+}
+
+// A sample bank file mapped into memory. Voices read their frames straight from the mapping, so opening a bank costs
+// no decoding and no copying, and only the pages of samples that are used are ever read in. Every entry is checked
+// when the bank is opened, so voices never need to check bounds. A sample's pages are read in when it is first added
+// to a score (see Prefetch), so that the audio thread does not wait for the disk. The file stays mapped for as long
+// as any score, queued command or voice refers to the bank.
+
+const size_t SAMPLE_BANK_PAGE_SIZE = 4096u;
+
+class SampleBank
+{
+public:
+    SampleBank()
+        : m_hFile(INVALID_HANDLE_VALUE)
+        , m_hMapping(nullptr)
+        , m_view(nullptr)
+        , m_entries(nullptr)
+        , m_count(0u)
+        , m_isPrefetched()
+        , m_lastError(0u)
+    {
+    }
+
+    DWORD GetLastError() const { return m_lastError; }
+
+    // may throw bad_alloc
+    bool Open(const wchar_t* path)
+    {
+        m_hFile = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+        if (m_hFile == INVALID_HANDLE_VALUE) { m_lastError = ::GetLastError(); return false; }
+
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(m_hFile, &fileSize)) { m_lastError = ::GetLastError(); return false; }
+        if (fileSize.QuadPart < static_cast<LONGLONG>(sizeof(BeepSampleBankHeader))) return false;
+
+        m_hMapping = CreateFileMapping(m_hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (m_hMapping == nullptr) { m_lastError = ::GetLastError(); return false; }
+
+        m_view = MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+        if (m_view == nullptr) { m_lastError = ::GetLastError(); return false; }
+
+        const BeepSampleBankHeader* header = reinterpret_cast<const BeepSampleBankHeader*>(m_view);
+        if (memcmp(header->magic, BEEP_SAMPLE_BANK_MAGIC, sizeof(header->magic)) != 0) return false;
+        if (header->version != BEEP_SAMPLE_BANK_VERSION) return false;
+
+        UINT64 size = static_cast<UINT64>(fileSize.QuadPart);
+        if (header->sampleCount > (size - sizeof(BeepSampleBankHeader)) / sizeof(BeepSampleBankEntry)) return false;
+
+        const BeepSampleBankEntry* entries = reinterpret_cast<const BeepSampleBankEntry*>(header + 1);
+        for (UINT32 i = 0; i < header->sampleCount; ++i)
+        {
+            if (entries[i].sampleRate == 0u) return false;
+            if (entries[i].offset % sizeof(float) != 0u) return false;
+            if (entries[i].offset > size || entries[i].frameCount > (size - entries[i].offset) / sizeof(float)) return false;
+        }
+
+        m_isPrefetched = std::vector<std::atomic<bool>>(header->sampleCount);
+        m_entries = entries;
+        m_count = header->sampleCount;
+        return true;
+    }
+
+    // Reads a sample's pages in, on the calling thread, the first time it is asked for. Returns false if a page cannot
+    // be read, in which case the sample must not be played. Pages can still be trimmed from the working set later,
+    // under memory pressure, but that is rare enough that the audio thread reads the mapping directly.
+    bool Prefetch(UINT32 index)
+    {
+        if (m_isPrefetched[index].load(std::memory_order_acquire)) return true;
+
+        const BYTE* first = reinterpret_cast<const BYTE*>(Frames(index));
+        size_t byteCount = static_cast<size_t>(FrameCount(index)) * sizeof(float);
+        if (byteCount != 0u)
+        {
+            WIN32_MEMORY_RANGE_ENTRY range;
+            range.VirtualAddress = const_cast<BYTE*>(first);
+            range.NumberOfBytes = byteCount;
+            PrefetchVirtualMemory(GetCurrentProcess(), 1u, &range, 0u);
+
+            // touching each page waits for the read, and turns a page that cannot be read into false
+            float frame;
+            for (size_t offset = 0u; offset < byteCount; offset += SAMPLE_BANK_PAGE_SIZE)
+            {
+                if (!CopyFromMappedView(&frame, first + offset, sizeof(frame))) return false;
+            }
+            if (!CopyFromMappedView(&frame, first + byteCount - sizeof(frame), sizeof(frame))) return false;
+        }
+
+        m_isPrefetched[index].store(true, std::memory_order_release);
+        return true;
+    }
+
+    UINT32 Count() const { return m_count; }
+    UINT32 FrameCount(UINT32 index) const { return m_entries[index].frameCount; }
+    UINT32 SampleRate(UINT32 index) const { return m_entries[index].sampleRate; }
+
+    const float* Frames(UINT32 index) const
+    {
+        return reinterpret_cast<const float*>(static_cast<const BYTE*>(m_view) + m_entries[index].offset);
+    }
+
+    // Writes a bank file, with each sample's frames starting on a 16-byte boundary.
+    static bool Save(const wchar_t* path, const float* const* samples, const UINT32* frameCounts, const UINT32* sampleRates, UINT32 count)
+    {
+        BeepSampleBankHeader header;
+        memcpy(header.magic, BEEP_SAMPLE_BANK_MAGIC, sizeof(header.magic));
+        header.version = BEEP_SAMPLE_BANK_VERSION;
+        header.sampleCount = count;
+
+        std::vector<BeepSampleBankEntry> entries(count);
+        UINT64 offset = sizeof(BeepSampleBankHeader) + count * sizeof(BeepSampleBankEntry);
+        for (UINT32 i = 0; i < count; ++i)
+        {
+            offset = (offset + 15u) & ~static_cast<UINT64>(15u);
+            entries[i].offset = offset;
+            entries[i].frameCount = frameCounts[i];
+            entries[i].sampleRate = sampleRates[i];
+            offset += frameCounts[i] * sizeof(float);
+        }
+
+        HANDLE hFile = CreateFile(path, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (hFile == INVALID_HANDLE_VALUE) return false;
+
+        UINT64 position = 0u;
+        auto write = [&](const void* data, UINT64 size) -> bool
+        {
+            const BYTE* bytes = static_cast<const BYTE*>(data);
+            while (size > 0)
+            {
+                DWORD chunk = static_cast<DWORD>(min(size, static_cast<UINT64>(1u << 30)));
+                DWORD written = 0;
+                if (!WriteFile(hFile, bytes, chunk, &written, nullptr) || written != chunk) return false;
+                bytes += chunk;
+                size -= chunk;
+                position += chunk;
+            }
+            return true;
+        };
+
+        const BYTE padding[16] = {};
+        bool ok = write(&header, sizeof(header)) && write(entries.data(), count * sizeof(BeepSampleBankEntry));
+        for (UINT32 i = 0; ok && i < count; ++i)
+        {
+            ok = write(padding, entries[i].offset - position) && write(samples[i], frameCounts[i] * sizeof(float));
+        }
+
+        CloseHandle(hFile);
+        return ok;
+    }
+
+    ~SampleBank()
+    {
+        if (m_view != nullptr)
+        {
+            UnmapViewOfFile(m_view);
+            m_view = nullptr;
+        }
+
+        if (m_hMapping != nullptr)
+        {
+            CloseHandle(m_hMapping);
+            m_hMapping = nullptr;
+        }
+
+        if (m_hFile != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(m_hFile);
+            m_hFile = INVALID_HANDLE_VALUE;
+        }
+    }
+
+private:
+    HANDLE m_hFile;
+    HANDLE m_hMapping;
+    LPVOID m_view;
+    const BeepSampleBankEntry* m_entries;
+    UINT32 m_count;
+    std::vector<std::atomic<bool>> m_isPrefetched;
+    DWORD m_lastError;
+};
+
+// The links that put a command or a voice on its group's list in the group table. The table keeps the lists; the
+// objects on them only carry the links.
+
+template<typename T>
+class GroupListLinks
+{
+public:
+    GroupListLinks()
+        : previousInGroup(nullptr)
+        , nextInGroup(nullptr)
+    {
+    }
+
+    T* previousInGroup;
+    T* nextInGroup;
+};
+
+class BeepCommand : public GroupListLinks<BeepCommand>
 {
 public:
+    BeepCommand()
+        : m_group(0u)
+        , m_heapIndex(0u)
+    {
+    }
+
 	virtual ~BeepCommand() {}
-    virtual UINT32 EventStartTimeSamples() const = 0;
+    virtual UINT64 EventStartTimeSamples() const = 0;
+
+    // the group the command was submitted in, or 0
+    UINT32 Group() const { return m_group; }
+    void SetGroup(UINT32 group) { m_group = group; }
+
+    // where the command is in the beep queue's heap; the queue keeps it up to date
+    UINT32 HeapIndex() const { return m_heapIndex; }
+    void SetHeapIndex(UINT32 heapIndex) { m_heapIndex = heapIndex; }
+
+private:
+    UINT32 m_group;
+    UINT32 m_heapIndex;
 };
 
 class BeepCommand_Beep : public BeepCommand
 {
 public:
-	BeepCommand_Beep(UINT32 eventStartTimeSamples, float frequencyRadiansPerSample, float amplitude, UINT32 durationSamples)
+	BeepCommand_Beep(UINT64 eventStartTimeSamples, float frequencyRadiansPerSample, float amplitude, UINT32 durationSamples, INT32 priority = 0)
+		: m_eventStartTimeSamples(eventStartTimeSamples)
+		, m_frequencyRadiansPerSample(frequencyRadiansPerSample)
+		, m_amplitude(amplitude)
+		, m_durationSamples(durationSamples)
+		, m_priority(priority)
+	{
+	}
+
+	UINT64 EventStartTimeSamples() const override { return m_eventStartTimeSamples; }
+	float FrequencyRadiansPerSample() const { return m_frequencyRadiansPerSample; }
+	float Amplitude() const { return m_amplitude; }
+    UINT32 DurationSamples() const { return m_durationSamples; }
+    INT32 Priority() const { return m_priority; }
+private:
+	const UINT64 m_eventStartTimeSamples;
+	const float m_frequencyRadiansPerSample;
+	const float m_amplitude;
+	const UINT32 m_durationSamples;
+	const INT32 m_priority;
+};
+
+// A sine partial rendered by the additive bank rather than by its own voice.
+
+class BeepCommand_Partial : public BeepCommand
+{
+public:
+	BeepCommand_Partial(UINT64 eventStartTimeSamples, float frequencyRadiansPerSample, float amplitude, UINT32 durationSamples)
 		: m_eventStartTimeSamples(eventStartTimeSamples)
 		, m_frequencyRadiansPerSample(frequencyRadiansPerSample)
 		, m_amplitude(amplitude)
@@ -129,12 +680,12 @@ public:
 	{
 	}
 
-	UINT32 EventStartTimeSamples() const override { return m_eventStartTimeSamples; }
+	UINT64 EventStartTimeSamples() const override { return m_eventStartTimeSamples; }
 	float FrequencyRadiansPerSample() const { return m_frequencyRadiansPerSample; }
 	float Amplitude() const { return m_amplitude; }
     UINT32 DurationSamples() const { return m_durationSamples; }
 private:
-	const UINT32 m_eventStartTimeSamples;
+	const UINT64 m_eventStartTimeSamples;
 	const float m_frequencyRadiansPerSample;
 	const float m_amplitude;
 	const UINT32 m_durationSamples;
@@ -143,46 +694,157 @@ private:
 class BeepCommand_Event : public BeepCommand
 {
 public:
-	BeepCommand_Event(UINT32 eventStartTimeSamples, UINT32 eventId)
+	BeepCommand_Event(UINT64 eventStartTimeSamples, UINT32 eventId)
 		: m_eventStartTimeSamples(eventStartTimeSamples)
 		, m_eventId(eventId)
 	{
 	}
 
-	UINT32 EventStartTimeSamples() const override { return m_eventStartTimeSamples; }
+	UINT64 EventStartTimeSamples() const override { return m_eventStartTimeSamples; }
 	UINT32 EventId() const { return m_eventId; }
 private:
-	const UINT32 m_eventStartTimeSamples;
+	const UINT64 m_eventStartTimeSamples;
 	const UINT32 m_eventId;
 };
 
-class BeepCommandCompare
+// A recorded sample played from a bank. step is how far the voice moves through the sample's frames for each output
+// sample, which takes in both the pitch and the difference between the two sample rates.
+
+class BeepCommand_Sample : public BeepCommand
 {
 public:
-    bool operator()(std::shared_ptr<BeepCommand> const & lhs, std::shared_ptr<BeepCommand> const & rhs) const
+	BeepCommand_Sample(UINT64 eventStartTimeSamples, std::shared_ptr<SampleBank> const & bank, UINT32 sampleIndex, double step, float gain, INT32 priority)
+		: m_eventStartTimeSamples(eventStartTimeSamples)
+		, m_bank(bank)
+		, m_sampleIndex(sampleIndex)
+		, m_step(step)
+		, m_gain(gain)
+		, m_priority(priority)
 	{
-		return lhs->EventStartTimeSamples() > rhs->EventStartTimeSamples();
 	}
-};
 
-typedef std::set<UINT32> EventSet;
-typedef std::priority_queue<std::shared_ptr<BeepCommand>, std::vector<std::shared_ptr<BeepCommand>>, BeepCommandCompare> BeepCommandQueue;
+	UINT64 EventStartTimeSamples() const override { return m_eventStartTimeSamples; }
+    UINT32 SampleIndex() const { return m_sampleIndex; }
+    double Step() const { return m_step; }
+	float Gain() const { return m_gain; }
+    INT32 Priority() const { return m_priority; }
 
-class AudioBeepCommand
-{
-public:
+    // the audio thread takes the reference so that it can choose where the bank is released
+    std::shared_ptr<SampleBank> TakeBank() { return std::move(m_bank); }
+
+private:
+	const UINT64 m_eventStartTimeSamples;
+	std::shared_ptr<SampleBank> m_bank;
+	const UINT32 m_sampleIndex;
+	const double m_step;
+	const float m_gain;
+	const INT32 m_priority;
+};
+
+class BeepCommandCompare
+{
+public:
+    bool operator()(ArenaPtr<BeepCommand> const & lhs, ArenaPtr<BeepCommand> const & rhs) const
+	{
+		return lhs->EventStartTimeSamples() > rhs->EventStartTimeSamples();
+	}
+};
+
+typedef std::multiset<UINT32, std::less<UINT32>, ArenaAllocator<UINT32>> EventSet;
+
+// Binary heap of queued commands, earliest first. Every command knows where it is in the heap, so that one can be taken
+// out from anywhere (when its group is cancelled) with a logarithmic number of moves.
+
+class BeepCommandQueue
+{
+public:
+    BeepCommandQueue(std::vector<ArenaPtr<BeepCommand>> && storage)
+        : m_heap(std::move(storage))
+        , m_compare()
+    {
+    }
+
+    bool empty() const { return m_heap.empty(); }
+    size_t size() const { return m_heap.size(); }
+    ArenaPtr<BeepCommand> const & top() const { return m_heap.front(); }
+
+    void push(ArenaPtr<BeepCommand> && command)
+    {
+        size_t i = m_heap.size();
+        command->SetHeapIndex(static_cast<UINT32>(i));
+        m_heap.push_back(std::move(command));
+        while (i > 0u && m_compare(m_heap[(i - 1u) / 2u], m_heap[i]))
+        {
+            Swap((i - 1u) / 2u, i);
+            i = (i - 1u) / 2u;
+        }
+    }
+
+    void pop()
+    {
+        Remove(m_heap.front().get());
+    }
+
+    // takes the command out of the queue and destroys it
+    void Remove(BeepCommand* command)
+    {
+        size_t i = command->HeapIndex();
+        assert(i < m_heap.size() && m_heap[i].get() == command);
+
+        m_heap[i] = std::move(m_heap.back());
+        m_heap.pop_back();
+        if (i == m_heap.size()) return;
+        m_heap[i]->SetHeapIndex(static_cast<UINT32>(i));
+
+        // the command moved in from the end may belong above or below this slot
+        while (i > 0u && m_compare(m_heap[(i - 1u) / 2u], m_heap[i]))
+        {
+            Swap((i - 1u) / 2u, i);
+            i = (i - 1u) / 2u;
+        }
+        while (true)
+        {
+            size_t largest = i;
+            size_t left = i * 2u + 1u;
+            size_t right = left + 1u;
+            if (left < m_heap.size() && m_compare(m_heap[largest], m_heap[left])) largest = left;
+            if (right < m_heap.size() && m_compare(m_heap[largest], m_heap[right])) largest = right;
+            if (largest == i) break;
+            Swap(i, largest);
+            i = largest;
+        }
+    }
+
+private:
+    std::vector<ArenaPtr<BeepCommand>> m_heap;
+    BeepCommandCompare m_compare;
+
+    void Swap(size_t i, size_t j)
+    {
+        std::swap(m_heap[i], m_heap[j]);
+        m_heap[i]->SetHeapIndex(static_cast<UINT32>(i));
+        m_heap[j]->SetHeapIndex(static_cast<UINT32>(j));
+    }
+};
+
+class AudioBeepCommand
+{
+public:
     virtual ~AudioBeepCommand() {}
-    virtual std::shared_ptr<BeepCommand> CreateCommand(UINT32 sampleRate, UINT32 offsetTime, bool * pPostWrap) const = 0;
+    // arena is nullptr when the command is not being created on the audio thread; offsetTime is the engine time, in
+    // samples, that the command's times are relative to
+    virtual ArenaPtr<BeepCommand> CreateCommand(AudioArena* arena, UINT32 sampleRate, UINT64 offsetTime) const = 0;
 };
 
 class AudioBeepCommand_Beep : public AudioBeepCommand
 {
 public:
-    AudioBeepCommand_Beep(float eventStartTimeSeconds, float frequencyHz, float amplitude, float durationSeconds)
+    AudioBeepCommand_Beep(float eventStartTimeSeconds, float frequencyHz, float amplitude, float durationSeconds, INT32 priority = 0)
         : m_eventStartTimeSeconds(eventStartTimeSeconds)
         , m_frequencyHz(frequencyHz)
         , m_amplitude(amplitude)
         , m_durationSeconds(durationSeconds)
+        , m_priority(priority)
     {
     }
 
@@ -190,18 +852,45 @@ public:
     float FrequencyHz() const { return m_frequencyHz; }
     float Amplitude() const { return m_amplitude; }
     float DurationSeconds() const { return m_durationSeconds; }
+    INT32 Priority() const { return m_priority; }
 
-    virtual std::shared_ptr<BeepCommand> CreateCommand(UINT32 sampleRate, UINT32 offsetTime, bool * pPostWrap) const override
+    virtual ArenaPtr<BeepCommand> CreateCommand(AudioArena* arena, UINT32 sampleRate, UINT64 offsetTime) const override
     {
-		UINT32 eventStartTimeSamples = static_cast<UINT32>(m_eventStartTimeSeconds * sampleRate);
-		UINT32 offsetEventStartTimeSamples = eventStartTimeSamples + offsetTime;
-		if (pPostWrap != nullptr)
-		{
-			*pPostWrap = offsetEventStartTimeSamples < offsetTime;
-		}
+		UINT64 offsetEventStartTimeSamples = static_cast<UINT64>(m_eventStartTimeSeconds * sampleRate) + offsetTime;
+		float frequencyRadiansPerSample = 2.0f * (float)(std::numbers::pi) * m_frequencyHz / sampleRate;
+		UINT32 durationSamples = static_cast<UINT32>(m_durationSeconds * sampleRate);
+		return MakeInArena<BeepCommand_Beep>(arena, offsetEventStartTimeSamples, frequencyRadiansPerSample, m_amplitude, durationSamples, m_priority);
+    }
+private:
+    const float m_eventStartTimeSeconds;
+    const float m_frequencyHz;
+    const float m_amplitude;
+    const float m_durationSeconds;
+    const INT32 m_priority;
+};
+
+class AudioBeepCommand_Partial : public AudioBeepCommand
+{
+public:
+    AudioBeepCommand_Partial(float eventStartTimeSeconds, float frequencyHz, float amplitude, float durationSeconds)
+        : m_eventStartTimeSeconds(eventStartTimeSeconds)
+        , m_frequencyHz(frequencyHz)
+        , m_amplitude(amplitude)
+        , m_durationSeconds(durationSeconds)
+    {
+    }
+
+    float EventStartTimeSeconds() const { return m_eventStartTimeSeconds; }
+    float FrequencyHz() const { return m_frequencyHz; }
+    float Amplitude() const { return m_amplitude; }
+    float DurationSeconds() const { return m_durationSeconds; }
+
+    virtual ArenaPtr<BeepCommand> CreateCommand(AudioArena* arena, UINT32 sampleRate, UINT64 offsetTime) const override
+    {
+		UINT64 offsetEventStartTimeSamples = static_cast<UINT64>(m_eventStartTimeSeconds * sampleRate) + offsetTime;
 		float frequencyRadiansPerSample = 2.0f * (float)(std::numbers::pi) * m_frequencyHz / sampleRate;
 		UINT32 durationSamples = static_cast<UINT32>(m_durationSeconds * sampleRate);
-		return std::shared_ptr<BeepCommand>(new BeepCommand_Beep(offsetEventStartTimeSamples, frequencyRadiansPerSample, m_amplitude, durationSamples));
+		return MakeInArena<BeepCommand_Partial>(arena, offsetEventStartTimeSamples, frequencyRadiansPerSample, m_amplitude, durationSamples);
     }
 private:
     const float m_eventStartTimeSeconds;
@@ -222,15 +911,10 @@ public:
     float EventStartTimeSeconds() const { return m_eventStartTimeSeconds; }
     UINT32 EventId() const { return m_eventId; }
 
-    virtual std::shared_ptr<BeepCommand> CreateCommand(UINT32 sampleRate, UINT32 offsetTime, bool * pPostWrap) const override
+    virtual ArenaPtr<BeepCommand> CreateCommand(AudioArena* arena, UINT32 sampleRate, UINT64 offsetTime) const override
     {
-        UINT32 eventStartTimeSamples = static_cast<UINT32>(m_eventStartTimeSeconds * sampleRate);
-		UINT32 offsetEventStartTimeSamples = eventStartTimeSamples + offsetTime;
-        if (pPostWrap != nullptr)
-        {
-			*pPostWrap = offsetEventStartTimeSamples < offsetTime;
-        }
-        return std::shared_ptr<BeepCommand>(new BeepCommand_Event(offsetEventStartTimeSamples, m_eventId));
+		UINT64 offsetEventStartTimeSamples = static_cast<UINT64>(m_eventStartTimeSeconds * sampleRate) + offsetTime;
+        return MakeInArena<BeepCommand_Event>(arena, offsetEventStartTimeSamples, m_eventId);
     }
 
 private:
@@ -238,658 +922,5927 @@ private:
 	const UINT32 m_eventId;
 };
 
-class AudioThreadCommand
+class AudioBeepCommand_Sample : public AudioBeepCommand
 {
 public:
-    virtual ~AudioThreadCommand() {}
+    AudioBeepCommand_Sample(float eventStartTimeSeconds, std::shared_ptr<SampleBank> const & bank, UINT32 sampleIndex, float pitch, float gain, INT32 priority)
+        : m_eventStartTimeSeconds(eventStartTimeSeconds)
+        , m_bank(bank)
+        , m_sampleIndex(sampleIndex)
+        , m_pitch(pitch)
+        , m_gain(gain)
+        , m_priority(priority)
+    {
+    }
+
+    virtual ArenaPtr<BeepCommand> CreateCommand(AudioArena* arena, UINT32 sampleRate, UINT64 offsetTime) const override
+    {
+		UINT64 offsetEventStartTimeSamples = static_cast<UINT64>(m_eventStartTimeSeconds * sampleRate) + offsetTime;
+        double step = static_cast<double>(m_pitch) * m_bank->SampleRate(m_sampleIndex) / sampleRate;
+		return MakeInArena<BeepCommand_Sample>(arena, offsetEventStartTimeSamples, m_bank, m_sampleIndex, step, m_gain, m_priority);
+    }
+private:
+    const float m_eventStartTimeSeconds;
+    const std::shared_ptr<SampleBank> m_bank;
+    const UINT32 m_sampleIndex;
+    const float m_pitch;
+    const float m_gain;
+    const INT32 m_priority;
 };
 
-class AudioThreadCommand_ScheduleBeeps : public AudioThreadCommand
+// A note or event at a fixed engine time, in samples, rather than relative to when it is submitted. A note whose time
+// has already passed when it reaches the audio thread joins in part way through, so it stays in step.
+
+class AudioBeepCommand_BeepAtSample : public AudioBeepCommand
 {
 public:
-    AudioThreadCommand_ScheduleBeeps(std::vector<std::unique_ptr<AudioBeepCommand>> && commands)
-        : commands(std::move(commands))
+    AudioBeepCommand_BeepAtSample(UINT64 startSample, float frequencyHz, float amplitude, UINT32 durationSamples, INT32 priority)
+        : m_startSample(startSample)
+        , m_frequencyHz(frequencyHz)
+        , m_amplitude(amplitude)
+        , m_durationSamples(durationSamples)
+        , m_priority(priority)
     {
     }
 
-    std::vector<std::unique_ptr<AudioBeepCommand>> const & Commands() const { return commands; }
+    virtual ArenaPtr<BeepCommand> CreateCommand(AudioArena* arena, UINT32 sampleRate, UINT64 offsetTime) const override
+    {
+		float frequencyRadiansPerSample = 2.0f * (float)(std::numbers::pi) * m_frequencyHz / sampleRate;
+		return MakeInArena<BeepCommand_Beep>(arena, m_startSample, frequencyRadiansPerSample, m_amplitude, m_durationSamples, m_priority);
+    }
 private:
-    std::vector<std::unique_ptr<AudioBeepCommand>> commands;
+    const UINT64 m_startSample;
+    const float m_frequencyHz;
+    const float m_amplitude;
+    const UINT32 m_durationSamples;
+    const INT32 m_priority;
 };
 
-class AudioThreadCommand_WaitForEvent : public AudioThreadCommand
+class AudioBeepCommand_EventAtSample : public AudioBeepCommand
 {
 public:
-	AudioThreadCommand_WaitForEvent(UINT32 eventId, HANDLE hResponseEvent, bool * pEventOccurred)
-		: m_eventId(eventId)
-		, m_hResponseEvent(hResponseEvent)
-        , m_pEventOccurred(pEventOccurred)
-	{
-	}
-	UINT32 EventId() const { return m_eventId; }
-	HANDLE ResponseEvent() const { return m_hResponseEvent; }
-	void SetEventOccurred(bool eventOccurred) const
+    AudioBeepCommand_EventAtSample(UINT64 sample, UINT32 eventId)
+        : m_sample(sample)
+        , m_eventId(eventId)
     {
-        if (m_pEventOccurred != nullptr)
-        {
-            *m_pEventOccurred = eventOccurred;
-        }
     }
+
+    virtual ArenaPtr<BeepCommand> CreateCommand(AudioArena* arena, UINT32 sampleRate, UINT64 offsetTime) const override
+    {
+        return MakeInArena<BeepCommand_Event>(arena, m_sample, m_eventId);
+    }
+
 private:
+	const UINT64 m_sample;
 	const UINT32 m_eventId;
-	const HANDLE m_hResponseEvent;
-	bool * const m_pEventOccurred;
 };
 
-typedef std::map<UINT32, std::unique_ptr<AudioThreadCommand_WaitForEvent>> EventMap;
+// A score that the engine repeats by itself, every period, repeatCount times (0 for ever).
 
-class BeepInProgress
+class BeepLoopPattern
 {
 public:
-	virtual std::optional<std::unique_ptr<BeepInProgress>> AddToBuffer(float* buf, UINT32 size) = 0;
-    virtual ~BeepInProgress() {}
+    BeepLoopPattern(std::vector<std::unique_ptr<AudioBeepCommand>> && commands, float periodSeconds, UINT32 repeatCount)
+        : m_commands(std::move(commands))
+        , m_periodSeconds(periodSeconds)
+        , m_repeatCount(repeatCount)
+    {
+    }
+
+    std::vector<std::unique_ptr<AudioBeepCommand>> const & Commands() const { return m_commands; }
+    float PeriodSeconds() const { return m_periodSeconds; }
+    UINT32 RepeatCount() const { return m_repeatCount; }
+private:
+    std::vector<std::unique_ptr<AudioBeepCommand>> m_commands;
+    const float m_periodSeconds;
+    const UINT32 m_repeatCount;
 };
 
-class BeepInProgress_SineWave : public BeepInProgress
+// Sits in the beep queue at the start of a loop's latest iteration, and queues the iteration after it when it comes
+// due. Iterations are thus queued one period ahead, so the next instance of each of the loop's events is always known.
+// The pattern must be taken out before the command is destroyed, so that it can be released off the audio thread.
+
+class BeepCommand_Loop : public BeepCommand
 {
 public:
-    BeepInProgress_SineWave(float frequencyRadiansPerSample, float amplitude, UINT32 delayStart, UINT32 totalDuration, UINT32 alreadyPlayed = 0)
-        : m_frequencyRadiansPerSample(frequencyRadiansPerSample)
-        , m_amplitude(amplitude)
-        , m_delayStart(delayStart)
-        , m_totalDuration(totalDuration)
-        , m_alreadyPlayed(alreadyPlayed)
+    BeepCommand_Loop(UINT64 eventStartTimeSamples, std::unique_ptr<BeepLoopPattern> && pattern, UINT64 periodSamples, UINT32 nextIteration)
+        : m_eventStartTimeSamples(eventStartTimeSamples)
+        , m_pattern(std::move(pattern))
+        , m_periodSamples(periodSamples)
+        , m_nextIteration(nextIteration)
     {
     }
 
-    virtual std::optional<std::unique_ptr<BeepInProgress>> AddToBuffer(float* buf, UINT32 bufSize) override
-	{
-        if (m_delayStart > bufSize)
-        {
-            // this should never happen, it should still be in the queued beeps
-            OutputDebugString(L"Delayed more than one buffer\n");
-			return std::optional<std::unique_ptr<BeepInProgress>>(new BeepInProgress_SineWave(m_frequencyRadiansPerSample, m_amplitude, m_delayStart - bufSize, m_totalDuration, m_alreadyPlayed));
-        }
-        else
-        {
-            float* start = buf + m_delayStart;
-			UINT32 sizeThisTime = min(m_totalDuration, bufSize - m_delayStart);
-            float* end = start + sizeThisTime;
-			for (float* it = start; it != end; ++it)
-			{
-				*it += m_amplitude * sinf(m_frequencyRadiansPerSample * (m_alreadyPlayed + (it - start)));
-			}
-            if (m_totalDuration > sizeThisTime)
-            {
-                return std::optional<std::unique_ptr<BeepInProgress>>
-                (
-                    std::unique_ptr<BeepInProgress>
-                    (
-                        new BeepInProgress_SineWave
-                        (
-                            m_frequencyRadiansPerSample,
-                            m_amplitude,
-                            0,
-                            m_totalDuration - sizeThisTime,
-                            m_alreadyPlayed + sizeThisTime
-                        )
-                    )
-                );
-            }
-            else
-            {
-                return std::nullopt;
-            }
-        }
-	}
+    UINT64 EventStartTimeSamples() const override { return m_eventStartTimeSamples; }
+    UINT64 PeriodSamples() const { return m_periodSamples; }
+    UINT32 NextIteration() const { return m_nextIteration; }
+    std::unique_ptr<BeepLoopPattern> TakePattern() { return std::move(m_pattern); }
+private:
+    const UINT64 m_eventStartTimeSamples;
+    std::unique_ptr<BeepLoopPattern> m_pattern;
+    const UINT64 m_periodSamples;
+    const UINT32 m_nextIteration;
+};
 
+class AudioThreadCommand
+{
+public:
+    AudioThreadCommand() : m_next(nullptr) {}
+    virtual ~AudioThreadCommand() {}
 private:
-    const float m_frequencyRadiansPerSample;
-    const float m_amplitude;
-    const UINT32 m_delayStart;
-    const UINT32 m_totalDuration;
-    const UINT32 m_alreadyPlayed;
+    friend class AudioThreadCommandQueue;
+    std::atomic<AudioThreadCommand*> m_next;
 };
 
-typedef std::vector<std::unique_ptr<BeepInProgress>> BeepInProgressVector;
+class AudioThreadCommand_Stub : public AudioThreadCommand
+{
+};
 
-HANDLE hStopEvent = nullptr;
+// Intrusive multiple-producer, single-consumer queue (Vyukov). Push is wait-free, so any number of client threads
+// can hand commands to the audio thread without contending on a lock. Only the audio thread may call Pop.
 
-class AudioThreadData
+class AudioThreadCommandQueue
 {
 public:
-    AudioThreadData(int bufferSize)
-		: BUFFER_SIZE(bufferSize)
-        , m_didCoInitialize(false)
-        , m_pXAudio2(nullptr)
-        , m_didCreateXAudio2(false)
-        , m_pMasterVoice(nullptr)
-        , m_didCreateMasteringVoice(false)
-        , m_sampleRate(0)
-        , m_lastError(0u)
-		, m_buffer1(nullptr)
-		, m_buffer2(nullptr)
-        , m_callback(nullptr)
-        , m_pSourceVoice(nullptr)
-        , m_didCreateSourceVoice(false)
-        , m_queueLock(nullptr)
-        , m_currentTime(0u)
-        , m_hQueueEvent(nullptr)
-        , m_commandQueue(nullptr)
-        , m_queuedBeeps(nullptr)
-        , m_queuedBeepsPostWrap(nullptr)
-        , m_possibleFutureEvents(nullptr)
-        , m_waitingEvents(nullptr)
+    AudioThreadCommandQueue()
+        : m_stub()
+        , m_head(&m_stub)
+        , m_tail(&m_stub)
     {
     }
 
-	UINT32 GetSampleRate() const { return m_sampleRate; }
-
-	DWORD GetLastError() const { return m_lastError; }
-
-    bool Initialize()
+    void Push(std::unique_ptr<AudioThreadCommand> command)
     {
-        assert(!m_didCoInitialize);
+        PushNode(command.release());
+    }
 
-        HRESULT coInitiailzeResult = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
-        if (FAILED(coInitiailzeResult)) return false;
-        m_didCoInitialize = true;
+    std::unique_ptr<AudioThreadCommand> Pop()
+    {
+        AudioThreadCommand* tail = m_tail;
+        AudioThreadCommand* next = tail->m_next.load(std::memory_order_acquire);
+        if (tail == &m_stub)
+        {
+            if (next == nullptr) return nullptr;
+            m_tail = next;
+            tail = next;
+            next = next->m_next.load(std::memory_order_acquire);
+        }
 
-        HRESULT hr = XAudio2Create(&m_pXAudio2);
-        if (FAILED(hr)) return false;
-        m_didCreateXAudio2 = true;
+        if (next != nullptr)
+        {
+            m_tail = next;
+            return std::unique_ptr<AudioThreadCommand>(tail);
+        }
 
-        hr = m_pXAudio2->CreateMasteringVoice(&m_pMasterVoice);
-        if (FAILED(hr)) return false;
-        m_didCreateMasteringVoice = true;
+        if (tail != m_head.load(std::memory_order_acquire))
+        {
+            // a producer has swapped the head but not linked it yet; it will signal the queue event once it has
+            return nullptr;
+        }
 
-        XAUDIO2_VOICE_DETAILS masterDetails;
-        m_pMasterVoice->GetVoiceDetails(&masterDetails);
-        m_sampleRate = masterDetails.InputSampleRate;
+        PushNode(&m_stub);
 
-        m_buffer1 = std::unique_ptr<BufferData>(new BufferData());
-        if (m_buffer1 == nullptr) return false;
-        bool isInitialized = m_buffer1->Initialize(BUFFER_SIZE);
-        if (!isInitialized) { m_lastError = m_buffer1->GetLastError(); return false; }
+        next = tail->m_next.load(std::memory_order_acquire);
+        if (next != nullptr)
+        {
+            m_tail = next;
+            return std::unique_ptr<AudioThreadCommand>(tail);
+        }
 
-		m_buffer2 = std::unique_ptr<BufferData>(new BufferData());
-        if (m_buffer2 == nullptr) return false;
-        isInitialized = m_buffer2->Initialize(BUFFER_SIZE);
-		if (!isInitialized) { m_lastError = m_buffer2->GetLastError(); return false; }
+        return nullptr;
+    }
 
-        m_callback = new VoiceCallback2();
-		if (m_callback == nullptr) return false;
+    ~AudioThreadCommandQueue()
+    {
+        while (Pop() != nullptr)
+        {
+            // discard
+        }
+    }
 
-        WAVEFORMATEX wfx = { WAVE_FORMAT_IEEE_FLOAT, 1, m_sampleRate, m_sampleRate * 4, 4, 32, 0 };
-        hr = m_pXAudio2->CreateSourceVoice(&m_pSourceVoice, &wfx, 0, XAUDIO2_DEFAULT_FREQ_RATIO, m_callback);
-        if (FAILED(hr)) return false;
-        m_didCreateSourceVoice = true;
+private:
+    AudioThreadCommand_Stub m_stub;
+    std::atomic<AudioThreadCommand*> m_head;
+    AudioThreadCommand* m_tail;
 
-		m_queueLock = std::unique_ptr<std::mutex>(new std::mutex());
-        if (m_queueLock == nullptr) return false;
+    void PushNode(AudioThreadCommand* node)
+    {
+        node->m_next.store(nullptr, std::memory_order_relaxed);
+        AudioThreadCommand* prev = m_head.exchange(node, std::memory_order_acq_rel);
+        prev->m_next.store(node, std::memory_order_release);
+    }
+};
 
-		m_hQueueEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
-        if (m_hQueueEvent == nullptr) { m_lastError = ::GetLastError(); return false; }
+class AudioThreadCommand_ScheduleBeeps : public AudioThreadCommand
+{
+public:
+    AudioThreadCommand_ScheduleBeeps(std::vector<std::unique_ptr<AudioBeepCommand>> && commands, UINT32 group)
+        : commands(std::move(commands))
+        , group(group)
+    {
+    }
 
-		m_commandQueue = std::unique_ptr<std::queue<std::unique_ptr<AudioThreadCommand>>>(new std::queue<std::unique_ptr<AudioThreadCommand>>());
-        if (m_commandQueue == nullptr) { return false; }
+    std::vector<std::unique_ptr<AudioBeepCommand>> const & Commands() const { return commands; }
+    UINT32 Group() const { return group; }
+private:
+    std::vector<std::unique_ptr<AudioBeepCommand>> commands;
+    const UINT32 group;
+};
 
-        m_queuedBeeps = std::unique_ptr<BeepCommandQueue>(new BeepCommandQueue());
-        if (m_queuedBeeps == nullptr) { return false; }
+class AudioThreadCommand_ScheduleLoop : public AudioThreadCommand
+{
+public:
+    AudioThreadCommand_ScheduleLoop(std::unique_ptr<BeepLoopPattern> && pattern, UINT32 group)
+        : m_pattern(std::move(pattern))
+        , m_group(group)
+    {
+    }
 
-		m_queuedBeepsPostWrap = std::unique_ptr<BeepCommandQueue>(new BeepCommandQueue());
-        if (m_queuedBeepsPostWrap == nullptr) { return false; }
-        
-		m_possibleFutureEvents = std::unique_ptr<EventSet>(new EventSet());
-		if (m_possibleFutureEvents == nullptr) { return false; }
+    std::unique_ptr<BeepLoopPattern> TakePattern() { return std::move(m_pattern); }
+    UINT32 Group() const { return m_group; }
+private:
+    std::unique_ptr<BeepLoopPattern> m_pattern;
+    const UINT32 m_group;
+};
 
-        m_waitingEvents = std::unique_ptr<EventMap>(new EventMap());
-		if (m_waitingEvents == nullptr) { return false; }
+class EventCompletionTarget
+{
+public:
+    virtual ~EventCompletionTarget() {}
 
-		m_beepInProgressVector = std::unique_ptr<BeepInProgressVector>(new BeepInProgressVector());
-		if (m_beepInProgressVector == nullptr) { return false; }
+    // Called on the event dispatcher thread, or on whichever thread discards a watch the audio thread never accepted.
+    virtual void Complete(UINT32 eventId, BeepEventStatus status) = 0;
+};
 
-        return true;
-    }
+// Completes when the first watched event occurs, or when none of the watched events can occur any more.
 
-    void ScheduleBeeps(std::vector<std::unique_ptr<AudioBeepCommand>>&& commands)
+class EventCompletionTarget_Wait : public EventCompletionTarget
+{
+public:
+    EventCompletionTarget_Wait(UINT32 watchCount)
+        : m_lock()
+        , m_changed()
+        , m_watchCount(watchCount)
+        , m_notScheduledCount(0u)
+        , m_isDone(false)
+        , m_eventId(0u)
+        , m_status(BeepEventStatus_Timeout)
     {
-		std::lock_guard<std::mutex> lock(*m_queueLock);
-		m_commandQueue->push(std::unique_ptr<AudioThreadCommand>(new AudioThreadCommand_ScheduleBeeps(std::move(commands))));
-		::SetEvent(m_hQueueEvent);
     }
 
-    bool WaitForEvent(UINT32 eventId)
+    void Complete(UINT32 eventId, BeepEventStatus status) override
     {
-		HANDLE hResponseEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
-		if (hResponseEvent == nullptr) return false;
-		bool eventOccurred = false;
         {
-			std::lock_guard<std::mutex> lock(*m_queueLock);
-			m_commandQueue->push(std::unique_ptr<AudioThreadCommand>(new AudioThreadCommand_WaitForEvent(eventId, hResponseEvent, &eventOccurred)));
-			::SetEvent(m_hQueueEvent);
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (m_isDone) return;
+            if (status == BeepEventStatus_NotScheduled)
+            {
+                ++m_notScheduledCount;
+                if (m_notScheduledCount < m_watchCount) return;
+            }
+            m_isDone = true;
+            m_eventId = eventId;
+            m_status = status;
         }
-		WaitForSingleObject(hResponseEvent, INFINITE);
-		CloseHandle(hResponseEvent);
-        return eventOccurred;
+        m_changed.notify_all();
     }
 
-    void RunLoop()
+    BeepEventStatus Wait(UINT32 timeoutMilliseconds, UINT32* pEventId)
     {
-        HRESULT hr = SubmitBuffer(m_buffer1.get());
-        if (FAILED(hr))
+        std::unique_lock<std::mutex> lock(m_lock);
+        if (timeoutMilliseconds == INFINITE)
         {
-            OutputDebugString(L"Failed to submit first buffer\n");
-            Stop();
-            return;
+            m_changed.wait(lock, [this]() { return m_isDone; });
         }
-        hr = SubmitBuffer(m_buffer2.get());
-		if (FAILED(hr))
-		{
-			OutputDebugString(L"Failed to submit second buffer\n");
-			Stop();
-			return;
-		}
-        Start();
-        HANDLE events[4] = { hStopEvent, m_hQueueEvent, m_buffer1->GetEventHandle(), m_buffer2->GetEventHandle() };
+        else if (!m_changed.wait_for(lock, std::chrono::milliseconds(timeoutMilliseconds), [this]() { return m_isDone; }))
+        {
+            return BeepEventStatus_Timeout;
+        }
+
+        if (pEventId != nullptr) *pEventId = m_eventId;
+        return m_status;
+    }
+
+private:
+    std::mutex m_lock;
+    std::condition_variable m_changed;
+    const UINT32 m_watchCount;
+    UINT32 m_notScheduledCount;
+    bool m_isDone;
+    UINT32 m_eventId;
+    BeepEventStatus m_status;
+};
+
+// Collects completions until the client polls for them.
+
+class EventCompletionTarget_Queue : public EventCompletionTarget
+{
+public:
+    EventCompletionTarget_Queue()
+        : m_lock()
+        , m_completions()
+    {
+    }
+
+    void Complete(UINT32 eventId, BeepEventStatus status) override
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_completions.push_back(std::make_pair(eventId, status));
+    }
+
+    bool TryGet(UINT32* pEventId, BeepEventStatus* pStatus)
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        if (m_completions.empty()) return false;
+        if (pEventId != nullptr) *pEventId = m_completions.front().first;
+        if (pStatus != nullptr) *pStatus = m_completions.front().second;
+        m_completions.pop_front();
+        return true;
+    }
+
+private:
+    std::mutex m_lock;
+    std::deque<std::pair<UINT32, BeepEventStatus>> m_completions;
+};
+
+class AudioThreadCommand_WatchEvents : public AudioThreadCommand
+{
+public:
+    AudioThreadCommand_WatchEvents(std::vector<UINT32> && eventIds, std::shared_ptr<EventCompletionTarget> const & target)
+        : m_eventIds(std::move(eventIds))
+        , m_target(target)
+        , m_isAccepted(false)
+    {
+    }
+
+    std::vector<UINT32> const & EventIds() const { return m_eventIds; }
+
+    std::shared_ptr<EventCompletionTarget> const & Target() const { return m_target; }
+
+    // Once the audio thread has accepted the watch, it is responsible for completing it. The command keeps its
+    // reference to the target, so the last reference is never dropped on the audio thread.
+    void Accept() { m_isAccepted = true; }
+
+    ~AudioThreadCommand_WatchEvents()
+    {
+        if (!m_isAccepted && m_target != nullptr)
+        {
+            // the engine stopped before it saw this watch
+            for (std::vector<UINT32>::const_iterator it = m_eventIds.cbegin(); it != m_eventIds.cend(); ++it)
+            {
+                m_target->Complete(*it, BeepEventStatus_EngineStopped);
+            }
+        }
+    }
+
+private:
+    const std::vector<UINT32> m_eventIds;
+    const std::shared_ptr<EventCompletionTarget> m_target;
+    bool m_isAccepted;
+};
+
+// Withdraws a watch whose waiter has stopped waiting (it timed out, or another of its events happened first). The
+// command keeps its own reference to the target, so the audio thread never drops the last one.
+
+class AudioThreadCommand_UnwatchEvents : public AudioThreadCommand
+{
+public:
+    AudioThreadCommand_UnwatchEvents(std::vector<UINT32> && eventIds, std::shared_ptr<EventCompletionTarget> const & target)
+        : m_eventIds(std::move(eventIds))
+        , m_target(target)
+    {
+    }
+
+    std::vector<UINT32> const & EventIds() const { return m_eventIds; }
+
+    EventCompletionTarget* Target() const { return m_target.get(); }
+
+private:
+    const std::vector<UINT32> m_eventIds;
+    const std::shared_ptr<EventCompletionTarget> m_target;
+};
+
+typedef std::multimap<UINT32, std::shared_ptr<EventCompletionTarget>, std::less<UINT32>, ArenaAllocator<std::pair<const UINT32, std::shared_ptr<EventCompletionTarget>>>> EventMap;
+
+// A score whose records are read in order as the play head approaches them, rather than submitted all at once. Times
+// are in seconds from the start of the stream. Only the audio thread uses a stream once it has been handed over.
+
+class ScoreStream
+{
+public:
+    // callTime is the engine clock when the stream was asked for; record times count from then
+    ScoreStream(float lookaheadSeconds, UINT32 group, UINT64 callTime)
+        : m_lookaheadSeconds(lookaheadSeconds)
+        , m_position(0u)
+        , m_group(group)
+        , m_callTime(callTime)
+    {
+    }
+
+    virtual ~ScoreStream() {}
+
+    // Returns the next record, or nullptr if there is none yet.
+    virtual const BeepScoreFileRecord* Peek() = 0;
+    virtual void Advance() = 0;
+    virtual bool IsFinished() = 0;
+
+    // samples played since the stream was asked for
+    UINT64 Position() const { return m_position; }
+    virtual void AddToPosition(UINT32 samples) { m_position += samples; }
+
+    // The audio thread takes the stream on a buffer or so after the call; records due in between start at once.
+    void Start(UINT64 currentTime) { m_position = (currentTime > m_callTime) ? (currentTime - m_callTime) : 0u; }
+
+    UINT64 LookaheadSamples(UINT32 sampleRate) const { return static_cast<UINT64>(m_lookaheadSeconds * sampleRate); }
+
+    UINT32 Group() const { return m_group; }
+
+private:
+    const float m_lookaheadSeconds;
+    UINT64 m_position;
+    const UINT32 m_group;
+    const UINT64 m_callTime;
+};
+
+// Score records the engine cannot schedule: times that are negative, infinite, NaN or too far out for the engine clock,
+// and notes whose values are not finite or whose length does not fit in a UINT32 of samples. The clock limit leaves room
+// to add the time the stream started without wrapping.
+
+const double MAX_SCORE_SAMPLES = 1.0e18;
+
+static bool IsPlayableScoreRecord(BeepScoreFileRecord const & record, UINT32 sampleRate)
+{
+    if (!std::isfinite(record.startTime) || record.startTime < 0.0) return false;
+    if (record.startTime * sampleRate >= MAX_SCORE_SAMPLES) return false;
+    if (record.kind != BeepScoreRecordKind_Note && record.kind != BeepScoreRecordKind_Partial) return true;
+
+    if (!std::isfinite(record.frequency) || !std::isfinite(record.amplitude)) return false;
+    if (!std::isfinite(record.duration) || record.duration < 0.0f) return false;
+    return static_cast<double>(record.duration) * sampleRate < 4294967296.0;
+}
+
+// Where a ScoreWorkerStream gets its records. Read fills up to capacity records and returns how many it wrote, or 0
+// when there are no more. It is called on the stream's worker thread, and on the client's thread before the worker
+// starts, but never on the audio thread.
+
+class ScoreRecordSource
+{
+public:
+    virtual ~ScoreRecordSource() {}
+
+    virtual UINT32 Read(BeepScoreFileRecord* records, UINT32 capacity) = 0;
+};
+
+// A score file mapped into memory. Records are copied out a batch at a time as the worker reaches them, so the file can
+// be any length, and a page that has to come from disk is waited for on the worker rather than on the audio thread.
+
+class ScoreFileSource : public ScoreRecordSource
+{
+public:
+    ScoreFileSource()
+        : m_hFile(INVALID_HANDLE_VALUE)
+        , m_hMapping(nullptr)
+        , m_view(nullptr)
+        , m_records(nullptr)
+        , m_recordCount(0u)
+        , m_nextRecord(0u)
+        , m_lastError(0u)
+    {
+    }
+
+    DWORD GetLastError() const { return m_lastError; }
+
+    bool Open(const wchar_t* path)
+    {
+        m_hFile = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (m_hFile == INVALID_HANDLE_VALUE) { m_lastError = ::GetLastError(); return false; }
+
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(m_hFile, &fileSize)) { m_lastError = ::GetLastError(); return false; }
+        if (fileSize.QuadPart < static_cast<LONGLONG>(sizeof(BeepScoreFileHeader))) return false;
+
+        m_hMapping = CreateFileMapping(m_hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (m_hMapping == nullptr) { m_lastError = ::GetLastError(); return false; }
+
+        m_view = MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0);
+        if (m_view == nullptr) { m_lastError = ::GetLastError(); return false; }
+
+        BeepScoreFileHeader header;
+        if (!CopyFromMappedView(&header, m_view, sizeof(header))) return false;
+        if (memcmp(header.magic, BEEP_SCORE_FILE_MAGIC, sizeof(header.magic)) != 0) return false;
+        if (header.version != BEEP_SCORE_FILE_VERSION) return false;
+        if (header.recordSize != sizeof(BeepScoreFileRecord)) return false;
+
+        UINT64 available = (static_cast<UINT64>(fileSize.QuadPart) - sizeof(BeepScoreFileHeader)) / sizeof(BeepScoreFileRecord);
+        if (header.recordCount > available) return false;
+
+        m_records = reinterpret_cast<const BeepScoreFileRecord*>(reinterpret_cast<const BeepScoreFileHeader*>(m_view) + 1);
+        m_recordCount = header.recordCount;
+        return true;
+    }
+
+    // A page that cannot be read ends the score.
+    UINT32 Read(BeepScoreFileRecord* records, UINT32 capacity) override
+    {
+        UINT64 remaining = m_recordCount - m_nextRecord;
+        UINT32 count = (remaining < capacity) ? static_cast<UINT32>(remaining) : capacity;
+        if (count == 0u) return 0u;
+
+        if (!CopyFromMappedView(records, m_records + m_nextRecord, count * sizeof(BeepScoreFileRecord)))
+        {
+            BEEP_LOG(LOG_LEVEL_ERROR, L"Score file could not be read at record {}", m_nextRecord);
+            m_nextRecord = m_recordCount;
+            return 0u;
+        }
+
+        m_nextRecord += count;
+        return count;
+    }
+
+    ~ScoreFileSource()
+    {
+        if (m_view != nullptr)
+        {
+            UnmapViewOfFile(m_view);
+            m_view = nullptr;
+        }
+
+        if (m_hMapping != nullptr)
+        {
+            CloseHandle(m_hMapping);
+            m_hMapping = nullptr;
+        }
+
+        if (m_hFile != INVALID_HANDLE_VALUE)
+        {
+            CloseHandle(m_hFile);
+            m_hFile = INVALID_HANDLE_VALUE;
+        }
+    }
+
+private:
+    HANDLE m_hFile;
+    HANDLE m_hMapping;
+    LPVOID m_view;
+    const BeepScoreFileRecord* m_records;
+    UINT64 m_recordCount;
+    UINT64 m_nextRecord;
+    DWORD m_lastError;
+};
+
+// A score made up as it plays by a client's generator. Its release callback is called once, when the source is
+// destroyed.
+
+class ScoreGeneratorSource : public ScoreRecordSource
+{
+public:
+    ScoreGeneratorSource(BeepGeneratorCallback generate, BeepGeneratorReleaseCallback release, void* context)
+        : m_generate(generate)
+        , m_release(release)
+        , m_context(context)
+    {
+    }
+
+    UINT32 Read(BeepScoreFileRecord* records, UINT32 capacity) override
+    {
+        UINT32 count = m_generate(m_context, records, capacity);
+        return min(count, capacity);
+    }
+
+    ~ScoreGeneratorSource()
+    {
+        if (m_release != nullptr)
+        {
+            m_release(m_context);
+        }
+    }
+
+private:
+    const BeepGeneratorCallback m_generate;
+    const BeepGeneratorReleaseCallback m_release;
+    void* const m_context;
+};
+
+// A score stream fed by a worker thread. The worker reads from the source, never further ahead of the play head than
+// twice the lookahead, and hands the records to the audio thread through a ring, so memory use does not depend on how
+// long the score is and the audio thread never waits on a file or a client. The first records are read on the calling
+// thread, by Initialize, so that playback can start at once. The worker is stopped before the source is destroyed.
+
+const UINT32 SCORE_RING_CAPACITY = 4096u;
+const UINT32 SCORE_BATCH_SIZE = 64u;
+
+class ScoreWorkerStream : public ScoreStream
+{
+public:
+    ScoreWorkerStream(std::unique_ptr<ScoreRecordSource> && source, float lookaheadSeconds, UINT32 sampleRate, UINT32 group, UINT64 callTime)
+        : ScoreStream(lookaheadSeconds, group, callTime)
+        , m_source(std::move(source))
+        , m_sampleRate(sampleRate)
+        , m_ring(SCORE_RING_CAPACITY)
+        , m_next()
+        , m_hasNext(false)
+        , m_isSourceFinished(false)
+        , m_publishedPosition(0u)
+        , m_batch(SCORE_BATCH_SIZE)
+        , m_batchCount(0u)
+        , m_batchNext(0u)
+        , m_lastStartTime(0.0)
+        , m_hStopEvent(nullptr)
+        , m_hWakeEvent(nullptr)
+        , m_hThread(nullptr)
+        , m_lastError(0u)
+    {
+    }
+
+    DWORD GetLastError() const { return m_lastError; }
+
+    bool Initialize()
+    {
+        m_hStopEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+        if (m_hStopEvent == nullptr) { m_lastError = ::GetLastError(); return false; }
+
+        m_hWakeEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+        if (m_hWakeEvent == nullptr) { m_lastError = ::GetLastError(); return false; }
+
+        Fill();
+
+        m_hThread = CreateThread(nullptr, 0, ThreadProc, this, 0, nullptr);
+        if (m_hThread == nullptr) { m_lastError = ::GetLastError(); return false; }
+
+        return true;
+    }
+
+    const BeepScoreFileRecord* Peek() override
+    {
+        if (!m_hasNext) m_hasNext = m_ring.TryPop(m_next);
+        return m_hasNext ? &m_next : nullptr;
+    }
+
+    void Advance() override { m_hasNext = false; }
+
+    bool IsFinished() override
+    {
+        if (m_hasNext) return false;
+        if (!m_isSourceFinished.load(std::memory_order_acquire)) return false;
+        m_hasNext = m_ring.TryPop(m_next);
+        return !m_hasNext;
+    }
+
+    // the worker is woken once a buffer, to top the ring up
+    void AddToPosition(UINT32 samples) override
+    {
+        ScoreStream::AddToPosition(samples);
+        m_publishedPosition.store(Position(), std::memory_order_release);
+        ::SetEvent(m_hWakeEvent);
+    }
+
+    ~ScoreWorkerStream()
+    {
+        if (m_hThread != nullptr)
+        {
+            ::SetEvent(m_hStopEvent);
+            WaitForSingleObject(m_hThread, INFINITE);
+            CloseHandle(m_hThread);
+            m_hThread = nullptr;
+        }
+
+        if (m_hWakeEvent != nullptr)
+        {
+            CloseHandle(m_hWakeEvent);
+            m_hWakeEvent = nullptr;
+        }
+
+        if (m_hStopEvent != nullptr)
+        {
+            CloseHandle(m_hStopEvent);
+            m_hStopEvent = nullptr;
+        }
+
+        m_source.reset();
+    }
+
+private:
+    std::unique_ptr<ScoreRecordSource> m_source; // worker
+    const UINT32 m_sampleRate;
+    SpscRing<BeepScoreFileRecord> m_ring;
+    BeepScoreFileRecord m_next; // audio thread
+    bool m_hasNext;
+    std::atomic<bool> m_isSourceFinished;
+    std::atomic<UINT64> m_publishedPosition;
+    std::vector<BeepScoreFileRecord> m_batch; // worker
+    UINT32 m_batchCount;
+    UINT32 m_batchNext;
+    double m_lastStartTime;
+    HANDLE m_hStopEvent;
+    HANDLE m_hWakeEvent;
+    HANDLE m_hThread;
+    DWORD m_lastError;
+
+    static DWORD WINAPI ThreadProc(LPVOID arg)
+    {
+        reinterpret_cast<ScoreWorkerStream*>(arg)->RunLoop();
+        return 0;
+    }
+
+    void RunLoop()
+    {
+        HANDLE events[2] = { m_hStopEvent, m_hWakeEvent };
+        while (!m_isSourceFinished.load(std::memory_order_relaxed))
+        {
+            DWORD waitResult = WaitForMultipleObjects(2, events, FALSE, INFINITE);
+            if (waitResult != WAIT_OBJECT_0 + 1) return;
+            Fill();
+        }
+    }
+
+    // Reads records until the ring is full or the horizon is reached. A source that returns no records is finished.
+    // A record earlier than the one before it, or one that cannot be played, ends the score, so the audio thread only
+    // ever sees records that are in order and in range.
+    void Fill()
+    {
+        UINT64 horizon = m_publishedPosition.load(std::memory_order_acquire) + 2u * LookaheadSamples(m_sampleRate);
         while (true)
         {
-            DWORD waitResult = WaitForMultipleObjects(4, events, FALSE, INFINITE);
-            switch (waitResult)
+            if (m_batchNext == m_batchCount)
             {
-            case WAIT_OBJECT_0:
-                Stop();
-                return;
+                m_batchCount = m_source->Read(m_batch.data(), SCORE_BATCH_SIZE);
+                m_batchNext = 0u;
+                if (m_batchCount == 0u) break;
+            }
 
-			case WAIT_OBJECT_0 + 1:
-                ProcessQueue();
-				break;
+            BeepScoreFileRecord& record = m_batch[m_batchNext];
+            if (!IsPlayableScoreRecord(record, m_sampleRate))
+            {
+                BEEP_LOG(LOG_LEVEL_ERROR, L"Score record at {} seconds cannot be played", record.startTime);
+                break;
+            }
+            if (record.startTime < m_lastStartTime)
+            {
+                OutputDebugString(L"Score is not sorted\n");
+                break;
+            }
+            if (static_cast<UINT64>(record.startTime * m_sampleRate) >= horizon) return;
 
-            case WAIT_OBJECT_0 + 2:
-                RenderToBuffer(m_buffer1.get());
-				hr = SubmitBuffer(m_buffer1.get());
-                if (FAILED(hr))
-                {
-					OutputDebugString(L"Failed to submit buffer\n");
-                    Stop();
-                    return;
-                }
-				break;
+            double startTime = record.startTime;
+            if (!m_ring.TryPush(record)) return;
+            m_lastStartTime = startTime;
+            ++m_batchNext;
+        }
+        m_isSourceFinished.store(true, std::memory_order_release);
+    }
+};
+
+typedef std::vector<std::unique_ptr<ScoreStream>> ScoreStreamVector;
+
+// Shared ring records come from another process and are checked before they are queued: the kind must be known, the
+// start must fit the engine clock as a score record's does, and a note or partial needs a finite amplitude, a
+// frequency between 0 and the Nyquist frequency, and a length. Every group number is allowed; 0 means none.
+
+const UINT32 MAX_SHARED_RECORDS_PER_BUFFER = 1024u;
+
+static bool IsValidSharedRecord(BeepSharedCommandRecord const & record, UINT32 sampleRate)
+{
+    if (static_cast<double>(record.startSample) >= MAX_SCORE_SAMPLES) return false;
+    if (record.kind == BeepScoreRecordKind_Event) return true;
+    if (record.kind != BeepScoreRecordKind_Note && record.kind != BeepScoreRecordKind_Partial) return false;
+
+    if (!std::isfinite(record.frequency) || record.frequency <= 0.0f || record.frequency >= sampleRate * 0.5f) return false;
+    if (!std::isfinite(record.amplitude)) return false;
+    return record.durationSamples != 0u;
+}
+
+// The shared-memory transport (see BeepSharedRingHeader). The engine's side creates the mapping and a client's side
+// opens it. Each side writes only the indices it owns, and reads the other side's with acquire semantics, so neither
+// side ever waits for the other or makes a system call. Records are copied out before they are looked at, because the
+// other process can write to the mapping at any time. For the same reason each side reads the capacities from the
+// header once, when it creates or opens the mapping, and keeps its own copy of them and of the record pointers.
+
+class SharedRing
+{
+public:
+    SharedRing()
+        : m_hMapping(nullptr)
+        , m_view(nullptr)
+        , m_header(nullptr)
+        , m_commands(nullptr)
+        , m_completions(nullptr)
+        , m_commandCapacity(0u)
+        , m_completionCapacity(0u)
+        , m_sampleRate(0u)
+        , m_lastError(0u)
+    {
+    }
+
+    DWORD GetLastError() const { return m_lastError; }
+
+    static bool IsValidCapacity(UINT32 capacity)
+    {
+        return capacity != 0u && (capacity & (capacity - 1u)) == 0u;
+    }
+
+    bool Create(const wchar_t* name, UINT32 commandCapacity, UINT32 completionCapacity, UINT32 sampleRate)
+    {
+        if (!IsValidCapacity(commandCapacity) || !IsValidCapacity(completionCapacity)) return false;
+
+        UINT64 size = sizeof(BeepSharedRingHeader) + (UINT64)commandCapacity * sizeof(BeepSharedCommandRecord) + (UINT64)completionCapacity * sizeof(BeepSharedCompletionRecord);
+        m_hMapping = CreateFileMapping(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, (DWORD)(size >> 32), (DWORD)size, name);
+        if (m_hMapping == nullptr) { m_lastError = ::GetLastError(); return false; }
+        if (::GetLastError() == ERROR_ALREADY_EXISTS) { m_lastError = ERROR_ALREADY_EXISTS; return false; }
+
+        m_view = MapViewOfFile(m_hMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+        if (m_view == nullptr) { m_lastError = ::GetLastError(); return false; }
+
+        BeepSharedRingHeader* header = reinterpret_cast<BeepSharedRingHeader*>(m_view);
+        memset(header, 0, sizeof(BeepSharedRingHeader));
+        header->version = BEEP_SHARED_RING_VERSION;
+        header->commandCapacity = commandCapacity;
+        header->completionCapacity = completionCapacity;
+        header->sampleRate = sampleRate;
+        std::atomic_thread_fence(std::memory_order_release);
+        memcpy(header->magic, BEEP_SHARED_RING_MAGIC, sizeof(header->magic));
+
+        SetPointers(commandCapacity, completionCapacity, sampleRate);
+        return true;
+    }
+
+    bool Open(const wchar_t* name)
+    {
+        m_hMapping = OpenFileMapping(FILE_MAP_ALL_ACCESS, FALSE, name);
+        if (m_hMapping == nullptr) { m_lastError = ::GetLastError(); return false; }
+
+        m_view = MapViewOfFile(m_hMapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+        if (m_view == nullptr) { m_lastError = ::GetLastError(); return false; }
+
+        const BeepSharedRingHeader* header = reinterpret_cast<const BeepSharedRingHeader*>(m_view);
+        if (memcmp(header->magic, BEEP_SHARED_RING_MAGIC, sizeof(header->magic)) != 0) return false;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (header->version != BEEP_SHARED_RING_VERSION) return false;
+        UINT32 commandCapacity = header->commandCapacity;
+        UINT32 completionCapacity = header->completionCapacity;
+        UINT32 sampleRate = header->sampleRate;
+        if (!IsValidCapacity(commandCapacity) || !IsValidCapacity(completionCapacity)) return false;
+
+        MEMORY_BASIC_INFORMATION info;
+        UINT64 size = sizeof(BeepSharedRingHeader) + (UINT64)commandCapacity * sizeof(BeepSharedCommandRecord) + (UINT64)completionCapacity * sizeof(BeepSharedCompletionRecord);
+        if (VirtualQuery(m_view, &info, sizeof(info)) == 0u || info.RegionSize < size) return false;
+
+        SetPointers(commandCapacity, completionCapacity, sampleRate);
+        return true;
+    }
+
+    UINT32 SampleRate() const { return m_sampleRate; }
+    UINT64 RenderPosition() const { return std::atomic_ref<UINT64>(m_header->renderPosition).load(std::memory_order_relaxed); }
+
+    // engine, audio thread only
+    void SetRenderPosition(UINT64 position)
+    {
+        std::atomic_ref<UINT64>(m_header->renderPosition).store(position, std::memory_order_relaxed);
+    }
+
+    // engine, audio thread only. Calls onRecord with a copy of each command the client has pushed, up to maxCount of
+    // them. onRecord returns false to leave the record, and the ones after it, in the ring for another time.
+    template<typename F>
+    void DrainCommands(UINT32 maxCount, F onRecord)
+    {
+        UINT32 tail = std::atomic_ref<UINT32>(m_header->commandTail).load(std::memory_order_relaxed);
+        UINT32 head = std::atomic_ref<UINT32>(m_header->commandHead).load(std::memory_order_acquire);
+        UINT32 count = min(head - tail, m_commandCapacity); // more than the capacity means the client broke the ring
+        count = min(count, maxCount);
+
+        UINT32 taken = 0u;
+        while (taken < count)
+        {
+            BeepSharedCommandRecord record = m_commands[(tail + taken) & (m_commandCapacity - 1u)];
+            if (!onRecord(record)) break;
+            ++taken;
+        }
+        std::atomic_ref<UINT32>(m_header->commandTail).store(tail + taken, std::memory_order_release);
+    }
+
+    // engine, event dispatcher thread only
+    void PushCompletion(UINT32 eventId, BeepEventStatus status)
+    {
+        UINT32 capacity = m_completionCapacity;
+        UINT32 head = std::atomic_ref<UINT32>(m_header->completionHead).load(std::memory_order_relaxed);
+        UINT32 tail = std::atomic_ref<UINT32>(m_header->completionTail).load(std::memory_order_acquire);
+        if (head - tail >= capacity)
+        {
+            std::atomic_ref<UINT64>(m_header->completionsDropped).fetch_add(1u, std::memory_order_relaxed);
+            return;
+        }
+
+        BeepSharedCompletionRecord& record = m_completions[head & (capacity - 1u)];
+        record.eventId = eventId;
+        record.status = status;
+        std::atomic_ref<UINT32>(m_header->completionHead).store(head + 1u, std::memory_order_release);
+    }
+
+    // client only; returns how many of the records fitted
+    UINT32 PushCommands(const BeepSharedCommandRecord* records, UINT32 count)
+    {
+        UINT32 capacity = m_commandCapacity;
+        UINT32 head = std::atomic_ref<UINT32>(m_header->commandHead).load(std::memory_order_relaxed);
+        UINT32 tail = std::atomic_ref<UINT32>(m_header->commandTail).load(std::memory_order_acquire);
+        count = min(count, capacity - (head - tail));
+
+        for (UINT32 i = 0; i < count; ++i)
+        {
+            m_commands[(head + i) & (capacity - 1u)] = records[i];
+        }
+        std::atomic_ref<UINT32>(m_header->commandHead).store(head + count, std::memory_order_release);
+        return count;
+    }
+
+    // client only
+    bool PopCompletion(UINT32* pEventId, BeepEventStatus* pStatus)
+    {
+        UINT32 capacity = m_completionCapacity;
+        UINT32 tail = std::atomic_ref<UINT32>(m_header->completionTail).load(std::memory_order_relaxed);
+        UINT32 head = std::atomic_ref<UINT32>(m_header->completionHead).load(std::memory_order_acquire);
+        if (head == tail) return false;
+
+        BeepSharedCompletionRecord record = m_completions[tail & (capacity - 1u)];
+        std::atomic_ref<UINT32>(m_header->completionTail).store(tail + 1u, std::memory_order_release);
+        if (pEventId != nullptr) *pEventId = record.eventId;
+        if (pStatus != nullptr) *pStatus = static_cast<BeepEventStatus>(record.status);
+        return true;
+    }
+
+    ~SharedRing()
+    {
+        if (m_view != nullptr)
+        {
+            UnmapViewOfFile(m_view);
+            m_view = nullptr;
+        }
+
+        if (m_hMapping != nullptr)
+        {
+            CloseHandle(m_hMapping);
+            m_hMapping = nullptr;
+        }
+    }
+
+private:
+    HANDLE m_hMapping;
+    LPVOID m_view;
+    BeepSharedRingHeader* m_header;
+    BeepSharedCommandRecord* m_commands;
+    BeepSharedCompletionRecord* m_completions;
+    UINT32 m_commandCapacity;
+    UINT32 m_completionCapacity;
+    UINT32 m_sampleRate;
+    DWORD m_lastError;
+
+    void SetPointers(UINT32 commandCapacity, UINT32 completionCapacity, UINT32 sampleRate)
+    {
+        m_header = reinterpret_cast<BeepSharedRingHeader*>(m_view);
+        m_commands = reinterpret_cast<BeepSharedCommandRecord*>(m_header + 1);
+        m_completions = reinterpret_cast<BeepSharedCompletionRecord*>(m_commands + commandCapacity);
+        m_commandCapacity = commandCapacity;
+        m_completionCapacity = completionCapacity;
+        m_sampleRate = sampleRate;
+    }
+};
+
+class AudioThreadCommand_SetSharedRing : public AudioThreadCommand
+{
+public:
+    AudioThreadCommand_SetSharedRing(std::shared_ptr<SharedRing> const & ring)
+        : m_ring(ring)
+    {
+    }
+
+    void SwapRing(std::shared_ptr<SharedRing> & ring) { std::swap(ring, m_ring); }
+private:
+    std::shared_ptr<SharedRing> m_ring;
+};
+
+class AudioThreadCommand_PlayScoreStream : public AudioThreadCommand
+{
+public:
+    AudioThreadCommand_PlayScoreStream(std::unique_ptr<ScoreStream> && stream)
+        : m_stream(std::move(stream))
+    {
+    }
+
+    std::unique_ptr<ScoreStream> TakeStream() { return std::move(m_stream); }
+private:
+    std::unique_ptr<ScoreStream> m_stream;
+};
+
+class AudioThreadCommand_SetNoteCacheBudget : public AudioThreadCommand
+{
+public:
+    AudioThreadCommand_SetNoteCacheBudget(UINT64 budgetBytes)
+        : m_budgetBytes(budgetBytes)
+    {
+    }
+
+    UINT64 BudgetBytes() const { return m_budgetBytes; }
+private:
+    const UINT64 m_budgetBytes;
+};
+
+class AudioThreadCommand_SetPolyphony : public AudioThreadCommand
+{
+public:
+    AudioThreadCommand_SetPolyphony(UINT32 maxVoices, BeepVoiceStealPolicy policy)
+        : m_maxVoices(maxVoices)
+        , m_policy(policy)
+    {
+    }
+
+    UINT32 MaxVoices() const { return m_maxVoices; }
+    BeepVoiceStealPolicy Policy() const { return m_policy; }
+private:
+    const UINT32 m_maxVoices;
+    const BeepVoiceStealPolicy m_policy;
+};
+
+class AudioThreadCommand_CancelGroup : public AudioThreadCommand
+{
+public:
+    AudioThreadCommand_CancelGroup(UINT32 group)
+        : m_group(group)
+    {
+    }
+
+    UINT32 Group() const { return m_group; }
+private:
+    const UINT32 m_group;
+};
+
+// Suspends or resumes the engine. requestTicks is when the caller asked, for measuring the time to the first sample.
+
+class AudioThreadCommand_SetSuspended : public AudioThreadCommand
+{
+public:
+    AudioThreadCommand_SetSuspended(bool suspend, LONGLONG requestTicks)
+        : m_suspend(suspend)
+        , m_requestTicks(requestTicks)
+    {
+    }
+
+    bool Suspend() const { return m_suspend; }
+    LONGLONG RequestTicks() const { return m_requestTicks; }
+private:
+    const bool m_suspend;
+    const LONGLONG m_requestTicks;
+};
+
+class AudioThreadCommand_SetShedding : public AudioThreadCommand
+{
+public:
+    AudioThreadCommand_SetShedding(bool enabled, float targetLoad)
+        : m_enabled(enabled)
+        , m_targetLoad(targetLoad)
+    {
+    }
+
+    bool Enabled() const { return m_enabled; }
+    float TargetLoad() const { return m_targetLoad; }
+private:
+    const bool m_enabled;
+    const float m_targetLoad;
+};
+
+class EventCompletion
+{
+public:
+    EventCompletion()
+        : eventId(0u)
+        , status(BeepEventStatus_Occurred)
+        , target(nullptr)
+    {
+    }
+
+    EventCompletion(UINT32 eventId, BeepEventStatus status, std::shared_ptr<EventCompletionTarget> && target)
+        : eventId(eventId)
+        , status(status)
+        , target(std::move(target))
+    {
+    }
+
+    UINT32 eventId;
+    BeepEventStatus status;
+    std::shared_ptr<EventCompletionTarget> target; // nullptr means "report to the event callback"
+};
+
+// Delivers event completions off the audio thread. The audio thread only ever pushes into a ring and sets an event;
+// waking waiters and running client callbacks happen here.
+
+class EventDispatcher
+{
+public:
+    EventDispatcher(AudioArena* arena)
+        : m_ring(4096u)
+        , m_overflow(OVERFLOW_CAPACITY)
+        , m_pending(ArenaAllocator<EventCompletion>(arena))
+        , m_hStopEvent(nullptr)
+        , m_hReadyEvent(nullptr)
+        , m_hThread(nullptr)
+        , m_callbackLock()
+        , m_callback(nullptr)
+        , m_callbackContext(nullptr)
+        , m_sharedRing(nullptr)
+        , m_lastError(0u)
+    {
+    }
+
+    DWORD GetLastError() const { return m_lastError; }
+
+    bool Initialize()
+    {
+        m_hStopEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+        if (m_hStopEvent == nullptr) { m_lastError = ::GetLastError(); return false; }
+
+        m_hReadyEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+        if (m_hReadyEvent == nullptr) { m_lastError = ::GetLastError(); return false; }
+
+        m_hThread = CreateThread(nullptr, 0, ThreadProc, this, 0, nullptr);
+        if (m_hThread == nullptr) { m_lastError = ::GetLastError(); return false; }
+
+        return true;
+    }
+
+    // Audio thread only; pass the target by moving it when dropping it would otherwise release the last reference.
+    // Completions that do not fit in the ring wait in a fixed overflow queue. Completions are never dropped, and the
+    // audio thread never waits for the dispatcher, so if that is full too (a cancel can finish a whole beep queue in one
+    // buffer), they go on a pending list in the arena, and later calls to Flush move them along.
+    void Post(UINT32 eventId, BeepEventStatus status, std::shared_ptr<EventCompletionTarget> target)
+    {
+        EventCompletion completion(eventId, status, std::move(target));
+        if (m_overflow.IsEmpty() && m_ring.TryPush(completion)) return;
+        if (m_pending.empty() && m_overflow.TryPush(completion)) return;
+
+        if (m_pending.empty())
+        {
+            BEEP_LOG(LOG_LEVEL_ERROR, L"Event completions are backed up; holding them until the dispatcher catches up");
+        }
+        m_pending.push_back(std::move(completion));
+    }
+
+    // audio thread only
+    void Flush()
+    {
+        while (!m_overflow.IsEmpty() && m_ring.TryPush(m_overflow.Front()))
+        {
+            m_overflow.PopFront();
+        }
+        while (!m_pending.empty() && m_overflow.TryPush(m_pending.front()))
+        {
+            m_pending.pop_front();
+        }
+        ::SetEvent(m_hReadyEvent);
+    }
+
+    // Once the audio thread has finished: waits until the dispatcher has taken every completion, so that none is lost
+    // when it stops.
+    void FlushAll()
+    {
+        Flush();
+        while (!m_overflow.IsEmpty() || !m_pending.empty())
+        {
+            Sleep(1);
+            Flush();
+        }
+    }
+
+    void SetCallback(BeepEventCallback callback, void* context)
+    {
+        std::lock_guard<std::mutex> lock(m_callbackLock);
+        m_callback = callback;
+        m_callbackContext = context;
+    }
+
+    // every event the callback sees is also written to the ring's completion ring
+    void SetSharedRing(std::shared_ptr<SharedRing> const & ring)
+    {
+        std::lock_guard<std::mutex> lock(m_callbackLock);
+        m_sharedRing = ring;
+    }
+
+    ~EventDispatcher()
+    {
+        if (m_hThread != nullptr)
+        {
+            ::SetEvent(m_hStopEvent);
+            WaitForSingleObject(m_hThread, INFINITE);
+            CloseHandle(m_hThread);
+            m_hThread = nullptr;
+        }
+
+        if (m_hReadyEvent != nullptr)
+        {
+            CloseHandle(m_hReadyEvent);
+            m_hReadyEvent = nullptr;
+        }
+
+        if (m_hStopEvent != nullptr)
+        {
+            CloseHandle(m_hStopEvent);
+            m_hStopEvent = nullptr;
+        }
+    }
+
+private:
+    static const UINT32 OVERFLOW_CAPACITY = 16384u;
+
+    SpscRing<EventCompletion> m_ring;
+    FixedQueue<EventCompletion> m_overflow; // audio thread
+    std::list<EventCompletion, ArenaAllocator<EventCompletion>> m_pending; // audio thread, only when m_overflow is full
+    HANDLE m_hStopEvent;
+    HANDLE m_hReadyEvent;
+    HANDLE m_hThread;
+    std::mutex m_callbackLock;
+    BeepEventCallback m_callback;
+    void* m_callbackContext;
+    std::shared_ptr<SharedRing> m_sharedRing;
+    DWORD m_lastError;
+
+    static DWORD WINAPI ThreadProc(LPVOID arg)
+    {
+        reinterpret_cast<EventDispatcher*>(arg)->RunLoop();
+        return 0;
+    }
+
+    void RunLoop()
+    {
+        HANDLE events[2] = { m_hStopEvent, m_hReadyEvent };
+        while (true)
+        {
+            DWORD waitResult = WaitForMultipleObjects(2, events, FALSE, INFINITE);
+            // the audio thread flushes its last completions before the dispatcher is stopped
+            Drain();
+            if (waitResult != WAIT_OBJECT_0 + 1) return;
+        }
+    }
+
+    void Drain()
+    {
+        EventCompletion completion;
+        while (m_ring.TryPop(completion))
+        {
+            if (completion.target != nullptr)
+            {
+                completion.target->Complete(completion.eventId, completion.status);
+            }
+            else
+            {
+                BeepEventCallback callback = nullptr;
+                void* context = nullptr;
+                std::shared_ptr<SharedRing> sharedRing = nullptr;
+                {
+                    std::lock_guard<std::mutex> lock(m_callbackLock);
+                    callback = m_callback;
+                    context = m_callbackContext;
+                    sharedRing = m_sharedRing;
+                }
+                if (callback != nullptr)
+                {
+                    callback(completion.eventId, completion.status, context);
+                }
+                if (sharedRing != nullptr)
+                {
+                    sharedRing->PushCompletion(completion.eventId, completion.status);
+                }
+            }
+            completion.target = nullptr;
+        }
+    }
+};
+
+class CachedNote;
+
+// A voice. Each buffer, AddToBuffer mixes the voice in and advances it; it returns false once the voice has finished.
+// A voice that has been told to fade out ramps down to silence over FADE_OUT_SAMPLES and finishes in its next buffer.
+
+const UINT32 FADE_OUT_SAMPLES = 256u;
+
+class BeepInProgress : public GroupListLinks<BeepInProgress>
+{
+public:
+    BeepInProgress(INT32 priority, float amplitude)
+        : m_priority(priority)
+        , m_amplitude(amplitude)
+        , m_serial(0u)
+        , m_group(0u)
+        , m_isFadingOut(false)
+    {
+    }
+
+	virtual bool AddToBuffer(float* buf, UINT32 size) = 0;
+
+    // Gives up the voice's reference to its recording, if it has one, so the caller can choose where it is released.
+    virtual std::shared_ptr<CachedNote> TakeNote() { return nullptr; }
+
+    // likewise for the sample bank the voice plays from
+    virtual std::shared_ptr<SampleBank> TakeBank() { return nullptr; }
+
+    virtual ~BeepInProgress() {}
+
+    INT32 Priority() const { return m_priority; }
+    float Amplitude() const { return m_amplitude; }
+
+    // voices are numbered in the order they start, so a lower serial number means an older voice
+    UINT64 Serial() const { return m_serial; }
+    void SetSerial(UINT64 serial) { m_serial = serial; }
+
+    // the group of the note that started the voice, or 0
+    UINT32 Group() const { return m_group; }
+    void SetGroup(UINT32 group) { m_group = group; }
+
+    bool IsFadingOut() const { return m_isFadingOut; }
+    void FadeOut() { m_isFadingOut = true; }
+
+private:
+    const INT32 m_priority;
+    const float m_amplitude;
+    UINT64 m_serial;
+    UINT32 m_group;
+    bool m_isFadingOut;
+};
+
+// Keeps each group's queued commands and playing voices on lists linked through the commands and voices themselves, so
+// that cancelling a group takes time in proportion to the size of the group, not to the number of commands queued or
+// voices playing. Adding to a list or removing from it costs one lookup of the group.
+//
+// A group's entry is kept only while it has queued commands or voices.
+
+class BeepGroupTable
+{
+public:
+    BeepGroupTable(AudioArena* arena)
+        : m_groups(GroupMap::allocator_type(arena))
+    {
+    }
+
+    // the command has been given a group and is being queued
+    void AddCommand(BeepCommand* command)
+    {
+        Link(m_groups.emplace(command->Group(), GroupState()).first->second.firstCommand, command);
+    }
+
+    // the command is leaving the queue
+    void RemoveCommand(BeepCommand* command)
+    {
+        GroupMap::iterator it = m_groups.find(command->Group());
+        if (it == m_groups.end()) return;
+        Unlink(it->second.firstCommand, command);
+        EraseIfEmpty(it);
+    }
+
+    // the voice has been given a group and is starting
+    void AddVoice(BeepInProgress* voice)
+    {
+        Link(m_groups.emplace(voice->Group(), GroupState()).first->second.firstVoice, voice);
+    }
+
+    // the voice is being retired
+    void RemoveVoice(BeepInProgress* voice)
+    {
+        GroupMap::iterator it = m_groups.find(voice->Group());
+        if (it == m_groups.end()) return;
+        Unlink(it->second.firstVoice, voice);
+        EraseIfEmpty(it);
+    }
+
+    // Takes the group's commands off its list and calls onCommand for each of them, which must take it out of the
+    // queue; then calls onVoice for each of the group's voices, which stay on the list until they are retired.
+    template<typename FC, typename FV>
+    void Cancel(UINT32 group, FC onCommand, FV onVoice)
+    {
+        GroupMap::iterator it = m_groups.find(group);
+        if (it == m_groups.end()) return;
+
+        BeepCommand* command = it->second.firstCommand;
+        BeepInProgress* voice = it->second.firstVoice;
+        it->second.firstCommand = nullptr;
+        EraseIfEmpty(it);
+
+        while (command != nullptr)
+        {
+            BeepCommand* next = command->nextInGroup;
+            command->previousInGroup = nullptr;
+            command->nextInGroup = nullptr;
+            onCommand(command);
+            command = next;
+        }
+
+        for (; voice != nullptr; voice = voice->nextInGroup)
+        {
+            onVoice(*voice);
+        }
+    }
+
+private:
+    struct GroupState
+    {
+        GroupState()
+            : firstCommand(nullptr)
+            , firstVoice(nullptr)
+        {
+        }
+
+        BeepCommand* firstCommand;
+        BeepInProgress* firstVoice;
+    };
+
+    typedef std::map<UINT32, GroupState, std::less<UINT32>, ArenaAllocator<std::pair<const UINT32, GroupState>>> GroupMap;
+
+    GroupMap m_groups;
+
+    template<typename T>
+    static void Link(T*& first, T* item)
+    {
+        item->previousInGroup = nullptr;
+        item->nextInGroup = first;
+        if (first != nullptr) first->previousInGroup = item;
+        first = item;
+    }
+
+    template<typename T>
+    static void Unlink(T*& first, T* item)
+    {
+        if (item->previousInGroup != nullptr)
+        {
+            item->previousInGroup->nextInGroup = item->nextInGroup;
+        }
+        else
+        {
+            first = item->nextInGroup;
+        }
+        if (item->nextInGroup != nullptr)
+        {
+            item->nextInGroup->previousInGroup = item->previousInGroup;
+        }
+        item->previousInGroup = nullptr;
+        item->nextInGroup = nullptr;
+    }
+
+    void EraseIfEmpty(GroupMap::iterator it)
+    {
+        if (it->second.firstCommand == nullptr && it->second.firstVoice == nullptr)
+        {
+            m_groups.erase(it);
+        }
+    }
+};
+
+// Adds src into dest, four samples at a time.
+
+static void MixInto(float* dest, const float* src, UINT32 count)
+{
+    UINT32 i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        _mm_storeu_ps(dest + i, _mm_add_ps(_mm_loadu_ps(dest + i), _mm_loadu_ps(src + i)));
+    }
+    for (; i < count; ++i)
+    {
+        dest[i] += src[i];
+    }
+}
+
+// Adds amplitude * sin(frequency * n) for n = phase, phase + 1, ... into dest. Both live and offline rendering go
+// through here, so they produce the same samples.
+
+static void AddSineWave(float* dest, UINT32 count, float frequencyRadiansPerSample, float amplitude, UINT32 phase)
+{
+    for (UINT32 i = 0; i < count; ++i)
+    {
+        dest[i] += amplitude * sinf(frequencyRadiansPerSample * (phase + i));
+    }
+}
+
+// Gain for sample i of a fade-out that reaches silence just after sample count - 1.
+
+static float FadeOutGain(UINT32 i, UINT32 count)
+{
+    return (float)(count - i) / (float)(count + 1u);
+}
+
+static void AddSineWaveFadingOut(float* dest, UINT32 count, float frequencyRadiansPerSample, float amplitude, UINT32 phase)
+{
+    for (UINT32 i = 0; i < count; ++i)
+    {
+        dest[i] += FadeOutGain(i, count) * amplitude * sinf(frequencyRadiansPerSample * (phase + i));
+    }
+}
+
+static void MixIntoFadingOut(float* dest, const float* src, UINT32 count)
+{
+    for (UINT32 i = 0; i < count; ++i)
+    {
+        dest[i] += FadeOutGain(i, count) * src[i];
+    }
+}
+
+// Frame position of a sample voice, interpolated linearly; past the last frame the sample is silent.
+
+static float SampleFrameAt(const float* frames, UINT32 frameCount, double position)
+{
+    UINT32 index = static_cast<UINT32>(position);
+    if (index >= frameCount) return 0.0f;
+    float a = frames[index];
+    float b = (index + 1u < frameCount) ? frames[index + 1u] : 0.0f;
+    float fraction = static_cast<float>(position - index);
+    return a + fraction * (b - a);
+}
+
+// Adds gain * frames[position + i * step] for i = 0 .. count - 1 into dest. At the original pitch, from a whole frame,
+// this is a multiply-add four samples at a time. Otherwise the interpolation is done four samples at a time, with
+// only the loads done one by one, up to the point where the next frame would be past the end.
+
+static void AddSampleFrames(float* dest, UINT32 count, const float* frames, UINT32 frameCount, double position, double step, float gain)
+{
+    __m128 gain4 = _mm_set1_ps(gain);
+    UINT32 i = 0;
+    if (step == 1.0 && position == floor(position))
+    {
+        const float* src = frames + static_cast<UINT32>(position);
+        UINT32 available = (position < frameCount) ? min(count, frameCount - static_cast<UINT32>(position)) : 0u;
+        for (; i + 4 <= available; i += 4)
+        {
+            _mm_storeu_ps(dest + i, _mm_add_ps(_mm_loadu_ps(dest + i), _mm_mul_ps(gain4, _mm_loadu_ps(src + i))));
+        }
+        for (; i < available; ++i)
+        {
+            dest[i] += gain * src[i];
+        }
+        return;
+    }
+
+    double limit = (static_cast<double>(frameCount) - 1.0 - position) / step;
+    UINT32 interior = (limit > 0.0) ? static_cast<UINT32>(min(static_cast<double>(count), ceil(limit))) : 0u;
+    for (; i + 4 <= interior; i += 4)
+    {
+        alignas(16) float a[4];
+        alignas(16) float b[4];
+        alignas(16) float fraction[4];
+        for (UINT32 k = 0; k < 4; ++k)
+        {
+            double p = position + (i + k) * step;
+            // rounding can only ever reach the last frame, never pass it
+            UINT32 index = min(static_cast<UINT32>(p), frameCount - 2u);
+            a[k] = frames[index];
+            b[k] = frames[index + 1u];
+            fraction[k] = static_cast<float>(p - index);
+        }
+        __m128 a4 = _mm_load_ps(a);
+        __m128 value = _mm_add_ps(a4, _mm_mul_ps(_mm_load_ps(fraction), _mm_sub_ps(_mm_load_ps(b), a4)));
+        _mm_storeu_ps(dest + i, _mm_add_ps(_mm_loadu_ps(dest + i), _mm_mul_ps(gain4, value)));
+    }
+    for (; i < count; ++i)
+    {
+        dest[i] += gain * SampleFrameAt(frames, frameCount, position + i * step);
+    }
+}
+
+static void AddSampleFramesFadingOut(float* dest, UINT32 count, const float* frames, UINT32 frameCount, double position, double step, float gain)
+{
+    for (UINT32 i = 0; i < count; ++i)
+    {
+        dest[i] += FadeOutGain(i, count) * gain * SampleFrameAt(frames, frameCount, position + i * step);
+    }
+}
+
+// The samples of one complete note, already multiplied by its amplitude. A note is recorded by the first voice that
+// plays it and can be replayed only after that voice has finished.
+
+class CachedNote
+{
+public:
+    CachedNote(UINT32 size)
+        : m_samples(new float[size])
+        , m_size(size)
+        , m_isComplete(false)
+        , m_isAbandoned(false)
+    {
+    }
+
+    float* Samples() const { return m_samples.get(); }
+    UINT32 Size() const { return m_size; }
+    bool IsComplete() const { return m_isComplete.load(std::memory_order_acquire); }
+    void MarkComplete() { m_isComplete.store(true, std::memory_order_release); }
+
+    // The recording voice was cut off before the end. The next voice to reserve the note records it again.
+    void MarkAbandoned() { m_isAbandoned.store(true, std::memory_order_release); }
+    bool ClaimAbandoned() { return m_isAbandoned.exchange(false, std::memory_order_acq_rel); }
+
+private:
+    std::unique_ptr<float[]> m_samples;
+    const UINT32 m_size;
+    std::atomic<bool> m_isComplete;
+    std::atomic<bool> m_isAbandoned;
+};
+
+class BeepInProgress_SineWave : public BeepInProgress
+{
+public:
+    BeepInProgress_SineWave(INT32 priority, float frequencyRadiansPerSample, float amplitude, UINT32 delayStart, UINT32 totalDuration, UINT32 alreadyPlayed = 0, std::shared_ptr<CachedNote> const & recording = nullptr)
+        : BeepInProgress(priority, amplitude)
+        , m_frequencyRadiansPerSample(frequencyRadiansPerSample)
+        , m_amplitude(amplitude)
+        , m_delayStart(delayStart)
+        , m_totalDuration(totalDuration)
+        , m_alreadyPlayed(alreadyPlayed)
+        , m_recording(recording)
+    {
+    }
+
+    virtual bool AddToBuffer(float* buf, UINT32 bufSize) override
+	{
+        if (m_delayStart > bufSize)
+        {
+            // this should never happen, it should still be in the queued beeps
+            BEEP_LOG(LOG_LEVEL_ERROR, L"Delayed more than one buffer ({} samples)", m_delayStart);
+            m_delayStart -= bufSize;
+            return true;
+        }
+
+        if (IsFadingOut())
+        {
+            // a voice that has not started yet just goes away; the recording, if any, is left for another voice
+            if (m_recording != nullptr) m_recording->MarkAbandoned();
+            if (m_delayStart == 0)
+            {
+                AddSineWaveFadingOut(buf, min(min(FADE_OUT_SAMPLES, m_totalDuration), bufSize), m_frequencyRadiansPerSample, m_amplitude, m_alreadyPlayed);
+            }
+            return false;
+        }
+
+        float* start = buf + m_delayStart;
+		UINT32 sizeThisTime = min(m_totalDuration, bufSize - m_delayStart);
+        if (m_recording != nullptr)
+        {
+            float* recorded = m_recording->Samples() + m_alreadyPlayed;
+            std::fill(recorded, recorded + sizeThisTime, 0.0f);
+            AddSineWave(recorded, sizeThisTime, m_frequencyRadiansPerSample, m_amplitude, m_alreadyPlayed);
+            MixInto(start, recorded, sizeThisTime);
+        }
+        else
+        {
+            AddSineWave(start, sizeThisTime, m_frequencyRadiansPerSample, m_amplitude, m_alreadyPlayed);
+        }
+
+        m_delayStart = 0;
+        m_totalDuration -= sizeThisTime;
+        m_alreadyPlayed += sizeThisTime;
+        if (m_totalDuration > 0) return true;
+
+        if (m_recording != nullptr) m_recording->MarkComplete();
+        return false;
+	}
+
+    virtual std::shared_ptr<CachedNote> TakeNote() override { return std::move(m_recording); }
+
+private:
+    const float m_frequencyRadiansPerSample;
+    const float m_amplitude;
+    UINT32 m_delayStart;
+    UINT32 m_totalDuration;
+    UINT32 m_alreadyPlayed;
+    std::shared_ptr<CachedNote> m_recording;
+};
+
+class BeepInProgress_CachedNote : public BeepInProgress
+{
+public:
+    BeepInProgress_CachedNote(INT32 priority, float amplitude, std::shared_ptr<CachedNote> const & note, UINT32 delayStart, UINT32 alreadyPlayed = 0)
+        : BeepInProgress(priority, amplitude)
+        , m_note(note)
+        , m_delayStart(delayStart)
+        , m_alreadyPlayed(alreadyPlayed)
+    {
+    }
+
+    virtual bool AddToBuffer(float* buf, UINT32 bufSize) override
+    {
+        if (m_delayStart > bufSize)
+        {
+            BEEP_LOG(LOG_LEVEL_ERROR, L"Delayed more than one buffer ({} samples)", m_delayStart);
+            m_delayStart -= bufSize;
+            return true;
+        }
+
+        UINT32 remaining = m_note->Size() - m_alreadyPlayed;
+        if (IsFadingOut())
+        {
+            if (m_delayStart == 0)
+            {
+                MixIntoFadingOut(buf, m_note->Samples() + m_alreadyPlayed, min(min(FADE_OUT_SAMPLES, remaining), bufSize));
+            }
+            return false;
+        }
+
+        UINT32 sizeThisTime = min(remaining, bufSize - m_delayStart);
+        MixInto(buf + m_delayStart, m_note->Samples() + m_alreadyPlayed, sizeThisTime);
+
+        m_delayStart = 0;
+        m_alreadyPlayed += sizeThisTime;
+        return remaining > sizeThisTime;
+    }
+
+    virtual std::shared_ptr<CachedNote> TakeNote() override { return std::move(m_note); }
+
+private:
+    std::shared_ptr<CachedNote> m_note;
+    UINT32 m_delayStart;
+    UINT32 m_alreadyPlayed;
+};
+
+// A voice playing a sample straight out of a mapped bank. Nothing is copied, so each voice costs the memory bandwidth
+// of reading its frames and little else.
+
+class BeepInProgress_Sample : public BeepInProgress
+{
+public:
+    BeepInProgress_Sample(INT32 priority, float gain, std::shared_ptr<SampleBank> && bank, UINT32 sampleIndex, double step, UINT32 delayStart, double position)
+        : BeepInProgress(priority, gain)
+        , m_bank(std::move(bank))
+        , m_frames(m_bank->Frames(sampleIndex))
+        , m_frameCount(m_bank->FrameCount(sampleIndex))
+        , m_step(step)
+        , m_gain(gain)
+        , m_delayStart(delayStart)
+        , m_position(position)
+    {
+    }
+
+    virtual bool AddToBuffer(float* buf, UINT32 bufSize) override
+    {
+        if (m_delayStart > bufSize)
+        {
+            BEEP_LOG(LOG_LEVEL_ERROR, L"Delayed more than one buffer ({} samples)", m_delayStart);
+            m_delayStart -= bufSize;
+            return true;
+        }
+
+        UINT32 remaining = Remaining();
+        if (IsFadingOut())
+        {
+            if (m_delayStart == 0)
+            {
+                AddSampleFramesFadingOut(buf, min(min(FADE_OUT_SAMPLES, remaining), bufSize), m_frames, m_frameCount, m_position, m_step, m_gain);
+            }
+            return false;
+        }
+
+        UINT32 sizeThisTime = min(remaining, bufSize - m_delayStart);
+        AddSampleFrames(buf + m_delayStart, sizeThisTime, m_frames, m_frameCount, m_position, m_step, m_gain);
+
+        m_delayStart = 0;
+        m_position += sizeThisTime * m_step;
+        return remaining > sizeThisTime;
+    }
+
+    virtual std::shared_ptr<SampleBank> TakeBank() override { return std::move(m_bank); }
+
+private:
+    std::shared_ptr<SampleBank> m_bank;
+    const float* const m_frames;
+    const UINT32 m_frameCount;
+    const double m_step;
+    const float m_gain;
+    UINT32 m_delayStart;
+    double m_position;
+
+    // output samples left to play; BeepEngineScoreAddSample's minimum pitch keeps this in range for real banks, and
+    // it saturates for the rest
+    UINT32 Remaining() const
+    {
+        if (m_position >= m_frameCount) return 0u;
+        double remaining = ceil((m_frameCount - m_position) / m_step);
+        return (remaining < 4294967295.0) ? static_cast<UINT32>(remaining) : UINT32_MAX;
+    }
+};
+
+class NoteCacheKey
+{
+public:
+    NoteCacheKey(float frequencyRadiansPerSample, float amplitude, UINT32 durationSamples, UINT32 sampleRate)
+        : frequencyRadiansPerSample(frequencyRadiansPerSample)
+        , amplitude(amplitude)
+        , durationSamples(durationSamples)
+        , sampleRate(sampleRate)
+    {
+    }
+
+    bool operator==(NoteCacheKey const & other) const
+    {
+        return frequencyRadiansPerSample == other.frequencyRadiansPerSample
+            && amplitude == other.amplitude
+            && durationSamples == other.durationSamples
+            && sampleRate == other.sampleRate;
+    }
+
+    // Parameters are compared exactly as they arrive from CreateCommand, which already rounds the duration to whole
+    // samples and the frequency to a float; two notes written with the same values always produce the same key.
+    float frequencyRadiansPerSample;
+    float amplitude;
+    UINT32 durationSamples;
+    UINT32 sampleRate;
+};
+
+class NoteCacheKeyHash
+{
+public:
+    size_t operator()(NoteCacheKey const & key) const
+    {
+        size_t h = std::hash<float>()(key.frequencyRadiansPerSample);
+        h = h * 31u + std::hash<float>()(key.amplitude);
+        h = h * 31u + std::hash<UINT32>()(key.durationSamples);
+        h = h * 31u + std::hash<UINT32>()(key.sampleRate);
+        return h;
+    }
+};
+
+// Hands a recording allocated by the housekeeper back to the note cache.
+
+class AudioThreadCommand_ProvideNoteRecording : public AudioThreadCommand
+{
+public:
+    AudioThreadCommand_ProvideNoteRecording(NoteCacheKey const & key, std::shared_ptr<CachedNote> const & note)
+        : m_key(key)
+        , m_note(note)
+    {
+    }
+
+    NoteCacheKey const & Key() const { return m_key; }
+    std::shared_ptr<CachedNote> const & Note() const { return m_note; }
+private:
+    const NoteCacheKey m_key;
+    const std::shared_ptr<CachedNote> m_note;
+};
+
+// Uniformly partitioned overlap-save convolution. The impulse response is cut into partitions one buffer long, and
+// each partition's spectrum (at twice the buffer size) is computed once, up front. For every buffer, the spectrum of
+// the last two buffers of input goes into a frequency-domain delay line; the output spectrum is the sum of each delay
+// line entry times its partition, and the second half of its inverse transform is the filtered buffer. Output is
+// produced for the same buffer whose input it was given, so no latency is added.
+//
+// Everything is allocated when the object is built, on the thread that loads the impulse response. The work per
+// buffer grows with the number of partitions, so responses longer than MAX_PARTITIONS buffers are refused.
+
+class PartitionedConvolver
+{
+public:
+    static const UINT32 MAX_PARTITIONS = 256u;
+
+    PartitionedConvolver(UINT32 blockSize)
+        : BLOCK_SIZE(blockSize)
+        , FFT_SIZE(blockSize * 2)
+        , BIN_COUNT(blockSize + 1)
+        , m_partitionCount(0u)
+        , m_partitions()
+        , m_delayLine()
+        , m_delayHead(0u)
+        , m_history()
+        , m_spectrum()
+        , m_output()
+    {
+        assert(FFTUtils::IsPowerOfTwo(static_cast<int>(blockSize)) && blockSize >= 2);
+    }
+
+    bool Initialize(const float* impulseResponse, UINT32 length)
+    {
+        if (impulseResponse == nullptr || length == 0) return false;
+        if ((length - 1u) / BLOCK_SIZE >= MAX_PARTITIONS) return false;
+
+        try
+        {
+            m_partitionCount = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            m_partitions.resize(static_cast<size_t>(m_partitionCount) * BIN_COUNT);
+            m_delayLine.assign(static_cast<size_t>(m_partitionCount) * BIN_COUNT, Complex(0.0f, 0.0f));
+            m_history.assign(FFT_SIZE, 0.0f);
+            m_spectrum.resize(BIN_COUNT);
+            m_output.resize(FFT_SIZE);
+
+            std::vector<float> padded(FFT_SIZE);
+            for (UINT32 p = 0; p < m_partitionCount; ++p)
+            {
+                std::fill(padded.begin(), padded.end(), 0.0f);
+                UINT32 offset = p * BLOCK_SIZE;
+                UINT32 count = min(BLOCK_SIZE, length - offset);
+                std::copy(impulseResponse + offset, impulseResponse + offset + count, padded.begin());
+                FFTUtils::DoRealFFT(padded.data(), static_cast<int>(FFT_SIZE), m_partitions.data() + static_cast<size_t>(p) * BIN_COUNT);
+            }
+        }
+        catch (std::bad_alloc const &)
+        {
+            return false;
+        }
+
+        return true;
+    }
+
+    // audio thread only; filters one block in place
+    void Process(float* buffer)
+    {
+        std::copy(m_history.begin() + BLOCK_SIZE, m_history.end(), m_history.begin());
+        std::copy(buffer, buffer + BLOCK_SIZE, m_history.begin() + BLOCK_SIZE);
+
+        m_delayHead = (m_delayHead + m_partitionCount - 1) % m_partitionCount;
+        Complex* newest = m_delayLine.data() + static_cast<size_t>(m_delayHead) * BIN_COUNT;
+        FFTUtils::DoRealFFT(m_history.data(), static_cast<int>(FFT_SIZE), newest);
+
+        std::fill(m_spectrum.begin(), m_spectrum.end(), Complex(0.0f, 0.0f));
+        for (UINT32 p = 0; p < m_partitionCount; ++p)
+        {
+            // delay line entry p holds the input spectrum from p buffers ago
+            const Complex* input = m_delayLine.data() + static_cast<size_t>((m_delayHead + p) % m_partitionCount) * BIN_COUNT;
+            const Complex* partition = m_partitions.data() + static_cast<size_t>(p) * BIN_COUNT;
+            for (UINT32 k = 0; k < BIN_COUNT; ++k)
+            {
+                m_spectrum[k] += input[k] * partition[k];
+            }
+        }
+
+        FFTUtils::DoInverseRealFFT(m_spectrum.data(), static_cast<int>(FFT_SIZE), m_output.data());
+
+        // the first half is circular wrap-around; the second half is the linear convolution for this block
+        std::copy(m_output.begin() + BLOCK_SIZE, m_output.end(), buffer);
+    }
+
+private:
+    const UINT32 BLOCK_SIZE;
+    const UINT32 FFT_SIZE;
+    const UINT32 BIN_COUNT;
+    UINT32 m_partitionCount;
+    std::vector<Complex> m_partitions;
+    std::vector<Complex> m_delayLine;
+    UINT32 m_delayHead;
+    std::vector<float> m_history;
+    std::vector<Complex> m_spectrum;
+    std::vector<float> m_output;
+};
+
+class HousekeepingItem
+{
+public:
+    HousekeepingItem()
+        : command(nullptr)
+        , stream(nullptr)
+        , loop(nullptr)
+        , note(nullptr)
+        , bank(nullptr)
+        , convolver(nullptr)
+        , recordingKey()
+    {
+    }
+
+    std::unique_ptr<AudioThreadCommand> command;
+    std::unique_ptr<ScoreStream> stream;
+    std::unique_ptr<BeepLoopPattern> loop;
+    std::shared_ptr<CachedNote> note;
+    std::shared_ptr<SampleBank> bank;
+    std::unique_ptr<PartitionedConvolver> convolver;
+    std::optional<NoteCacheKey> recordingKey; // a recording of this note should be allocated
+};
+
+// Does the heap work of the audio thread on a thread of its own: commands, streams, recordings and sample banks the
+// audio thread is done with are released here, and recordings the note cache asks for are allocated here and sent back through the
+// command queue. Items that do not fit in the ring wait in a fixed backlog on the audio thread. The audio thread never
+// releases an item itself (releasing a stream can wait for a generator thread), so if the backlog is full too, it waits
+// for the housekeeper to take one; a recording request is dropped instead.
+
+class Housekeeper
+{
+public:
+    Housekeeper(AudioThreadCommandQueue* commandQueue, HANDLE hQueueEvent, AudioArena* arena)
+        : m_ring(4096u)
+        , m_backlog(BACKLOG_CAPACITY)
+        , m_pending(ArenaAllocator<HousekeepingItem>(arena))
+        , m_commandQueue(commandQueue)
+        , m_hQueueEvent(hQueueEvent)
+        , m_hStopEvent(nullptr)
+        , m_hReadyEvent(nullptr)
+        , m_hThread(nullptr)
+        , m_hasPushed(false)
+        , m_lastError(0u)
+    {
+    }
+
+    DWORD GetLastError() const { return m_lastError; }
+
+    bool Initialize()
+    {
+        m_hStopEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+        if (m_hStopEvent == nullptr) { m_lastError = ::GetLastError(); return false; }
+
+        m_hReadyEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+        if (m_hReadyEvent == nullptr) { m_lastError = ::GetLastError(); return false; }
+
+        m_hThread = CreateThread(nullptr, 0, ThreadProc, this, 0, nullptr);
+        if (m_hThread == nullptr) { m_lastError = ::GetLastError(); return false; }
+
+        return true;
+    }
+
+    // audio thread only
+    void Retire(std::unique_ptr<AudioThreadCommand> && command)
+    {
+        HousekeepingItem item;
+        item.command = std::move(command);
+        Push(item);
+    }
+
+    // audio thread only
+    void Retire(std::unique_ptr<ScoreStream> && stream)
+    {
+        HousekeepingItem item;
+        item.stream = std::move(stream);
+        Push(item);
+    }
+
+    // audio thread only
+    void Retire(std::unique_ptr<BeepLoopPattern> && loop)
+    {
+        HousekeepingItem item;
+        item.loop = std::move(loop);
+        Push(item);
+    }
+
+    // audio thread only
+    void Retire(std::shared_ptr<CachedNote> && note)
+    {
+        if (note == nullptr) return;
+        HousekeepingItem item;
+        item.note = std::move(note);
+        Push(item);
+    }
+
+    // audio thread only
+    void Retire(std::shared_ptr<SampleBank> && bank)
+    {
+        if (bank == nullptr) return;
+        HousekeepingItem item;
+        item.bank = std::move(bank);
+        Push(item);
+    }
+
+    // audio thread only
+    void Retire(std::unique_ptr<PartitionedConvolver> && convolver)
+    {
+        if (convolver == nullptr) return;
+        HousekeepingItem item;
+        item.convolver = std::move(convolver);
+        Push(item);
+    }
+
+    // Audio thread only. Returns false if the request could not be queued, in which case the note is never cached.
+    bool RequestRecording(NoteCacheKey const & key)
+    {
+        HousekeepingItem item;
+        item.recordingKey = key;
+        return TryPush(item);
+    }
+
+    // audio thread only
+    void Flush()
+    {
+        while (!m_backlog.IsEmpty() && m_ring.TryPush(m_backlog.Front()))
+        {
+            m_backlog.PopFront();
+            m_hasPushed = true;
+        }
+        while (!m_pending.empty() && m_backlog.TryPush(m_pending.front()))
+        {
+            m_pending.pop_front();
+        }
+
+        if (m_hasPushed)
+        {
+            m_hasPushed = false;
+            ::SetEvent(m_hReadyEvent);
+        }
+    }
+
+    ~Housekeeper()
+    {
+        if (m_hThread != nullptr)
+        {
+            ::SetEvent(m_hStopEvent);
+            WaitForSingleObject(m_hThread, INFINITE);
+            CloseHandle(m_hThread);
+            m_hThread = nullptr;
+        }
+
+        if (m_hReadyEvent != nullptr)
+        {
+            CloseHandle(m_hReadyEvent);
+            m_hReadyEvent = nullptr;
+        }
+
+        if (m_hStopEvent != nullptr)
+        {
+            CloseHandle(m_hStopEvent);
+            m_hStopEvent = nullptr;
+        }
+    }
+
+private:
+    static const UINT32 BACKLOG_CAPACITY = 8192u;
+
+    SpscRing<HousekeepingItem> m_ring;
+    FixedQueue<HousekeepingItem> m_backlog; // audio thread
+    std::list<HousekeepingItem, ArenaAllocator<HousekeepingItem>> m_pending; // audio thread, only when m_backlog is full
+    AudioThreadCommandQueue* const m_commandQueue;
+    const HANDLE m_hQueueEvent;
+    HANDLE m_hStopEvent;
+    HANDLE m_hReadyEvent;
+    HANDLE m_hThread;
+    bool m_hasPushed;
+    DWORD m_lastError;
+
+    bool TryPush(HousekeepingItem& item)
+    {
+        if (m_backlog.IsEmpty() && m_ring.TryPush(item))
+        {
+            m_hasPushed = true;
+            return true;
+        }
+        return m_pending.empty() && m_backlog.TryPush(item);
+    }
+
+    // Items are never dropped, since dropping one would free it here, and the audio thread never waits for the
+    // housekeeper. Items that find the backlog full go on a pending list in the arena, and later calls to Flush move
+    // them along.
+    void Push(HousekeepingItem& item)
+    {
+        if (TryPush(item)) return;
+
+        if (m_pending.empty())
+        {
+            BEEP_LOG(LOG_LEVEL_ERROR, L"Housekeeping is backed up; holding items until the housekeeper catches up");
+        }
+        m_pending.push_back(std::move(item));
+    }
+
+    static DWORD WINAPI ThreadProc(LPVOID arg)
+    {
+        reinterpret_cast<Housekeeper*>(arg)->RunLoop();
+        return 0;
+    }
+
+    void RunLoop()
+    {
+        HANDLE events[2] = { m_hStopEvent, m_hReadyEvent };
+        while (true)
+        {
+            DWORD waitResult = WaitForMultipleObjects(2, events, FALSE, INFINITE);
+            Drain();
+            if (waitResult != WAIT_OBJECT_0 + 1) return;
+        }
+    }
+
+    void Drain()
+    {
+        HousekeepingItem item;
+        while (m_ring.TryPop(item))
+        {
+            if (item.recordingKey.has_value())
+            {
+                std::shared_ptr<CachedNote> note(new CachedNote(item.recordingKey->durationSamples));
+                if (note != nullptr)
+                {
+                    m_commandQueue->Push(std::unique_ptr<AudioThreadCommand>(new AudioThreadCommand_ProvideNoteRecording(item.recordingKey.value(), note)));
+                    ::SetEvent(m_hQueueEvent);
+                }
+            }
+
+            // whatever the item holds is released here
+            item = HousekeepingItem();
+        }
+    }
+};
+
+// Least-recently-used cache of rendered notes, limited by the number of bytes of samples it holds and by its number of
+// entries. Lookups and insertions happen on the audio thread; the counters can be read from anywhere.
+//
+// The audio thread never allocates a recording itself. The first time a note misses, the cache makes a pending entry
+// and asks the housekeeper for a recording; a later copy of the note records into it once it has arrived, and copies
+// after that replay it.
+
+class NoteCache
+{
+public:
+    NoteCache(UINT64 budgetBytes, AudioArena* arena, Housekeeper* housekeeper)
+        : m_budgetBytes(budgetBytes)
+        , m_usedBytes(0u)
+        , m_entries(ArenaAllocator<Entry>(arena))
+        , m_index(MAX_ENTRIES, NoteCacheKeyHash(), std::equal_to<NoteCacheKey>(), ArenaAllocator<std::pair<const NoteCacheKey, EntryList::iterator>>(arena))
+        , m_housekeeper(housekeeper)
+        , m_hits(0u)
+        , m_misses(0u)
+    {
+        // with this many buckets the index is never rehashed, since it never holds more than MAX_ENTRIES
+        m_index.reserve(MAX_ENTRIES);
+    }
+
+    static const size_t MAX_ENTRIES = 4096u;
+
+    void SetBudget(UINT64 budgetBytes)
+    {
+        m_budgetBytes = budgetBytes;
+        EvictUntil(m_budgetBytes, MAX_ENTRIES);
+    }
+
+    // Returns a complete recording of the note, or nullptr.
+    std::shared_ptr<CachedNote> Find(NoteCacheKey const & key)
+    {
+        if (m_budgetBytes == 0) return nullptr;
+
+        auto it = m_index.find(key);
+        if (it != m_index.end() && it->second->note != nullptr && it->second->note->IsComplete())
+        {
+            m_entries.splice(m_entries.begin(), m_entries, it->second);
+            m_hits.fetch_add(1u, std::memory_order_relaxed);
+            return it->second->note;
+        }
+
+        m_misses.fetch_add(1u, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    // Returns an empty recording for a voice to fill in, or nullptr if there is none ready for this note yet, the note
+    // is already being recorded, or it is too big to be worth caching.
+    std::shared_ptr<CachedNote> Reserve(NoteCacheKey const & key)
+    {
+        UINT64 bytes = static_cast<UINT64>(key.durationSamples) * sizeof(float);
+        if (bytes == 0 || bytes > m_budgetBytes / 4) return nullptr;
+
+        auto it = m_index.find(key);
+        if (it != m_index.end())
+        {
+            Entry& entry = *(it->second);
+            if (entry.note == nullptr) return nullptr;
+            // a recording whose voice was cut off can be started over
+            if (entry.isRecording && !entry.note->ClaimAbandoned()) return nullptr;
+            entry.isRecording = true;
+            return entry.note;
+        }
+
+        EvictUntil(m_budgetBytes - bytes, MAX_ENTRIES - 1);
+
+        if (!m_housekeeper->RequestRecording(key)) return nullptr;
+
+        m_entries.push_front(Entry(key));
+        m_index.insert(std::make_pair(key, m_entries.begin()));
+        m_usedBytes.fetch_add(bytes, std::memory_order_relaxed);
+        return nullptr;
+    }
+
+    // Fills in a pending entry with the recording the housekeeper allocated for it. If the entry has been evicted in
+    // the meantime, the recording is not used.
+    void Provide(NoteCacheKey const & key, std::shared_ptr<CachedNote> const & note)
+    {
+        auto it = m_index.find(key);
+        if (it != m_index.end() && it->second->note == nullptr)
+        {
+            it->second->note = note;
+        }
+    }
+
+    UINT64 Hits() const { return m_hits.load(std::memory_order_relaxed); }
+    UINT64 Misses() const { return m_misses.load(std::memory_order_relaxed); }
+    UINT64 UsedBytes() const { return m_usedBytes.load(std::memory_order_relaxed); }
+
+private:
+    class Entry
+    {
+    public:
+        Entry(NoteCacheKey const & key)
+            : key(key)
+            , note(nullptr)
+            , isRecording(false)
+        {
+        }
+
+        NoteCacheKey key;
+        std::shared_ptr<CachedNote> note; // nullptr until the housekeeper provides it
+        bool isRecording;
+    };
+
+    typedef std::list<Entry, ArenaAllocator<Entry>> EntryList;
+
+    UINT64 m_budgetBytes;
+    std::atomic<UINT64> m_usedBytes;
+    EntryList m_entries;
+    std::unordered_map<NoteCacheKey, EntryList::iterator, NoteCacheKeyHash, std::equal_to<NoteCacheKey>, ArenaAllocator<std::pair<const NoteCacheKey, EntryList::iterator>>> m_index;
+    Housekeeper* const m_housekeeper;
+    std::atomic<UINT64> m_hits;
+    std::atomic<UINT64> m_misses;
+
+    void EvictUntil(UINT64 targetBytes, size_t targetEntries)
+    {
+        while (!m_entries.empty() && (m_usedBytes.load(std::memory_order_relaxed) > targetBytes || m_entries.size() > targetEntries))
+        {
+            // a voice that is still recording or playing the note keeps its own reference
+            EntryList::iterator last = std::prev(m_entries.end());
+            m_usedBytes.fetch_sub(static_cast<UINT64>(last->key.durationSamples) * sizeof(float), std::memory_order_relaxed);
+            m_index.erase(last->key);
+            m_housekeeper->Retire(std::move(last->note));
+            m_entries.erase(last);
+        }
+    }
+};
+
+typedef std::vector<ArenaPtr<BeepInProgress>> BeepInProgressVector;
+
+// Keeps the number of voices under the polyphony cap, and under what the audio thread has lately been able to render
+// in time. When there is no room, the lowest-ranked voice is replaced: lowest priority first, then oldest or quietest
+// depending on the policy. A new note that would rank lowest of all is not played. The voices are ranked in a heap,
+// built the first time a buffer needs a victim and kept up to date until the voices are mixed and packed down, so
+// starting many notes in one buffer does not compare each of them with every voice.
+//
+// Voices told to fade out stop at the end of the next buffer, so they are counted separately until then. All of this
+// runs on the audio thread except the statistics.
+
+class VoiceLimiter
+{
+public:
+    VoiceLimiter(UINT32 sampleRate, UINT32 bufferSize)
+        : m_maxVoices(VOICE_CAPACITY)
+        , m_policy(BeepVoiceStealPolicy_Oldest)
+        , m_isSheddingEnabled(false)
+        , m_targetLoad(0.0f)
+        , m_sheddingLimit(VOICE_CAPACITY)
+        , m_fadingCount(0u)
+        , m_nextSerial(0u)
+        , m_ticksPerBuffer(0.0)
+        , m_averageLoad(0.0f)
+        , m_candidates()
+        , m_ranking()
+        , m_isRankingValid(false)
+        , m_fadingScan(0u)
+        , m_stolen(0u)
+        , m_dropped(0u)
+        , m_shed(0u)
+        , m_load(0.0f)
+        , m_sampleRate(sampleRate)
+        , m_bufferSize(bufferSize)
+    {
+    }
+
+    bool Initialize()
+    {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        m_ticksPerBuffer = (double)frequency.QuadPart * m_bufferSize / m_sampleRate;
+        m_candidates.reserve(VOICE_CAPACITY);
+        m_ranking.reserve(VOICE_CAPACITY);
+        return true;
+    }
+
+    static bool IsValidPolicy(BeepVoiceStealPolicy policy)
+    {
+        return policy == BeepVoiceStealPolicy_Oldest || policy == BeepVoiceStealPolicy_Quietest || policy == BeepVoiceStealPolicy_None;
+    }
+
+    void SetPolyphony(UINT32 maxVoices, BeepVoiceStealPolicy policy)
+    {
+        assert(IsValidPolicy(policy));
+        m_maxVoices = (maxVoices == 0u) ? VOICE_CAPACITY : min(maxVoices, VOICE_CAPACITY);
+        m_policy = policy;
+        m_sheddingLimit = m_maxVoices;
+        m_isRankingValid = false;
+    }
+
+    // below this, shedding would fade out voices on every buffer however few were left
+    static constexpr float MIN_TARGET_LOAD = 0.05f;
+
+    void SetShedding(bool enabled, float targetLoad)
+    {
+        m_isSheddingEnabled = enabled;
+        m_targetLoad = (targetLoad >= MIN_TARGET_LOAD) ? targetLoad : MIN_TARGET_LOAD; // NaN too
+        m_sheddingLimit = m_maxVoices;
+    }
+
+    // Makes room for a new voice. Returns false if the new voice should not be played. Otherwise *pReplace is the
+    // index of a voice the new one replaces, or SIZE_MAX to add it. The voice being replaced is not cut off: the
+    // caller mixes its fade-out into the current buffer before letting it go.
+    bool MakeRoom(BeepInProgressVector& voices, INT32 priority, float amplitude, size_t* pReplace)
+    {
+        *pReplace = SIZE_MAX;
+        size_t active = voices.size() - m_fadingCount;
+        size_t limit = min(m_maxVoices, m_sheddingLimit);
+        if (active < limit && voices.size() < VOICE_CAPACITY) return true;
+
+        if (active < limit)
+        {
+            // full of voices that are fading out anyway; one of them finishes now. Each one found is replaced, so no
+            // slot before m_fadingScan holds a fading voice.
+            for (; m_fadingScan < voices.size(); ++m_fadingScan)
+            {
+                if (voices[m_fadingScan]->IsFadingOut())
+                {
+                    *pReplace = m_fadingScan;
+                    --m_fadingCount;
+                    return true;
+                }
+            }
+        }
+
+        size_t victim = (m_policy == BeepVoiceStealPolicy_None) ? SIZE_MAX : LowestRanked(voices);
+
+        // the new note is the newest of all, so on equal terms it is the one that stays
+        if (victim == SIZE_MAX || Ranks(RankEntry(priority, amplitude, m_nextSerial, SIZE_MAX), m_ranking.front()))
+        {
+            m_dropped.fetch_add(1u, std::memory_order_relaxed);
+            return false;
+        }
+
+        std::pop_heap(m_ranking.begin(), m_ranking.end(), HeapOrder(this));
+        m_ranking.pop_back();
+        m_stolen.fetch_add(1u, std::memory_order_relaxed);
+        *pReplace = victim;
+        return true;
+    }
+
+    // called once the new voice is at voices[index]
+    void AddVoice(BeepInProgress& voice, size_t index)
+    {
+        voice.SetSerial(m_nextSerial++);
+        if (!m_isRankingValid) return;
+
+        if (m_ranking.size() == m_ranking.capacity())
+        {
+            // only stale entries could have filled it; it is rebuilt when next needed rather than grown
+            m_isRankingValid = false;
+            return;
+        }
+        m_ranking.push_back(EntryFor(voice, index));
+        std::push_heap(m_ranking.begin(), m_ranking.end(), HeapOrder(this));
+    }
+
+    // fades out a voice for some other reason, such as its group being cancelled
+    void FadeOutVoice(BeepInProgress& voice)
+    {
+        if (voice.IsFadingOut()) return;
+        voice.FadeOut();
+        ++m_fadingCount;
+        m_fadingScan = 0u;
+    }
+
+    // Called after the voices have been mixed, with how long the buffer took to render. Every voice that was fading
+    // out has now finished. If rendering is taking too much of the buffer's time, the lowest-ranked voices are faded
+    // out and the limit is lowered; once there is time to spare again, the limit rises a little each buffer.
+    void EndBuffer(BeepInProgressVector& voices, UINT64 renderTicks)
+    {
+        m_fadingCount = 0u;
+        m_fadingScan = 0u;
+        m_isRankingValid = false; // the voices have been packed down, so the indices have moved
+
+        float load = (float)(renderTicks / m_ticksPerBuffer);
+        m_averageLoad = 0.75f * m_averageLoad + 0.25f * load;
+        m_load.store(m_averageLoad, std::memory_order_relaxed);
+        if (!m_isSheddingEnabled) return;
+
+        if (m_averageLoad > m_targetLoad && !voices.empty())
+        {
+            size_t shedCount = max(voices.size() / 8u, (size_t)1u);
+            ShedLowest(voices, shedCount);
+            m_sheddingLimit = voices.size() - shedCount;
+            m_averageLoad = m_targetLoad; // give the smaller mix a chance to show its cost before shedding more
+        }
+        else if (m_averageLoad < m_targetLoad * 0.75f && m_sheddingLimit < m_maxVoices)
+        {
+            m_sheddingLimit = min(m_maxVoices, m_sheddingLimit + max(m_sheddingLimit / 16u, (size_t)1u));
+        }
+    }
+
+    // a note that could not be played for lack of room somewhere else, such as the beep queue
+    void CountDropped() { m_dropped.fetch_add(1u, std::memory_order_relaxed); }
+
+    UINT64 Stolen() const { return m_stolen.load(std::memory_order_relaxed); }
+    UINT64 Dropped() const { return m_dropped.load(std::memory_order_relaxed); }
+    UINT64 Shed() const { return m_shed.load(std::memory_order_relaxed); }
+    float Load() const { return m_load.load(std::memory_order_relaxed); }
+
+private:
+    size_t m_maxVoices;
+    BeepVoiceStealPolicy m_policy;
+    bool m_isSheddingEnabled;
+    float m_targetLoad;
+    size_t m_sheddingLimit;
+    size_t m_fadingCount;
+    UINT64 m_nextSerial;
+    double m_ticksPerBuffer;
+    float m_averageLoad;
+    class RankEntry
+    {
+    public:
+        RankEntry(INT32 priority, float amplitude, UINT64 serial, size_t index)
+            : priority(priority)
+            , amplitude(amplitude)
+            , serial(serial)
+            , index(index)
+        {
+        }
+
+        INT32 priority;
+        float amplitude;
+        UINT64 serial;
+        size_t index;
+    };
+
+    std::vector<size_t> m_candidates;
+    std::vector<RankEntry> m_ranking; // a heap with the lowest-ranked voice on top; entries go stale as voices fade
+    bool m_isRankingValid;
+    size_t m_fadingScan;
+    std::atomic<UINT64> m_stolen;
+    std::atomic<UINT64> m_dropped;
+    std::atomic<UINT64> m_shed;
+    std::atomic<float> m_load;
+    const UINT32 m_sampleRate;
+    const UINT32 m_bufferSize;
+
+    static RankEntry EntryFor(BeepInProgress const & voice, size_t index)
+    {
+        return RankEntry(voice.Priority(), voice.Amplitude(), voice.Serial(), index);
+    }
+
+    // true if a should be given up before b
+    bool Ranks(RankEntry const & a, RankEntry const & b) const
+    {
+        if (a.priority != b.priority) return a.priority < b.priority;
+        if (m_policy == BeepVoiceStealPolicy_Quietest && a.amplitude != b.amplitude) return a.amplitude < b.amplitude;
+        return a.serial < b.serial;
+    }
+
+    bool Ranks(BeepInProgress const & a, BeepInProgress const & b) const
+    {
+        return Ranks(EntryFor(a, 0u), EntryFor(b, 0u));
+    }
+
+    // orders the heap so that the first voice to give up is on top
+    class HeapOrder
+    {
+    public:
+        HeapOrder(VoiceLimiter const * limiter)
+            : m_limiter(limiter)
+        {
+        }
+
+        bool operator()(RankEntry const & a, RankEntry const & b) const { return m_limiter->Ranks(b, a); }
+
+    private:
+        VoiceLimiter const * const m_limiter;
+    };
+
+    void BuildRanking(BeepInProgressVector const & voices)
+    {
+        m_ranking.clear();
+        for (size_t i = 0; i < voices.size(); ++i)
+        {
+            if (!voices[i]->IsFadingOut()) m_ranking.push_back(EntryFor(*voices[i], i));
+        }
+        std::make_heap(m_ranking.begin(), m_ranking.end(), HeapOrder(this));
+        m_isRankingValid = true;
+    }
+
+    // the index of the lowest-ranked voice that is not fading out, or SIZE_MAX; stale entries are dropped on the way
+    size_t LowestRanked(BeepInProgressVector const & voices)
+    {
+        if (!m_isRankingValid) BuildRanking(voices);
+        while (!m_ranking.empty())
+        {
+            RankEntry const & top = m_ranking.front();
+            if (top.index < voices.size() && voices[top.index]->Serial() == top.serial && !voices[top.index]->IsFadingOut()) return top.index;
+            std::pop_heap(m_ranking.begin(), m_ranking.end(), HeapOrder(this));
+            m_ranking.pop_back();
+        }
+        return SIZE_MAX;
+    }
+
+    void ShedLowest(BeepInProgressVector& voices, size_t count)
+    {
+        m_candidates.clear();
+        for (size_t i = 0; i < voices.size(); ++i)
+        {
+            m_candidates.push_back(i);
+        }
+
+        count = min(count, m_candidates.size());
+        std::nth_element(m_candidates.begin(), m_candidates.begin() + (count - 1u), m_candidates.end(), [&voices, this](size_t a, size_t b)
+        {
+            return Ranks(*voices[a], *voices[b]);
+        });
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            voices[m_candidates[i]]->FadeOut();
+        }
+        m_fadingCount = count;
+        m_shed.fetch_add(count, std::memory_order_relaxed);
+    }
+};
+
+// Inverse-FFT additive synthesis (overlap-add). Each frame is the sum of Hann-windowed sinusoids; a windowed sinusoid
+// is placed in the frame's spectrum as a copy of the window's transform, shifted to the partial's frequency and
+// truncated to a few bins either side. One inverse FFT per hop then renders every partial at once, so the cost grows
+// with the number of partials plus the number of frames instead of their product. Frames overlap by half, and Hann
+// windows at half overlap add up to one, so a steady partial comes out at full amplitude.
+//
+// A partial belongs to every frame whose middle hop it overlaps, so its start and end are accurate to about one hop.
+
+class AdditiveBank
+{
+public:
+    AdditiveBank(UINT32 frameSize)
+        : FRAME_SIZE(frameSize)
+        , HOP_SIZE(frameSize / 2)
+        , m_kernel()
+        , m_partials()
+        , m_spectrum()
+        , m_accumulator()
+        , m_ready()
+        , m_frameTime(0u)
+        , m_outputTime(0u)
+    {
+        assert(FFTUtils::IsPowerOfTwo(static_cast<int>(frameSize)));
+    }
+
+    bool Initialize()
+    {
+        m_spectrum.resize(FRAME_SIZE);
+        m_accumulator.assign(FRAME_SIZE, 0.0f);
+        m_ready.reserve(FRAME_SIZE * 4);
+        m_partials.reserve(VOICE_CAPACITY);
+        BuildKernel();
+        return true;
+    }
+
+    // samples already handed out by AddToBuffer
+    UINT64 Time() const { return m_outputTime; }
+
+    // Returns false if the bank already has VOICE_CAPACITY partials playing, in which case the partial is dropped.
+    bool AddPartial(UINT64 startTime, UINT32 durationSamples, float frequencyRadiansPerSample, float amplitude)
+    {
+        if (durationSamples == 0) return true;
+        if (m_partials.size() >= VOICE_CAPACITY) return false;
+        m_partials.push_back(Partial(startTime, startTime + durationSamples, frequencyRadiansPerSample, amplitude));
+        return true;
+    }
+
+    void AddToBuffer(float* buf, UINT32 bufSize)
+    {
+        while (m_ready.size() < bufSize)
+        {
+            SynthesizeFrame();
+        }
+
+        MixInto(buf, m_ready.data(), bufSize);
+        m_ready.erase(m_ready.begin(), m_ready.begin() + bufSize);
+        m_outputTime += bufSize;
+    }
+
+private:
+    static const int KERNEL_HALF_WIDTH = 6;
+    static const int KERNEL_STEPS_PER_BIN = 256;
+
+    class Partial
+    {
+    public:
+        Partial(UINT64 start, UINT64 end, float frequencyRadiansPerSample, float amplitude)
+            : start(start)
+            , end(end)
+            , frequencyRadiansPerSample(frequencyRadiansPerSample)
+            , amplitude(amplitude)
+        {
+        }
+
+        UINT64 start;
+        UINT64 end;
+        float frequencyRadiansPerSample;
+        float amplitude;
+    };
+
+    const UINT32 FRAME_SIZE;
+    const UINT32 HOP_SIZE;
+    std::vector<Complex> m_kernel;
+    std::vector<Partial> m_partials;
+    std::vector<Complex> m_spectrum; // transformed in place into the frame
+    std::vector<float> m_accumulator;
+    std::vector<float> m_ready;
+    UINT64 m_frameTime;
+    UINT64 m_outputTime;
+
+    // Transform of the periodic Hann window, sum over n of w[n] e^(-2 pi i x n / N), tabulated for offsets x within
+    // KERNEL_HALF_WIDTH + 1 bins of the peak.
+    void BuildKernel()
+    {
+        const int halfSteps = (KERNEL_HALF_WIDTH + 1) * KERNEL_STEPS_PER_BIN;
+        m_kernel.resize(halfSteps * 2 + 2);
+        for (int i = 0; i < static_cast<int>(m_kernel.size()); ++i)
+        {
+            double x = static_cast<double>(i - halfSteps) / KERNEL_STEPS_PER_BIN;
+            std::complex<double> w = 0.5 * Dirichlet(x) - 0.25 * Dirichlet(x - 1.0) - 0.25 * Dirichlet(x + 1.0);
+            m_kernel[i] = Complex(static_cast<float>(w.real()), static_cast<float>(w.imag()));
+        }
+    }
+
+    std::complex<double> Dirichlet(double x) const
+    {
+        const double n = static_cast<double>(FRAME_SIZE);
+        const std::complex<double> i(0.0, 1.0);
+        std::complex<double> denominator = 1.0 - std::exp(-2.0 * std::numbers::pi * i * x / n);
+        if (std::abs(denominator) < 1.0e-12) return std::complex<double>(n, 0.0);
+        return (1.0 - std::exp(-2.0 * std::numbers::pi * i * x)) / denominator;
+    }
+
+    Complex KernelAt(double x) const
+    {
+        const int halfSteps = (KERNEL_HALF_WIDTH + 1) * KERNEL_STEPS_PER_BIN;
+        double position = x * KERNEL_STEPS_PER_BIN + halfSteps;
+        int index = static_cast<int>(position);
+        float fraction = static_cast<float>(position - index);
+        return m_kernel[index] + (m_kernel[index + 1] - m_kernel[index]) * fraction;
+    }
+
+    void SynthesizeFrame()
+    {
+        const UINT64 middleStart = m_frameTime + HOP_SIZE / 2;
+        const UINT64 middleEnd = middleStart + HOP_SIZE;
+
+        m_partials.erase
+        (
+            std::remove_if(m_partials.begin(), m_partials.end(), [=](Partial const& p) { return p.end <= middleStart; }),
+            m_partials.end()
+        );
+
+        bool anyActive = false;
+        for (std::vector<Partial>::const_iterator it = m_partials.cbegin(); it != m_partials.cend(); ++it)
+        {
+            if (it->start >= middleEnd) continue;
+
+            if (!anyActive)
+            {
+                std::fill(m_spectrum.begin(), m_spectrum.end(), Complex(0.0f, 0.0f));
+                anyActive = true;
+            }
+
+            double bin = static_cast<double>(it->frequencyRadiansPerSample) * FRAME_SIZE / (2.0 * std::numbers::pi);
+            double phase = std::fmod(static_cast<double>(it->frequencyRadiansPerSample) * (static_cast<double>(m_frameTime) - static_cast<double>(it->start)), 2.0 * std::numbers::pi);
+            Complex weight = std::polar(it->amplitude, static_cast<float>(phase));
+
+            int firstBin = static_cast<int>(std::floor(bin)) - KERNEL_HALF_WIDTH + 1;
+            for (int k = firstBin; k < firstBin + 2 * KERNEL_HALF_WIDTH; ++k)
+            {
+                int index = k & static_cast<int>(FRAME_SIZE - 1);
+                m_spectrum[index] += weight * KernelAt(k - bin);
+            }
+        }
+
+        if (anyActive)
+        {
+            // the real part of the analytic windowed sinusoid is the windowed cosine we want
+            FFTUtils::DoFFTInPlace(m_spectrum.data(), static_cast<int>(FRAME_SIZE), true);
+            const float scale = 1.0f / FRAME_SIZE;
+            for (UINT32 n = 0; n < FRAME_SIZE; ++n)
+            {
+                m_accumulator[n] += m_spectrum[n].real() * scale;
+            }
+        }
+
+        m_ready.insert(m_ready.end(), m_accumulator.begin(), m_accumulator.begin() + HOP_SIZE);
+        std::copy(m_accumulator.begin() + HOP_SIZE, m_accumulator.end(), m_accumulator.begin());
+        std::fill(m_accumulator.end() - HOP_SIZE, m_accumulator.end(), 0.0f);
+        m_frameTime += HOP_SIZE;
+    }
+};
+
+class AudioThreadCommand_SetConvolver : public AudioThreadCommand
+{
+public:
+    AudioThreadCommand_SetConvolver(std::unique_ptr<PartitionedConvolver> && convolver)
+        : m_convolver(std::move(convolver))
+    {
+    }
+
+    void SwapConvolver(std::unique_ptr<PartitionedConvolver> & convolver) { std::swap(convolver, m_convolver); }
+private:
+    std::unique_ptr<PartitionedConvolver> m_convolver;
+};
+
+// Measures the magnitude spectrum of every output buffer (Hann window, real FFT) while it is enabled. Spectra are
+// published through a triple buffer: the audio thread fills its back slot and swaps it with the shared middle slot,
+// and a reader swaps the middle slot with its front slot when a newer spectrum is there. The audio thread never waits
+// for a reader. Readers are serialized among themselves.
+
+class SpectrumAnalyzer
+{
+public:
+    SpectrumAnalyzer(UINT32 size)
+        : SIZE(size)
+        , BIN_COUNT(size / 2 + 1)
+        , m_isEnabled(false)
+        , m_window()
+        , m_windowed()
+        , m_bins()
+        , m_slots()
+        , m_slotSequence()
+        , m_back(0u)
+        , m_middle(1u)
+        , m_front(2u)
+        , m_sequence(0u)
+        , m_readLock()
+        , m_buffersAnalyzed(0u)
+        , m_totalTicks(0u)
+        , m_lastTicks(0u)
+        , m_ticksPerSecond(0u)
+    {
+        assert(FFTUtils::IsPowerOfTwo(static_cast<int>(size)) && size >= 4);
+    }
+
+    bool Initialize()
+    {
+        m_window.resize(SIZE);
+        float windowSum = 0.0f;
+        for (UINT32 i = 0; i < SIZE; ++i)
+        {
+            m_window[i] = 0.5f - 0.5f * cosf(2.0f * (float)(std::numbers::pi) * i / SIZE);
+            windowSum += m_window[i];
+        }
+
+        // scale so that a full-scale sine reads as its amplitude
+        for (UINT32 i = 0; i < SIZE; ++i)
+        {
+            m_window[i] *= 2.0f / windowSum;
+        }
+
+        m_windowed.resize(SIZE);
+        m_bins.resize(BIN_COUNT);
+        m_slots.assign(3, std::vector<float>(BIN_COUNT, 0.0f));
+        m_slotSequence.assign(3, 0u);
+
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        m_ticksPerSecond = static_cast<UINT64>(frequency.QuadPart);
+        return true;
+    }
+
+    void SetEnabled(bool enabled) { m_isEnabled.store(enabled, std::memory_order_relaxed); }
+
+    UINT32 BinCount() const { return BIN_COUNT; }
+
+    // audio thread only
+    void Analyze(const float* buffer)
+    {
+        if (!m_isEnabled.load(std::memory_order_relaxed)) return;
+
+        LARGE_INTEGER start;
+        QueryPerformanceCounter(&start);
+
+        for (UINT32 i = 0; i < SIZE; ++i)
+        {
+            m_windowed[i] = buffer[i] * m_window[i];
+        }
+        FFTUtils::DoRealFFT(m_windowed.data(), static_cast<int>(SIZE), m_bins.data());
+
+        std::vector<float>& slot = m_slots[m_back];
+        for (UINT32 k = 0; k < BIN_COUNT; ++k)
+        {
+            slot[k] = std::abs(m_bins[k]);
+        }
+        m_slotSequence[m_back] = ++m_sequence;
+        m_back = m_middle.exchange(m_back | FRESH, std::memory_order_acq_rel) & SLOT_MASK;
+
+        LARGE_INTEGER end;
+        QueryPerformanceCounter(&end);
+        UINT64 ticks = static_cast<UINT64>(end.QuadPart - start.QuadPart);
+        m_lastTicks.store(ticks, std::memory_order_relaxed);
+        m_totalTicks.fetch_add(ticks, std::memory_order_relaxed);
+        m_buffersAnalyzed.fetch_add(1u, std::memory_order_relaxed);
+    }
+
+    // Copies the newest spectrum; returns the number of bins copied. The sequence number goes up by one for each
+    // buffer analyzed, and is zero if nothing has been analyzed yet.
+    UINT32 Read(float* dest, UINT32 count, UINT64* pSequence)
+    {
+        std::lock_guard<std::mutex> lock(m_readLock);
+        if ((m_middle.load(std::memory_order_acquire) & FRESH) != 0)
+        {
+            m_front = m_middle.exchange(m_front, std::memory_order_acq_rel) & SLOT_MASK;
+        }
+
+        UINT32 copied = min(count, BIN_COUNT);
+        std::copy(m_slots[m_front].begin(), m_slots[m_front].begin() + copied, dest);
+        if (pSequence != nullptr) *pSequence = m_slotSequence[m_front];
+        return copied;
+    }
+
+    void GetCost(UINT64* pBuffersAnalyzed, double* pAverageMicroseconds, double* pLastMicroseconds) const
+    {
+        UINT64 buffers = m_buffersAnalyzed.load(std::memory_order_relaxed);
+        double microsecondsPerTick = (m_ticksPerSecond != 0) ? 1.0e6 / m_ticksPerSecond : 0.0;
+        if (pBuffersAnalyzed != nullptr) *pBuffersAnalyzed = buffers;
+        if (pAverageMicroseconds != nullptr)
+        {
+            *pAverageMicroseconds = (buffers != 0) ? m_totalTicks.load(std::memory_order_relaxed) * microsecondsPerTick / buffers : 0.0;
+        }
+        if (pLastMicroseconds != nullptr) *pLastMicroseconds = m_lastTicks.load(std::memory_order_relaxed) * microsecondsPerTick;
+    }
+
+private:
+    static const UINT32 SLOT_MASK = 3u;
+    static const UINT32 FRESH = 4u;
+
+    const UINT32 SIZE;
+    const UINT32 BIN_COUNT;
+    std::atomic<bool> m_isEnabled;
+    std::vector<float> m_window;
+    std::vector<float> m_windowed;
+    std::vector<Complex> m_bins;
+    std::vector<std::vector<float>> m_slots;
+    std::vector<UINT64> m_slotSequence;
+    UINT32 m_back;
+    std::atomic<UINT32> m_middle;
+    UINT32 m_front;
+    UINT64 m_sequence;
+    std::mutex m_readLock;
+    std::atomic<UINT64> m_buffersAnalyzed;
+    std::atomic<UINT64> m_totalTicks;
+    std::atomic<UINT64> m_lastTicks;
+    UINT64 m_ticksPerSecond;
+};
+
+// Splits the active voices into chunks and mixes them on a pool of pinned worker threads, with the audio thread
+// taking chunks as well. Each chunk mixes into its own sub-bus and the sub-buses are summed in chunk order, so the
+// output does not depend on which thread rendered which chunk.
+
+class VoiceRenderPool
+{
+public:
+    VoiceRenderPool(UINT32 workerCount, UINT32 bufferSize, UINT32 minVoicesPerChunk)
+        : m_workerCount(workerCount)
+        , m_bufferSize(bufferSize)
+        , m_minVoicesPerChunk(max(minVoicesPerChunk, 1u))
+        , m_workers()
+        , m_buses(nullptr)
+        , m_stillPlaying()
+        , m_voices(nullptr)
+        , m_buffer(nullptr)
+        , m_chunkSize(0u)
+        , m_epoch(0u)
+        , m_nextChunk(0u)
+        , m_chunksDone(0u)
+        , m_stopping(false)
+        , m_lastError(0u)
+    {
+    }
+
+    static const UINT32 MAX_CHUNKS = 64u;
+
+    DWORD GetLastError() const { return m_lastError; }
+
+    bool Initialize()
+    {
+        m_buses = std::unique_ptr<float[]>(new float[MAX_CHUNKS * m_bufferSize]);
+        if (m_buses == nullptr) return false;
+
+        m_stillPlaying.reserve(VOICE_CAPACITY);
+
+        SYSTEM_INFO systemInfo;
+        GetSystemInfo(&systemInfo);
+        DWORD processorCount = max(systemInfo.dwNumberOfProcessors, 1ul);
+
+        for (UINT32 i = 0; i < m_workerCount; ++i)
+        {
+            std::unique_ptr<Worker> worker(new Worker(this));
+            if (worker == nullptr) return false;
+
+            worker->hGoEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+            if (worker->hGoEvent == nullptr) { m_lastError = ::GetLastError(); return false; }
+
+            worker->hThread = CreateThread(nullptr, 0, WorkerThreadProc, worker.get(), CREATE_SUSPENDED, nullptr);
+            if (worker->hThread == nullptr) { m_lastError = ::GetLastError(); return false; }
+
+            // one worker per processor from the second on; the audio thread itself is not pinned, but while there are
+            // fewer workers than processors the first one (and any left over) is free for the scheduler to run it on
+            DWORD processor = (i + 1) % processorCount;
+            SetThreadAffinityMask(worker->hThread, static_cast<DWORD_PTR>(1) << processor);
+            SetThreadPriority(worker->hThread, THREAD_PRIORITY_HIGHEST);
+            ResumeThread(worker->hThread);
+
+            m_workers.push_back(std::move(worker));
+        }
+
+        return true;
+    }
+
+    bool ShouldRender(size_t voiceCount) const
+    {
+        return m_workerCount != 0 && voiceCount >= static_cast<size_t>(m_minVoicesPerChunk) * 2u;
+    }
+
+    // audio thread only; afterwards, StillPlaying tells which voices have not finished
+    void Render(BeepInProgressVector const & voices, float* buffer)
+    {
+        size_t voiceCount = voices.size();
+        UINT32 chunkCount = static_cast<UINT32>(min(static_cast<size_t>(MAX_CHUNKS), voiceCount / m_minVoicesPerChunk));
+        if (chunkCount == 0) chunkCount = 1;
+
+        m_stillPlaying.resize(voiceCount);
+        m_voices = &voices;
+        m_buffer = buffer;
+        m_chunkSize = static_cast<UINT32>((voiceCount + chunkCount - 1) / chunkCount);
+        chunkCount = static_cast<UINT32>((voiceCount + m_chunkSize - 1) / m_chunkSize);
+        m_chunksDone.store(0u, std::memory_order_relaxed);
+
+        ++m_epoch;
+        m_nextChunk.store(Pack(m_epoch, chunkCount, 0u), std::memory_order_release);
+
+        for (std::vector<std::unique_ptr<Worker>>::const_iterator it = m_workers.cbegin(); it != m_workers.cend(); ++it)
+        {
+            ::SetEvent((*it)->hGoEvent);
+        }
+
+        // the audio thread keeps taking chunks itself, so a worker that is slow to wake only costs parallelism
+        RunChunks();
+
+        while (m_chunksDone.load(std::memory_order_acquire) < chunkCount)
+        {
+            YieldProcessor();
+        }
+
+        for (UINT32 chunk = 0; chunk < chunkCount; ++chunk)
+        {
+            const float* bus = m_buses.get() + chunk * m_bufferSize;
+            for (UINT32 i = 0; i < m_bufferSize; ++i)
+            {
+                buffer[i] += bus[i];
+            }
+        }
+    }
+
+    bool StillPlaying(size_t voice) const { return m_stillPlaying[voice] != 0; }
+
+    ~VoiceRenderPool()
+    {
+        m_stopping.store(true, std::memory_order_release);
+        for (std::vector<std::unique_ptr<Worker>>::const_iterator it = m_workers.cbegin(); it != m_workers.cend(); ++it)
+        {
+            if ((*it)->hThread != nullptr)
+            {
+                ::SetEvent((*it)->hGoEvent);
+                WaitForSingleObject((*it)->hThread, INFINITE);
+            }
+        }
+        m_workers.clear();
+    }
+
+private:
+    class Worker
+    {
+    public:
+        Worker(VoiceRenderPool* pool)
+            : pool(pool)
+            , hGoEvent(nullptr)
+            , hThread(nullptr)
+        {
+        }
+
+        ~Worker()
+        {
+            if (hThread != nullptr) CloseHandle(hThread);
+            if (hGoEvent != nullptr) CloseHandle(hGoEvent);
+        }
+
+        VoiceRenderPool* const pool;
+        HANDLE hGoEvent;
+        HANDLE hThread;
+    };
+
+    const UINT32 m_workerCount;
+    const UINT32 m_bufferSize;
+    const UINT32 m_minVoicesPerChunk;
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    std::unique_ptr<float[]> m_buses;
+    std::vector<UINT8> m_stillPlaying;
+    BeepInProgressVector const * m_voices;
+    float* m_buffer;
+    UINT32 m_chunkSize;
+    UINT32 m_epoch;
+
+    // epoch, chunk count and next chunk index share one word, so a worker that wakes up late for an old job
+    // can never claim a chunk of the current one
+    std::atomic<UINT64> m_nextChunk;
+    std::atomic<UINT32> m_chunksDone;
+    std::atomic<bool> m_stopping;
+    DWORD m_lastError;
+
+    static UINT64 Pack(UINT32 epoch, UINT32 chunkCount, UINT32 index)
+    {
+        return (static_cast<UINT64>(epoch) << 32) | (static_cast<UINT64>(chunkCount) << 16) | index;
+    }
+
+    static DWORD WINAPI WorkerThreadProc(LPVOID arg)
+    {
+        Worker* worker = reinterpret_cast<Worker*>(arg);
+        LogPrepareThread();
+        RealTimeThreadScope realTime;
+        while (true)
+        {
+            WaitForSingleObject(worker->hGoEvent, INFINITE);
+            if (worker->pool->m_stopping.load(std::memory_order_acquire)) return 0;
+            worker->pool->RunChunks();
+        }
+    }
+
+    void RunChunks()
+    {
+        UINT64 current = m_nextChunk.load(std::memory_order_acquire);
+        while (true)
+        {
+            UINT32 chunkCount = static_cast<UINT32>((current >> 16) & 0xFFFFu);
+            UINT32 chunk = static_cast<UINT32>(current & 0xFFFFu);
+            if (chunk >= chunkCount) return;
+            if (!m_nextChunk.compare_exchange_weak(current, current + 1, std::memory_order_acq_rel, std::memory_order_acquire)) continue;
+
+            RenderChunk(chunk);
+            m_chunksDone.fetch_add(1u, std::memory_order_release);
+            current = m_nextChunk.load(std::memory_order_acquire);
+        }
+    }
+
+    void RenderChunk(UINT32 chunk)
+    {
+        float* bus = m_buses.get() + chunk * m_bufferSize;
+        std::fill(bus, bus + m_bufferSize, 0.0f);
+
+        size_t begin = static_cast<size_t>(chunk) * m_chunkSize;
+        size_t end = min(begin + m_chunkSize, m_voices->size());
+        for (size_t i = begin; i < end; ++i)
+        {
+            m_stillPlaying[i] = (*m_voices)[i]->AddToBuffer(bus, m_bufferSize) ? 1 : 0;
+        }
+    }
+};
+
+// Carries a render pool built on the client's thread. The audio thread swaps it for the one it had, and the old one
+// goes away with the command.
+
+class AudioThreadCommand_SetRenderWorkers : public AudioThreadCommand
+{
+public:
+    AudioThreadCommand_SetRenderWorkers(std::unique_ptr<VoiceRenderPool> && pool)
+        : m_pool(std::move(pool))
+    {
+    }
+
+    void SwapPool(std::unique_ptr<VoiceRenderPool> & pool) { std::swap(pool, m_pool); }
+private:
+    std::unique_ptr<VoiceRenderPool> m_pool;
+};
+
+class AudioThreadData
+{
+public:
+    AudioThreadData(int bufferSize, HANDLE hStopEvent)
+		: BUFFER_SIZE(bufferSize)
+        , m_hStopEvent(hStopEvent)
+        , m_didCoInitialize(false)
+        , m_pXAudio2(nullptr)
+        , m_didCreateXAudio2(false)
+        , m_pMasterVoice(nullptr)
+        , m_didCreateMasteringVoice(false)
+        , m_sampleRate(0)
+        , m_lastError(0u)
+		, m_buffer1(nullptr)
+		, m_buffer2(nullptr)
+        , m_callback(nullptr)
+        , m_pSourceVoice(nullptr)
+        , m_didCreateSourceVoice(false)
+        , m_currentTime(0u)
+        , m_arena(nullptr)
+        , m_hQueueEvent(nullptr)
+        , m_commandQueue(nullptr)
+        , m_housekeeper(nullptr)
+        , m_queuedBeeps(nullptr)
+        , m_possibleFutureEvents(nullptr)
+        , m_waitingEvents(nullptr)
+        , m_groups(nullptr)
+        , m_dispatcher(nullptr)
+        , m_polledEvents(nullptr)
+        , m_renderPool(nullptr)
+        , m_noteCache(nullptr)
+        , m_scoreStreams(nullptr)
+        , m_additiveBank(nullptr)
+        , m_spectrumAnalyzer(nullptr)
+        , m_convolver(nullptr)
+        , m_fadingConvolver(nullptr)
+        , m_isConvolverFading(false)
+        , m_crossfadeBuffer()
+        , m_voiceLimiter(nullptr)
+        , m_sharedRing(nullptr)
+        , m_renderedTime(0u)
+        , m_hSuspendDoneEvent(nullptr)
+        , m_isSuspending(false)
+        , m_buffersInFlight(0u)
+        , m_isSuspended(false)
+        , m_ticksPerMicrosecond(0.0)
+        , m_coldStartTicks(0)
+        , m_warmStartTicks(0)
+    {
+    }
+
+	UINT32 GetSampleRate() const { return m_sampleRate; }
+
+    static const UINT64 DEFAULT_NOTE_CACHE_BYTES = 16u * 1024u * 1024u;
+    static const UINT32 ADDITIVE_FRAME_SIZE = 1024u;
+    static const size_t MAX_SCORE_STREAMS = 16u;
+
+	DWORD GetLastError() const { return m_lastError; }
+
+    bool Initialize()
+    {
+        assert(!m_didCoInitialize);
+
+        HRESULT coInitiailzeResult = CoInitializeEx(nullptr, COINIT_MULTITHREADED);
+        if (FAILED(coInitiailzeResult)) return false;
+        m_didCoInitialize = true;
+
+        HRESULT hr = XAudio2Create(&m_pXAudio2);
+        if (FAILED(hr)) return false;
+        m_didCreateXAudio2 = true;
+
+        hr = m_pXAudio2->CreateMasteringVoice(&m_pMasterVoice);
+        if (FAILED(hr)) return false;
+        m_didCreateMasteringVoice = true;
+
+        XAUDIO2_VOICE_DETAILS masterDetails;
+        m_pMasterVoice->GetVoiceDetails(&masterDetails);
+        m_sampleRate = masterDetails.InputSampleRate;
+
+        m_buffer1 = std::unique_ptr<BufferData>(new BufferData());
+        if (m_buffer1 == nullptr) return false;
+        bool isInitialized = m_buffer1->Initialize(BUFFER_SIZE);
+        if (!isInitialized) { m_lastError = m_buffer1->GetLastError(); return false; }
+
+		m_buffer2 = std::unique_ptr<BufferData>(new BufferData());
+        if (m_buffer2 == nullptr) return false;
+        isInitialized = m_buffer2->Initialize(BUFFER_SIZE);
+		if (!isInitialized) { m_lastError = m_buffer2->GetLastError(); return false; }
+
+        m_callback = new VoiceCallback2();
+		if (m_callback == nullptr) return false;
+
+        WAVEFORMATEX wfx = { WAVE_FORMAT_IEEE_FLOAT, 1, m_sampleRate, m_sampleRate * 4, 4, 32, 0 };
+        hr = m_pXAudio2->CreateSourceVoice(&m_pSourceVoice, &wfx, 0, XAUDIO2_DEFAULT_FREQ_RATIO, m_callback);
+        if (FAILED(hr)) return false;
+        m_didCreateSourceVoice = true;
+
+		m_hQueueEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+        if (m_hQueueEvent == nullptr) { m_lastError = ::GetLastError(); return false; }
+
+        m_hSuspendDoneEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+        if (m_hSuspendDoneEvent == nullptr) { m_lastError = ::GetLastError(); return false; }
+
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        m_ticksPerMicrosecond = frequency.QuadPart / 1.0e6;
+
+		m_commandQueue = std::unique_ptr<AudioThreadCommandQueue>(new AudioThreadCommandQueue());
+        if (m_commandQueue == nullptr) { return false; }
+
+        m_arena = std::unique_ptr<AudioArena>(new AudioArena());
+        if (m_arena == nullptr) { return false; }
+        if (!m_arena->Initialize()) { return false; }
+
+        m_housekeeper = std::unique_ptr<Housekeeper>(new Housekeeper(m_commandQueue.get(), m_hQueueEvent, m_arena.get()));
+        if (m_housekeeper == nullptr) { return false; }
+        isInitialized = m_housekeeper->Initialize();
+        if (!isInitialized) { m_lastError = m_housekeeper->GetLastError(); return false; }
+
+        m_queuedBeeps = CreateBeepCommandQueue();
+        if (m_queuedBeeps == nullptr) { return false; }
+        
+		m_possibleFutureEvents = std::unique_ptr<EventSet>(new EventSet(ArenaAllocator<UINT32>(m_arena.get())));
+		if (m_possibleFutureEvents == nullptr) { return false; }
+
+        m_waitingEvents = std::unique_ptr<EventMap>(new EventMap(EventMap::allocator_type(m_arena.get())));
+		if (m_waitingEvents == nullptr) { return false; }
+
+        m_groups = std::unique_ptr<BeepGroupTable>(new BeepGroupTable(m_arena.get()));
+        if (m_groups == nullptr) { return false; }
+
+        m_dispatcher = std::unique_ptr<EventDispatcher>(new EventDispatcher(m_arena.get()));
+        if (m_dispatcher == nullptr) { return false; }
+        isInitialized = m_dispatcher->Initialize();
+        if (!isInitialized) { m_lastError = m_dispatcher->GetLastError(); return false; }
+
+        m_polledEvents = std::shared_ptr<EventCompletionTarget_Queue>(new EventCompletionTarget_Queue());
+        if (m_polledEvents == nullptr) { return false; }
+
+        m_noteCache = std::unique_ptr<NoteCache>(new NoteCache(DEFAULT_NOTE_CACHE_BYTES, m_arena.get(), m_housekeeper.get()));
+        if (m_noteCache == nullptr) { return false; }
+
+        m_scoreStreams = std::unique_ptr<ScoreStreamVector>(new ScoreStreamVector());
+        if (m_scoreStreams == nullptr) { return false; }
+        m_scoreStreams->reserve(MAX_SCORE_STREAMS);
+
+        m_additiveBank = std::unique_ptr<AdditiveBank>(new AdditiveBank(ADDITIVE_FRAME_SIZE));
+        if (m_additiveBank == nullptr) { return false; }
+        if (!m_additiveBank->Initialize()) { return false; }
+
+        m_spectrumAnalyzer = std::unique_ptr<SpectrumAnalyzer>(new SpectrumAnalyzer(BUFFER_SIZE));
+        if (m_spectrumAnalyzer == nullptr) { return false; }
+        if (!m_spectrumAnalyzer->Initialize()) { return false; }
+
+        m_crossfadeBuffer.resize(BUFFER_SIZE);
+
+        m_voiceLimiter = std::unique_ptr<VoiceLimiter>(new VoiceLimiter(m_sampleRate, BUFFER_SIZE));
+        if (m_voiceLimiter == nullptr) { return false; }
+        if (!m_voiceLimiter->Initialize()) { return false; }
+
+		m_beepInProgressVector = std::unique_ptr<BeepInProgressVector>(new BeepInProgressVector());
+		if (m_beepInProgressVector == nullptr) { return false; }
+        m_beepInProgressVector->reserve(VOICE_CAPACITY);
+
+        return true;
+    }
+
+    void ScheduleBeeps(std::vector<std::unique_ptr<AudioBeepCommand>>&& commands, UINT32 group = 0u)
+    {
+		m_commandQueue->Push(std::unique_ptr<AudioThreadCommand>(new AudioThreadCommand_ScheduleBeeps(std::move(commands), group)));
+		::SetEvent(m_hQueueEvent);
+    }
+
+    void WatchEvents(std::vector<UINT32>&& eventIds, std::shared_ptr<EventCompletionTarget> const & target)
+    {
+        m_commandQueue->Push(std::unique_ptr<AudioThreadCommand>(new AudioThreadCommand_WatchEvents(std::move(eventIds), target)));
+        ::SetEvent(m_hQueueEvent);
+    }
+
+    // heap use on the audio thread and render workers so far; always zero unless the allocation tripwire is built in
+    static UINT64 GetRealTimeHeapUseCount() { return g_realTimeHeapUseCount.load(std::memory_order_relaxed); }
+
+    BeepEventStatus WaitForEvents(const UINT32* eventIds, UINT32 count, UINT32 timeoutMilliseconds, UINT32* pEventId)
+    {
+        std::shared_ptr<EventCompletionTarget_Wait> target(new EventCompletionTarget_Wait(count));
+        WatchEvents(std::vector<UINT32>(eventIds, eventIds + count), target);
+        BeepEventStatus status = target->Wait(timeoutMilliseconds, pEventId);
+
+        // the watches that did not complete the wait would otherwise stay until their events happen, if ever
+        if (status == BeepEventStatus_Timeout || count > 1u)
+        {
+            m_commandQueue->Push(std::unique_ptr<AudioThreadCommand>(new AudioThreadCommand_UnwatchEvents(std::vector<UINT32>(eventIds, eventIds + count), target)));
+            ::SetEvent(m_hQueueEvent);
+        }
+        return status;
+    }
+
+    void WatchEvent(UINT32 eventId)
+    {
+        WatchEvents(std::vector<UINT32>(1, eventId), m_polledEvents);
+    }
+
+    bool GetCompletedEvent(UINT32* pEventId, BeepEventStatus* pStatus)
+    {
+        return m_polledEvents->TryGet(pEventId, pStatus);
+    }
+
+    void SetEventCallback(BeepEventCallback callback, void* context)
+    {
+        m_dispatcher->SetCallback(callback, context);
+    }
+
+    // replaces any ring the engine already has
+    bool OpenSharedRing(const wchar_t* name, UINT32 commandCapacity, UINT32 completionCapacity)
+    {
+        std::shared_ptr<SharedRing> ring(new SharedRing());
+        if (ring == nullptr) return false;
+        if (!ring->Create(name, commandCapacity, completionCapacity, m_sampleRate))
+        {
+            OutputDebugString(L"Failed to create shared ring\n");
+            return false;
+        }
+
+        m_dispatcher->SetSharedRing(ring);
+        m_commandQueue->Push(std::unique_ptr<AudioThreadCommand>(new AudioThreadCommand_SetSharedRing(ring)));
+        ::SetEvent(m_hQueueEvent);
+        return true;
+    }
+
+    void CloseSharedRing()
+    {
+        m_dispatcher->SetSharedRing(nullptr);
+        m_commandQueue->Push(std::unique_ptr<AudioThreadCommand>(new AudioThreadCommand_SetSharedRing(nullptr)));
+        ::SetEvent(m_hQueueEvent);
+    }
+
+    void PlayScoreStream(std::unique_ptr<ScoreStream> && stream)
+    {
+        m_commandQueue->Push(std::unique_ptr<AudioThreadCommand>(new AudioThreadCommand_PlayScoreStream(std::move(stream))));
+        ::SetEvent(m_hQueueEvent);
+    }
+
+    SpectrumAnalyzer* GetSpectrumAnalyzer() const { return m_spectrumAnalyzer.get(); }
+
+    // The render position is how far the audio thread has rendered, and the play position is how far the device has
+    // played; the difference is the audio waiting in XAudio2's queue. Both count samples from when the engine started.
+    void GetClock(UINT64* pRenderPosition, UINT64* pPlayPosition) const
+    {
+        if (pRenderPosition != nullptr) *pRenderPosition = m_renderedTime.load(std::memory_order_acquire);
+        if (pPlayPosition != nullptr)
+        {
+            XAUDIO2_VOICE_STATE state;
+            m_pSourceVoice->GetState(&state, 0);
+            *pPlayPosition = state.SamplesPlayed;
+        }
+    }
+
+    // A null impulse response turns convolution off.
+    bool SetImpulseResponse(const float* impulseResponse, UINT32 length)
+    {
+        std::unique_ptr<PartitionedConvolver> convolver;
+        if (impulseResponse != nullptr && length != 0)
+        {
+            convolver = std::unique_ptr<PartitionedConvolver>(new PartitionedConvolver(BUFFER_SIZE));
+            if (convolver == nullptr) return false;
+            if (!convolver->Initialize(impulseResponse, length)) return false;
+        }
+
+        m_commandQueue->Push(std::unique_ptr<AudioThreadCommand>(new AudioThreadCommand_SetConvolver(std::move(convolver))));
+        ::SetEvent(m_hQueueEvent);
+        return true;
+    }
+
+    void SetNoteCacheBudget(UINT64 budgetBytes)
+    {
+        m_commandQueue->Push(std::unique_ptr<AudioThreadCommand>(new AudioThreadCommand_SetNoteCacheBudget(budgetBytes)));
+        ::SetEvent(m_hQueueEvent);
+    }
+
+    void SetPolyphony(UINT32 maxVoices, BeepVoiceStealPolicy policy)
+    {
+        m_commandQueue->Push(std::unique_ptr<AudioThreadCommand>(new AudioThreadCommand_SetPolyphony(maxVoices, policy)));
+        ::SetEvent(m_hQueueEvent);
+    }
+
+    void ScheduleLoop(std::unique_ptr<BeepLoopPattern>&& pattern, UINT32 group)
+    {
+        m_commandQueue->Push(std::unique_ptr<AudioThreadCommand>(new AudioThreadCommand_ScheduleLoop(std::move(pattern), group)));
+        ::SetEvent(m_hQueueEvent);
+    }
+
+    void CancelGroup(UINT32 group)
+    {
+        m_commandQueue->Push(std::unique_ptr<AudioThreadCommand>(new AudioThreadCommand_CancelGroup(group)));
+        ::SetEvent(m_hQueueEvent);
+    }
+
+    void SetShedding(bool enabled, float targetLoad)
+    {
+        m_commandQueue->Push(std::unique_ptr<AudioThreadCommand>(new AudioThreadCommand_SetShedding(enabled, targetLoad)));
+        ::SetEvent(m_hQueueEvent);
+    }
+
+    void GetOverloadStats(UINT64* pVoicesStolen, UINT64* pNotesDropped, UINT64* pVoicesShed, float* pLoad) const
+    {
+        if (pVoicesStolen != nullptr) *pVoicesStolen = m_voiceLimiter->Stolen();
+        if (pNotesDropped != nullptr) *pNotesDropped = m_voiceLimiter->Dropped();
+        if (pVoicesShed != nullptr) *pVoicesShed = m_voiceLimiter->Shed();
+        if (pLoad != nullptr) *pLoad = m_voiceLimiter->Load();
+    }
+
+    void GetNoteCacheStats(UINT64* pHits, UINT64* pMisses, UINT64* pBytesUsed) const
+    {
+        if (pHits != nullptr) *pHits = m_noteCache->Hits();
+        if (pMisses != nullptr) *pMisses = m_noteCache->Misses();
+        if (pBytesUsed != nullptr) *pBytesUsed = m_noteCache->UsedBytes();
+    }
+
+    // The pool and its threads are set up here, on the caller's thread; a worker count of zero turns the pool off.
+    void SetRenderWorkers(UINT32 workerCount, UINT32 minVoicesPerChunk)
+    {
+        std::unique_ptr<VoiceRenderPool> pool;
+        if (workerCount != 0)
+        {
+            pool = std::unique_ptr<VoiceRenderPool>(new VoiceRenderPool(workerCount, BUFFER_SIZE, minVoicesPerChunk));
+            if (pool == nullptr || !pool->Initialize())
+            {
+                OutputDebugString(L"Failed to start render workers\n");
+                pool = nullptr;
+            }
+        }
+
+        m_commandQueue->Push(std::unique_ptr<AudioThreadCommand>(new AudioThreadCommand_SetRenderWorkers(std::move(pool))));
+        ::SetEvent(m_hQueueEvent);
+    }
+
+    // Suspending stops the device but keeps everything else: the thread, the XAudio2 objects, the arena, pools and
+    // tables. Both wait until the audio thread has done it, or has stopped (ReleaseCallers answers a suspend or resume
+    // that was still pending, and hAudioThread covers a thread that ended without getting that far); the engine
+    // instance makes sure only one thread at a time calls them.
+    void SetSuspended(bool suspend, HANDLE hAudioThread)
+    {
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        m_commandQueue->Push(std::unique_ptr<AudioThreadCommand>(new AudioThreadCommand_SetSuspended(suspend, now.QuadPart)));
+        ::SetEvent(m_hQueueEvent);
+
+        HANDLE events[2] = { m_hSuspendDoneEvent, hAudioThread };
+        WaitForMultipleObjects(2, events, FALSE, INFINITE);
+    }
+
+    bool IsSuspended() const { return m_isSuspended.load(std::memory_order_acquire); }
+
+    // Time to first sample, in microseconds: from the call that started or resumed the engine until its first buffer
+    // was queued and the device started. A prewarmed engine's cold start ends when it is ready to be resumed.
+    void GetTimeToFirstSample(double* pColdMicroseconds, double* pWarmMicroseconds) const
+    {
+        if (pColdMicroseconds != nullptr) *pColdMicroseconds = m_coldStartTicks.load(std::memory_order_relaxed) / m_ticksPerMicrosecond;
+        if (pWarmMicroseconds != nullptr) *pWarmMicroseconds = m_warmStartTicks.load(std::memory_order_relaxed) / m_ticksPerMicrosecond;
+    }
+
+    // hStarted is signalled once the device has started, or the engine is ready to be resumed.
+    void RunLoop(bool startSuspended, LONGLONG startTicks, HANDLE hStarted)
+    {
+        if (startSuspended)
+        {
+            // the device is stopped, as it is after a suspend; the timeline starts at the first resume, which queues
+            // rendered buffers straight away
+            m_pXAudio2->StopEngine();
+            m_isSuspended.store(true, std::memory_order_release);
+        }
+        else
+        {
+            HRESULT hr = SubmitBuffer(m_buffer1.get());
+            if (FAILED(hr))
+            {
+                OutputDebugString(L"Failed to submit first buffer\n");
+                Stop();
+                return;
+            }
+            hr = SubmitBuffer(m_buffer2.get());
+		    if (FAILED(hr))
+		    {
+			    OutputDebugString(L"Failed to submit second buffer\n");
+			    Stop();
+			    return;
+		    }
+
+            // the two silent buffers are part of the timeline, so that engine time and the device's play position agree
+            m_currentTime = m_buffer1->GetBufferSize() + m_buffer2->GetBufferSize();
+            m_renderedTime.store(m_currentTime, std::memory_order_release);
+            Start();
+            m_buffersInFlight = 2u;
+        }
+        RecordTimeToFirstSample(m_coldStartTicks, startTicks);
+        ::SetEvent(hStarted);
+        LogPrepareThread();
+        RealTimeThreadScope realTime;
+        HANDLE events[4] = { m_hStopEvent, m_hQueueEvent, m_buffer1->GetEventHandle(), m_buffer2->GetEventHandle() };
+        HRESULT hr = S_OK;
+        while (true)
+        {
+            DWORD waitResult = WaitForMultipleObjects(4, events, FALSE, INFINITE);
+            switch (waitResult)
+            {
+            case WAIT_OBJECT_0:
+                Stop();
+                return;
+
+			case WAIT_OBJECT_0 + 1:
+                ProcessQueue();
+				break;
+
+            case WAIT_OBJECT_0 + 2:
+				hr = RefillBuffer(m_buffer1.get());
+                if (FAILED(hr))
+                {
+					OutputDebugString(L"Failed to submit buffer\n");
+                    Stop();
+                    return;
+                }
+				break;
+
+			case WAIT_OBJECT_0 + 3:
+				hr = RefillBuffer(m_buffer2.get());
+                if (FAILED(hr))
+                {
+					OutputDebugString(L"Failed to submit buffer\n");
+					Stop();
+					return;
+                }
+                break;
+            }
+        }
+    }
+
+    // The run loop has ended, but client calls that found the engine running may still be waiting on it. This answers
+    // them as a stopped engine would, and may be called again for calls that were still on their way: queued commands
+    // are dropped unprocessed (a watch the audio thread never accepted completes with BeepEventStatus_EngineStopped),
+    // a suspend or resume returns, and every waiter is released with BeepEventStatus_EngineStopped.
+    void ReleaseCallers()
+    {
+        while (std::unique_ptr<AudioThreadCommand> command = m_commandQueue->Pop())
+        {
+            if (dynamic_cast<AudioThreadCommand_SetSuspended*>(command.get()) != nullptr)
+            {
+                ::SetEvent(m_hSuspendDoneEvent);
+            }
+        }
+
+        // a suspend that was waiting for buffers that will never come back
+        if (m_isSuspending)
+        {
+            m_isSuspending = false;
+            ::SetEvent(m_hSuspendDoneEvent);
+        }
+
+        for (EventMap::const_iterator it = m_waitingEvents->cbegin(); it != m_waitingEvents->cend(); ++it)
+        {
+            m_dispatcher->Post(it->first, BeepEventStatus_EngineStopped, it->second);
+        }
+        m_waitingEvents->clear();
+        m_dispatcher->FlushAll();
+    }
+
+    ~AudioThreadData()
+    {
+        // the housekeeper signals the queue event, so it has to stop before the event is closed
+        m_housekeeper = nullptr;
+
+        if (m_waitingEvents != nullptr && m_dispatcher != nullptr)
+        {
+            for (EventMap::const_iterator it = m_waitingEvents->cbegin(); it != m_waitingEvents->cend(); ++it)
+            {
+                m_dispatcher->Post(it->first, BeepEventStatus_EngineStopped, it->second);
+            }
+            m_waitingEvents->clear();
+            m_dispatcher->FlushAll();
+        }
+
+		if (m_hQueueEvent != nullptr)
+		{
+			CloseHandle(m_hQueueEvent);
+			m_hQueueEvent = nullptr;
+		}
+
+        if (m_hSuspendDoneEvent != nullptr)
+        {
+            CloseHandle(m_hSuspendDoneEvent);
+            m_hSuspendDoneEvent = nullptr;
+        }
+
+        if (m_didCreateSourceVoice)
+        {
+			m_pSourceVoice->DestroyVoice();
+			m_pSourceVoice = nullptr;
+            m_didCreateSourceVoice = false;
+        }
+
+        if (m_callback != nullptr)
+        {
+            delete m_callback;
+            m_callback = nullptr;
+        }
+        
+        if (m_didCreateMasteringVoice)
+        {
+            m_pMasterVoice->DestroyVoice();
+			m_didCreateMasteringVoice = false;
+        }
+
+        if (m_didCreateXAudio2)
+        {
+            m_pXAudio2->Release();
+			m_didCreateXAudio2 = false;
+        }
+
+        if (m_didCoInitialize)
+        {
+            CoUninitialize();
+			m_didCoInitialize = false;
+        }
+    }
+private:
+    const int BUFFER_SIZE;
+    const HANDLE m_hStopEvent; // owned by the engine instance
+
+    bool m_didCoInitialize;
+    IXAudio2* m_pXAudio2;
+	bool m_didCreateXAudio2;
+    IXAudio2MasteringVoice* m_pMasterVoice;
+	bool m_didCreateMasteringVoice;
+    UINT32 m_sampleRate;
+    DWORD m_lastError;
+    std::unique_ptr<BufferData> m_buffer1;
+    std::unique_ptr<BufferData> m_buffer2;
+	VoiceCallback2 * m_callback;
+    IXAudio2SourceVoice* m_pSourceVoice;
+	bool m_didCreateSourceVoice;
+    UINT64 m_currentTime; // samples rendered since the engine started
+
+    // everything made in the arena has to be declared after it, so that it is destroyed first
+    std::unique_ptr<AudioArena> m_arena;
+    HANDLE m_hQueueEvent;
+	std::unique_ptr<AudioThreadCommandQueue> m_commandQueue;
+    std::unique_ptr<Housekeeper> m_housekeeper;
+    std::unique_ptr<BeepCommandQueue> m_queuedBeeps;
+    std::unique_ptr<EventSet> m_possibleFutureEvents;
+    std::unique_ptr<EventMap> m_waitingEvents;
+    std::unique_ptr<BeepGroupTable> m_groups;
+    std::unique_ptr<EventDispatcher> m_dispatcher;
+    std::shared_ptr<EventCompletionTarget_Queue> m_polledEvents;
+    std::unique_ptr<VoiceRenderPool> m_renderPool;
+    std::unique_ptr<NoteCache> m_noteCache;
+    std::unique_ptr<ScoreStreamVector> m_scoreStreams;
+    std::unique_ptr<AdditiveBank> m_additiveBank;
+    std::unique_ptr<SpectrumAnalyzer> m_spectrumAnalyzer;
+    std::unique_ptr<PartitionedConvolver> m_convolver;
+    std::unique_ptr<PartitionedConvolver> m_fadingConvolver; // null if convolution was off
+    bool m_isConvolverFading;
+    std::vector<float> m_crossfadeBuffer;
+    std::unique_ptr<VoiceLimiter> m_voiceLimiter;
+    std::shared_ptr<SharedRing> m_sharedRing;
+    std::unique_ptr<BeepInProgressVector> m_beepInProgressVector;
+    std::atomic<UINT64> m_renderedTime; // m_currentTime, for other threads
+    HANDLE m_hSuspendDoneEvent;
+    bool m_isSuspending; // waiting for the buffers in flight to finish playing
+    UINT32 m_buffersInFlight;
+    std::atomic<bool> m_isSuspended;
+    double m_ticksPerMicrosecond;
+    std::atomic<LONGLONG> m_coldStartTicks;
+    std::atomic<LONGLONG> m_warmStartTicks;
+
+    void RecordTimeToFirstSample(std::atomic<LONGLONG>& ticks, LONGLONG requestTicks)
+    {
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        ticks.store(now.QuadPart - requestTicks, std::memory_order_relaxed);
+    }
+
+    // A buffer has finished playing and is normally rendered again and resubmitted. While the engine is suspending,
+    // the buffers are left idle as they come back, so that nothing already rendered is lost, and the device is
+    // stopped once both are idle.
+    HRESULT RefillBuffer(BufferData* bufferData)
+    {
+        if (m_isSuspended.load(std::memory_order_relaxed)) return S_OK;
+        if (m_isSuspending)
+        {
+            --m_buffersInFlight;
+            if (m_buffersInFlight == 0u)
+            {
+                Stop();
+                m_pXAudio2->StopEngine();
+                m_isSuspending = false;
+                m_isSuspended.store(true, std::memory_order_release);
+                ::SetEvent(m_hSuspendDoneEvent);
+            }
+            return S_OK;
+        }
+
+        RenderToBuffer(bufferData);
+        return SubmitBuffer(bufferData);
+    }
+
+    // The engine clock stands still while the engine is suspended, and it carries on from where it was, so nothing
+    // that was scheduled is lost. Resuming renders into the first buffer and starts the device at once, then renders
+    // the second buffer while the first is playing.
+    void ProcessSetSuspended(AudioThreadCommand_SetSuspended* ss)
+    {
+        if (ss->Suspend())
+        {
+            if (m_isSuspended.load(std::memory_order_relaxed))
+            {
+                ::SetEvent(m_hSuspendDoneEvent);
+            }
+            else
+            {
+                m_isSuspending = true;
+            }
+            return;
+        }
+
+        if (!m_isSuspended.load(std::memory_order_relaxed))
+        {
+            ::SetEvent(m_hSuspendDoneEvent);
+            return;
+        }
+
+        HRESULT hr = m_pXAudio2->StartEngine();
+        if (SUCCEEDED(hr))
+        {
+            RenderToBuffer(m_buffer1.get());
+            hr = SubmitBuffer(m_buffer1.get());
+            if (FAILED(hr))
+            {
+                // the engine stays suspended, so the device has to be stopped again
+                m_pXAudio2->StopEngine();
+            }
+        }
+        if (FAILED(hr))
+        {
+            BEEP_LOG(LOG_LEVEL_ERROR, L"Failed to resume ({})", static_cast<UINT32>(hr));
+            ::SetEvent(m_hSuspendDoneEvent);
+            return;
+        }
+
+        Start();
+        m_buffersInFlight = 1u;
+        m_isSuspended.store(false, std::memory_order_release);
+        RecordTimeToFirstSample(m_warmStartTicks, ss->RequestTicks());
+        ::SetEvent(m_hSuspendDoneEvent);
+
+        RenderToBuffer(m_buffer2.get());
+        if (SUCCEEDED(SubmitBuffer(m_buffer2.get())))
+        {
+            m_buffersInFlight = 2u;
+        }
+    }
+
+	void Start()
+	{
+		m_pSourceVoice->Start(0);
+	}
+
+	void Stop()
+	{
+		m_pSourceVoice->Stop();
+	}
+
+    std::unique_ptr<BeepCommandQueue> CreateBeepCommandQueue()
+    {
+        std::vector<ArenaPtr<BeepCommand>> storage;
+        storage.reserve(BEEP_QUEUE_CAPACITY);
+        return std::unique_ptr<BeepCommandQueue>(new BeepCommandQueue(std::move(storage)));
+    }
+
+    HRESULT SubmitBuffer(BufferData* bufferData)
+    {
+        HRESULT hr = m_pSourceVoice->SubmitSourceBuffer(bufferData->GetXBuffer());
+		if (FAILED(hr))
+		{
+			OutputDebugString(L"Failed to submit buffer\n");
+		}
+        return hr;
+    }
+
+    void ProcessQueue()
+    {
+        while (true)
+        {
+            std::unique_ptr<AudioThreadCommand> command = m_commandQueue->Pop();
+            if (command == nullptr) break;
+
+            if (AudioThreadCommand_ScheduleBeeps* sb = dynamic_cast<AudioThreadCommand_ScheduleBeeps*>(command.get()))
+            {
+                ProcessScheduleBeeps(sb);
+            }
+            else if (AudioThreadCommand_WatchEvents* we = dynamic_cast<AudioThreadCommand_WatchEvents*>(command.get()))
+            {
+                ProcessWatchEvents(we);
+            }
+            else if (AudioThreadCommand_UnwatchEvents* uwe = dynamic_cast<AudioThreadCommand_UnwatchEvents*>(command.get()))
+            {
+                ProcessUnwatchEvents(uwe);
+            }
+            else if (AudioThreadCommand_SetRenderWorkers* srw = dynamic_cast<AudioThreadCommand_SetRenderWorkers*>(command.get()))
+            {
+                srw->SwapPool(m_renderPool);
+            }
+            else if (AudioThreadCommand_SetNoteCacheBudget* sncb = dynamic_cast<AudioThreadCommand_SetNoteCacheBudget*>(command.get()))
+            {
+                m_noteCache->SetBudget(sncb->BudgetBytes());
+            }
+            else if (AudioThreadCommand_SetPolyphony* sp = dynamic_cast<AudioThreadCommand_SetPolyphony*>(command.get()))
+            {
+                m_voiceLimiter->SetPolyphony(sp->MaxVoices(), sp->Policy());
+            }
+            else if (AudioThreadCommand_ScheduleLoop* sl = dynamic_cast<AudioThreadCommand_ScheduleLoop*>(command.get()))
+            {
+                QueueLoopIteration(sl->TakePattern(), sl->Group(), m_currentTime, 0u);
+            }
+            else if (AudioThreadCommand_CancelGroup* cg = dynamic_cast<AudioThreadCommand_CancelGroup*>(command.get()))
+            {
+                ProcessCancelGroup(cg->Group());
+            }
+            else if (AudioThreadCommand_SetSuspended* sus = dynamic_cast<AudioThreadCommand_SetSuspended*>(command.get()))
+            {
+                ProcessSetSuspended(sus);
+            }
+            else if (AudioThreadCommand_SetShedding* ss = dynamic_cast<AudioThreadCommand_SetShedding*>(command.get()))
+            {
+                m_voiceLimiter->SetShedding(ss->Enabled(), ss->TargetLoad());
+            }
+            else if (AudioThreadCommand_SetConvolver* sc = dynamic_cast<AudioThreadCommand_SetConvolver*>(command.get()))
+            {
+                // The outgoing convolver is kept for one more buffer, to be faded out (see CrossfadeConvolvers). If a
+                // change has not been heard yet, the fade still starts from the convolver before it, and the unheard
+                // one goes back with the command.
+                if (!m_isConvolverFading)
+                {
+                    m_fadingConvolver = std::move(m_convolver);
+                    m_isConvolverFading = true;
+                }
+                sc->SwapConvolver(m_convolver);
+            }
+            else if (AudioThreadCommand_SetSharedRing* ssr = dynamic_cast<AudioThreadCommand_SetSharedRing*>(command.get()))
+            {
+                ssr->SwapRing(m_sharedRing);
+            }
+            else if (AudioThreadCommand_ProvideNoteRecording* pnr = dynamic_cast<AudioThreadCommand_ProvideNoteRecording*>(command.get()))
+            {
+                m_noteCache->Provide(pnr->Key(), pnr->Note());
+            }
+            else if (AudioThreadCommand_PlayScoreStream* pss = dynamic_cast<AudioThreadCommand_PlayScoreStream*>(command.get()))
+            {
+                if (m_scoreStreams->size() < MAX_SCORE_STREAMS)
+                {
+                    m_scoreStreams->push_back(pss->TakeStream());
+                    m_scoreStreams->back()->Start(m_currentTime);
+                }
+                else
+                {
+                    // the stream stays in the command, and is released with it
+                    BEEP_LOG(LOG_LEVEL_ERROR, L"Too many score streams; one was not played");
+                }
+            }
+            else
+            {
+                BEEP_LOG(LOG_LEVEL_ERROR, L"Unknown command type");
+            }
+
+            // the command, and anything swapped into it, is released on the housekeeper's thread
+            m_housekeeper->Retire(std::move(command));
+        }
+
+        m_dispatcher->Flush();
+        m_housekeeper->Flush();
+    }
+
+    bool HasBeepQueueRoom() const { return m_queuedBeeps->size() < BEEP_QUEUE_CAPACITY; }
+
+    // Returns false if the queue already holds BEEP_QUEUE_CAPACITY commands, in which case the command is dropped.
+    bool EnqueueBeepCommand(ArenaPtr<BeepCommand> && beepCommand, UINT32 group = 0u)
+    {
+        if (!HasBeepQueueRoom())
+        {
+            DiscardCommand(beepCommand.get());
+            m_voiceLimiter->CountDropped();
+            return false;
+        }
+
+        BeepCommand_Event* eventCommand = dynamic_cast<BeepCommand_Event*>(beepCommand.get());
+        if (eventCommand != nullptr)
+        {
+            m_possibleFutureEvents->insert(eventCommand->EventId());
+        }
+
+        if (group != 0u)
+        {
+            beepCommand->SetGroup(group);
+            m_groups->AddCommand(beepCommand.get());
+        }
+
+        m_queuedBeeps->push(std::move(beepCommand));
+        return true;
+    }
+
+    // Commands that do not fit in the beep queue are dropped, and counted as dropped notes.
+    void ProcessScheduleBeeps(AudioThreadCommand_ScheduleBeeps* sb)
+    {
+        std::vector<std::unique_ptr<AudioBeepCommand>> const& commands = sb->Commands();
+        for (std::vector<std::unique_ptr<AudioBeepCommand>>::const_iterator it = commands.cbegin(); it != commands.cend(); ++it)
+        {
+            if (!HasBeepQueueRoom())
+            {
+                size_t dropped = commands.cend() - it;
+                BEEP_LOG(LOG_LEVEL_ERROR, L"Beep queue is full; {} commands were dropped", dropped);
+                for (size_t i = 0; i < dropped; ++i) m_voiceLimiter->CountDropped();
+                return;
+            }
+            EnqueueBeepCommand((*it)->CreateCommand(m_arena.get(), m_sampleRate, m_currentTime), sb->Group());
+        }
+    }
+
+    // Queues one iteration of a loop, starting at startTime, followed by the command that will queue the next one.
+    void QueueLoopIteration(std::unique_ptr<BeepLoopPattern> && pattern, UINT32 group, UINT64 startTime, UINT32 iteration)
+    {
+        if (pattern->RepeatCount() != 0u && iteration >= pattern->RepeatCount())
+        {
+            m_housekeeper->Retire(std::move(pattern));
+            return;
+        }
+
+        // the loop itself is queued first, so that it keeps going even if this iteration's notes do not all fit; the
+        // period is at least one buffer, so a buffer never has to queue more than one iteration of a loop
+        std::vector<std::unique_ptr<AudioBeepCommand>> const& commands = pattern->Commands();
+        UINT64 periodSamples = static_cast<UINT64>(static_cast<double>(pattern->PeriodSeconds()) * m_sampleRate + 0.5);
+        periodSamples = max(periodSamples, static_cast<UINT64>(BUFFER_SIZE));
+        if (!EnqueueBeepCommand(MakeInArena<BeepCommand_Loop>(m_arena.get(), startTime, std::move(pattern), periodSamples, iteration + 1u), group))
+        {
+            BEEP_LOG(LOG_LEVEL_ERROR, L"Beep queue is full; a loop was stopped");
+            return;
+        }
+
+        for (std::vector<std::unique_ptr<AudioBeepCommand>>::const_iterator it = commands.cbegin(); it != commands.cend(); ++it)
+        {
+            if (!HasBeepQueueRoom())
+            {
+                m_voiceLimiter->CountDropped();
+                continue;
+            }
+            EnqueueBeepCommand((*it)->CreateCommand(m_arena.get(), m_sampleRate, startTime), group);
+        }
+    }
+
+    // A command is being thrown away without being played, because its group was cancelled or there is no room for it.
+    void DiscardCommand(BeepCommand* command)
+    {
+        if (BeepCommand_Loop* loopCommand = dynamic_cast<BeepCommand_Loop*>(command))
+        {
+            m_housekeeper->Retire(loopCommand->TakePattern());
+        }
+        else if (BeepCommand_Sample* sampleCommand = dynamic_cast<BeepCommand_Sample*>(command))
+        {
+            ReleaseBank(sampleCommand->TakeBank());
+        }
+    }
+
+    // The group's queued commands are taken out of the queue, and its voices fade out. The group table finds both, so
+    // this costs time in proportion to the size of the group. The group's score streams end.
+    void ProcessCancelGroup(UINT32 group)
+    {
+        if (group == 0u) return;
+
+        m_groups->Cancel
+        (
+            group,
+            [this](BeepCommand* command)
+            {
+                if (BeepCommand_Event* eventCommand = dynamic_cast<BeepCommand_Event*>(command))
+                {
+                    UINT32 eventId = eventCommand->EventId();
+                    auto possible = m_possibleFutureEvents->find(eventId);
+                    if (possible != m_possibleFutureEvents->end())
+                    {
+                        m_possibleFutureEvents->erase(possible);
+                    }
+                    m_dispatcher->Post(eventId, BeepEventStatus_Cancelled, nullptr);
+
+                    if (m_possibleFutureEvents->find(eventId) == m_possibleFutureEvents->end())
+                    {
+                        auto range = m_waitingEvents->equal_range(eventId);
+                        for (auto it = range.first; it != range.second; ++it)
+                        {
+                            m_dispatcher->Post(eventId, BeepEventStatus_Cancelled, std::move(it->second));
+                        }
+                        m_waitingEvents->erase(range.first, range.second);
+                    }
+                }
+                DiscardCommand(command);
+                m_queuedBeeps->Remove(command);
+            },
+            [this](BeepInProgress& voice)
+            {
+                m_voiceLimiter->FadeOutVoice(voice);
+            }
+        );
+
+        bool hadStreams = !m_scoreStreams->empty();
+        for (ScoreStreamVector::iterator it = m_scoreStreams->begin(); it != m_scoreStreams->end(); )
+        {
+            if ((*it)->Group() == group)
+            {
+                m_housekeeper->Retire(std::move(*it));
+                it = m_scoreStreams->erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+        if (hadStreams)
+        {
+            ReleaseWaitersAfterStreams();
+        }
+    }
+
+    void ProcessWatchEvents(AudioThreadCommand_WatchEvents* we)
+    {
+        we->Accept();
+        std::shared_ptr<EventCompletionTarget> const & target = we->Target();
+        std::vector<UINT32> const& eventIds = we->EventIds();
+        for (std::vector<UINT32>::const_iterator it = eventIds.cbegin(); it != eventIds.cend(); ++it)
+        {
+            if (m_possibleFutureEvents->find(*it) == m_possibleFutureEvents->end() && m_scoreStreams->empty())
+            {
+                // this event cannot possibly happen (or has already happened), so we answer immediately
+                m_dispatcher->Post(*it, BeepEventStatus_NotScheduled, target);
+            }
+            else
+            {
+                // while a score file is streaming, the event may still be in the part not read yet
+                m_waitingEvents->insert(std::make_pair(*it, target));
+            }
+        }
+    }
+
+    void ProcessUnwatchEvents(AudioThreadCommand_UnwatchEvents* uwe)
+    {
+        std::vector<UINT32> const& eventIds = uwe->EventIds();
+        for (std::vector<UINT32>::const_iterator it = eventIds.cbegin(); it != eventIds.cend(); ++it)
+        {
+            auto range = m_waitingEvents->equal_range(*it);
+            for (auto waiter = range.first; waiter != range.second; )
+            {
+                if (waiter->second.get() == uwe->Target())
+                {
+                    waiter = m_waitingEvents->erase(waiter);
+                }
+                else
+                {
+                    ++waiter;
+                }
+            }
+        }
+    }
+
+    // Moves records from the score streams into the beep queues, up to the lookahead horizon. The streams' workers have
+    // already checked that every record is playable (see IsPlayableScoreRecord), so the conversions below are in range.
+    void FeedScoreStreams(UINT32 bufferSize)
+    {
+        if (m_scoreStreams->empty()) return;
+
+        for (ScoreStreamVector::iterator it = m_scoreStreams->begin(); it != m_scoreStreams->end(); )
+        {
+            ScoreStream* stream = it->get();
+            UINT64 horizon = stream->Position() + bufferSize + stream->LookaheadSamples(m_sampleRate);
+
+            // when the beep queue is full, the stream's records wait in the stream
+            while (HasBeepQueueRoom())
+            {
+                const BeepScoreFileRecord* record = stream->Peek();
+                if (record == nullptr) break;
+
+                UINT64 recordStart = static_cast<UINT64>(record->startTime * m_sampleRate);
+                if (recordStart >= horizon) break;
+
+                UINT64 delay = (recordStart > stream->Position()) ? (recordStart - stream->Position()) : 0u;
+                UINT64 startTime = m_currentTime + delay;
+
+                if (record->kind == BeepScoreRecordKind_Note)
+                {
+                    float frequencyRadiansPerSample = 2.0f * (float)(std::numbers::pi) * record->frequency / m_sampleRate;
+                    UINT32 durationSamples = static_cast<UINT32>(record->duration * m_sampleRate);
+                    EnqueueBeepCommand(MakeInArena<BeepCommand_Beep>(m_arena.get(), startTime, frequencyRadiansPerSample, record->amplitude, durationSamples), stream->Group());
+                }
+                else if (record->kind == BeepScoreRecordKind_Partial)
+                {
+                    float frequencyRadiansPerSample = 2.0f * (float)(std::numbers::pi) * record->frequency / m_sampleRate;
+                    UINT32 durationSamples = static_cast<UINT32>(record->duration * m_sampleRate);
+                    EnqueueBeepCommand(MakeInArena<BeepCommand_Partial>(m_arena.get(), startTime, frequencyRadiansPerSample, record->amplitude, durationSamples), stream->Group());
+                }
+                else if (record->kind == BeepScoreRecordKind_Event)
+                {
+                    EnqueueBeepCommand(MakeInArena<BeepCommand_Event>(m_arena.get(), startTime, record->eventId), stream->Group());
+                }
+                stream->Advance();
+            }
+
+            stream->AddToPosition(bufferSize);
+
+            if (stream->IsFinished())
+            {
+                m_housekeeper->Retire(std::move(*it));
+                it = m_scoreStreams->erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+
+        ReleaseWaitersAfterStreams();
+    }
+
+    // Waiters were kept in case a stream contained their event. Once no streams are left, those whose event never
+    // turned up are released.
+    void ReleaseWaitersAfterStreams()
+    {
+        if (!m_scoreStreams->empty()) return;
+
+        for (EventMap::iterator it = m_waitingEvents->begin(); it != m_waitingEvents->end(); )
+        {
+            if (m_possibleFutureEvents->find(it->first) == m_possibleFutureEvents->end())
+            {
+                m_dispatcher->Post(it->first, BeepEventStatus_NotScheduled, std::move(it->second));
+                it = m_waitingEvents->erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    // Moves the records a client in another process has pushed into the shared ring into the beep queue. Records keep
+    // their place on the engine clock; notes and events that arrive late start at once. At most
+    // MAX_SHARED_RECORDS_PER_BUFFER are taken each buffer, and none while the beep queue is full, so a client that
+    // floods the ring waits for room instead of costing the audio thread time or losing records. Records that fail
+    // IsValidSharedRecord are thrown away.
+    void DrainSharedRing()
+    {
+        if (m_sharedRing == nullptr) return;
+
+        m_sharedRing->SetRenderPosition(m_currentTime);
+        UINT32 rejected = 0u;
+        m_sharedRing->DrainCommands(MAX_SHARED_RECORDS_PER_BUFFER, [this, &rejected](BeepSharedCommandRecord const & record)
+        {
+            if (!HasBeepQueueRoom()) return false;
+
+            if (!IsValidSharedRecord(record, m_sampleRate))
+            {
+                ++rejected;
+            }
+            else if (record.kind == BeepScoreRecordKind_Note)
+            {
+                float frequencyRadiansPerSample = 2.0f * (float)(std::numbers::pi) * record.frequency / m_sampleRate;
+                EnqueueBeepCommand(MakeInArena<BeepCommand_Beep>(m_arena.get(), record.startSample, frequencyRadiansPerSample, record.amplitude, record.durationSamples, record.priority), record.group);
+            }
+            else if (record.kind == BeepScoreRecordKind_Partial)
+            {
+                // the additive bank cannot start a partial in the past
+                float frequencyRadiansPerSample = 2.0f * (float)(std::numbers::pi) * record.frequency / m_sampleRate;
+                EnqueueBeepCommand(MakeInArena<BeepCommand_Partial>(m_arena.get(), max(record.startSample, m_currentTime), frequencyRadiansPerSample, record.amplitude, record.durationSamples), record.group);
+            }
+            else
+            {
+                EnqueueBeepCommand(MakeInArena<BeepCommand_Event>(m_arena.get(), record.startSample, record.eventId), record.group);
+            }
+            return true;
+        });
+
+        if (rejected != 0u)
+        {
+            BEEP_LOG(LOG_LEVEL_ERROR, L"Threw away {} invalid shared ring records", rejected);
+        }
+    }
+
+    // A note that should already have started (one scheduled at a fixed time that arrived late) starts part way through.
+    ArenaPtr<BeepInProgress> CreateVoice(BeepCommand_Beep const * beepCommand, UINT64 startTime, UINT64 currentTime)
+    {
+        UINT32 delayStart = (startTime > currentTime) ? static_cast<UINT32>(startTime - currentTime) : 0u;
+        UINT32 alreadyPlayed = static_cast<UINT32>(min(currentTime - min(startTime, currentTime), (UINT64)beepCommand->DurationSamples()));
+
+        NoteCacheKey key(beepCommand->FrequencyRadiansPerSample(), beepCommand->Amplitude(), beepCommand->DurationSamples(), m_sampleRate);
+
+        std::shared_ptr<CachedNote> cached = m_noteCache->Find(key);
+        if (cached != nullptr)
+        {
+            return MakeInArena<BeepInProgress_CachedNote>(m_arena.get(), beepCommand->Priority(), beepCommand->Amplitude(), cached, delayStart, alreadyPlayed);
+        }
+
+        return MakeInArena<BeepInProgress_SineWave>
+        (
+            m_arena.get(),
+            beepCommand->Priority(),
+            beepCommand->FrequencyRadiansPerSample(),
+            beepCommand->Amplitude(),
+            delayStart,
+            beepCommand->DurationSamples() - alreadyPlayed,
+            alreadyPlayed,
+            (alreadyPlayed == 0u) ? m_noteCache->Reserve(key) : nullptr
+        );
+    }
+
+    // A finished voice's recording or sample bank is always handed to the housekeeper. Other threads hold and drop
+    // references too, so use_count() cannot tell the audio thread whether its reference is the last one.
+    void RetireVoice(ArenaPtr<BeepInProgress> & voice)
+    {
+        if (voice->Group() != 0u)
+        {
+            m_groups->RemoveVoice(voice.get());
+        }
+        m_housekeeper->Retire(voice->TakeNote());
+        ReleaseBank(voice->TakeBank());
+        voice = nullptr;
+    }
+
+    void ReleaseBank(std::shared_ptr<SampleBank> && bank)
+    {
+        m_housekeeper->Retire(std::move(bank));
+    }
+
+    // Replaces a voice with a new one, or adds it if replace is SIZE_MAX. The voice being replaced mixes its
+    // fade-out into the buffer first, just as it would have when the voices are mixed, so it does not click; a voice
+    // that was recording a note marks the recording abandoned as it does so.
+    void InstallVoice(ArenaPtr<BeepInProgress> && voice, UINT32 group, size_t replace, float* buffer, UINT32 bufferSize)
+    {
+        voice->SetGroup(group);
+        if (group != 0u)
+        {
+            m_groups->AddVoice(voice.get());
+        }
+        if (replace == SIZE_MAX)
+        {
+            replace = m_beepInProgressVector->size();
+            m_beepInProgressVector->push_back(std::move(voice));
+        }
+        else
+        {
+            ArenaPtr<BeepInProgress>& victim = (*m_beepInProgressVector)[replace];
+            victim->FadeOut();
+            victim->AddToBuffer(buffer, bufferSize);
+            RetireVoice(victim);
+            victim = std::move(voice);
+        }
+        m_voiceLimiter->AddVoice(*(*m_beepInProgressVector)[replace], replace);
+    }
+
+    // Runs the outgoing and incoming convolvers on the same input, and fades from one to the other over the buffer, so
+    // that changing the impulse response does not click. Either one may be null, for no filtering. The outgoing one is
+    // then handed to the housekeeper.
+    void CrossfadeConvolvers(float* buffer)
+    {
+        std::copy(buffer, buffer + BUFFER_SIZE, m_crossfadeBuffer.begin());
+        if (m_fadingConvolver != nullptr) m_fadingConvolver->Process(m_crossfadeBuffer.data());
+        if (m_convolver != nullptr) m_convolver->Process(buffer);
+
+        for (int i = 0; i < BUFFER_SIZE; ++i)
+        {
+            float fadeIn = (i + 0.5f) / BUFFER_SIZE;
+            buffer[i] = buffer[i] * fadeIn + m_crossfadeBuffer[i] * (1.0f - fadeIn);
+        }
+
+        m_housekeeper->Retire(std::move(m_fadingConvolver));
+        m_isConvolverFading = false;
+    }
+
+    void RenderToBuffer(BufferData* bufferData)
+    {
+        LARGE_INTEGER renderStart;
+        QueryPerformanceCounter(&renderStart);
+
+        float* buffer = bufferData->GetBuffer();
+        std::fill(buffer, buffer + bufferData->GetBufferSize(), 0.0f);
+
+        UINT64 endTime = m_currentTime + bufferData->GetBufferSize();
+
+        FeedScoreStreams(bufferData->GetBufferSize());
+        DrainSharedRing();
+
+        auto processQueuedBeeps = [=]()
+        {
+            while (!m_queuedBeeps->empty() && m_queuedBeeps->top()->EventStartTimeSamples() < endTime)
+            {
+                UINT32 group = m_queuedBeeps->top()->Group();
+                if (group != 0u)
+                {
+                    m_groups->RemoveCommand(m_queuedBeeps->top().get());
+                }
+
+                if (BeepCommand_Loop* loopCommand = dynamic_cast<BeepCommand_Loop*>(m_queuedBeeps->top().get()))
+                {
+                    // taken out of the queue first, because the next iteration goes into it
+                    UINT64 nextStartTime = loopCommand->EventStartTimeSamples() + loopCommand->PeriodSamples();
+                    UINT32 nextIteration = loopCommand->NextIteration();
+                    std::unique_ptr<BeepLoopPattern> pattern = loopCommand->TakePattern();
+                    m_queuedBeeps->pop();
+                    QueueLoopIteration(std::move(pattern), group, nextStartTime, nextIteration);
+                    continue;
+                }
+
+                BeepCommand_Beep* beepCommand = dynamic_cast<BeepCommand_Beep*>(m_queuedBeeps->top().get());
+                BeepCommand_Partial* partialCommand = dynamic_cast<BeepCommand_Partial*>(m_queuedBeeps->top().get());
+                BeepCommand_Sample* sampleCommand = dynamic_cast<BeepCommand_Sample*>(m_queuedBeeps->top().get());
+                if (beepCommand != nullptr)
+                {
+                    size_t replace;
+                    if (m_voiceLimiter->MakeRoom(*m_beepInProgressVector, beepCommand->Priority(), beepCommand->Amplitude(), &replace))
+                    {
+                        InstallVoice(CreateVoice(beepCommand, beepCommand->EventStartTimeSamples(), m_currentTime), group, replace, buffer, bufferData->GetBufferSize());
+                    }
+                }
+                else if (sampleCommand != nullptr)
+                {
+                    std::shared_ptr<SampleBank> bank = sampleCommand->TakeBank();
+                    size_t replace;
+                    if (m_voiceLimiter->MakeRoom(*m_beepInProgressVector, sampleCommand->Priority(), sampleCommand->Gain(), &replace))
+                    {
+                        // a sample scheduled at a time that has already passed starts part way through, as notes do
+                        UINT64 startTime = sampleCommand->EventStartTimeSamples();
+                        UINT32 delayStart = (startTime > m_currentTime) ? static_cast<UINT32>(startTime - m_currentTime) : 0u;
+                        double position = static_cast<double>(m_currentTime - min(startTime, m_currentTime)) * sampleCommand->Step();
+                        InstallVoice
+                        (
+                            MakeInArena<BeepInProgress_Sample>(m_arena.get(), sampleCommand->Priority(), sampleCommand->Gain(), std::move(bank), sampleCommand->SampleIndex(), sampleCommand->Step(), delayStart, position),
+                            group,
+                            replace,
+                            buffer,
+                            bufferData->GetBufferSize()
+                        );
+                    }
+                    ReleaseBank(std::move(bank));
+                }
+                else if (partialCommand != nullptr)
+                {
+                    bool isAdded = m_additiveBank->AddPartial
+                    (
+                        m_additiveBank->Time() + (partialCommand->EventStartTimeSamples() - m_currentTime),
+                        partialCommand->DurationSamples(),
+                        partialCommand->FrequencyRadiansPerSample(),
+                        partialCommand->Amplitude()
+                    );
+                    if (!isAdded) m_voiceLimiter->CountDropped();
+                }
+                else
+                {
+                    BeepCommand_Event* eventCommand = dynamic_cast<BeepCommand_Event*>(m_queuedBeeps->top().get());
+                    if (eventCommand != nullptr)
+                    {
+                        UINT32 eventId = eventCommand->EventId();
+                        m_dispatcher->Post(eventId, BeepEventStatus_Occurred, nullptr);
+
+                        auto range = m_waitingEvents->equal_range(eventId);
+                        for (auto it = range.first; it != range.second; ++it)
+                        {
+                            m_dispatcher->Post(eventId, BeepEventStatus_Occurred, std::move(it->second));
+                        }
+                        m_waitingEvents->erase(range.first, range.second);
+
+                        auto possible = m_possibleFutureEvents->find(eventId);
+                        if (possible != m_possibleFutureEvents->end())
+                        {
+                            m_possibleFutureEvents->erase(possible);
+                        }
+                    }
+                    else
+                    {
+                        BEEP_LOG(LOG_LEVEL_ERROR, L"Unknown command type");
+                    }
+                }
+                m_queuedBeeps->pop();
+            }
+        };
+
+        processQueuedBeeps();
+
+        bool useRenderPool = m_renderPool != nullptr && m_renderPool->ShouldRender(m_beepInProgressVector->size());
+        if (useRenderPool)
+        {
+            m_renderPool->Render(*m_beepInProgressVector, buffer);
+        }
+
+        // voices advance in place; finished ones are dropped and the rest are packed down, keeping their order
+        BeepInProgressVector& voices = *m_beepInProgressVector;
+        size_t kept = 0;
+        for (size_t i = 0; i < voices.size(); ++i)
+        {
+            bool stillPlaying = useRenderPool ? m_renderPool->StillPlaying(i) : voices[i]->AddToBuffer(buffer, bufferData->GetBufferSize());
+            if (stillPlaying)
+            {
+                if (kept != i) voices[kept] = std::move(voices[i]);
+                ++kept;
+            }
+            else
+            {
+                RetireVoice(voices[i]);
+            }
+        }
+        voices.erase(voices.begin() + kept, voices.end());
+
+        m_additiveBank->AddToBuffer(buffer, bufferData->GetBufferSize());
+
+        if (m_isConvolverFading)
+        {
+            CrossfadeConvolvers(buffer);
+        }
+        else if (m_convolver != nullptr)
+        {
+            m_convolver->Process(buffer);
+        }
+
+        m_spectrumAnalyzer->Analyze(buffer);
+
+        LARGE_INTEGER renderEnd;
+        QueryPerformanceCounter(&renderEnd);
+        m_voiceLimiter->EndBuffer(voices, static_cast<UINT64>(renderEnd.QuadPart - renderStart.QuadPart));
+
+        m_dispatcher->Flush();
+        m_housekeeper->Flush();
+
+        m_currentTime = endTime;
+        m_renderedTime.store(m_currentTime, std::memory_order_release);
+    }
+};
+
+// One engine: an audio thread with its own output voice, scheduler, voices and event dispatcher. Engines share
+// nothing but the process-wide allocation counter and log, so any number can run side by side and each can be stopped
+// without disturbing the others. The exports that take no engine handle use the default engine.
+//
+// The audio thread's data lives on its stack. Every call that uses it goes through an EngineCall, which counts the
+// call as in flight; when the engine stops, the audio thread unpublishes its data, releases whatever those calls are
+// waiting for, and returns only once none is left, so no call is ever left holding data that is gone.
+
+class BeepEngineInstance
+{
+public:
+    BeepEngineInstance()
+        : m_hAudioThread(nullptr)
+        , m_hAudioThreadInitialized(nullptr)
+        , m_hStopEvent(nullptr)
+        , m_audioThreadData(nullptr)
+        , m_callsInFlight(0u)
+        , m_stateLock()
+        , m_isRunning(false)
+        , m_startSuspended(false)
+        , m_startTicks(0)
+    {
+    }
+
+    // The caller must make sure that no other thread starts a call on this engine from now on. Calls already in
+    // progress are finished first.
+    ~BeepEngineInstance()
+    {
+        Stop();
+        while (m_callsInFlight.load(std::memory_order_seq_cst) != 0u)
+        {
+            Sleep(1);
+        }
+    }
+
+    // Starting an engine that is already running resumes it if it is suspended, and fails if that fails. A prewarmed
+    // engine (startSuspended) does all of its setup but leaves the device stopped until it is resumed.
+    bool Start(bool startSuspended = false)
+    {
+        std::lock_guard<std::mutex> lock(m_stateLock);
+        if (m_hAudioThread != nullptr)
+        {
+            AudioThreadData* data = EnterCall();
+            bool isStarted = data != nullptr;
+            if (data != nullptr && !startSuspended && data->IsSuspended())
+            {
+                data->SetSuspended(false, m_hAudioThread);
+                isStarted = !data->IsSuspended();
+            }
+            LeaveCall();
+            return isStarted;
+        }
+
+        LARGE_INTEGER now;
+        QueryPerformanceCounter(&now);
+        m_startTicks = now.QuadPart;
+        m_startSuspended = startSuspended;
+
+        m_hAudioThreadInitialized = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+        if (m_hAudioThreadInitialized == nullptr)
+        {
+            OutputDebugString(L"Failed to create hAudioThreadInitialized event\n");
+            return false;
+        }
+
+        m_hStopEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+        if (m_hStopEvent == nullptr)
+        {
+            OutputDebugString(L"Failed to create hStopEvent\n");
+            CloseHandle(m_hAudioThreadInitialized);
+            m_hAudioThreadInitialized = nullptr;
+            return false;
+        }
+
+        m_hAudioThread = CreateThread(nullptr, 0, AudioThreadProc, this, 0, nullptr);
+        if (m_hAudioThread == nullptr)
+        {
+            OutputDebugString(L"Failed to create hAudioThread\n");
+            CloseHandles();
+            return false;
+        }
+
+        HANDLE events[2] = { m_hAudioThread, m_hAudioThreadInitialized };
+        DWORD waitResult = WaitForMultipleObjects(2, events, FALSE, INFINITE);
+
+        if (waitResult == WAIT_OBJECT_0)
+        {
+            OutputDebugString(L"Audio thread failed to initialize\n");
+            CloseHandles();
+            return false;
+        }
+
+        m_isRunning.store(true, std::memory_order_release);
+        return true;
+    }
+
+    void Stop()
+    {
+        std::lock_guard<std::mutex> lock(m_stateLock);
+        if (m_hAudioThread == nullptr) return;
+        SetEvent(m_hStopEvent);
+        WaitForSingleObject(m_hAudioThread, INFINITE);
+        CloseHandles();
+    }
+
+    // Does not take m_stateLock, so that an event callback can call it while Stop waits for the callbacks to finish.
+    bool IsRunning() const { return m_isRunning.load(std::memory_order_acquire); }
+
+    bool Suspend()
+    {
+        std::lock_guard<std::mutex> lock(m_stateLock);
+        AudioThreadData* data = EnterCall();
+        if (data != nullptr)
+        {
+            data->SetSuspended(true, m_hAudioThread);
+        }
+        LeaveCall();
+        return data != nullptr;
+    }
+
+    bool Resume()
+    {
+        std::lock_guard<std::mutex> lock(m_stateLock);
+        AudioThreadData* data = EnterCall();
+        bool isResumed = false;
+        if (data != nullptr)
+        {
+            data->SetSuspended(false, m_hAudioThread);
+            isResumed = !data->IsSuspended();
+        }
+        LeaveCall();
+        return isResumed;
+    }
+
+    // Counts a call as in flight and returns the audio thread's data, or nullptr unless the audio thread is running.
+    // The data stays valid until the matching LeaveCall. Both orderings are sequentially consistent, so either the
+    // audio thread sees the call, or the call sees that the data has been withdrawn.
+    AudioThreadData* EnterCall()
+    {
+        m_callsInFlight.fetch_add(1u, std::memory_order_seq_cst);
+        return m_audioThreadData.load(std::memory_order_seq_cst);
+    }
+
+    void LeaveCall()
+    {
+        m_callsInFlight.fetch_sub(1u, std::memory_order_seq_cst);
+    }
+
+private:
+    HANDLE m_hAudioThread;
+    HANDLE m_hAudioThreadInitialized;
+    HANDLE m_hStopEvent;
+    std::atomic<AudioThreadData*> m_audioThreadData; // written by the audio thread, read by callers
+    std::atomic<UINT32> m_callsInFlight;
+    std::mutex m_stateLock; // start, stop, suspend and resume
+    std::atomic<bool> m_isRunning; // started and not yet stopped, for callers that do not hold m_stateLock
+    bool m_startSuspended;
+    LONGLONG m_startTicks;
+
+    void CloseHandles()
+    {
+        m_isRunning.store(false, std::memory_order_release);
+        if (m_hAudioThread != nullptr) { CloseHandle(m_hAudioThread); m_hAudioThread = nullptr; }
+        if (m_hStopEvent != nullptr) { CloseHandle(m_hStopEvent); m_hStopEvent = nullptr; }
+        if (m_hAudioThreadInitialized != nullptr) { CloseHandle(m_hAudioThreadInitialized); m_hAudioThreadInitialized = nullptr; }
+    }
+
+    static DWORD WINAPI AudioThreadProc(LPVOID arg)
+    {
+        BeepEngineInstance* engine = static_cast<BeepEngineInstance*>(arg);
+        AudioThreadData a(2048, engine->m_hStopEvent);
+
+        if (a.Initialize())
+        {
+            engine->m_audioThreadData.store(&a, std::memory_order_seq_cst);
+            a.RunLoop(engine->m_startSuspended, engine->m_startTicks, engine->m_hAudioThreadInitialized);
+            engine->m_audioThreadData.store(nullptr, std::memory_order_seq_cst);
+
+            // a is destroyed on return, so calls that found it must be done with it first
+            while (engine->m_callsInFlight.load(std::memory_order_seq_cst) != 0u)
+            {
+                a.ReleaseCallers();
+                Sleep(1);
+            }
+            return 0;
+        }
+        else
+        {
+            return 1;
+        }
+    }
+};
+
+// The default engine is never destroyed, so that nothing has to wait for its thread while the process is exiting.
+static BeepEngineInstance* DefaultEngine()
+{
+    static BeepEngineInstance* engine = new BeepEngineInstance();
+    return engine;
+}
+
+// One call into an engine. Data() is nullptr unless the engine is running, and stays valid for as long as the
+// EngineCall exists.
+class EngineCall
+{
+public:
+    EngineCall(BeepEngineHandle engine)
+        : m_engine(static_cast<BeepEngineInstance*>(engine))
+        , m_data((engine != nullptr) ? m_engine->EnterCall() : nullptr)
+    {
+    }
+
+    ~EngineCall()
+    {
+        if (m_engine != nullptr) m_engine->LeaveCall();
+    }
+
+    AudioThreadData* Data() const { return m_data; }
+
+    EngineCall(const EngineCall&) = delete;
+    EngineCall& operator=(const EngineCall&) = delete;
+
+private:
+    BeepEngineInstance* const m_engine;
+    AudioThreadData* const m_data;
+};
+
+extern "C" __declspec(dllexport) BeepEngineHandle BeepEngineCreateInstance()
+{
+    std::unique_ptr<BeepEngineInstance> engine(new BeepEngineInstance());
+    if (engine == nullptr) return nullptr;
+    if (!engine->Start()) return nullptr;
+    return static_cast<BeepEngineHandle>(engine.release());
+}
+
+extern "C" __declspec(dllexport) BeepEngineHandle BeepEngineCreateSuspendedInstance()
+{
+    std::unique_ptr<BeepEngineInstance> engine(new BeepEngineInstance());
+    if (engine == nullptr) return nullptr;
+    if (!engine->Start(true)) return nullptr;
+    return static_cast<BeepEngineHandle>(engine.release());
+}
+
+extern "C" __declspec(dllexport) void BeepEngineDestroyInstance(BeepEngineHandle engine)
+{
+    if (engine == nullptr || engine == DefaultEngine()) return;
+    delete static_cast<BeepEngineInstance*>(engine);
+}
+
+extern "C" __declspec(dllexport) BeepEngineHandle BeepEngineGetDefaultInstance()
+{
+    return static_cast<BeepEngineHandle>(DefaultEngine());
+}
+
+extern "C" __declspec(dllexport) bool StartBeepEngine()
+{
+    return DefaultEngine()->Start();
+}
+
+extern "C" __declspec(dllexport) void StopBeepEngine()
+{
+    DefaultEngine()->Stop();
+}
+
+extern "C" __declspec(dllexport) bool IsBeepEngineRunning()
+{
+    return DefaultEngine()->IsRunning();
+}
+
+extern "C" __declspec(dllexport) bool BeepEnginePrewarm()
+{
+    return DefaultEngine()->Start(true);
+}
+
+extern "C" __declspec(dllexport) bool BeepEngineInstanceSuspend(BeepEngineHandle engine)
+{
+    if (engine == nullptr) return false;
+    return static_cast<BeepEngineInstance*>(engine)->Suspend();
+}
+
+extern "C" __declspec(dllexport) bool BeepEngineSuspend()
+{
+    return BeepEngineInstanceSuspend(DefaultEngine());
+}
+
+extern "C" __declspec(dllexport) bool BeepEngineInstanceResume(BeepEngineHandle engine)
+{
+    if (engine == nullptr) return false;
+    return static_cast<BeepEngineInstance*>(engine)->Resume();
+}
+
+extern "C" __declspec(dllexport) bool BeepEngineResume()
+{
+    return BeepEngineInstanceResume(DefaultEngine());
+}
+
+extern "C" __declspec(dllexport) bool BeepEngineInstanceIsSuspended(BeepEngineHandle engine)
+{
+    EngineCall call(engine);
+    AudioThreadData* data = call.Data();
+    if (data == nullptr) return false;
+    return data->IsSuspended();
+}
+
+extern "C" __declspec(dllexport) bool BeepEngineIsSuspended()
+{
+    return BeepEngineInstanceIsSuspended(DefaultEngine());
+}
+
+extern "C" __declspec(dllexport) void BeepEngineInstanceGetTimeToFirstSample(BeepEngineHandle engine, double* pColdMicroseconds, double* pWarmMicroseconds)
+{
+    EngineCall call(engine);
+    AudioThreadData* data = call.Data();
+    if (data == nullptr)
+    {
+        if (pColdMicroseconds != nullptr) *pColdMicroseconds = 0.0;
+        if (pWarmMicroseconds != nullptr) *pWarmMicroseconds = 0.0;
+        return;
+    }
+    data->GetTimeToFirstSample(pColdMicroseconds, pWarmMicroseconds);
+}
+
+extern "C" __declspec(dllexport) void BeepEngineGetTimeToFirstSample(double* pColdMicroseconds, double* pWarmMicroseconds)
+{
+    BeepEngineInstanceGetTimeToFirstSample(DefaultEngine(), pColdMicroseconds, pWarmMicroseconds);
+}
+
+// BeepEngineBeep returns once the note has played, so that calls in a row play in turn; the event that marks the end
+// of the note uses an id reserved for it.
+extern "C" __declspec(dllexport) void BeepEngineInstanceBeep(BeepEngineHandle engine, float frequency, float duration)
+{
+    const UINT32 eventId = 0xFFFFEA8Bu;
+    EngineCall call(engine);
+    AudioThreadData* data = call.Data();
+	if (data == nullptr) return;
+	std::vector<std::unique_ptr<AudioBeepCommand>> commands;
+	commands.push_back(std::unique_ptr<AudioBeepCommand>(new AudioBeepCommand_Beep(0.0f, frequency, 0.125f, duration)));
+    commands.push_back(std::unique_ptr<AudioBeepCommand>(new AudioBeepCommand_Event(duration, eventId)));
+
+	data->ScheduleBeeps(std::move(commands));
+    data->WaitForEvents(&eventId, 1u, INFINITE, nullptr);
+}
+
+extern "C" __declspec(dllexport) void BeepEngineBeep(float frequency, float duration)
+{
+    BeepEngineInstanceBeep(DefaultEngine(), frequency, duration);
+}
+
+extern "C" __declspec(dllexport) void BeepEngineInstanceBeepAsync(BeepEngineHandle engine, float frequency, float duration)
+{
+    EngineCall call(engine);
+    AudioThreadData* data = call.Data();
+	if (data == nullptr) return;
+	std::vector<std::unique_ptr<AudioBeepCommand>> commands;
+	commands.push_back(std::unique_ptr<AudioBeepCommand>(new AudioBeepCommand_Beep(0.0f, frequency, 0.125f, duration)));
+
+	data->ScheduleBeeps(std::move(commands));
+}
+
+extern "C" __declspec(dllexport) void BeepEngineBeepAsync(float frequency, float duration)
+{
+    BeepEngineInstanceBeepAsync(DefaultEngine(), frequency, duration);
+}
+
+class ScoreBuilder
+{
+public:
+    ScoreBuilder()
+        : m_commands()
+    {
+    }
+
+    void AddNote(float startTime, float frequency, float amplitude, float duration, INT32 priority = 0)
+    {
+        m_commands.push_back
+        (
+            std::unique_ptr<AudioBeepCommand>
+            (
+                new AudioBeepCommand_Beep(startTime, frequency, amplitude, duration, priority)
+            )
+        );
+    }
+
+    void AddPartial(float startTime, float frequency, float amplitude, float duration)
+    {
+        m_commands.push_back
+        (
+            std::unique_ptr<AudioBeepCommand>
+            (
+                new AudioBeepCommand_Partial(startTime, frequency, amplitude, duration)
+            )
+        );
+    }
+
+    void AddEvent(float time, UINT32 eventId)
+    {
+        m_commands.push_back
+        (
+            std::unique_ptr<AudioBeepCommand>
+            (
+                new AudioBeepCommand_Event(time, eventId)
+            )
+        );
+    }
+
+    // Samples are not saved in score files.
+    void AddSample(float startTime, std::shared_ptr<SampleBank> const & bank, UINT32 sampleIndex, float pitch, float gain, INT32 priority)
+    {
+        m_commands.push_back
+        (
+            std::unique_ptr<AudioBeepCommand>
+            (
+                new AudioBeepCommand_Sample(startTime, bank, sampleIndex, pitch, gain, priority)
+            )
+        );
+    }
+
+    // Fixed engine times are not saved in score files.
+    void AddNoteAtSample(UINT64 startSample, float frequency, float amplitude, UINT32 durationSamples, INT32 priority)
+    {
+        m_commands.push_back
+        (
+            std::unique_ptr<AudioBeepCommand>
+            (
+                new AudioBeepCommand_BeepAtSample(startSample, frequency, amplitude, durationSamples, priority)
+            )
+        );
+    }
+
+    void AddEventAtSample(UINT64 sample, UINT32 eventId)
+    {
+        m_commands.push_back
+        (
+            std::unique_ptr<AudioBeepCommand>
+            (
+                new AudioBeepCommand_EventAtSample(sample, eventId)
+            )
+        );
+    }
+
+    bool IsEmpty() const { return m_commands.empty(); }
+
+    void Clear() { m_commands.clear(); }
+
+    // Writes the score in the binary score file format, sorted by start time.
+    bool SaveToFile(const wchar_t* path) const
+    {
+        std::vector<BeepScoreFileRecord> records;
+        records.reserve(m_commands.size());
+        for (std::vector<std::unique_ptr<AudioBeepCommand>>::const_iterator it = m_commands.cbegin(); it != m_commands.cend(); ++it)
+        {
+            BeepScoreFileRecord record;
+            memset(&record, 0, sizeof(record));
+
+            if (AudioBeepCommand_Beep* beep = dynamic_cast<AudioBeepCommand_Beep*>(it->get()))
+            {
+                record.startTime = beep->EventStartTimeSeconds();
+                record.kind = BeepScoreRecordKind_Note;
+                record.frequency = beep->FrequencyHz();
+                record.amplitude = beep->Amplitude();
+                record.duration = beep->DurationSeconds();
+            }
+            else if (AudioBeepCommand_Partial* partial = dynamic_cast<AudioBeepCommand_Partial*>(it->get()))
+            {
+                record.startTime = partial->EventStartTimeSeconds();
+                record.kind = BeepScoreRecordKind_Partial;
+                record.frequency = partial->FrequencyHz();
+                record.amplitude = partial->Amplitude();
+                record.duration = partial->DurationSeconds();
+            }
+            else if (AudioBeepCommand_Event* event = dynamic_cast<AudioBeepCommand_Event*>(it->get()))
+            {
+                record.startTime = event->EventStartTimeSeconds();
+                record.kind = BeepScoreRecordKind_Event;
+                record.eventId = event->EventId();
+            }
+            else
+            {
+                continue;
+            }
+            records.push_back(record);
+        }
+
+        std::stable_sort
+        (
+            records.begin(), records.end(),
+            [](BeepScoreFileRecord const& a, BeepScoreFileRecord const& b) { return a.startTime < b.startTime; }
+        );
+
+        BeepScoreFileHeader header;
+        memcpy(header.magic, BEEP_SCORE_FILE_MAGIC, sizeof(header.magic));
+        header.version = BEEP_SCORE_FILE_VERSION;
+        header.recordSize = sizeof(BeepScoreFileRecord);
+        header.recordCount = records.size();
+
+        HANDLE hFile = CreateFile(path, GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (hFile == INVALID_HANDLE_VALUE) return false;
+
+        DWORD written = 0;
+        bool ok = WriteFile(hFile, &header, sizeof(header), &written, nullptr) && written == sizeof(header);
+        const BYTE* data = reinterpret_cast<const BYTE*>(records.data());
+        size_t remaining = records.size() * sizeof(BeepScoreFileRecord);
+        while (ok && remaining > 0)
+        {
+            DWORD chunk = static_cast<DWORD>(min(remaining, static_cast<size_t>(1u << 30)));
+            ok = WriteFile(hFile, data, chunk, &written, nullptr) && written == chunk;
+            data += chunk;
+            remaining -= chunk;
+        }
+
+        CloseHandle(hFile);
+        return ok;
+    }
+
+    std::vector<std::unique_ptr<AudioBeepCommand>> const & Commands() const { return m_commands; }
+
+    std::vector<std::unique_ptr<AudioBeepCommand>> TakeCommands()
+    {
+        std::vector<std::unique_ptr<AudioBeepCommand>> result;
+        std::swap(result, m_commands);
+        return result;
+    }
+
+private:
+    std::vector<std::unique_ptr<AudioBeepCommand>> m_commands;
+};
+
+// Renders a score to memory without the audio device. The timeline is cut into segments that are rendered in
+// parallel. Every note that overlaps a segment is listed for it along with the phase it has reached at the segment's
+// start, and each segment adds its notes in score order. Every output sample is therefore the same sum, in the same
+// order, however the timeline is divided, so a parallel render matches a serial one exactly.
+
+class OfflineRenderer
+{
+public:
+    OfflineRenderer(UINT32 sampleRate)
+        : m_sampleRate(sampleRate)
+        , m_notes()
+        , m_segmentSize(0u)
+        , m_segmentCount(0u)
+        , m_segmentNotes()
+        , m_dest(nullptr)
+        , m_renderStart(0u)
+        , m_sampleCount(0u)
+        , m_sounding()
+        , m_nextNote(0u)
+        , m_sweepPosition(0u)
+        , m_workers()
+        , m_areWorkersStarted(false)
+    {
+    }
+
+    void Load(ScoreBuilder const & score)
+    {
+        std::vector<std::unique_ptr<AudioBeepCommand>> const & commands = score.Commands();
+        for (std::vector<std::unique_ptr<AudioBeepCommand>>::const_iterator it = commands.cbegin(); it != commands.cend(); ++it)
+        {
+            ArenaPtr<BeepCommand> command = (*it)->CreateCommand(nullptr, m_sampleRate, 0u);
+            BeepCommand_Beep* beep = dynamic_cast<BeepCommand_Beep*>(command.get());
+            if (beep != nullptr && beep->DurationSamples() != 0)
+            {
+                m_notes.push_back(Note(beep->EventStartTimeSamples(), beep->DurationSamples(), beep->FrequencyRadiansPerSample(), beep->Amplitude()));
+            }
+        }
+
+        std::stable_sort(m_notes.begin(), m_notes.end(), [](Note const& a, Note const& b) { return a.start < b.start; });
+    }
+
+    UINT64 LengthSamples() const
+    {
+        UINT64 length = 0u;
+        for (std::vector<Note>::const_iterator it = m_notes.cbegin(); it != m_notes.cend(); ++it)
+        {
+            length = max(length, it->start + it->duration);
+        }
+        return length;
+    }
+
+    bool Render(float* dest, UINT64 sampleCount, UINT32 threadCount)
+    {
+        return RenderRange(dest, 0u, sampleCount, threadCount);
+    }
+
+    // renders samples [startSample, startSample + sampleCount) of the score into dest; a caller that renders a score
+    // range by range, in order, gets the same worker threads each time and has each note looked at once
+    bool RenderRange(float* dest, UINT64 startSample, UINT64 sampleCount, UINT32 threadCount)
+    {
+        if (threadCount == 0)
+        {
+            SYSTEM_INFO systemInfo;
+            GetSystemInfo(&systemInfo);
+            threadCount = max(systemInfo.dwNumberOfProcessors, 1ul);
+        }
+
+        m_dest = dest;
+        m_renderStart = startSample;
+        m_sampleCount = sampleCount;
+        m_segmentSize = max(MIN_SEGMENT_SIZE, (sampleCount + threadCount * 4u - 1u) / (threadCount * 4u));
+        m_segmentCount = (sampleCount + m_segmentSize - 1u) / m_segmentSize;
+        AssignNotesToSegments();
+
+        // started for the first range, which is the longest when a score is rendered in chunks
+        if (!m_areWorkersStarted)
+        {
+            UINT64 workerCount = min(static_cast<UINT64>(threadCount), m_segmentCount);
+            m_workers.Start(static_cast<int>(workerCount));
+            m_areWorkersStarted = true;
+        }
+
+        m_workers.Run((int)m_segmentCount, 1, [this](int begin, int end)
+        {
+            for (int segment = begin; segment < end; ++segment)
+            {
+                RenderSegment((UINT64)segment);
+            }
+        });
+
+        return true;
+    }
+
+private:
+    static constexpr UINT64 MIN_SEGMENT_SIZE = 65536u;
+
+    class Note
+    {
+    public:
+        Note(UINT64 start, UINT32 duration, float frequencyRadiansPerSample, float amplitude)
+            : start(start)
+            , duration(duration)
+            , frequencyRadiansPerSample(frequencyRadiansPerSample)
+            , amplitude(amplitude)
+        {
+        }
+
+        UINT64 start;
+        UINT32 duration;
+        float frequencyRadiansPerSample;
+        float amplitude;
+    };
+
+    const UINT32 m_sampleRate;
+    std::vector<Note> m_notes;
+    UINT64 m_segmentSize;
+    UINT64 m_segmentCount;
+    std::vector<std::vector<UINT32>> m_segmentNotes;
+    float* m_dest;
+    UINT64 m_renderStart;
+    UINT64 m_sampleCount;
+
+    // the notes that start before m_sweepPosition and may still be sounding there, in score order, and the first note
+    // that starts at or after it
+    std::vector<UINT32> m_sounding;
+    UINT32 m_nextNote;
+    UINT64 m_sweepPosition;
+
+    WorkerGroup m_workers;
+    bool m_areWorkersStarted;
+
+    // moves the sweep to m_renderStart; a range that starts before the previous one starts the sweep over
+    void SweepToRenderStart()
+    {
+        if (m_renderStart < m_sweepPosition)
+        {
+            m_sounding.clear();
+            m_nextNote = 0u;
+        }
+
+        while (m_nextNote < m_notes.size() && m_notes[m_nextNote].start < m_renderStart)
+        {
+            m_sounding.push_back(m_nextNote);
+            ++m_nextNote;
+        }
+
+        m_sounding.erase(std::remove_if(m_sounding.begin(), m_sounding.end(), [this](UINT32 i)
+        {
+            return m_notes[i].start + m_notes[i].duration <= m_renderStart;
+        }), m_sounding.end());
+        m_sweepPosition = m_renderStart;
+    }
+
+    void AssignNote(UINT32 i)
+    {
+        Note const & note = m_notes[i];
+        UINT64 first = (max(note.start, m_renderStart) - m_renderStart) / m_segmentSize;
+        UINT64 last = min(note.start + note.duration - m_renderStart - 1u, m_sampleCount - 1u) / m_segmentSize;
+        for (UINT64 segment = first; segment <= last; ++segment)
+        {
+            m_segmentNotes[static_cast<size_t>(segment)].push_back(i);
+        }
+    }
+
+    void AssignNotesToSegments()
+    {
+        m_segmentNotes.assign(static_cast<size_t>(m_segmentCount), std::vector<UINT32>());
+        SweepToRenderStart();
+
+        // every sounding note comes before m_nextNote in score order, so each segment still lists its notes in order
+        for (std::vector<UINT32>::const_iterator it = m_sounding.cbegin(); it != m_sounding.cend(); ++it)
+        {
+            AssignNote(*it);
+        }
+        for (UINT32 i = m_nextNote; i < m_notes.size(); ++i)
+        {
+            if (m_notes[i].start >= m_renderStart + m_sampleCount) break;
+            AssignNote(i);
+        }
+    }
+
+    void RenderSegment(UINT64 segment)
+    {
+        UINT64 segmentStart = segment * m_segmentSize;
+        UINT64 segmentEnd = min(segmentStart + m_segmentSize, m_sampleCount);
+        std::fill(m_dest + segmentStart, m_dest + segmentEnd, 0.0f);
+
+        // from here on, positions are in score time
+        float* dest = m_dest - m_renderStart;
+        segmentStart += m_renderStart;
+        segmentEnd += m_renderStart;
+
+        std::vector<UINT32> const & notes = m_segmentNotes[static_cast<size_t>(segment)];
+        for (std::vector<UINT32>::const_iterator it = notes.cbegin(); it != notes.cend(); ++it)
+        {
+            Note const & note = m_notes[*it];
+            UINT64 from = max(segmentStart, note.start);
+            UINT64 to = min(segmentEnd, note.start + note.duration);
+            if (from >= to) continue;
+
+            // the phase a note has reached at the segment boundary is just how long it has been playing
+            UINT32 phase = static_cast<UINT32>(from - note.start);
+            AddSineWave(dest + from, static_cast<UINT32>(to - from), note.frequencyRadiansPerSample, note.amplitude, phase);
+        }
+    }
+};
+
+std::unique_ptr<ScoreBuilder> g_beepCommands;
+
+extern "C" __declspec(dllexport) void BeepEngineClearBuffer()
+{
+    g_beepCommands = std::unique_ptr<ScoreBuilder>(new ScoreBuilder());
+}
+
+extern "C" __declspec(dllexport) void BeepEngineAddNoteToBuffer(float startTime, float frequency, float amplitude, float duration)
+{
+	if (g_beepCommands == nullptr) BeepEngineClearBuffer();
+    g_beepCommands->AddNote(startTime, frequency, amplitude, duration);
+}
+
+extern "C" __declspec(dllexport) void BeepEngineAddPartialToBuffer(float startTime, float frequency, float amplitude, float duration)
+{
+	if (g_beepCommands == nullptr) BeepEngineClearBuffer();
+    g_beepCommands->AddPartial(startTime, frequency, amplitude, duration);
+}
+
+extern "C" __declspec(dllexport) void BeepEngineAddEventToBuffer(float time, UINT32 eventId)
+{
+	if (g_beepCommands == nullptr) BeepEngineClearBuffer();
+	g_beepCommands->AddEvent(time, eventId);
+}
+
+extern "C" __declspec(dllexport) void BeepEngineStartPlayBuffer()
+{
+    EngineCall call(DefaultEngine());
+	if (call.Data() == nullptr) return;
+	if (g_beepCommands == nullptr) return;
+    if (g_beepCommands->IsEmpty()) return;
+
+	call.Data()->ScheduleBeeps(g_beepCommands->TakeCommands());
+	g_beepCommands = nullptr;
+}
+
+extern "C" __declspec(dllexport) bool BeepEngineWaitForEvent(UINT32 eventId)
+{
+    return BeepEngineWaitForEventTimeout(eventId, INFINITE) == BeepEventStatus_Occurred;
+}
+
+extern "C" __declspec(dllexport) BeepEventStatus BeepEngineInstanceWaitForEventTimeout(BeepEngineHandle engine, UINT32 eventId, UINT32 timeoutMilliseconds)
+{
+    EngineCall call(engine);
+    AudioThreadData* data = call.Data();
+    if (data == nullptr) return BeepEventStatus_EngineStopped;
+    return data->WaitForEvents(&eventId, 1u, timeoutMilliseconds, nullptr);
+}
+
+extern "C" __declspec(dllexport) BeepEventStatus BeepEngineWaitForEventTimeout(UINT32 eventId, UINT32 timeoutMilliseconds)
+{
+    return BeepEngineInstanceWaitForEventTimeout(DefaultEngine(), eventId, timeoutMilliseconds);
+}
+
+extern "C" __declspec(dllexport) BeepEventStatus BeepEngineInstanceWaitForAnyEvent(BeepEngineHandle engine, const UINT32* eventIds, UINT32 count, UINT32 timeoutMilliseconds, UINT32* pEventId)
+{
+    EngineCall call(engine);
+    AudioThreadData* data = call.Data();
+    if (data == nullptr) return BeepEventStatus_EngineStopped;
+    if (eventIds == nullptr || count == 0) return BeepEventStatus_NotScheduled;
+    return data->WaitForEvents(eventIds, count, timeoutMilliseconds, pEventId);
+}
+
+extern "C" __declspec(dllexport) BeepEventStatus BeepEngineWaitForAnyEvent(const UINT32* eventIds, UINT32 count, UINT32 timeoutMilliseconds, UINT32* pEventId)
+{
+    return BeepEngineInstanceWaitForAnyEvent(DefaultEngine(), eventIds, count, timeoutMilliseconds, pEventId);
+}
+
+extern "C" __declspec(dllexport) void BeepEngineInstanceWatchEvent(BeepEngineHandle engine, UINT32 eventId)
+{
+    EngineCall call(engine);
+    AudioThreadData* data = call.Data();
+    if (data == nullptr) return;
+    data->WatchEvent(eventId);
+}
+
+extern "C" __declspec(dllexport) void BeepEngineWatchEvent(UINT32 eventId)
+{
+    BeepEngineInstanceWatchEvent(DefaultEngine(), eventId);
+}
+
+extern "C" __declspec(dllexport) bool BeepEngineInstanceGetCompletedEvent(BeepEngineHandle engine, UINT32* pEventId, BeepEventStatus* pStatus)
+{
+    EngineCall call(engine);
+    AudioThreadData* data = call.Data();
+    if (data == nullptr) return false;
+    return data->GetCompletedEvent(pEventId, pStatus);
+}
+
+extern "C" __declspec(dllexport) bool BeepEngineGetCompletedEvent(UINT32* pEventId, BeepEventStatus* pStatus)
+{
+    return BeepEngineInstanceGetCompletedEvent(DefaultEngine(), pEventId, pStatus);
+}
+
+extern "C" __declspec(dllexport) void BeepEngineInstanceSetEventCallback(BeepEngineHandle engine, BeepEventCallback callback, void* context)
+{
+    EngineCall call(engine);
+    AudioThreadData* data = call.Data();
+    if (data == nullptr) return;
+    data->SetEventCallback(callback, context);
+}
+
+extern "C" __declspec(dllexport) void BeepEngineSetEventCallback(BeepEventCallback callback, void* context)
+{
+    BeepEngineInstanceSetEventCallback(DefaultEngine(), callback, context);
+}
+
+// Score handles are independent of each other and of the buffer above, so each producer thread can fill its own
+// without locking. A handle must not be used from two threads at the same time.
+
+extern "C" __declspec(dllexport) BeepScoreHandle BeepEngineCreateScore()
+{
+    return static_cast<BeepScoreHandle>(new ScoreBuilder());
+}
+
+extern "C" __declspec(dllexport) void BeepEngineScoreAddNote(BeepScoreHandle score, float startTime, float frequency, float amplitude, float duration)
+{
+    if (score == nullptr) return;
+    static_cast<ScoreBuilder*>(score)->AddNote(startTime, frequency, amplitude, duration);
+}
+
+extern "C" __declspec(dllexport) void BeepEngineScoreAddNoteAtSample(BeepScoreHandle score, UINT64 startSample, float frequency, float amplitude, UINT32 durationSamples, INT32 priority)
+{
+    if (score == nullptr) return;
+    static_cast<ScoreBuilder*>(score)->AddNoteAtSample(startSample, frequency, amplitude, durationSamples, priority);
+}
+
+extern "C" __declspec(dllexport) void BeepEngineScoreAddEventAtSample(BeepScoreHandle score, UINT64 sample, UINT32 eventId)
+{
+    if (score == nullptr) return;
+    static_cast<ScoreBuilder*>(score)->AddEventAtSample(sample, eventId);
+}
+
+extern "C" __declspec(dllexport) void BeepEngineScoreAddNoteWithPriority(BeepScoreHandle score, float startTime, float frequency, float amplitude, float duration, INT32 priority)
+{
+    if (score == nullptr) return;
+    static_cast<ScoreBuilder*>(score)->AddNote(startTime, frequency, amplitude, duration, priority);
+}
+
+extern "C" __declspec(dllexport) void BeepEngineScoreAddPartial(BeepScoreHandle score, float startTime, float frequency, float amplitude, float duration)
+{
+    if (score == nullptr) return;
+    static_cast<ScoreBuilder*>(score)->AddPartial(startTime, frequency, amplitude, duration);
+}
+
+extern "C" __declspec(dllexport) void BeepEngineScoreAddEvent(BeepScoreHandle score, float time, UINT32 eventId)
+{
+    if (score == nullptr) return;
+    static_cast<ScoreBuilder*>(score)->AddEvent(time, eventId);
+}
+
+extern "C" __declspec(dllexport) BeepSampleBankHandle BeepEngineOpenSampleBank(const wchar_t* path)
+{
+    try
+    {
+        std::shared_ptr<SampleBank> bank(new SampleBank());
+        if (bank == nullptr) return nullptr;
+        if (!bank->Open(path))
+        {
+            OutputDebugString(L"Failed to open sample bank\n");
+            return nullptr;
+        }
+        return static_cast<BeepSampleBankHandle>(new std::shared_ptr<SampleBank>(bank));
+    }
+    catch (std::bad_alloc const &)
+    {
+        return nullptr;
+    }
+}
+
+// Notes already added to scores keep the bank open until they are done with it.
+extern "C" __declspec(dllexport) void BeepEngineCloseSampleBank(BeepSampleBankHandle bank)
+{
+    if (bank == nullptr) return;
+    delete static_cast<std::shared_ptr<SampleBank>*>(bank);
+}
+
+extern "C" __declspec(dllexport) UINT32 BeepEngineSampleBankGetCount(BeepSampleBankHandle bank)
+{
+    if (bank == nullptr) return 0u;
+    return (*static_cast<std::shared_ptr<SampleBank>*>(bank))->Count();
+}
+
+extern "C" __declspec(dllexport) bool BeepEngineSampleBankGetInfo(BeepSampleBankHandle bank, UINT32 sampleIndex, UINT32* pFrameCount, UINT32* pSampleRate)
+{
+    if (bank == nullptr) return false;
+    std::shared_ptr<SampleBank> const & sampleBank = *static_cast<std::shared_ptr<SampleBank>*>(bank);
+    if (sampleIndex >= sampleBank->Count()) return false;
+    if (pFrameCount != nullptr) *pFrameCount = sampleBank->FrameCount(sampleIndex);
+    if (pSampleRate != nullptr) *pSampleRate = sampleBank->SampleRate(sampleIndex);
+    return true;
+}
+
+extern "C" __declspec(dllexport) bool BeepEngineSaveSampleBank(const wchar_t* path, const float* const* samples, const UINT32* frameCounts, const UINT32* sampleRates, UINT32 count)
+{
+    if (count != 0u && (samples == nullptr || frameCounts == nullptr || sampleRates == nullptr)) return false;
+    for (UINT32 i = 0; i < count; ++i)
+    {
+        if (sampleRates[i] == 0u || (frameCounts[i] != 0u && samples[i] == nullptr)) return false;
+    }
+    return SampleBank::Save(path, samples, frameCounts, sampleRates, count);
+}
+
+// Below this pitch a long sample would play for longer than a voice can count.
+const float MIN_SAMPLE_PITCH = 1.0f / 256.0f;
+
+extern "C" __declspec(dllexport) void BeepEngineScoreAddSample(BeepScoreHandle score, float startTime, BeepSampleBankHandle bank, UINT32 sampleIndex, float pitch, float gain, INT32 priority)
+{
+    if (score == nullptr || bank == nullptr) return;
+    std::shared_ptr<SampleBank> const & sampleBank = *static_cast<std::shared_ptr<SampleBank>*>(bank);
+    if (sampleIndex >= sampleBank->Count() || !(pitch >= MIN_SAMPLE_PITCH) || !std::isfinite(pitch)) return;
+    if (!sampleBank->Prefetch(sampleIndex))
+    {
+        OutputDebugString(L"Sample could not be read from its bank\n");
+        return;
+    }
+    static_cast<ScoreBuilder*>(score)->AddSample(startTime, sampleBank, sampleIndex, pitch, gain, priority);
+}
+
+extern "C" __declspec(dllexport) void BeepEngineScoreClear(BeepScoreHandle score)
+{
+    if (score == nullptr) return;
+    static_cast<ScoreBuilder*>(score)->Clear();
+}
+
+extern "C" __declspec(dllexport) bool BeepEngineInstanceScoreSubmit(BeepEngineHandle engine, BeepScoreHandle score)
+{
+    EngineCall call(engine);
+    AudioThreadData* data = call.Data();
+    if (score == nullptr) return false;
+    if (data == nullptr) return false;
+    ScoreBuilder* builder = static_cast<ScoreBuilder*>(score);
+    if (builder->IsEmpty()) return true;
+
+    data->ScheduleBeeps(builder->TakeCommands());
+    return true;
+}
+
+extern "C" __declspec(dllexport) bool BeepEngineScoreSubmit(BeepScoreHandle score)
+{
+    return BeepEngineInstanceScoreSubmit(DefaultEngine(), score);
+}
+
+extern "C" __declspec(dllexport) bool BeepEngineInstanceScoreSubmitToGroup(BeepEngineHandle engine, BeepScoreHandle score, UINT32 group)
+{
+    EngineCall call(engine);
+    AudioThreadData* data = call.Data();
+    if (score == nullptr) return false;
+    if (data == nullptr) return false;
+    ScoreBuilder* builder = static_cast<ScoreBuilder*>(score);
+    if (builder->IsEmpty()) return true;
+
+    data->ScheduleBeeps(builder->TakeCommands(), group);
+    return true;
+}
+
+extern "C" __declspec(dllexport) bool BeepEngineScoreSubmitToGroup(BeepScoreHandle score, UINT32 group)
+{
+    return BeepEngineInstanceScoreSubmitToGroup(DefaultEngine(), score, group);
+}
+
+extern "C" __declspec(dllexport) bool BeepEngineInstanceScoreSubmitLoop(BeepEngineHandle engine, BeepScoreHandle score, float periodSeconds, UINT32 repeatCount, UINT32 group)
+{
+    EngineCall call(engine);
+    AudioThreadData* data = call.Data();
+    if (score == nullptr) return false;
+    if (data == nullptr) return false;
+    if (!(periodSeconds > 0.0f) || !std::isfinite(periodSeconds)) return false;
+
+    // nothing could ever stop it
+    if (group == 0u && repeatCount == 0u) return false;
+
+    ScoreBuilder* builder = static_cast<ScoreBuilder*>(score);
+    if (builder->IsEmpty()) return true;
+
+    data->ScheduleLoop(std::unique_ptr<BeepLoopPattern>(new BeepLoopPattern(builder->TakeCommands(), periodSeconds, repeatCount)), group);
+    return true;
+}
+
+extern "C" __declspec(dllexport) bool BeepEngineScoreSubmitLoop(BeepScoreHandle score, float periodSeconds, UINT32 repeatCount, UINT32 group)
+{
+    return BeepEngineInstanceScoreSubmitLoop(DefaultEngine(), score, periodSeconds, repeatCount, group);
+}
+
+extern "C" __declspec(dllexport) void BeepEngineInstanceCancelGroup(BeepEngineHandle engine, UINT32 group)
+{
+    EngineCall call(engine);
+    AudioThreadData* data = call.Data();
+    if (data == nullptr) return;
+    data->CancelGroup(group);
+}
+
+extern "C" __declspec(dllexport) void BeepEngineCancelGroup(UINT32 group)
+{
+    BeepEngineInstanceCancelGroup(DefaultEngine(), group);
+}
+
+extern "C" __declspec(dllexport) void BeepEngineDestroyScore(BeepScoreHandle score)
+{
+    delete static_cast<ScoreBuilder*>(score);
+}
+
+extern "C" __declspec(dllexport) void BeepEngineInstanceSetRenderWorkers(BeepEngineHandle engine, UINT32 workerCount, UINT32 minVoicesPerChunk)
+{
+    EngineCall call(engine);
+    AudioThreadData* data = call.Data();
+    if (data == nullptr) return;
+    data->SetRenderWorkers(workerCount, minVoicesPerChunk);
+}
+
+extern "C" __declspec(dllexport) void BeepEngineSetRenderWorkers(UINT32 workerCount, UINT32 minVoicesPerChunk)
+{
+    BeepEngineInstanceSetRenderWorkers(DefaultEngine(), workerCount, minVoicesPerChunk);
+}
+
+extern "C" __declspec(dllexport) void BeepEngineInstanceSetNoteCacheBudget(BeepEngineHandle engine, UINT64 budgetBytes)
+{
+    EngineCall call(engine);
+    AudioThreadData* data = call.Data();
+    if (data == nullptr) return;
+    data->SetNoteCacheBudget(budgetBytes);
+}
+
+extern "C" __declspec(dllexport) void BeepEngineSetNoteCacheBudget(UINT64 budgetBytes)
+{
+    BeepEngineInstanceSetNoteCacheBudget(DefaultEngine(), budgetBytes);
+}
+
+extern "C" __declspec(dllexport) bool BeepEngineInstanceGetClock(BeepEngineHandle engine, UINT64* pRenderPosition, UINT64* pPlayPosition, UINT32* pSampleRate)
+{
+    EngineCall call(engine);
+    AudioThreadData* data = call.Data();
+    if (data == nullptr) return false;
+    data->GetClock(pRenderPosition, pPlayPosition);
+    if (pSampleRate != nullptr) *pSampleRate = data->GetSampleRate();
+    return true;
+}
+
+extern "C" __declspec(dllexport) bool BeepEngineGetClock(UINT64* pRenderPosition, UINT64* pPlayPosition, UINT32* pSampleRate)
+{
+    return BeepEngineInstanceGetClock(DefaultEngine(), pRenderPosition, pPlayPosition, pSampleRate);
+}
 
-			case WAIT_OBJECT_0 + 3:
-                RenderToBuffer(m_buffer2.get());
-				hr = SubmitBuffer(m_buffer2.get());
-                if (FAILED(hr))
-                {
-					OutputDebugString(L"Failed to submit buffer\n");
-					Stop();
-					return;
-                }
-                break;
-            }
-        }
-    }
+extern "C" __declspec(dllexport) bool BeepEngineInstanceSetPolyphony(BeepEngineHandle engine, UINT32 maxVoices, BeepVoiceStealPolicy policy)
+{
+    EngineCall call(engine);
+    AudioThreadData* data = call.Data();
+    if (data == nullptr || !VoiceLimiter::IsValidPolicy(policy)) return false;
+    data->SetPolyphony(maxVoices, policy);
+    return true;
+}
 
-    ~AudioThreadData()
-    {
-		if (m_hQueueEvent != nullptr)
-		{
-			CloseHandle(m_hQueueEvent);
-			m_hQueueEvent = nullptr;
-		}
+extern "C" __declspec(dllexport) bool BeepEngineSetPolyphony(UINT32 maxVoices, BeepVoiceStealPolicy policy)
+{
+    return BeepEngineInstanceSetPolyphony(DefaultEngine(), maxVoices, policy);
+}
 
-        if (m_didCreateSourceVoice)
-        {
-			m_pSourceVoice->DestroyVoice();
-			m_pSourceVoice = nullptr;
-            m_didCreateSourceVoice = false;
-        }
+extern "C" __declspec(dllexport) void BeepEngineInstanceSetOverloadShedding(BeepEngineHandle engine, bool enable, float targetLoad)
+{
+    EngineCall call(engine);
+    AudioThreadData* data = call.Data();
+    if (data == nullptr) return;
+    data->SetShedding(enable, targetLoad);
+}
 
-        if (m_callback != nullptr)
-        {
-            delete m_callback;
-            m_callback = nullptr;
-        }
-        
-        if (m_didCreateMasteringVoice)
-        {
-            m_pMasterVoice->DestroyVoice();
-			m_didCreateMasteringVoice = false;
-        }
+extern "C" __declspec(dllexport) void BeepEngineSetOverloadShedding(bool enable, float targetLoad)
+{
+    BeepEngineInstanceSetOverloadShedding(DefaultEngine(), enable, targetLoad);
+}
 
-        if (m_didCreateXAudio2)
-        {
-            m_pXAudio2->Release();
-			m_didCreateXAudio2 = false;
-        }
+extern "C" __declspec(dllexport) void BeepEngineInstanceGetOverloadStats(BeepEngineHandle engine, UINT64* pVoicesStolen, UINT64* pNotesDropped, UINT64* pVoicesShed, float* pLoad)
+{
+    EngineCall call(engine);
+    AudioThreadData* data = call.Data();
+    if (data == nullptr) return;
+    data->GetOverloadStats(pVoicesStolen, pNotesDropped, pVoicesShed, pLoad);
+}
 
-        if (m_didCoInitialize)
-        {
-            CoUninitialize();
-			m_didCoInitialize = false;
-        }
-    }
-private:
-    const int BUFFER_SIZE;
+extern "C" __declspec(dllexport) void BeepEngineGetOverloadStats(UINT64* pVoicesStolen, UINT64* pNotesDropped, UINT64* pVoicesShed, float* pLoad)
+{
+    BeepEngineInstanceGetOverloadStats(DefaultEngine(), pVoicesStolen, pNotesDropped, pVoicesShed, pLoad);
+}
 
-    bool m_didCoInitialize;
-    IXAudio2* m_pXAudio2;
-	bool m_didCreateXAudio2;
-    IXAudio2MasteringVoice* m_pMasterVoice;
-	bool m_didCreateMasteringVoice;
-    UINT32 m_sampleRate;
-    DWORD m_lastError;
-    std::unique_ptr<BufferData> m_buffer1;
-    std::unique_ptr<BufferData> m_buffer2;
-	VoiceCallback2 * m_callback;
-    IXAudio2SourceVoice* m_pSourceVoice;
-	bool m_didCreateSourceVoice;
-    UINT32 m_currentTime;
+extern "C" __declspec(dllexport) void BeepEngineInstanceGetNoteCacheStats(BeepEngineHandle engine, UINT64* pHits, UINT64* pMisses, UINT64* pBytesUsed)
+{
+    EngineCall call(engine);
+    AudioThreadData* data = call.Data();
+    if (data == nullptr) return;
+    data->GetNoteCacheStats(pHits, pMisses, pBytesUsed);
+}
 
-	std::unique_ptr<std::mutex> m_queueLock;
-    HANDLE m_hQueueEvent;
-	std::unique_ptr<std::queue<std::unique_ptr<AudioThreadCommand>>> m_commandQueue;
-    std::unique_ptr<BeepCommandQueue> m_queuedBeeps;
-    std::unique_ptr<BeepCommandQueue> m_queuedBeepsPostWrap;
-    std::unique_ptr<EventSet> m_possibleFutureEvents;
-    std::unique_ptr<EventMap> m_waitingEvents;
-    std::unique_ptr<BeepInProgressVector> m_beepInProgressVector;
+extern "C" __declspec(dllexport) void BeepEngineGetNoteCacheStats(UINT64* pHits, UINT64* pMisses, UINT64* pBytesUsed)
+{
+    BeepEngineInstanceGetNoteCacheStats(DefaultEngine(), pHits, pMisses, pBytesUsed);
+}
 
-	void Start()
-	{
-		m_pSourceVoice->Start(0);
-	}
+extern "C" __declspec(dllexport) bool BeepEngineScoreSaveToFile(BeepScoreHandle score, const wchar_t* path)
+{
+    if (score == nullptr || path == nullptr) return false;
+    return static_cast<ScoreBuilder*>(score)->SaveToFile(path);
+}
 
-	void Stop()
-	{
-		m_pSourceVoice->Stop();
-	}
+extern "C" __declspec(dllexport) bool BeepEngineInstancePlayScoreFile(BeepEngineHandle engine, const wchar_t* path, float lookaheadSeconds)
+{
+    EngineCall call(engine);
+    AudioThreadData* data = call.Data();
+    if (data == nullptr || path == nullptr) return false;
+    // the worker needs some room ahead of the play head
+    if (!(lookaheadSeconds > 0.05f)) lookaheadSeconds = 0.05f;
 
-    HRESULT SubmitBuffer(BufferData* bufferData)
+    std::unique_ptr<ScoreFileSource> source(new ScoreFileSource());
+    if (source == nullptr) return false;
+    if (!source->Open(path))
     {
-        HRESULT hr = m_pSourceVoice->SubmitSourceBuffer(bufferData->GetXBuffer());
-		if (FAILED(hr))
-		{
-			OutputDebugString(L"Failed to submit buffer\n");
-		}
-        return hr;
+        OutputDebugString(L"Failed to open score file\n");
+        return false;
     }
 
-    void ProcessQueue()
+    UINT64 callTime = 0u;
+    data->GetClock(&callTime, nullptr);
+    std::unique_ptr<ScoreWorkerStream> stream(new ScoreWorkerStream(std::move(source), lookaheadSeconds, data->GetSampleRate(), 0u, callTime));
+    if (stream == nullptr) return false;
+    if (!stream->Initialize())
     {
-        std::lock_guard<std::mutex> lock(*m_queueLock);
-        while (!m_commandQueue->empty())
-        {
-            std::unique_ptr<AudioThreadCommand> command = std::move(m_commandQueue->front());
-            m_commandQueue->pop();
+        OutputDebugString(L"Failed to start score file\n");
+        return false;
+    }
 
-            AudioThreadCommand_ScheduleBeeps* sb = dynamic_cast<AudioThreadCommand_ScheduleBeeps*>(command.get());
-            if (sb != nullptr)
-            {
-                std::vector<std::unique_ptr<AudioBeepCommand>> const& commands = sb->Commands();
-                for (std::vector<std::unique_ptr<AudioBeepCommand>>::const_iterator it = commands.cbegin(); it != commands.cend(); ++it)
-                {
-                    bool postWrap = false;
-                    std::shared_ptr<BeepCommand> beepCommand = (*it)->CreateCommand(m_sampleRate, m_currentTime, &postWrap);
+    data->PlayScoreStream(std::move(stream));
+    return true;
+}
 
-                    BeepCommand_Event* eventCommand = dynamic_cast<BeepCommand_Event*>(beepCommand.get());
-                    if (eventCommand != nullptr)
-                    {
-                        m_possibleFutureEvents->insert(eventCommand->EventId());
-                    }
+extern "C" __declspec(dllexport) bool BeepEnginePlayScoreFile(const wchar_t* path, float lookaheadSeconds)
+{
+    return BeepEngineInstancePlayScoreFile(DefaultEngine(), path, lookaheadSeconds);
+}
 
-                    if (postWrap)
-                    {
-                        m_queuedBeepsPostWrap->push(beepCommand);
-                    }
-                    else
-                    {
-                        m_queuedBeeps->push(beepCommand);
-                    }
-                }
-            }
-            else
-            {
-                AudioThreadCommand_WaitForEvent* wfe = dynamic_cast<AudioThreadCommand_WaitForEvent*>(command.get());
-                if (wfe != nullptr)
-                {
-                    if (m_possibleFutureEvents->find(wfe->EventId()) == m_possibleFutureEvents->end())
-                    {
-                        // this event cannot possibly happen (or has already happened), so we return immediately
-                        wfe->SetEventOccurred(false);
-                        ::SetEvent(wfe->ResponseEvent());
-                    }
-                    else
-                    {
-                        command.release();
-						std::unique_ptr<AudioThreadCommand_WaitForEvent> wfe2 = std::unique_ptr<AudioThreadCommand_WaitForEvent>(wfe);
-                        m_waitingEvents->insert(std::move(std::make_pair(wfe->EventId(), std::move(wfe2))));
-                    }
-                }
-                else
-                {
-                    OutputDebugString(L"Unknown command type\n");
-                }
-            }
-        }
+extern "C" __declspec(dllexport) bool BeepEngineInstancePlayGenerator(BeepEngineHandle engine, BeepGeneratorCallback generate, BeepGeneratorReleaseCallback release, void* context, float lookaheadSeconds, UINT32 group)
+{
+    EngineCall call(engine);
+    AudioThreadData* data = call.Data();
+    // a generator may never end, so it needs a group to cancel it by
+    if (data == nullptr || generate == nullptr || group == 0u)
+    {
+        if (release != nullptr) release(context);
+        return false;
     }
+    // the worker needs some room ahead of the play head
+    if (!(lookaheadSeconds > 0.05f)) lookaheadSeconds = 0.05f;
 
-    void RenderToBuffer(BufferData* bufferData)
+    std::unique_ptr<ScoreRecordSource> source(new ScoreGeneratorSource(generate, release, context));
+    if (source == nullptr)
     {
-        float* buffer = bufferData->GetBuffer();
-        std::fill(buffer, buffer + bufferData->GetBufferSize(), 0.0f);
+        if (release != nullptr) release(context);
+        return false;
+    }
 
-        UINT32 endTime = m_currentTime + bufferData->GetBufferSize();
+    UINT64 callTime = 0u;
+    data->GetClock(&callTime, nullptr);
+    std::unique_ptr<ScoreWorkerStream> stream(new ScoreWorkerStream(std::move(source), lookaheadSeconds, data->GetSampleRate(), group, callTime));
+    if (stream == nullptr) return false;
+    if (!stream->Initialize())
+    {
+        OutputDebugString(L"Failed to start generator\n");
+        return false;
+    }
 
-        auto processQueuedBeeps = [=](bool all)
-        {
-            while (!m_queuedBeeps->empty() && (all || m_queuedBeeps->top()->EventStartTimeSamples() < endTime))
-            {
-                BeepCommand_Beep* beepCommand = dynamic_cast<BeepCommand_Beep*>(m_queuedBeeps->top().get());
-                if (beepCommand != nullptr)
-                {
-                    m_beepInProgressVector->push_back
-                    (
-                        std::unique_ptr<BeepInProgress>
-                        (
-                            new BeepInProgress_SineWave
-                            (
-                                beepCommand->FrequencyRadiansPerSample(),
-                                beepCommand->Amplitude(),
-                                beepCommand->EventStartTimeSamples() - m_currentTime,
-                                beepCommand->DurationSamples()
-                            )
-                        )
-                    );
-                }
-                else
-                {
-                    BeepCommand_Event* eventCommand = dynamic_cast<BeepCommand_Event*>(m_queuedBeeps->top().get());
-                    if (eventCommand != nullptr)
-                    {
-                        auto it = m_waitingEvents->find(eventCommand->EventId());
-                        if (it != m_waitingEvents->end())
-                        {
-                            OutputDebugString(L"Waiting event found.\n");
-                            it->second->SetEventOccurred(true);
-                            ::SetEvent(it->second->ResponseEvent());
-                            m_possibleFutureEvents->erase(eventCommand->EventId());
-                            m_waitingEvents->erase(it);
-                        }
-                    }
-                    else
-                    {
-                        OutputDebugString(L"Unknown command type\n");
-                    }
-                }
-                m_queuedBeeps->pop();
-            }
-        };
+    data->PlayScoreStream(std::move(stream));
+    return true;
+}
 
-        if (endTime < m_currentTime)
-        {
-            processQueuedBeeps(true);
-            std::swap(m_queuedBeeps, m_queuedBeepsPostWrap);
-        }
-        processQueuedBeeps(false);
+extern "C" __declspec(dllexport) bool BeepEnginePlayGenerator(BeepGeneratorCallback generate, BeepGeneratorReleaseCallback release, void* context, float lookaheadSeconds, UINT32 group)
+{
+    return BeepEngineInstancePlayGenerator(DefaultEngine(), generate, release, context, lookaheadSeconds, group);
+}
 
-        BeepInProgressVector newBeepsInProgress;
-        for (BeepInProgressVector::const_iterator it = m_beepInProgressVector->cbegin(); it != m_beepInProgressVector->cend(); ++it)
-        {
-            std::optional<std::unique_ptr<BeepInProgress>> newBeep = (*it)->AddToBuffer(buffer, bufferData->GetBufferSize());
-            if (newBeep.has_value())
-            {
-                newBeepsInProgress.push_back(std::move(newBeep.value()));
-            }
-        }
+extern "C" __declspec(dllexport) bool BeepEngineInstanceOpenSharedRing(BeepEngineHandle engine, const wchar_t* name, UINT32 commandCapacity, UINT32 completionCapacity)
+{
+    EngineCall call(engine);
+    AudioThreadData* data = call.Data();
+    if (data == nullptr || name == nullptr) return false;
+    return data->OpenSharedRing(name, commandCapacity, completionCapacity);
+}
+
+extern "C" __declspec(dllexport) bool BeepEngineOpenSharedRing(const wchar_t* name, UINT32 commandCapacity, UINT32 completionCapacity)
+{
+    return BeepEngineInstanceOpenSharedRing(DefaultEngine(), name, commandCapacity, completionCapacity);
+}
 
-		std::swap(*m_beepInProgressVector, newBeepsInProgress);
-        //*m_beepInProgressVector = std::move(newBeepsInProgress);
+extern "C" __declspec(dllexport) void BeepEngineInstanceCloseSharedRing(BeepEngineHandle engine)
+{
+    EngineCall call(engine);
+    AudioThreadData* data = call.Data();
+    if (data == nullptr) return;
+    data->CloseSharedRing();
+}
 
-        m_currentTime = endTime;
-    }
-};
+extern "C" __declspec(dllexport) void BeepEngineCloseSharedRing()
+{
+    BeepEngineInstanceCloseSharedRing(DefaultEngine());
+}
 
-HANDLE hAudioThread = nullptr;
-HANDLE hAudioThreadInitialized = nullptr;
-AudioThreadData* pAudioThreadData = nullptr;
+// The client side of the shared ring needs no engine in its own process. A connection must not be used from two
+// threads at the same time.
 
-DWORD WINAPI AudioThreadProc(LPVOID arg)
+extern "C" __declspec(dllexport) BeepSharedRingHandle BeepSharedRingConnect(const wchar_t* name)
 {
-    AudioThreadData a(2048);
+    if (name == nullptr) return nullptr;
+    std::unique_ptr<SharedRing> ring(new SharedRing());
+    if (ring == nullptr) return nullptr;
+    if (!ring->Open(name)) return nullptr;
+    return static_cast<BeepSharedRingHandle>(ring.release());
+}
 
-    if (a.Initialize())
-    {
-        pAudioThreadData = &a;
-		SetEvent(hAudioThreadInitialized);
-        a.RunLoop();
-        pAudioThreadData = nullptr;
-        return 0;
-    }
-    else
-	{
-		return 1;
-	}
+extern "C" __declspec(dllexport) UINT32 BeepSharedRingPush(BeepSharedRingHandle ring, const BeepSharedCommandRecord* records, UINT32 count)
+{
+    if (ring == nullptr || records == nullptr) return 0u;
+    return static_cast<SharedRing*>(ring)->PushCommands(records, count);
 }
 
-extern "C" __declspec(dllexport) bool StartBeepEngine()
+extern "C" __declspec(dllexport) bool BeepSharedRingPopCompletion(BeepSharedRingHandle ring, UINT32* pEventId, BeepEventStatus* pStatus)
+{
+    if (ring == nullptr) return false;
+    return static_cast<SharedRing*>(ring)->PopCompletion(pEventId, pStatus);
+}
+
+extern "C" __declspec(dllexport) bool BeepSharedRingGetClock(BeepSharedRingHandle ring, UINT64* pRenderPosition, UINT32* pSampleRate)
+{
+    if (ring == nullptr) return false;
+    SharedRing* sharedRing = static_cast<SharedRing*>(ring);
+    if (pRenderPosition != nullptr) *pRenderPosition = sharedRing->RenderPosition();
+    if (pSampleRate != nullptr) *pSampleRate = sharedRing->SampleRate();
+    return true;
+}
+
+extern "C" __declspec(dllexport) void BeepSharedRingDisconnect(BeepSharedRingHandle ring)
+{
+    delete static_cast<SharedRing*>(ring);
+}
+
+extern "C" __declspec(dllexport) UINT64 BeepEngineScoreGetLengthSamples(BeepScoreHandle score, UINT32 sampleRate)
+{
+    if (score == nullptr || sampleRate == 0) return 0u;
+    OfflineRenderer renderer(sampleRate);
+    renderer.Load(*static_cast<ScoreBuilder*>(score));
+    return renderer.LengthSamples();
+}
+
+extern "C" __declspec(dllexport) bool BeepEngineScoreRenderOffline(BeepScoreHandle score, UINT32 sampleRate, float* dest, UINT64 sampleCount, UINT32 threadCount)
 {
-	if (hAudioThread != nullptr) return true;
+    if (score == nullptr || dest == nullptr || sampleRate == 0) return false;
 
-	hAudioThreadInitialized = CreateEvent(nullptr, FALSE, FALSE, nullptr);
-    if (hAudioThreadInitialized == nullptr)
+    try
     {
-        DWORD lastError = GetLastError();
-        OutputDebugString(L"Failed to create hAudioThreadInitialized event\n");
-        return false;
+        OfflineRenderer renderer(sampleRate);
+        renderer.Load(*static_cast<ScoreBuilder*>(score));
+        return renderer.Render(dest, sampleCount, threadCount);
     }
-
-	hStopEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
-    if (hStopEvent == nullptr)
+    catch (std::bad_alloc const &)
     {
-        DWORD lastError = GetLastError();
-        OutputDebugString(L"Failed to create hStopEvent\n");
-        CloseHandle(hAudioThreadInitialized);
         return false;
     }
+}
 
-	hAudioThread = CreateThread(nullptr, 0, AudioThreadProc, nullptr, 0, nullptr);
-	if (hAudioThread == nullptr)
+extern "C" __declspec(dllexport) UINT64 BeepEngineScoreDetectTones(BeepScoreHandle score, UINT32 sampleRate, const float* frequencies, UINT32 frequencyCount, UINT32 windowSize, UINT32 hopSize, float* amplitudes, UINT64 maxFrames, UINT32 threadCount)
+{
+    if (score == nullptr || sampleRate == 0 || windowSize == 0 || hopSize == 0) return 0u;
+
+    try
     {
-        DWORD lastError = GetLastError();
-        OutputDebugString(L"Failed to create hAudioThread\n");
-        CloseHandle(hStopEvent);
-        CloseHandle(hAudioThreadInitialized);
-        return false;
-    }
+        OfflineRenderer renderer(sampleRate);
+        renderer.Load(*static_cast<ScoreBuilder*>(score));
 
-	HANDLE events[2] = { hAudioThread, hAudioThreadInitialized };
-	DWORD waitResult = WaitForMultipleObjects(2, events, FALSE, INFINITE);
+        UINT64 length = renderer.LengthSamples();
+        UINT64 frameCount = length < windowSize ? 0u : (length - windowSize) / hopSize + 1u;
+        if (amplitudes == nullptr) return frameCount;
+        frameCount = min(frameCount, maxFrames);
+        if (frameCount == 0u) return 0u;
 
-    if (waitResult == WAIT_OBJECT_0)
+        ToneDetector detector((float)sampleRate, (int)windowSize, (int)hopSize);
+        if (!detector.Initialize(frequencies, (int)frequencyCount)) return 0u;
+
+        // the score is rendered a chunk at a time, in order, so memory use does not depend on its length and the renderer
+        // keeps its threads and its place in the notes from one chunk to the next
+        const UINT64 chunkSize = 1u << 20;
+        std::vector<float> chunk(static_cast<size_t>(min(chunkSize, length)));
+        UINT64 framesWritten = 0u;
+        for (UINT64 position = 0u; position < length && framesWritten < frameCount; position += chunkSize)
+        {
+            UINT64 count = min(chunkSize, length - position);
+            if (!renderer.RenderRange(chunk.data(), position, count, threadCount)) break;
+            framesWritten += detector.Process(chunk.data(), (int)count, amplitudes + framesWritten * frequencyCount, (int)min(frameCount - framesWritten, (UINT64)INT_MAX), nullptr);
+        }
+        return framesWritten;
+    }
+    catch (std::bad_alloc const &)
     {
-        OutputDebugString(L"Audio thread failed to initialize\n");
-        CloseHandle(hAudioThread);
-        CloseHandle(hStopEvent);
-        CloseHandle(hAudioThreadInitialized);
-        return false;
+        return 0u;
     }
-
-    return true;
 }
 
-extern "C" __declspec(dllexport) void StopBeepEngine()
+extern "C" __declspec(dllexport) void BeepEngineInstanceEnableSpectrumAnalyzer(BeepEngineHandle engine, bool enable)
 {
-	if (hAudioThread == nullptr) return;
-	SetEvent(hStopEvent);
-	WaitForSingleObject(hAudioThread, INFINITE);
-	CloseHandle(hAudioThread);
-	CloseHandle(hStopEvent);
-	CloseHandle(hAudioThreadInitialized);
-    pAudioThreadData = nullptr;
-	hAudioThread = nullptr;
+    EngineCall call(engine);
+    AudioThreadData* data = call.Data();
+    if (data == nullptr) return;
+    data->GetSpectrumAnalyzer()->SetEnabled(enable);
 }
 
-extern "C" __declspec(dllexport) bool IsBeepEngineRunning()
+extern "C" __declspec(dllexport) void BeepEngineEnableSpectrumAnalyzer(bool enable)
 {
-    return (hAudioThread != nullptr);
+    BeepEngineInstanceEnableSpectrumAnalyzer(DefaultEngine(), enable);
 }
 
-extern "C" __declspec(dllexport) void BeepEngineBeep(float frequency, float duration)
+extern "C" __declspec(dllexport) UINT32 BeepEngineInstanceGetSpectrum(BeepEngineHandle engine, float* magnitudes, UINT32 count, UINT64* pSequence)
 {
-    const UINT32 eventId = 0xFFFFEA8Bu;
-	if (pAudioThreadData == nullptr) return;
-	std::vector<std::unique_ptr<AudioBeepCommand>> commands;
-	commands.push_back(std::unique_ptr<AudioBeepCommand>(new AudioBeepCommand_Beep(0.0f, frequency, 0.125f, duration)));
-    commands.push_back(std::unique_ptr<AudioBeepCommand>(new AudioBeepCommand_Event(duration, eventId)));
+    EngineCall call(engine);
+    AudioThreadData* data = call.Data();
+    if (data == nullptr || magnitudes == nullptr) return 0u;
+    return data->GetSpectrumAnalyzer()->Read(magnitudes, count, pSequence);
+}
 
-	pAudioThreadData->ScheduleBeeps(std::move(commands));
-    pAudioThreadData->WaitForEvent(eventId);
+extern "C" __declspec(dllexport) UINT32 BeepEngineGetSpectrum(float* magnitudes, UINT32 count, UINT64* pSequence)
+{
+    return BeepEngineInstanceGetSpectrum(DefaultEngine(), magnitudes, count, pSequence);
 }
 
-std::unique_ptr<std::vector<std::unique_ptr<AudioBeepCommand>>> g_beepCommands;
+extern "C" __declspec(dllexport) UINT32 BeepEngineInstanceGetSpectrumBinCount(BeepEngineHandle engine)
+{
+    EngineCall call(engine);
+    AudioThreadData* data = call.Data();
+    if (data == nullptr) return 0u;
+    return data->GetSpectrumAnalyzer()->BinCount();
+}
 
-extern "C" __declspec(dllexport) void BeepEngineClearBuffer()
+extern "C" __declspec(dllexport) UINT32 BeepEngineGetSpectrumBinCount()
 {
-    g_beepCommands = std::unique_ptr<std::vector<std::unique_ptr<AudioBeepCommand>>>(new std::vector<std::unique_ptr<AudioBeepCommand>>());
+    return BeepEngineInstanceGetSpectrumBinCount(DefaultEngine());
 }
 
-extern "C" __declspec(dllexport) void BeepEngineAddNoteToBuffer(float startTime, float frequency, float amplitude, float duration)
+extern "C" __declspec(dllexport) void BeepEngineInstanceGetSpectrumAnalyzerCost(BeepEngineHandle engine, UINT64* pBuffersAnalyzed, double* pAverageMicroseconds, double* pLastMicroseconds)
 {
-	if (g_beepCommands == nullptr) BeepEngineClearBuffer();
-    g_beepCommands->push_back
-    (
-        std::unique_ptr<AudioBeepCommand>
-        (
-            new AudioBeepCommand_Beep(startTime, frequency, amplitude, duration)
-        )
-    );
+    EngineCall call(engine);
+    AudioThreadData* data = call.Data();
+    if (data == nullptr) return;
+    data->GetSpectrumAnalyzer()->GetCost(pBuffersAnalyzed, pAverageMicroseconds, pLastMicroseconds);
 }
 
-extern "C" __declspec(dllexport) void BeepEngineAddEventToBuffer(float time, UINT32 eventId)
+extern "C" __declspec(dllexport) void BeepEngineGetSpectrumAnalyzerCost(UINT64* pBuffersAnalyzed, double* pAverageMicroseconds, double* pLastMicroseconds)
 {
-	if (g_beepCommands == nullptr) BeepEngineClearBuffer();
-	g_beepCommands->push_back
-	(
-		std::unique_ptr<AudioBeepCommand>
-		(
-			new AudioBeepCommand_Event(time, eventId)
-		)
-	);
+    BeepEngineInstanceGetSpectrumAnalyzerCost(DefaultEngine(), pBuffersAnalyzed, pAverageMicroseconds, pLastMicroseconds);
 }
 
-extern "C" __declspec(dllexport) void BeepEngineStartPlayBuffer()
+extern "C" __declspec(dllexport) bool BeepEngineInstanceSetImpulseResponse(BeepEngineHandle engine, const float* impulseResponse, UINT32 length)
 {
-	if (pAudioThreadData == nullptr) return;
-	if (g_beepCommands == nullptr) return;
-    if (g_beepCommands->empty()) return;
+    EngineCall call(engine);
+    AudioThreadData* data = call.Data();
+    if (data == nullptr) return false;
 
-	pAudioThreadData->ScheduleBeeps(std::move(*g_beepCommands));
-	g_beepCommands = nullptr;
+    try
+    {
+        return data->SetImpulseResponse(impulseResponse, length);
+    }
+    catch (std::bad_alloc const &)
+    {
+        return false;
+    }
 }
 
-extern "C" __declspec(dllexport) bool BeepEngineWaitForEvent(UINT32 eventId)
+extern "C" __declspec(dllexport) bool BeepEngineSetImpulseResponse(const float* impulseResponse, UINT32 length)
+{
+    return BeepEngineInstanceSetImpulseResponse(DefaultEngine(), impulseResponse, length);
+}
+
+extern "C" __declspec(dllexport) UINT64 BeepEngineGetAudioThreadAllocationCount()
 {
-    if (pAudioThreadData == nullptr) return false;
-	return pAudioThreadData->WaitForEvent(eventId);
+    return AudioThreadData::GetRealTimeHeapUseCount();
 }
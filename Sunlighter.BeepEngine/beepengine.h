@@ -6,8 +6,23 @@ extern "C" __declspec(dllexport) void StopBeepEngine();
 
 extern "C" __declspec(dllexport) bool IsBeepEngineRunning();
 
+// Suspend and resume. A suspended engine keeps its thread, device objects, pools and tables, so resuming it is much
+// cheaper than starting it. BeepEnginePrewarm starts the engine suspended. Time to first sample is in microseconds.
+
+extern "C" __declspec(dllexport) bool BeepEnginePrewarm();
+
+extern "C" __declspec(dllexport) bool BeepEngineSuspend();
+
+extern "C" __declspec(dllexport) bool BeepEngineResume();
+
+extern "C" __declspec(dllexport) bool BeepEngineIsSuspended();
+
+extern "C" __declspec(dllexport) void BeepEngineGetTimeToFirstSample(double* pColdMicroseconds, double* pWarmMicroseconds);
+
 extern "C" __declspec(dllexport) void BeepEngineBeep(float frequency, float duration);
 
+extern "C" __declspec(dllexport) void BeepEngineBeepAsync(float frequency, float duration);
+
 extern "C" __declspec(dllexport) void BeepEngineClearBuffer();
 
 extern "C" __declspec(dllexport) void BeepEngineAddNoteToBuffer(float startTime, float frequency, float amplitude, float duration);
@@ -17,3 +32,430 @@ extern "C" __declspec(dllexport) void BeepEngineAddEventToBuffer(float time, UIN
 extern "C" __declspec(dllexport) void BeepEngineStartPlayBuffer();
 
 extern "C" __declspec(dllexport) bool BeepEngineWaitForEvent(UINT32 eventId);
+
+enum BeepEventStatus
+{
+    BeepEventStatus_Occurred = 0,
+    BeepEventStatus_NotScheduled = 1,
+    BeepEventStatus_Timeout = 2,
+    BeepEventStatus_EngineStopped = 3,
+    BeepEventStatus_Cancelled = 4,
+};
+
+typedef void (*BeepEventCallback)(UINT32 eventId, BeepEventStatus status, void* context);
+
+extern "C" __declspec(dllexport) BeepEventStatus BeepEngineWaitForEventTimeout(UINT32 eventId, UINT32 timeoutMilliseconds);
+
+extern "C" __declspec(dllexport) BeepEventStatus BeepEngineWaitForAnyEvent(const UINT32* eventIds, UINT32 count, UINT32 timeoutMilliseconds, UINT32* pEventId);
+
+extern "C" __declspec(dllexport) void BeepEngineWatchEvent(UINT32 eventId);
+
+extern "C" __declspec(dllexport) bool BeepEngineGetCompletedEvent(UINT32* pEventId, BeepEventStatus* pStatus);
+
+extern "C" __declspec(dllexport) void BeepEngineSetEventCallback(BeepEventCallback callback, void* context);
+
+typedef void* BeepScoreHandle;
+
+extern "C" __declspec(dllexport) BeepScoreHandle BeepEngineCreateScore();
+
+extern "C" __declspec(dllexport) void BeepEngineScoreAddNote(BeepScoreHandle score, float startTime, float frequency, float amplitude, float duration);
+
+extern "C" __declspec(dllexport) void BeepEngineScoreAddNoteWithPriority(BeepScoreHandle score, float startTime, float frequency, float amplitude, float duration, INT32 priority);
+
+extern "C" __declspec(dllexport) bool BeepEngineGetClock(UINT64* pRenderPosition, UINT64* pPlayPosition, UINT32* pSampleRate);
+
+extern "C" __declspec(dllexport) void BeepEngineScoreAddNoteAtSample(BeepScoreHandle score, UINT64 startSample, float frequency, float amplitude, UINT32 durationSamples, INT32 priority);
+
+extern "C" __declspec(dllexport) void BeepEngineScoreAddEventAtSample(BeepScoreHandle score, UINT64 sample, UINT32 eventId);
+
+extern "C" __declspec(dllexport) void BeepEngineScoreAddEvent(BeepScoreHandle score, float time, UINT32 eventId);
+
+extern "C" __declspec(dllexport) void BeepEngineScoreAddPartial(BeepScoreHandle score, float startTime, float frequency, float amplitude, float duration);
+
+extern "C" __declspec(dllexport) void BeepEngineScoreClear(BeepScoreHandle score);
+
+extern "C" __declspec(dllexport) bool BeepEngineScoreSubmit(BeepScoreHandle score);
+
+extern "C" __declspec(dllexport) bool BeepEngineScoreSubmitToGroup(BeepScoreHandle score, UINT32 group);
+
+extern "C" __declspec(dllexport) bool BeepEngineScoreSubmitLoop(BeepScoreHandle score, float periodSeconds, UINT32 repeatCount, UINT32 group);
+
+extern "C" __declspec(dllexport) void BeepEngineCancelGroup(UINT32 group);
+
+extern "C" __declspec(dllexport) void BeepEngineDestroyScore(BeepScoreHandle score);
+
+extern "C" __declspec(dllexport) void BeepEngineSetRenderWorkers(UINT32 workerCount, UINT32 minVoicesPerChunk);
+
+extern "C" __declspec(dllexport) void BeepEngineSetNoteCacheBudget(UINT64 budgetBytes);
+
+extern "C" __declspec(dllexport) void BeepEngineGetNoteCacheStats(UINT64* pHits, UINT64* pMisses, UINT64* pBytesUsed);
+
+enum BeepVoiceStealPolicy
+{
+    BeepVoiceStealPolicy_Oldest = 0,
+    BeepVoiceStealPolicy_Quietest = 1,
+    BeepVoiceStealPolicy_None = 2,
+};
+
+extern "C" __declspec(dllexport) bool BeepEngineSetPolyphony(UINT32 maxVoices, BeepVoiceStealPolicy policy);
+
+extern "C" __declspec(dllexport) void BeepEngineSetOverloadShedding(bool enable, float targetLoad);
+
+extern "C" __declspec(dllexport) void BeepEngineGetOverloadStats(UINT64* pVoicesStolen, UINT64* pNotesDropped, UINT64* pVoicesShed, float* pLoad);
+
+// Binary score file: a header followed by recordCount records sorted by startTime. Times are in seconds from the
+// start of the score.
+
+#define BEEP_SCORE_FILE_MAGIC "BEEPSCR1"
+#define BEEP_SCORE_FILE_VERSION 1u
+
+struct BeepScoreFileHeader
+{
+    char magic[8];
+    UINT32 version;
+    UINT32 recordSize;
+    UINT64 recordCount;
+};
+
+enum BeepScoreRecordKind
+{
+    BeepScoreRecordKind_Note = 0,
+    BeepScoreRecordKind_Event = 1,
+    BeepScoreRecordKind_Partial = 2,
+};
+
+struct BeepScoreFileRecord
+{
+    double startTime;
+    UINT32 kind;
+    union
+    {
+        float frequency; // notes and partials
+        UINT32 eventId;  // events
+    };
+    float amplitude;
+    float duration;
+};
+
+extern "C" __declspec(dllexport) bool BeepEngineScoreSaveToFile(BeepScoreHandle score, const wchar_t* path);
+
+extern "C" __declspec(dllexport) bool BeepEnginePlayScoreFile(const wchar_t* path, float lookaheadSeconds);
+
+// Sample banks. A bank file is a BeepSampleBankHeader, then sampleCount entries, then the samples themselves: mono
+// 32-bit floats, each at the byte offset its entry gives, which must be a multiple of 4. The engine plays samples
+// straight out of the mapped file, so they are not decoded or copied when the bank is opened.
+
+#define BEEP_SAMPLE_BANK_MAGIC "BEEPSMB1"
+#define BEEP_SAMPLE_BANK_VERSION 1u
+
+struct BeepSampleBankHeader
+{
+    char magic[8];
+    UINT32 version;
+    UINT32 sampleCount;
+};
+
+struct BeepSampleBankEntry
+{
+    UINT64 offset;
+    UINT32 frameCount;
+    UINT32 sampleRate;
+};
+
+typedef void* BeepSampleBankHandle;
+
+extern "C" __declspec(dllexport) bool BeepEngineSaveSampleBank(const wchar_t* path, const float* const* samples, const UINT32* frameCounts, const UINT32* sampleRates, UINT32 count);
+
+extern "C" __declspec(dllexport) BeepSampleBankHandle BeepEngineOpenSampleBank(const wchar_t* path);
+
+extern "C" __declspec(dllexport) void BeepEngineCloseSampleBank(BeepSampleBankHandle bank);
+
+extern "C" __declspec(dllexport) UINT32 BeepEngineSampleBankGetCount(BeepSampleBankHandle bank);
+
+extern "C" __declspec(dllexport) bool BeepEngineSampleBankGetInfo(BeepSampleBankHandle bank, UINT32 sampleIndex, UINT32* pFrameCount, UINT32* pSampleRate);
+
+// pitch is a playback rate, 1 being the sample's own pitch, and at least 1/256; gain multiplies the sample's frames.
+// The sample's pages are read in by the first call that adds it.
+extern "C" __declspec(dllexport) void BeepEngineScoreAddSample(BeepScoreHandle score, float startTime, BeepSampleBankHandle bank, UINT32 sampleIndex, float pitch, float gain, INT32 priority);
+
+// Generators. The engine calls generate on a worker thread of its own, never on the audio thread, and only as far
+// ahead of the play head as twice lookaheadSeconds. Each call writes up to capacity records, in the same form and
+// order as a score file, and returns how many it wrote; returning 0 ends the generator. Times are in seconds from
+// the moment BeepEnginePlayGenerator is called, on the engine clock. group must not be 0, since cancelling the group
+// is the only way to stop a generator that never ends. release, if not null, is called once when the engine is done
+// with context: when the generator ends, when its group is cancelled, when the engine stops, or when this function
+// fails.
+
+typedef UINT32 (*BeepGeneratorCallback)(void* context, BeepScoreFileRecord* records, UINT32 capacity);
+
+typedef void (*BeepGeneratorReleaseCallback)(void* context);
+
+extern "C" __declspec(dllexport) bool BeepEnginePlayGenerator(BeepGeneratorCallback generate, BeepGeneratorReleaseCallback release, void* context, float lookaheadSeconds, UINT32 group);
+
+// Shared-memory transport, for clients in another process. The engine creates a named file mapping holding a
+// BeepSharedRingHeader, then commandCapacity command records, then completionCapacity completion records. Each ring
+// has one producer and one consumer: the producer writes records and then advances head, with release semantics; the
+// consumer reads records and then advances tail. Indices count records and wrap around at 2^32; a record's slot is
+// its index modulo the capacity, which is a power of two.
+
+#define BEEP_SHARED_RING_MAGIC "BEEPRNG1"
+#define BEEP_SHARED_RING_VERSION 1u
+
+struct BeepSharedRingHeader
+{
+    char magic[8];
+    UINT32 version;
+    UINT32 commandCapacity;
+    UINT32 completionCapacity;
+    UINT32 sampleRate;
+    UINT64 renderPosition;     // the engine clock, updated every buffer
+    UINT64 completionsDropped; // completions lost because the completion ring was full
+    UINT8 reserved0[24];
+    UINT32 commandHead;        // written by the client
+    UINT8 reserved1[60];
+    UINT32 commandTail;        // written by the engine
+    UINT8 reserved2[60];
+    UINT32 completionHead;     // written by the engine
+    UINT8 reserved3[60];
+    UINT32 completionTail;     // written by the client
+    UINT8 reserved4[60];
+};
+
+struct BeepSharedCommandRecord
+{
+    UINT64 startSample;        // on the engine clock
+    UINT32 kind;               // BeepScoreRecordKind
+    union
+    {
+        float frequency;       // notes and partials
+        UINT32 eventId;        // events
+    };
+    float amplitude;
+    UINT32 durationSamples;
+    INT32 priority;            // notes
+    UINT32 group;              // 0 for none
+};
+
+struct BeepSharedCompletionRecord
+{
+    UINT32 eventId;
+    UINT32 status;             // BeepEventStatus
+};
+
+extern "C" __declspec(dllexport) bool BeepEngineOpenSharedRing(const wchar_t* name, UINT32 commandCapacity, UINT32 completionCapacity);
+
+extern "C" __declspec(dllexport) void BeepEngineCloseSharedRing();
+
+typedef void* BeepSharedRingHandle;
+
+extern "C" __declspec(dllexport) BeepSharedRingHandle BeepSharedRingConnect(const wchar_t* name);
+
+extern "C" __declspec(dllexport) UINT32 BeepSharedRingPush(BeepSharedRingHandle ring, const BeepSharedCommandRecord* records, UINT32 count);
+
+extern "C" __declspec(dllexport) bool BeepSharedRingPopCompletion(BeepSharedRingHandle ring, UINT32* pEventId, BeepEventStatus* pStatus);
+
+extern "C" __declspec(dllexport) bool BeepSharedRingGetClock(BeepSharedRingHandle ring, UINT64* pRenderPosition, UINT32* pSampleRate);
+
+extern "C" __declspec(dllexport) void BeepSharedRingDisconnect(BeepSharedRingHandle ring);
+
+extern "C" __declspec(dllexport) UINT64 BeepEngineScoreGetLengthSamples(BeepScoreHandle score, UINT32 sampleRate);
+
+extern "C" __declspec(dllexport) bool BeepEngineScoreRenderOffline(BeepScoreHandle score, UINT32 sampleRate, float* dest, UINT64 sampleCount, UINT32 threadCount);
+
+extern "C" __declspec(dllexport) UINT64 BeepEngineScoreDetectTones(BeepScoreHandle score, UINT32 sampleRate, const float* frequencies, UINT32 frequencyCount, UINT32 windowSize, UINT32 hopSize, float* amplitudes, UINT64 maxFrames, UINT32 threadCount);
+
+extern "C" __declspec(dllexport) void BeepEngineAddPartialToBuffer(float startTime, float frequency, float amplitude, float duration);
+
+extern "C" __declspec(dllexport) void BeepEngineEnableSpectrumAnalyzer(bool enable);
+
+extern "C" __declspec(dllexport) UINT32 BeepEngineGetSpectrumBinCount();
+
+extern "C" __declspec(dllexport) UINT32 BeepEngineGetSpectrum(float* magnitudes, UINT32 count, UINT64* pSequence);
+
+extern "C" __declspec(dllexport) void BeepEngineGetSpectrumAnalyzerCost(UINT64* pBuffersAnalyzed, double* pAverageMicroseconds, double* pLastMicroseconds);
+
+extern "C" __declspec(dllexport) bool BeepEngineSetImpulseResponse(const float* impulseResponse, UINT32 length);
+
+extern "C" __declspec(dllexport) UINT64 BeepEngineGetAudioThreadAllocationCount();
+
+// Engine instances. The functions above use the default engine, which StartBeepEngine starts; each function below does
+// the same for the engine given as its first argument.
+
+typedef void* BeepEngineHandle;
+
+extern "C" __declspec(dllexport) BeepEngineHandle BeepEngineCreateInstance();
+
+extern "C" __declspec(dllexport) BeepEngineHandle BeepEngineCreateSuspendedInstance();
+
+// Calls already in progress on other threads finish first; none may start once this has been called.
+extern "C" __declspec(dllexport) void BeepEngineDestroyInstance(BeepEngineHandle engine);
+
+extern "C" __declspec(dllexport) BeepEngineHandle BeepEngineGetDefaultInstance();
+
+extern "C" __declspec(dllexport) bool BeepEngineInstanceSuspend(BeepEngineHandle engine);
+
+extern "C" __declspec(dllexport) bool BeepEngineInstanceResume(BeepEngineHandle engine);
+
+extern "C" __declspec(dllexport) bool BeepEngineInstanceIsSuspended(BeepEngineHandle engine);
+
+extern "C" __declspec(dllexport) void BeepEngineInstanceGetTimeToFirstSample(BeepEngineHandle engine, double* pColdMicroseconds, double* pWarmMicroseconds);
+
+extern "C" __declspec(dllexport) void BeepEngineInstanceBeep(BeepEngineHandle engine, float frequency, float duration);
+
+extern "C" __declspec(dllexport) void BeepEngineInstanceBeepAsync(BeepEngineHandle engine, float frequency, float duration);
+
+extern "C" __declspec(dllexport) BeepEventStatus BeepEngineInstanceWaitForEventTimeout(BeepEngineHandle engine, UINT32 eventId, UINT32 timeoutMilliseconds);
+
+extern "C" __declspec(dllexport) BeepEventStatus BeepEngineInstanceWaitForAnyEvent(BeepEngineHandle engine, const UINT32* eventIds, UINT32 count, UINT32 timeoutMilliseconds, UINT32* pEventId);
+
+extern "C" __declspec(dllexport) void BeepEngineInstanceWatchEvent(BeepEngineHandle engine, UINT32 eventId);
+
+extern "C" __declspec(dllexport) bool BeepEngineInstanceGetCompletedEvent(BeepEngineHandle engine, UINT32* pEventId, BeepEventStatus* pStatus);
+
+extern "C" __declspec(dllexport) void BeepEngineInstanceSetEventCallback(BeepEngineHandle engine, BeepEventCallback callback, void* context);
+
+extern "C" __declspec(dllexport) bool BeepEngineInstanceScoreSubmit(BeepEngineHandle engine, BeepScoreHandle score);
+
+extern "C" __declspec(dllexport) bool BeepEngineInstanceScoreSubmitToGroup(BeepEngineHandle engine, BeepScoreHandle score, UINT32 group);
+
+extern "C" __declspec(dllexport) bool BeepEngineInstanceScoreSubmitLoop(BeepEngineHandle engine, BeepScoreHandle score, float periodSeconds, UINT32 repeatCount, UINT32 group);
+
+extern "C" __declspec(dllexport) void BeepEngineInstanceCancelGroup(BeepEngineHandle engine, UINT32 group);
+
+extern "C" __declspec(dllexport) void BeepEngineInstanceSetRenderWorkers(BeepEngineHandle engine, UINT32 workerCount, UINT32 minVoicesPerChunk);
+
+extern "C" __declspec(dllexport) void BeepEngineInstanceSetNoteCacheBudget(BeepEngineHandle engine, UINT64 budgetBytes);
+
+extern "C" __declspec(dllexport) bool BeepEngineInstanceGetClock(BeepEngineHandle engine, UINT64* pRenderPosition, UINT64* pPlayPosition, UINT32* pSampleRate);
+
+extern "C" __declspec(dllexport) bool BeepEngineInstanceSetPolyphony(BeepEngineHandle engine, UINT32 maxVoices, BeepVoiceStealPolicy policy);
+
+extern "C" __declspec(dllexport) void BeepEngineInstanceSetOverloadShedding(BeepEngineHandle engine, bool enable, float targetLoad);
+
+extern "C" __declspec(dllexport) void BeepEngineInstanceGetOverloadStats(BeepEngineHandle engine, UINT64* pVoicesStolen, UINT64* pNotesDropped, UINT64* pVoicesShed, float* pLoad);
+
+extern "C" __declspec(dllexport) void BeepEngineInstanceGetNoteCacheStats(BeepEngineHandle engine, UINT64* pHits, UINT64* pMisses, UINT64* pBytesUsed);
+
+extern "C" __declspec(dllexport) bool BeepEngineInstancePlayScoreFile(BeepEngineHandle engine, const wchar_t* path, float lookaheadSeconds);
+
+extern "C" __declspec(dllexport) bool BeepEngineInstancePlayGenerator(BeepEngineHandle engine, BeepGeneratorCallback generate, BeepGeneratorReleaseCallback release, void* context, float lookaheadSeconds, UINT32 group);
+
+extern "C" __declspec(dllexport) void BeepEngineInstanceEnableSpectrumAnalyzer(BeepEngineHandle engine, bool enable);
+
+extern "C" __declspec(dllexport) UINT32 BeepEngineInstanceGetSpectrum(BeepEngineHandle engine, float* magnitudes, UINT32 count, UINT64* pSequence);
+
+extern "C" __declspec(dllexport) UINT32 BeepEngineInstanceGetSpectrumBinCount(BeepEngineHandle engine);
+
+extern "C" __declspec(dllexport) void BeepEngineInstanceGetSpectrumAnalyzerCost(BeepEngineHandle engine, UINT64* pBuffersAnalyzed, double* pAverageMicroseconds, double* pLastMicroseconds);
+
+extern "C" __declspec(dllexport) bool BeepEngineInstanceSetImpulseResponse(BeepEngineHandle engine, const float* impulseResponse, UINT32 length);
+
+extern "C" __declspec(dllexport) bool BeepEngineInstanceOpenSharedRing(BeepEngineHandle engine, const wchar_t* name, UINT32 commandCapacity, UINT32 completionCapacity);
+
+extern "C" __declspec(dllexport) void BeepEngineInstanceCloseSharedRing(BeepEngineHandle engine);
+
+// A C++20 coroutine that yields score records, for use with the generator functions. For example:
+//
+//     BeepNoteGenerator Arpeggio()
+//     {
+//         for (double t = 0.0; ; t += 0.125) co_yield BeepNoteRecord(t, 440.0f, 0.2f, 0.1f);
+//     }
+//
+//     Arpeggio().Play(0.5f, group);
+//
+// Play hands the coroutine to the engine, which resumes it on its generator thread and destroys it when it is done.
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+
+inline BeepScoreFileRecord BeepNoteRecord(double startTime, float frequency, float amplitude, float duration)
+{
+    BeepScoreFileRecord record;
+    record.startTime = startTime;
+    record.kind = BeepScoreRecordKind_Note;
+    record.frequency = frequency;
+    record.amplitude = amplitude;
+    record.duration = duration;
+    return record;
+}
+
+inline BeepScoreFileRecord BeepEventRecord(double time, UINT32 eventId)
+{
+    BeepScoreFileRecord record;
+    record.startTime = time;
+    record.kind = BeepScoreRecordKind_Event;
+    record.eventId = eventId;
+    record.amplitude = 0.0f;
+    record.duration = 0.0f;
+    return record;
+}
+
+class BeepNoteGenerator
+{
+public:
+    struct promise_type
+    {
+        BeepScoreFileRecord current;
+
+        BeepNoteGenerator get_return_object() { return BeepNoteGenerator(Handle::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        std::suspend_always yield_value(const BeepScoreFileRecord& record) noexcept { current = record; return {}; }
+        void return_void() noexcept {}
+        // an exception ends the generator
+        void unhandled_exception() noexcept {}
+    };
+
+    BeepNoteGenerator(BeepNoteGenerator&& other) noexcept : m_handle(other.m_handle) { other.m_handle = nullptr; }
+    BeepNoteGenerator(const BeepNoteGenerator&) = delete;
+    BeepNoteGenerator& operator=(const BeepNoteGenerator&) = delete;
+
+    ~BeepNoteGenerator()
+    {
+        if (m_handle) m_handle.destroy();
+    }
+
+    bool Play(float lookaheadSeconds, UINT32 group)
+    {
+        return BeepEnginePlayGenerator(Generate, Release, Detach(), lookaheadSeconds, group);
+    }
+
+    bool Play(BeepEngineHandle engine, float lookaheadSeconds, UINT32 group)
+    {
+        return BeepEngineInstancePlayGenerator(engine, Generate, Release, Detach(), lookaheadSeconds, group);
+    }
+
+private:
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    Handle m_handle;
+
+    explicit BeepNoteGenerator(Handle handle) : m_handle(handle) {}
+
+    void* Detach()
+    {
+        void* address = m_handle.address();
+        m_handle = nullptr;
+        return address;
+    }
+
+    static UINT32 Generate(void* context, BeepScoreFileRecord* records, UINT32 capacity)
+    {
+        Handle handle = Handle::from_address(context);
+        UINT32 count = 0u;
+        while (count < capacity && !handle.done())
+        {
+            handle.resume();
+            if (handle.done()) break;
+            records[count++] = handle.promise().current;
+        }
+        return count;
+    }
+
+    static void Release(void* context)
+    {
+        Handle::from_address(context).destroy();
+    }
+};
+
+#endif
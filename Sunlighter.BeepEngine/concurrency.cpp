@@ -0,0 +1,112 @@
+﻿#include "pch.h"
+#include "concurrency.h"
+
+WorkerGroup::WorkerGroup()
+    : m_workers()
+    , m_hDoneEvent(nullptr)
+    , m_invoke(nullptr)
+    , m_body(nullptr)
+    , m_count(0)
+    , m_grain(1)
+    , m_next(0)
+    , m_pending(0)
+    , m_stopping(false)
+{
+}
+
+void WorkerGroup::Start(int threadCount)
+{
+    if (threadCount <= 1) return;
+
+    m_hDoneEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+    if (m_hDoneEvent == nullptr) return;
+
+    // reserved first, so that a thread is never running without being in m_workers
+    m_workers.reserve(threadCount - 1);
+    for (int i = 1; i < threadCount; ++i)
+    {
+        std::unique_ptr<Worker> worker(new Worker(this, i));
+
+        worker->hGoEvent = CreateEvent(nullptr, FALSE, FALSE, nullptr);
+        if (worker->hGoEvent == nullptr) break;
+
+        worker->hThread = CreateThread(nullptr, 0, WorkerThreadProc, worker.get(), 0, nullptr);
+        if (worker->hThread == nullptr)
+        {
+            CloseHandle(worker->hGoEvent);
+            break;
+        }
+
+        m_workers.push_back(std::move(worker));
+    }
+}
+
+WorkerGroup::~WorkerGroup()
+{
+    m_stopping.store(true, std::memory_order_release);
+    for (std::vector<std::unique_ptr<Worker>>::const_iterator it = m_workers.cbegin(); it != m_workers.cend(); ++it)
+    {
+        SetEvent((*it)->hGoEvent);
+        WaitForSingleObject((*it)->hThread, INFINITE);
+        CloseHandle((*it)->hThread);
+        CloseHandle((*it)->hGoEvent);
+    }
+    if (m_hDoneEvent != nullptr)
+    {
+        CloseHandle(m_hDoneEvent);
+    }
+}
+
+void WorkerGroup::RunErased(int count, int grain, Invoker invoke, const void* body)
+{
+    m_invoke = invoke;
+    m_body = body;
+    m_count = count;
+    m_grain = max(grain, 1);
+    m_next.store(0, std::memory_order_relaxed);
+
+    // only as many workers as there are batches beyond the one this thread takes
+    int batchCount = (m_count + m_grain - 1) / m_grain;
+    int workerCount = (int)m_workers.size();
+    int wakeCount = max(min(workerCount, batchCount - 1), 0);
+    m_pending.store(wakeCount, std::memory_order_relaxed);
+    for (int i = 0; i < wakeCount; ++i)
+    {
+        SetEvent(m_workers[i]->hGoEvent);
+    }
+
+    RunBatches(0);
+
+    if (wakeCount != 0)
+    {
+        WaitForSingleObject(m_hDoneEvent, INFINITE);
+    }
+}
+
+void WorkerGroup::RunBatches(int thread)
+{
+    while (true)
+    {
+        int begin = m_next.fetch_add(m_grain, std::memory_order_relaxed);
+        if (begin >= m_count) break;
+        m_invoke(m_body, begin, min(begin + m_grain, m_count), thread);
+    }
+}
+
+DWORD WINAPI WorkerGroup::WorkerThreadProc(LPVOID lpParameter)
+{
+    Worker* worker = static_cast<Worker*>(lpParameter);
+    WorkerGroup* group = worker->group;
+    while (true)
+    {
+        WaitForSingleObject(worker->hGoEvent, INFINITE);
+        if (group->m_stopping.load(std::memory_order_acquire)) break;
+
+        group->RunBatches(worker->index);
+        if (group->m_pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            SetEvent(group->m_hDoneEvent);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,162 @@
+﻿#pragma once
+
+// Bounded single-producer, single-consumer ring. Capacity must be a power of two.
+
+template<typename T>
+class SpscRing
+{
+public:
+    SpscRing(UINT32 capacity)
+        : m_items(new T[capacity])
+        , m_capacity(capacity)
+        , m_head(0u)
+        , m_tail(0u)
+    {
+        assert(capacity != 0 && (capacity & (capacity - 1)) == 0);
+    }
+
+    // producer only; item is moved from only if the push succeeds
+    bool TryPush(T& item)
+    {
+        UINT32 head = m_head.load(std::memory_order_relaxed);
+        if (head - m_tail.load(std::memory_order_acquire) == m_capacity) return false;
+        m_items[head & (m_capacity - 1)] = std::move(item);
+        m_head.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // consumer only
+    bool TryPop(T& item)
+    {
+        UINT32 tail = m_tail.load(std::memory_order_relaxed);
+        if (tail == m_head.load(std::memory_order_acquire)) return false;
+        item = std::move(m_items[tail & (m_capacity - 1)]);
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    std::unique_ptr<T[]> m_items;
+    const UINT32 m_capacity;
+    std::atomic<UINT32> m_head;
+    std::atomic<UINT32> m_tail;
+};
+
+// Bounded first-in, first-out queue used by one thread, for items that do not fit in an SpscRing at the moment.
+// Capacity must be a power of two. Nothing is allocated after construction.
+
+template<typename T>
+class FixedQueue
+{
+public:
+    FixedQueue(UINT32 capacity)
+        : m_items(new T[capacity])
+        , m_capacity(capacity)
+        , m_head(0u)
+        , m_tail(0u)
+    {
+        assert(capacity != 0 && (capacity & (capacity - 1)) == 0);
+    }
+
+    bool IsEmpty() const { return m_head == m_tail; }
+
+    // item is moved from only if the push succeeds
+    bool TryPush(T& item)
+    {
+        if (m_head - m_tail == m_capacity) return false;
+        m_items[m_head & (m_capacity - 1)] = std::move(item);
+        ++m_head;
+        return true;
+    }
+
+    T& Front() { return m_items[m_tail & (m_capacity - 1)]; }
+
+    void PopFront() { ++m_tail; }
+
+private:
+    std::unique_ptr<T[]> m_items;
+    const UINT32 m_capacity;
+    UINT32 m_head;
+    UINT32 m_tail;
+};
+
+// A set of worker threads that runs one parallel loop after another, so that a call made of several passes starts its
+// threads once. Run splits [0, count) into batches of at least grain items and calls body(begin, end) on each, on the
+// workers and the calling thread, and returns once every batch is done. Start may throw std::bad_alloc; a thread that
+// cannot be created only costs parallelism. Bodies must not throw, so scratch space they need is set aside per thread
+// before Run, and RunPerThread tells each batch which thread's scratch is its own.
+
+class WorkerGroup
+{
+public:
+    WorkerGroup();
+    ~WorkerGroup();
+
+    // threadCount includes the calling thread
+    void Start(int threadCount);
+
+    // the calling thread and the workers that were started; never more than the threadCount given to Start
+    int ThreadCount() const { return (int)m_workers.size() + 1; }
+
+    template<typename Body>
+    void Run(int count, int grain, Body const & body)
+    {
+        RunErased(count, grain, &Invoke<Body>, &body);
+    }
+
+    // calls body(begin, end, thread), where thread is 0 on the calling thread and below ThreadCount() on the workers
+    template<typename Body>
+    void RunPerThread(int count, int grain, Body const & body)
+    {
+        RunErased(count, grain, &InvokePerThread<Body>, &body);
+    }
+
+    WorkerGroup(const WorkerGroup&) = delete;
+    WorkerGroup& operator=(const WorkerGroup&) = delete;
+
+private:
+    typedef void (*Invoker)(const void* body, int begin, int end, int thread);
+
+    class Worker
+    {
+    public:
+        Worker(WorkerGroup* group, int index)
+            : group(group)
+            , index(index)
+            , hGoEvent(nullptr)
+            , hThread(nullptr)
+        {
+        }
+
+        WorkerGroup* const group;
+        const int index;
+        HANDLE hGoEvent;
+        HANDLE hThread;
+    };
+
+    std::vector<std::unique_ptr<Worker>> m_workers;
+    HANDLE m_hDoneEvent;
+    Invoker m_invoke;
+    const void* m_body;
+    int m_count;
+    int m_grain;
+    std::atomic<int> m_next;
+    std::atomic<int> m_pending;
+    std::atomic<bool> m_stopping;
+
+    template<typename Body>
+    static void Invoke(const void* body, int begin, int end, int)
+    {
+        (*static_cast<Body const *>(body))(begin, end);
+    }
+
+    template<typename Body>
+    static void InvokePerThread(const void* body, int begin, int end, int thread)
+    {
+        (*static_cast<Body const *>(body))(begin, end, thread);
+    }
+
+    void RunErased(int count, int grain, Invoker invoke, const void* body);
+    void RunBatches(int thread);
+    static DWORD WINAPI WorkerThreadProc(LPVOID lpParameter);
+};
@@ -1,27 +1,177 @@
 ﻿#include "pch.h"
+#include "concurrency.h"
 #include "fft_internal.h"
 
-std::unique_ptr<std::deque<std::wstring>> g_log = std::make_unique<std::deque<std::wstring>>();
+// Each thread that logs owns one ring. Rings are never freed: when a thread exits, its ring is released and the next
+// thread to log claims it. The reader drains every ring under g_logReaderLock, so each ring has one producer and one
+// consumer at a time.
 
-void Log(const std::wstring& message)
+const UINT32 LOG_RING_CAPACITY = 1024u;
+const size_t LOG_HISTORY_SIZE = 1000u;
+
+class LogRing
+{
+public:
+    LogRing()
+        : records(LOG_RING_CAPACITY)
+        , next(nullptr)
+        , owned(true)
+        , dropped(0u)
+    {
+    }
+
+    SpscRing<LogRecord> records;
+    LogRing* next;
+    std::atomic<bool> owned;
+    std::atomic<UINT64> dropped;
+};
+
+static std::atomic<LogRing*> g_logRings(nullptr);
+static std::atomic<UINT64> g_logSequence(0u);
+
+static LogRing* ClaimLogRing()
 {
-    g_log->push_back(message);
-    if (g_log->size() > 1000)
+    for (LogRing* ring = g_logRings.load(std::memory_order_acquire); ring != nullptr; ring = ring->next)
+    {
+        bool expected = false;
+        if (ring->owned.compare_exchange_strong(expected, true, std::memory_order_acquire)) return ring;
+    }
+
+    LogRing* ring = new LogRing();
+    LogRing* head = g_logRings.load(std::memory_order_relaxed);
+    do
     {
-        g_log->pop_front();
+        ring->next = head;
     }
+    while (!g_logRings.compare_exchange_weak(head, ring, std::memory_order_release, std::memory_order_relaxed));
+    return ring;
 }
 
-void WithLogStream(std::function<void(std::wostream & o)> f)
+class LogRingOwner
 {
-    std::wostringstream o;
-    f(o);
-    Log(o.str());
+public:
+    LogRingOwner()
+        : m_ring(nullptr)
+    {
+    }
+
+    ~LogRingOwner()
+    {
+        if (m_ring != nullptr)
+        {
+            m_ring->owned.store(false, std::memory_order_release);
+        }
+    }
+
+    LogRing* Get()
+    {
+        if (m_ring == nullptr)
+        {
+            m_ring = ClaimLogRing();
+        }
+        return m_ring;
+    }
+
+private:
+    LogRing* m_ring;
+};
+
+static thread_local LogRingOwner t_logRing;
+
+void LogWriteRecord(LogRecord& record)
+{
+    record.sequence = g_logSequence.fetch_add(1u, std::memory_order_relaxed);
+    record.threadId = GetCurrentThreadId();
+
+    LogRing* ring = t_logRing.Get();
+    if (!ring->records.TryPush(record))
+    {
+        ring->dropped.fetch_add(1u, std::memory_order_relaxed);
+    }
+}
+
+void LogPrepareThread()
+{
+    t_logRing.Get();
+}
+
+static std::mutex g_logReaderLock;
+static std::deque<LogRecord> g_logHistory;
+
+// g_logReaderLock must be held
+static void DrainLogRings()
+{
+    std::vector<LogRecord> drained;
+    for (LogRing* ring = g_logRings.load(std::memory_order_acquire); ring != nullptr; ring = ring->next)
+    {
+        LogRecord record;
+        while (ring->records.TryPop(record))
+        {
+            drained.push_back(record);
+        }
+
+        UINT64 dropped = ring->dropped.exchange(0u, std::memory_order_relaxed);
+        if (dropped != 0u)
+        {
+            LogRecord note;
+            note.sequence = g_logSequence.fetch_add(1u, std::memory_order_relaxed);
+            note.threadId = 0u;
+            note.level = LOG_LEVEL_ERROR;
+            note.format = L"{} log records dropped";
+            note.argCount = 1u;
+            note.args[0] = MakeLogArg(dropped);
+            drained.push_back(note);
+        }
+    }
+
+    // sequence numbers are taken just before the push, so this is the order the records were written in, give or take
+    // records that were racing the drain
+    std::sort(drained.begin(), drained.end(), [](const LogRecord& a, const LogRecord& b) { return a.sequence < b.sequence; });
+
+    for (const LogRecord& record : drained)
+    {
+        g_logHistory.push_back(record);
+        if (g_logHistory.size() > LOG_HISTORY_SIZE)
+        {
+            g_logHistory.pop_front();
+        }
+    }
+}
+
+static void WriteLogArg(std::wostream& o, const LogArg& arg)
+{
+    switch (arg.kind)
+    {
+    case LogArgKind_Int: o << arg.i; break;
+    case LogArgKind_UInt: o << arg.u; break;
+    case LogArgKind_Double: o << arg.d; break;
+    case LogArgKind_Complex: o << Complex(arg.c[0], arg.c[1]); break;
+    case LogArgKind_String: o << (arg.s == nullptr ? L"(null)" : arg.s); break;
+    }
 }
 
-SomethingToWriteBase::~SomethingToWriteBase()
+static std::wstring FormatLogRecord(const LogRecord& record)
 {
-    // empty
+    static const wchar_t* const levelNames[] = { L"TRACE", L"INFO", L"ERROR" };
+
+    std::wostringstream o;
+    o << L"[" << record.threadId << L"] " << levelNames[min(record.level, (UINT32)LOG_LEVEL_ERROR)] << L": ";
+
+    UINT32 argIndex = 0u;
+    for (const wchar_t* p = record.format; *p != L'\0'; ++p)
+    {
+        if (p[0] == L'{' && p[1] == L'}' && argIndex < record.argCount)
+        {
+            WriteLogArg(o, record.args[argIndex++]);
+            ++p;
+        }
+        else
+        {
+            o << *p;
+        }
+    }
+
+    return o.str();
 }
 
 static Complex root_of_unity(int i, int size, bool isInverse)
@@ -136,21 +286,14 @@ namespace FFTUtils
         return std::shared_ptr<Sequence<Complex>>(new Subsequence<Complex>(input, size, size, 1));
     }
 
-    bool doLogging = false;
-
     void DoFFT(std::shared_ptr<Sequence<Complex>> const& input, std::shared_ptr<Sequence<Complex>> output, bool isInverse)
     {
         if (input->Length() == 2)
         {
-            if (doLogging)
+            if constexpr (BEEP_LOG_ENABLED(LOG_LEVEL_TRACE))
             {
-                WithLogStream
-                (
-                    [&](std::wostream& o)
-                    {
-                        o << L"Input:" << input->Length() << L" " << input;
-                    }
-                );
+                LogWrite(LOG_LEVEL_TRACE, L"Input: {}", input->Length());
+                LogSequence(LOG_LEVEL_TRACE, L"input", input);
             }
 
             Complex a = (*input)[0];
@@ -158,44 +301,27 @@ namespace FFTUtils
             (*output)[0] = a + b;
             (*output)[1] = a - b;
 
-            if (doLogging)
+            if constexpr (BEEP_LOG_ENABLED(LOG_LEVEL_TRACE))
             {
-                WithLogStream
-                (
-                    [&](std::wostream& o)
-                    {
-                        o << L"output:" << output;
-                    }
-                );
+                LogSequence(LOG_LEVEL_TRACE, L"output", output);
             }
         }
         else if (IsPowerOfTwo(input->Length()))
         {
             int size = input->Length();
 
-            if (doLogging)
+            if constexpr (BEEP_LOG_ENABLED(LOG_LEVEL_TRACE))
             {
-                WithLogStream
-                (
-                    [&](std::wostream& o)
-                    {
-                        o << L"Input:" << input->Length() << L" " << input;
-                    }
-                );
+                LogWrite(LOG_LEVEL_TRACE, L"Input: {}", input->Length());
+                LogSequence(LOG_LEVEL_TRACE, L"input", input);
             }
 
             std::shared_ptr<Sequence<Complex>> temp0 = AllocateSequence(size);
             Swizzle(input, temp0);
 
-            if (doLogging)
+            if constexpr (BEEP_LOG_ENABLED(LOG_LEVEL_TRACE))
             {
-                WithLogStream
-                (
-                    [&](std::wostream& o)
-                    {
-                        o << L"temp0:" << temp0;
-                    }
-                );
+                LogSequence(LOG_LEVEL_TRACE, L"temp0", temp0);
             }
 
             std::shared_ptr<Sequence<Complex>> temp1 = AllocateSequence(size);
@@ -203,15 +329,9 @@ namespace FFTUtils
             DoFFT(LeftHalf(temp0), LeftHalf(temp1), isInverse);
             DoFFT(RightHalf(temp0), RightHalf(temp1), isInverse);
 
-            if (doLogging)
+            if constexpr (BEEP_LOG_ENABLED(LOG_LEVEL_TRACE))
             {
-                WithLogStream
-                (
-                    [&](std::wostream& o)
-                    {
-                        o << L"temp1:" << temp1;
-                    }
-                );
+                LogSequence(LOG_LEVEL_TRACE, L"temp1", temp1);
             }
 
             int halfSize = size / 2;
@@ -223,15 +343,9 @@ namespace FFTUtils
                 c = c * twiddle;
             }
 
-            if (doLogging)
+            if constexpr (BEEP_LOG_ENABLED(LOG_LEVEL_TRACE))
             {
-                WithLogStream
-                (
-                    [&](std::wostream& o)
-                    {
-                        o << L"temp1 (after twiddle factors):" << temp1;
-                    }
-                );
+                LogSequence(LOG_LEVEL_TRACE, L"temp1 (after twiddle factors)", temp1);
             }
 
             for (int i = 0; i < halfSize; ++i)
@@ -242,50 +356,1334 @@ namespace FFTUtils
                 (*output)[halfSize + i] = a - b;
             }
 
-            if (doLogging)
+            if constexpr (BEEP_LOG_ENABLED(LOG_LEVEL_TRACE))
+            {
+                LogSequence(LOG_LEVEL_TRACE, L"output", output);
+            }
+        }
+        else
+        {
+            assert(false);
+        }
+    }
+
+
+    // calls visit(i, j) for every index i, where j is i with its bits reversed; j is updated incrementally
+    template<typename Visit>
+    static void ForEachBitReversal(int size, Visit visit)
+    {
+        visit(0, 0);
+        for (int i = 1, j = 0; i < size; ++i)
+        {
+            int bit = size >> 1;
+            for (; (j & bit) != 0; bit >>= 1)
+            {
+                j ^= bit;
+            }
+            j |= bit;
+            visit(i, j);
+        }
+    }
+
+    // iterative radix-2 stages over data that is already in bit-reversed order; the last stage also multiplies by
+    // scale, so normalizing an inverse transform does not take another pass over the data
+    static void Butterflies(Complex* data, int size, bool isInverse, float scale)
+    {
+        if (size == 1)
+        {
+            data[0] *= scale;
+            return;
+        }
+
+        for (int length = 2; length <= size; length <<= 1)
+        {
+            int halfLength = length / 2;
+            bool isLastStage = (length == size) && scale != 1.0f;
+            for (int j = 0; j < halfLength; ++j)
             {
-                WithLogStream
-                (
-                    [&](std::wostream& o)
+                Complex twiddle = root_of_unity(j, length, isInverse);
+                if (isLastStage)
+                {
+                    Complex a = data[j] * scale;
+                    Complex b = data[j + halfLength] * (twiddle * scale);
+                    data[j] = a + b;
+                    data[j + halfLength] = a - b;
+                }
+                else
+                {
+                    for (int i = j; i < size; i += length)
                     {
-                        o << L"output:" << output;
+                        Complex a = data[i];
+                        Complex b = data[i + halfLength] * twiddle;
+                        data[i] = a + b;
+                        data[i + halfLength] = a - b;
                     }
-                );
+                }
+            }
+        }
+    }
+
+    // same as Butterflies, for real and imaginary parts kept in separate arrays
+    static void ButterfliesSplit(float* real, float* imag, int size, bool isInverse, float scale)
+    {
+        if (size == 1)
+        {
+            real[0] *= scale;
+            imag[0] *= scale;
+            return;
+        }
+
+        for (int length = 2; length <= size; length <<= 1)
+        {
+            int halfLength = length / 2;
+            bool isLastStage = (length == size);
+            float stageScale = isLastStage ? scale : 1.0f;
+            for (int j = 0; j < halfLength; ++j)
+            {
+                Complex twiddle = root_of_unity(j, length, isInverse) * stageScale;
+                float wr = twiddle.real();
+                float wi = twiddle.imag();
+                for (int i = j; i < size; i += length)
+                {
+                    int k = i + halfLength;
+                    float ar = real[i] * stageScale;
+                    float ai = imag[i] * stageScale;
+                    float br = real[k] * wr - imag[k] * wi;
+                    float bi = real[k] * wi + imag[k] * wr;
+                    real[i] = ar + br;
+                    imag[i] = ai + bi;
+                    real[k] = ar - br;
+                    imag[k] = ai - bi;
+                }
             }
         }
+    }
+
+    void DoFFTInPlace(Complex* data, int size, bool isInverse, float scale)
+    {
+        assert(IsPowerOfTwo(size));
+
+        // nothing is allocated, so this is safe to call from the audio thread
+        ForEachBitReversal(size, [data](int i, int j)
+        {
+            if (i < j) std::swap(data[i], data[j]);
+        });
+
+        Butterflies(data, size, isInverse, scale);
+    }
+
+    void DoFFTInPlace(Complex* data, int size, bool isInverse)
+    {
+        DoFFTInPlace(data, size, isInverse, 1.0f);
+    }
+
+    void DoFFTCopy(const Complex* input, Complex* output, int size, bool isInverse, float scale)
+    {
+        assert(IsPowerOfTwo(size));
+
+        // the bit-reversal permutation is done while copying, so the input is read once and the output is written
+        // in place from then on
+        ForEachBitReversal(size, [input, output](int i, int j)
+        {
+            output[j] = input[i];
+        });
+
+        Butterflies(output, size, isInverse, scale);
+    }
+
+    void DoFFTSplit(const float* inputReal, const float* inputImag, float* outputReal, float* outputImag, int size, bool isInverse, float scale)
+    {
+        assert(IsPowerOfTwo(size));
+
+        if (inputReal == outputReal && inputImag == outputImag)
+        {
+            ForEachBitReversal(size, [outputReal, outputImag](int i, int j)
+            {
+                if (i < j)
+                {
+                    std::swap(outputReal[i], outputReal[j]);
+                    std::swap(outputImag[i], outputImag[j]);
+                }
+            });
+        }
         else
         {
-            assert(false);
+            ForEachBitReversal(size, [=](int i, int j)
+            {
+                outputReal[j] = inputReal[i];
+                outputImag[j] = inputImag[i];
+            });
+        }
+
+        ButterfliesSplit(outputReal, outputImag, size, isInverse, scale);
+    }
+
+    void DoRealFFT(const float* input, int size, Complex* output)
+    {
+        assert(IsPowerOfTwo(size) && size >= 4);
+
+        // pack even samples into the real part and odd samples into the imaginary part, transform at half size,
+        // then separate the two half-size spectra and combine them with one more butterfly; output doubles as the
+        // working buffer
+        int half = size / 2;
+        for (int i = 0; i < half; ++i)
+        {
+            output[i] = Complex(input[i * 2], input[i * 2 + 1]);
+        }
+
+        DoFFTInPlace(output, half, false);
+
+        // bins k and half - k are computed from the same two values, so they are done in pairs
+        Complex z0 = output[0];
+        for (int k = 1; k <= half / 2; ++k)
+        {
+            Complex zk = output[k];
+            Complex zhk = output[half - k];
+
+            Complex even = (zk + std::conj(zhk)) * 0.5f;
+            Complex odd = (zk - std::conj(zhk)) * Complex(0.0f, -0.5f);
+            Complex evenMirror = (zhk + std::conj(zk)) * 0.5f;
+            Complex oddMirror = (zhk - std::conj(zk)) * Complex(0.0f, -0.5f);
+
+            output[k] = even + root_of_unity(k, size, false) * odd;
+            output[half - k] = evenMirror + root_of_unity(half - k, size, false) * oddMirror;
         }
+
+        output[0] = Complex(z0.real() + z0.imag(), 0.0f);
+        output[half] = Complex(z0.real() - z0.imag(), 0.0f);
     }
 
+    void DoInverseRealFFT(const Complex* input, int size, float* output)
+    {
+        assert(IsPowerOfTwo(size) && size >= 4);
+
+        // undo the last butterfly of DoRealFFT, then one half-size inverse transform yields the even samples in the
+        // real part and the odd samples in the imaginary part, which is already the layout of the output
+        int half = size / 2;
+        Complex* packed = reinterpret_cast<Complex*>(output);
+        for (int k = 0; k < half; ++k)
+        {
+            Complex xk = input[k];
+            Complex xnk = std::conj(input[half - k]);
+            Complex even = (xk + xnk) * 0.5f;
+            Complex odd = (xk - xnk) * 0.5f * root_of_unity(k, size, true);
+            packed[k] = even + Complex(0.0f, 1.0f) * odd;
+        }
+
+        DoFFTInPlace(packed, half, true);
+
+        float scale = 1.0f / (float)half;
+        for (int i = 0; i < size; ++i)
+        {
+            output[i] *= scale;
+        }
+    }
 }
 
-extern "C" __declspec(dllexport) bool FFT(const float* src, float* dest, int size, bool isInverse)
+namespace FFTUtils
 {
-    if (!FFTUtils::IsPowerOfTwo(size)) return false;
-    std::shared_ptr<Sequence<Complex>> input = FFTUtils::AllocateCopyFromMemory(src, size);
-    std::shared_ptr<Sequence<Complex>> output = FFTUtils::AllocateSequence(size);
-    FFTUtils::DoFFT(input, output, isInverse);
-    FFTUtils::CopyToMemory(output, dest, size);
-    if (isInverse)
+    // 32 x 32 complex values is 8 KiB, so a source tile and a destination tile fit in L1 together
+    static constexpr int TRANSPOSE_TILE = 32;
+
+    // a batch should hold at least this many complex values, so that claiming it costs little next to doing it
+    static constexpr int PARALLEL_GRAIN_VALUES = 16384;
+
+    // below this many values, starting threads costs more than it saves
+    static constexpr int PARALLEL_MIN_VALUES = 65536;
+
+    // output (columns x rows) = transpose of input (rows x columns), one band of TRANSPOSE_TILE input rows per item
+    static void TransposeBands(const Complex* input, Complex* output, int rows, int columns, int firstBand, int endBand)
     {
-        int iEnd = size * 2;
-        for (int i = 0; i < iEnd; ++i)
+        for (int band = firstBand; band < endBand; ++band)
+        {
+            int rowBegin = band * TRANSPOSE_TILE;
+            int rowEnd = min(rowBegin + TRANSPOSE_TILE, rows);
+            for (int columnBegin = 0; columnBegin < columns; columnBegin += TRANSPOSE_TILE)
+            {
+                int columnEnd = min(columnBegin + TRANSPOSE_TILE, columns);
+                for (int r = rowBegin; r < rowEnd; ++r)
+                {
+                    const Complex* source = input + (size_t)r * columns;
+                    for (int c = columnBegin; c < columnEnd; ++c)
+                    {
+                        output[(size_t)c * rows + r] = source[c];
+                    }
+                }
+            }
+        }
+    }
+
+    static void Transpose(const Complex* input, Complex* output, int rows, int columns, WorkerGroup& workers)
+    {
+        int bandCount = (rows + TRANSPOSE_TILE - 1) / TRANSPOSE_TILE;
+        int grain = (int)(PARALLEL_GRAIN_VALUES / ((size_t)TRANSPOSE_TILE * columns)) + 1;
+        workers.Run(bandCount, grain, [=](int begin, int end)
+        {
+            TransposeBands(input, output, rows, columns, begin, end);
+        });
+    }
+
+    void DoFFT2D(const Complex* input, Complex* output, int rows, int columns, bool isInverse, float scale, int threadCount)
+    {
+        assert(IsPowerOfTwo(rows) && IsPowerOfTwo(columns));
+
+        if ((size_t)rows * columns < PARALLEL_MIN_VALUES) threadCount = 1;
+
+        // the scratch is allocated before any thread is started, and the same threads run all four passes
+        std::vector<Complex> transposed(rows == 1 ? 0 : (size_t)rows * columns);
+        WorkerGroup workers;
+        workers.Start(threadCount);
+
+        // rows are transformed where they lie; the columns are transposed into rows so that they are contiguous too,
+        // transformed with the scale folded in, and transposed back
+        int rowGrain = PARALLEL_GRAIN_VALUES / columns + 1;
+        workers.Run(rows, rowGrain, [=](int begin, int end)
+        {
+            for (int r = begin; r < end; ++r)
+            {
+                size_t offset = (size_t)r * columns;
+                if (input == output)
+                {
+                    DoFFTInPlace(output + offset, columns, isInverse, 1.0f);
+                }
+                else
+                {
+                    DoFFTCopy(input + offset, output + offset, columns, isInverse, 1.0f);
+                }
+            }
+        });
+
+        if (rows == 1)
+        {
+            if (scale != 1.0f)
+            {
+                for (int c = 0; c < columns; ++c) output[c] *= scale;
+            }
+            return;
+        }
+
+        Transpose(output, transposed.data(), rows, columns, workers);
+
+        int columnGrain = PARALLEL_GRAIN_VALUES / rows + 1;
+        workers.Run(columns, columnGrain, [&transposed, rows, isInverse, scale](int begin, int end)
         {
-            dest[i] /= (float)size;
+            for (int c = begin; c < end; ++c)
+            {
+                DoFFTInPlace(transposed.data() + (size_t)c * rows, rows, isInverse, scale);
+            }
+        });
+
+        Transpose(transposed.data(), output, columns, rows, workers);
+    }
+
+    bool FillWindow(int window, float* dest, int size)
+    {
+        // periodic windows, so that overlapping copies add up evenly
+        const double step = 2.0 * std::numbers::pi / (double)size;
+        for (int n = 0; n < size; ++n)
+        {
+            double c1 = std::cos(step * n);
+            double c2 = std::cos(step * 2.0 * n);
+            switch (window)
+            {
+            case FFTWindow_Rectangular: dest[n] = 1.0f; break;
+            case FFTWindow_Hann: dest[n] = (float)(0.5 - 0.5 * c1); break;
+            case FFTWindow_Hamming: dest[n] = (float)(0.54 - 0.46 * c1); break;
+            case FFTWindow_Blackman: dest[n] = (float)(0.42 - 0.5 * c1 + 0.08 * c2); break;
+            default: return false;
+            }
+        }
+        return true;
+    }
+
+    int STFTFrameCount(int sampleCount, int frameSize, int hopSize)
+    {
+        // frame i is centered on sample i * hopSize, so the first sample is in the middle of a frame; there are just
+        // enough frames for the last one to reach the last sample
+        int half = frameSize / 2;
+        if (sampleCount - 1 < half) return 1;
+        return (sampleCount - 1 - half) / hopSize + 2;
+    }
+
+    static bool IsValidSTFT(int sampleCount, int frameSize, int hopSize)
+    {
+        return sampleCount > 0 && IsPowerOfTwo(frameSize) && frameSize >= 4 && hopSize > 0 && hopSize <= frameSize;
+    }
+
+    // Every sample has to be covered by some frame where the window is not zero, or ISTFT cannot recover it. Frames
+    // start every hopSize samples, so that holds when, for each offset below hopSize, the window is nonzero somewhere
+    // among the offsets that are hopSize apart from it.
+    static bool WindowCoversEverySample(const float* window, int frameSize, int hopSize)
+    {
+        for (int r = 0; r < hopSize; ++r)
+        {
+            float weight = 0.0f;
+            for (int n = r; n < frameSize; n += hopSize)
+            {
+                weight += window[n] * window[n];
+            }
+            if (weight <= 1.0e-10f) return false;
+        }
+        return true;
+    }
+
+    void DoSTFT(const float* samples, int sampleCount, int frameSize, int hopSize, const float* window, Complex* spectra, int threadCount)
+    {
+        int frameCount = STFTFrameCount(sampleCount, frameSize, hopSize);
+        int binCount = frameSize / 2 + 1;
+        if ((size_t)frameCount * frameSize < PARALLEL_MIN_VALUES) threadCount = 1;
+
+        // one frame of scratch per thread, allocated before any thread is started
+        std::vector<float> frames((size_t)threadCount * frameSize);
+        WorkerGroup workers;
+        workers.Start(threadCount);
+        workers.RunPerThread(frameCount, PARALLEL_GRAIN_VALUES / frameSize + 1, [=, &frames](int begin, int end, int thread)
+        {
+            float* frame = frames.data() + (size_t)thread * frameSize;
+            for (int i = begin; i < end; ++i)
+            {
+                int start = i * hopSize - frameSize / 2;
+                for (int n = 0; n < frameSize; ++n)
+                {
+                    int t = start + n;
+                    frame[n] = (t >= 0 && t < sampleCount) ? samples[t] * window[n] : 0.0f;
+                }
+                DoRealFFT(frame, frameSize, spectra + (size_t)i * binCount);
+            }
+        });
+    }
+
+    void DoISTFT(const Complex* spectra, int frameCount, int frameSize, int hopSize, const float* window, float* samples, int sampleCount, int threadCount)
+    {
+        int binCount = frameSize / 2 + 1;
+        if ((size_t)frameCount * frameSize < PARALLEL_MIN_VALUES) threadCount = 1;
+
+        // The output is split into blocks, and each block adds up every frame that touches it, so no two threads write
+        // the same sample; a frame that straddles two blocks is transformed twice. Each sample is divided by the sum
+        // of the squared window over the frames that cover it, which makes this the exact inverse of DoSTFT.
+        int blockSize = max(hopSize * 16, PARALLEL_GRAIN_VALUES);
+        int blockCount = (sampleCount + blockSize - 1) / blockSize;
+
+        // a frame and a block of weights of scratch per thread, allocated before any thread is started
+        std::vector<float> frames((size_t)threadCount * frameSize);
+        std::vector<float> weights((size_t)threadCount * blockSize);
+        WorkerGroup workers;
+        workers.Start(threadCount);
+        workers.RunPerThread(blockCount, 1, [=, &frames, &weights](int block, int, int thread)
+        {
+            int blockStart = block * blockSize;
+            int blockEnd = min(blockStart + blockSize, sampleCount);
+            float* frame = frames.data() + (size_t)thread * frameSize;
+            float* weight = weights.data() + (size_t)thread * blockSize;
+            std::fill(weight, weight + (blockEnd - blockStart), 0.0f);
+            std::fill(samples + blockStart, samples + blockEnd, 0.0f);
+
+            int half = frameSize / 2;
+            int firstFrame = max(0, (blockStart - half + hopSize) / hopSize - 1);
+            int lastFrame = min(frameCount - 1, (blockEnd - 1 + half) / hopSize);
+            for (int i = firstFrame; i <= lastFrame; ++i)
+            {
+                int start = i * hopSize - half;
+                int from = max(start, blockStart);
+                int to = min(start + frameSize, blockEnd);
+                if (from >= to) continue;
+
+                DoInverseRealFFT(spectra + (size_t)i * binCount, frameSize, frame);
+                for (int t = from; t < to; ++t)
+                {
+                    float w = window[t - start];
+                    samples[t] += frame[t - start] * w;
+                    weight[t - blockStart] += w * w;
+                }
+            }
+
+            for (int t = blockStart; t < blockEnd; ++t)
+            {
+                float w = weight[t - blockStart];
+                samples[t] = (w > 1.0e-10f) ? samples[t] / w : 0.0f;
+            }
+        });
+    }
+}
+
+ToneDetector::ToneDetector(float sampleRate, int windowSize, int hopSize)
+    : m_sampleRate(sampleRate)
+    , m_windowSize(windowSize)
+    , m_hopSize(hopSize)
+    , m_count(0)
+    , m_samplesSeen(0u)
+    , m_coefficient()
+    , m_s1()
+    , m_s2()
+    , m_rotateReal()
+    , m_rotateImag()
+    , m_wrapReal()
+    , m_wrapImag()
+    , m_binReal()
+    , m_binImag()
+    , m_history()
+{
+}
+
+bool ToneDetector::Initialize(const float* frequencies, int frequencyCount)
+{
+    if (frequencies == nullptr || frequencyCount <= 0 || m_sampleRate <= 0.0f || m_windowSize <= 0 || m_hopSize <= 0) return false;
+
+    m_count = frequencyCount;
+    if (IsSliding())
+    {
+        // S[n] = e^(jw) S[n-1] + x[n] - e^(jwN) x[n-N] is the DFT at w of the last N samples
+        m_rotateReal.resize(m_count);
+        m_rotateImag.resize(m_count);
+        m_wrapReal.resize(m_count);
+        m_wrapImag.resize(m_count);
+        for (int k = 0; k < m_count; ++k)
+        {
+            double w = 2.0 * std::numbers::pi * (double)frequencies[k] / (double)m_sampleRate;
+            m_rotateReal[k] = std::cos(w);
+            m_rotateImag[k] = std::sin(w);
+            m_wrapReal[k] = std::cos(w * m_windowSize);
+            m_wrapImag[k] = std::sin(w * m_windowSize);
+        }
+        m_history.resize(m_windowSize);
+    }
+    else
+    {
+        m_coefficient.resize(m_count);
+        for (int k = 0; k < m_count; ++k)
+        {
+            double w = 2.0 * std::numbers::pi * (double)frequencies[k] / (double)m_sampleRate;
+            m_coefficient[k] = (float)(2.0 * std::cos(w));
         }
     }
+
+    Reset();
     return true;
 }
 
-extern "C" __declspec(dllexport) int GetLogSize()
+void ToneDetector::Reset()
 {
-    return (int)g_log->size();
+    m_samplesSeen = 0u;
+    m_s1.assign(IsSliding() ? 0 : m_count, 0.0f);
+    m_s2.assign(IsSliding() ? 0 : m_count, 0.0f);
+    m_binReal.assign(IsSliding() ? m_count : 0, 0.0);
+    m_binImag.assign(IsSliding() ? m_count : 0, 0.0);
+    std::fill(m_history.begin(), m_history.end(), 0.0f);
 }
 
-extern "C" __declspec(dllexport) void GetLogEntry(int index, wchar_t* buffer, int bufferSize)
+int ToneDetector::Process(const float* samples, int sampleCount, float* amplitudes, int maxFrames, int* pSamplesConsumed)
 {
-    if (index < 0 || index >= g_log->size()) return;
-    wcscpy_s(buffer, bufferSize, g_log->at(index).c_str());
-}
\ No newline at end of file
+    int frames = 0;
+    int i = 0;
+    if (IsSliding())
+    {
+        const int count = m_count;
+        const double* rotateReal = m_rotateReal.data();
+        const double* rotateImag = m_rotateImag.data();
+        const double* wrapReal = m_wrapReal.data();
+        const double* wrapImag = m_wrapImag.data();
+        double* binReal = m_binReal.data();
+        double* binImag = m_binImag.data();
+
+        for (; i < sampleCount && frames < maxFrames; ++i)
+        {
+            size_t slot = (size_t)(m_samplesSeen % (UINT64)m_windowSize);
+            double x = samples[i];
+            double leaving = m_history[slot];
+            m_history[slot] = samples[i];
+
+            for (int k = 0; k < count; ++k)
+            {
+                double re = binReal[k] * rotateReal[k] - binImag[k] * rotateImag[k] + x - leaving * wrapReal[k];
+                double im = binReal[k] * rotateImag[k] + binImag[k] * rotateReal[k] - leaving * wrapImag[k];
+                binReal[k] = re;
+                binImag[k] = im;
+            }
+
+            ++m_samplesSeen;
+            if (m_samplesSeen >= (UINT64)m_windowSize && (m_samplesSeen - m_windowSize) % (UINT64)m_hopSize == 0u)
+            {
+                WriteSlidingFrame(amplitudes + (size_t)frames * m_count);
+                ++frames;
+            }
+        }
+    }
+    else
+    {
+        const int count = m_count;
+        const float* coefficient = m_coefficient.data();
+        float* s1 = m_s1.data();
+        float* s2 = m_s2.data();
+
+        while (i < sampleCount && frames < maxFrames)
+        {
+            // position within the current hop; samples past the end of the window are skipped
+            int phase = (int)(m_samplesSeen % (UINT64)m_hopSize);
+            if (phase < m_windowSize)
+            {
+                int run = min(m_windowSize - phase, sampleCount - i);
+                for (int n = 0; n < run; ++n)
+                {
+                    float x = samples[i + n];
+                    for (int k = 0; k < count; ++k)
+                    {
+                        float s0 = x + coefficient[k] * s1[k] - s2[k];
+                        s2[k] = s1[k];
+                        s1[k] = s0;
+                    }
+                }
+                i += run;
+                m_samplesSeen += run;
+                if (phase + run == m_windowSize)
+                {
+                    WriteGoertzelFrame(amplitudes + (size_t)frames * m_count);
+                    ++frames;
+                }
+            }
+            else
+            {
+                int run = min(m_hopSize - phase, sampleCount - i);
+                i += run;
+                m_samplesSeen += run;
+            }
+        }
+    }
+
+    if (pSamplesConsumed != nullptr) *pSamplesConsumed = i;
+    return frames;
+}
+
+void ToneDetector::WriteGoertzelFrame(float* amplitudes)
+{
+    float scale = 2.0f / (float)m_windowSize;
+    for (int k = 0; k < m_count; ++k)
+    {
+        float power = m_s1[k] * m_s1[k] + m_s2[k] * m_s2[k] - m_coefficient[k] * m_s1[k] * m_s2[k];
+        amplitudes[k] = std::sqrt(max(power, 0.0f)) * scale;
+        m_s1[k] = 0.0f;
+        m_s2[k] = 0.0f;
+    }
+}
+
+void ToneDetector::WriteSlidingFrame(float* amplitudes)
+{
+    double scale = 2.0 / (double)m_windowSize;
+    for (int k = 0; k < m_count; ++k)
+    {
+        amplitudes[k] = (float)(std::sqrt(m_binReal[k] * m_binReal[k] + m_binImag[k] * m_binImag[k]) * scale);
+    }
+}
+
+// CPUID leaf 1 reports SSE3 in ECX bit 0 and AVX in ECX bit 28. AVX is only usable if the OS saves the YMM
+// registers on a context switch, which XGETBV reports once OSXSAVE (ECX bit 27) is set.
+static int DetectCpuFeatures()
+{
+    int info[4];
+    __cpuid(info, 1);
+    int features = 0;
+    if ((info[2] & (1 << 0)) != 0) features |= FFTCpuFeature_Sse3;
+    if ((info[2] & (1 << 27)) != 0 && (info[2] & (1 << 28)) != 0 && (_xgetbv(0) & 6u) == 6u) features |= FFTCpuFeature_Avx;
+    return features;
+}
+
+static int CpuFeatures()
+{
+    static const int features = DetectCpuFeatures();
+    return features;
+}
+
+// vendor, family/model/stepping and usable features, so that wisdom tuned on one machine is not used on another
+static std::string CpuSignature()
+{
+    int info[4];
+    __cpuid(info, 0);
+    char vendor[13];
+    memcpy(vendor, &info[1], 4);
+    memcpy(vendor + 4, &info[3], 4);
+    memcpy(vendor + 8, &info[2], 4);
+    vendor[12] = '\0';
+    __cpuid(info, 1);
+
+    std::ostringstream o;
+    o << vendor << " " << std::hex << info[0] << std::dec << " " << CpuFeatures();
+    return o.str();
+}
+
+const int FFT_KERNEL_COUNT = 6;
+
+static bool IsKernelSupported(int kernel)
+{
+    switch (kernel)
+    {
+    case FFTKernel_Radix2:
+    case FFTKernel_Radix4:
+        return true;
+    case FFTKernel_Radix2Sse3:
+    case FFTKernel_Radix4Sse3:
+        return (CpuFeatures() & FFTCpuFeature_Sse3) != 0;
+    case FFTKernel_Radix2Avx:
+    case FFTKernel_Radix4Avx:
+        return (CpuFeatures() & FFTCpuFeature_Avx) != 0;
+    default:
+        return false;
+    }
+}
+
+namespace FFTUtils
+{
+    // Complex arithmetic on Width adjacent values at a time, so that one stage template serves every instruction set.
+    // The scalar multiply is written out so that it rounds exactly as the vector lanes do.
+
+    struct ScalarLanes
+    {
+        typedef Complex Vector;
+        static constexpr int Width = 1;
+
+        static Vector Load(const Complex* p) { return *p; }
+        static void Store(Complex* p, Vector v) { *p = v; }
+        static Vector Add(Vector a, Vector b) { return a + b; }
+        static Vector Sub(Vector a, Vector b) { return a - b; }
+
+        static Vector Mul(Vector a, Vector w)
+        {
+            return Complex(a.real() * w.real() - a.imag() * w.imag(), a.imag() * w.real() + a.real() * w.imag());
+        }
+    };
+
+    struct Sse3Lanes
+    {
+        typedef __m128 Vector;
+        static constexpr int Width = 2;
+
+        static Vector Load(const Complex* p) { return _mm_loadu_ps(reinterpret_cast<const float*>(p)); }
+        static void Store(Complex* p, Vector v) { _mm_storeu_ps(reinterpret_cast<float*>(p), v); }
+        static Vector Add(Vector a, Vector b) { return _mm_add_ps(a, b); }
+        static Vector Sub(Vector a, Vector b) { return _mm_sub_ps(a, b); }
+
+        // (ar wr - ai wi, ai wr + ar wi): addsub subtracts in the real lanes and adds in the imaginary ones
+        static Vector Mul(Vector a, Vector w)
+        {
+            __m128 swapped = _mm_shuffle_ps(a, a, _MM_SHUFFLE(2, 3, 0, 1));
+            return _mm_addsub_ps(_mm_mul_ps(a, _mm_moveldup_ps(w)), _mm_mul_ps(swapped, _mm_movehdup_ps(w)));
+        }
+    };
+
+    struct AvxLanes
+    {
+        typedef __m256 Vector;
+        static constexpr int Width = 4;
+
+        static Vector Load(const Complex* p) { return _mm256_loadu_ps(reinterpret_cast<const float*>(p)); }
+        static void Store(Complex* p, Vector v) { _mm256_storeu_ps(reinterpret_cast<float*>(p), v); }
+        static Vector Add(Vector a, Vector b) { return _mm256_add_ps(a, b); }
+        static Vector Sub(Vector a, Vector b) { return _mm256_sub_ps(a, b); }
+
+        static Vector Mul(Vector a, Vector w)
+        {
+            __m256 swapped = _mm256_permute_ps(a, _MM_SHUFFLE(2, 3, 0, 1));
+            return _mm256_addsub_ps(_mm256_mul_ps(a, _mm256_moveldup_ps(w)), _mm256_mul_ps(swapped, _mm256_movehdup_ps(w)));
+        }
+    };
+
+    // one radix-2 stage, with butterflies halfLength apart in blocks of 2 * halfLength
+    template<typename Lanes>
+    static void Radix2Stage(Complex* data, int size, int halfLength, const Complex* twiddles)
+    {
+        for (int i = 0; i < size; i += 2 * halfLength)
+        {
+            for (int j = 0; j < halfLength; j += Lanes::Width)
+            {
+                Complex* p = data + i + j;
+                typename Lanes::Vector a = Lanes::Load(p);
+                typename Lanes::Vector b = Lanes::Mul(Lanes::Load(p + halfLength), Lanes::Load(twiddles + j));
+                Lanes::Store(p, Lanes::Add(a, b));
+                Lanes::Store(p + halfLength, Lanes::Sub(a, b));
+            }
+        }
+    }
+
+    // the radix-2 stages for quarterLength and 2 * quarterLength done together, so that the data makes one pass
+    // through memory instead of two; the arithmetic is the same as doing them one at a time, and so are the results
+    template<typename Lanes>
+    static void Radix4Stage(Complex* data, int size, int quarterLength, const Complex* innerTwiddles, const Complex* outerTwiddles)
+    {
+        int q = quarterLength;
+        for (int i = 0; i < size; i += 4 * q)
+        {
+            for (int j = 0; j < q; j += Lanes::Width)
+            {
+                Complex* p = data + i + j;
+                typename Lanes::Vector w = Lanes::Load(innerTwiddles + j);
+                typename Lanes::Vector x0 = Lanes::Load(p);
+                typename Lanes::Vector x1 = Lanes::Mul(Lanes::Load(p + q), w);
+                typename Lanes::Vector x2 = Lanes::Load(p + 2 * q);
+                typename Lanes::Vector x3 = Lanes::Mul(Lanes::Load(p + 3 * q), w);
+                typename Lanes::Vector a0 = Lanes::Add(x0, x1);
+                typename Lanes::Vector a1 = Lanes::Sub(x0, x1);
+                typename Lanes::Vector a2 = Lanes::Mul(Lanes::Add(x2, x3), Lanes::Load(outerTwiddles + j));
+                typename Lanes::Vector a3 = Lanes::Mul(Lanes::Sub(x2, x3), Lanes::Load(outerTwiddles + j + q));
+                Lanes::Store(p, Lanes::Add(a0, a2));
+                Lanes::Store(p + q, Lanes::Add(a1, a3));
+                Lanes::Store(p + 2 * q, Lanes::Sub(a0, a2));
+                Lanes::Store(p + 3 * q, Lanes::Sub(a1, a3));
+            }
+        }
+    }
+
+    // every stage over data that is already in bit-reversed order; stages narrower than a vector run scalar
+    template<typename Lanes>
+    static void Stages(Complex* data, int size, const Complex* twiddles, bool inPairs)
+    {
+        int halfLength = 1;
+        if (inPairs)
+        {
+            // a power of two with no bit at an even position has an odd number of stages, and the first runs alone
+            if ((size & 0x55555555) == 0)
+            {
+                Radix2Stage<ScalarLanes>(data, size, 1, twiddles);
+                halfLength = 2;
+            }
+            for (; halfLength < size; halfLength <<= 2)
+            {
+                const Complex* inner = twiddles + halfLength - 1;
+                const Complex* outer = twiddles + 2 * halfLength - 1;
+                if (halfLength >= Lanes::Width)
+                {
+                    Radix4Stage<Lanes>(data, size, halfLength, inner, outer);
+                }
+                else
+                {
+                    Radix4Stage<ScalarLanes>(data, size, halfLength, inner, outer);
+                }
+            }
+        }
+        else
+        {
+            for (; halfLength < size; halfLength <<= 1)
+            {
+                if (halfLength >= Lanes::Width)
+                {
+                    Radix2Stage<Lanes>(data, size, halfLength, twiddles + halfLength - 1);
+                }
+                else
+                {
+                    Radix2Stage<ScalarLanes>(data, size, halfLength, twiddles + halfLength - 1);
+                }
+            }
+        }
+    }
+
+    // the bit-reversal permutation, multiplying by scale on the way so that it costs no extra pass
+    static void PermuteScaled(const Complex* input, Complex* output, int size, float scale)
+    {
+        if (input == output)
+        {
+            ForEachBitReversal(size, [output, scale](int i, int j)
+            {
+                if (i < j)
+                {
+                    Complex temp = output[i];
+                    output[i] = output[j] * scale;
+                    output[j] = temp * scale;
+                }
+                else if (i == j)
+                {
+                    output[i] *= scale;
+                }
+            });
+        }
+        else
+        {
+            ForEachBitReversal(size, [input, output, scale](int i, int j)
+            {
+                output[j] = input[i] * scale;
+            });
+        }
+    }
+}
+
+// Tuned kernel choices by transform size, shared by every plan in the process. Measuring a size adds it; wisdom can
+// be exported as text and imported again after a restart.
+
+static std::mutex g_wisdomLock;
+static std::map<int, FFTKernel> g_wisdom;
+
+// each kernel is timed this many times and its fastest time kept, which leaves out the first (cold) run and any
+// interruptions
+const int FFT_PLAN_MEASURE_ROUNDS = 5;
+
+// one timing covers at least this many values' worth of transforms, so small sizes are not lost in timer resolution
+const int FFT_PLAN_MEASURE_VALUES = 65536;
+
+static FFTKernel EstimateKernel()
+{
+    if ((CpuFeatures() & FFTCpuFeature_Avx) != 0) return FFTKernel_Radix4Avx;
+    if ((CpuFeatures() & FFTCpuFeature_Sse3) != 0) return FFTKernel_Radix4Sse3;
+    return FFTKernel_Radix4;
+}
+
+FFTPlan::FFTPlan(int size)
+    : m_size(size)
+    , m_kernel(FFTKernel_Radix2)
+    , m_forwardTwiddles()
+    , m_inverseTwiddles()
+{
+}
+
+bool FFTPlan::Initialize(int mode)
+{
+    if (m_size <= 0 || !FFTUtils::IsPowerOfTwo(m_size)) return false;
+    if (mode != FFTPlanMode_Estimate && mode != FFTPlanMode_Measure) return false;
+
+    // FFTCreatePlan is called from C, so running out of memory (for the twiddles, for measuring, or for the wisdom
+    // table) is reported as a failure rather than thrown
+    try
+    {
+        // worked out in double, so that large sizes do not inherit the rounding of a float angle
+        m_forwardTwiddles.resize(m_size - 1);
+        m_inverseTwiddles.resize(m_size - 1);
+        for (int halfLength = 1; halfLength < m_size; halfLength <<= 1)
+        {
+            for (int j = 0; j < halfLength; ++j)
+            {
+                double angle = std::numbers::pi * j / halfLength;
+                float c = (float)std::cos(angle);
+                float s = (float)std::sin(angle);
+                m_forwardTwiddles[halfLength - 1 + j] = Complex(c, -s);
+                m_inverseTwiddles[halfLength - 1 + j] = Complex(c, s);
+            }
+        }
+
+        std::optional<FFTKernel> remembered;
+        {
+            std::lock_guard<std::mutex> lock(g_wisdomLock);
+            std::map<int, FFTKernel>::const_iterator it = g_wisdom.find(m_size);
+            if (it != g_wisdom.cend()) remembered = it->second;
+        }
+
+        if (remembered.has_value())
+        {
+            m_kernel = remembered.value();
+        }
+        else if (mode == FFTPlanMode_Measure)
+        {
+            m_kernel = Measure();
+            std::lock_guard<std::mutex> lock(g_wisdomLock);
+            g_wisdom[m_size] = m_kernel;
+        }
+        else
+        {
+            m_kernel = EstimateKernel();
+        }
+    }
+    catch (std::bad_alloc const &)
+    {
+        return false;
+    }
+
+    BEEP_LOG(LOG_LEVEL_INFO, L"FFT plan for size {} uses kernel {}", m_size, (int)m_kernel);
+    return true;
+}
+
+FFTKernel FFTPlan::Measure() const
+{
+    std::vector<Complex> input(m_size);
+    std::vector<Complex> output(m_size);
+    for (int i = 0; i < m_size; ++i)
+    {
+        input[i] = Complex((float)(i % 7) - 3.0f, (float)(i % 5) - 2.0f);
+    }
+
+    int repeat = max(1, FFT_PLAN_MEASURE_VALUES / m_size);
+    FFTKernel best = FFTKernel_Radix2;
+    LONGLONG bestTicks = LLONG_MAX;
+    for (int kernel = 0; kernel < FFT_KERNEL_COUNT; ++kernel)
+    {
+        if (!IsKernelSupported(kernel)) continue;
+
+        LONGLONG ticks = LLONG_MAX;
+        for (int round = 0; round < FFT_PLAN_MEASURE_ROUNDS; ++round)
+        {
+            LARGE_INTEGER start;
+            LARGE_INTEGER end;
+            QueryPerformanceCounter(&start);
+            for (int i = 0; i < repeat; ++i)
+            {
+                Run((FFTKernel)kernel, input.data(), output.data(), false, 1.0f);
+            }
+            QueryPerformanceCounter(&end);
+            ticks = min(ticks, end.QuadPart - start.QuadPart);
+        }
+
+        BEEP_LOG(LOG_LEVEL_TRACE, L"FFT size {}, kernel {}: {} ticks for {} transforms", m_size, kernel, ticks, repeat);
+        if (ticks < bestTicks)
+        {
+            bestTicks = ticks;
+            best = (FFTKernel)kernel;
+        }
+    }
+    return best;
+}
+
+void FFTPlan::Run(FFTKernel kernel, const Complex* input, Complex* output, bool isInverse, float scale) const
+{
+    FFTUtils::PermuteScaled(input, output, m_size, scale);
+
+    const Complex* twiddles = isInverse ? m_inverseTwiddles.data() : m_forwardTwiddles.data();
+    switch (kernel)
+    {
+    case FFTKernel_Radix2:
+        FFTUtils::Stages<FFTUtils::ScalarLanes>(output, m_size, twiddles, false);
+        break;
+    case FFTKernel_Radix4:
+        FFTUtils::Stages<FFTUtils::ScalarLanes>(output, m_size, twiddles, true);
+        break;
+    case FFTKernel_Radix2Sse3:
+        FFTUtils::Stages<FFTUtils::Sse3Lanes>(output, m_size, twiddles, false);
+        break;
+    case FFTKernel_Radix4Sse3:
+        FFTUtils::Stages<FFTUtils::Sse3Lanes>(output, m_size, twiddles, true);
+        break;
+    case FFTKernel_Radix2Avx:
+        FFTUtils::Stages<FFTUtils::AvxLanes>(output, m_size, twiddles, false);
+        break;
+    case FFTKernel_Radix4Avx:
+        FFTUtils::Stages<FFTUtils::AvxLanes>(output, m_size, twiddles, true);
+        break;
+    default:
+        assert(false);
+    }
+}
+
+void FFTPlan::Execute(const Complex* input, Complex* output, bool isInverse, float scale) const
+{
+    Run(m_kernel, input, output, isInverse, scale);
+}
+
+// Wisdom text is a header line naming the format and the CPU, then one "size kernel" line per tuned size.
+
+const char* const FFT_WISDOM_MAGIC = "BEEPFFTW";
+const int FFT_WISDOM_VERSION = 1;
+
+static std::string WisdomHeader()
+{
+    std::ostringstream o;
+    o << FFT_WISDOM_MAGIC << " " << FFT_WISDOM_VERSION << " " << CpuSignature();
+    return o.str();
+}
+
+// like std::getline, but also accepts lines that end in "\r\n"
+static bool ReadWisdomLine(std::istream& in, std::string& line)
+{
+    if (!std::getline(in, line)) return false;
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    return true;
+}
+
+// true if the count floats at a and the count floats at b share any memory
+static bool Overlaps(const float* a, const float* b, size_t count)
+{
+    uintptr_t aStart = reinterpret_cast<uintptr_t>(a);
+    uintptr_t bStart = reinterpret_cast<uintptr_t>(b);
+    size_t bytes = count * sizeof(float);
+    return aStart < bStart + bytes && bStart < aStart + bytes;
+}
+
+// A source that partly overlaps the destination is moved into the destination first, and transformed there.
+extern "C" __declspec(dllexport) bool FFT(const float* src, float* dest, int size, bool isInverse)
+{
+    if (!FFTUtils::IsPowerOfTwo(size)) return false;
+    float scale = isInverse ? 1.0f / (float)size : 1.0f;
+    if (src == dest)
+    {
+        FFTUtils::DoFFTInPlace(reinterpret_cast<Complex*>(dest), size, isInverse, scale);
+    }
+    else if (Overlaps(src, dest, (size_t)size * 2))
+    {
+        memmove(dest, src, (size_t)size * 2 * sizeof(float));
+        FFTUtils::DoFFTInPlace(reinterpret_cast<Complex*>(dest), size, isInverse, scale);
+    }
+    else
+    {
+        FFTUtils::DoFFTCopy(reinterpret_cast<const Complex*>(src), reinterpret_cast<Complex*>(dest), size, isInverse, scale);
+    }
+    return true;
+}
+
+extern "C" __declspec(dllexport) bool FFTInPlace(float* data, int size, bool isInverse)
+{
+    return FFT(data, data, size, isInverse);
+}
+
+// Working in place needs both source arrays to be the destination arrays. Any other overlap between a source and a
+// destination array is handled by copying the source first, which is the only case that allocates.
+extern "C" __declspec(dllexport) bool FFTSplit(const float* srcReal, const float* srcImag, float* destReal, float* destImag, int size, bool isInverse)
+{
+    if (!FFTUtils::IsPowerOfTwo(size)) return false;
+    float scale = isInverse ? 1.0f / (float)size : 1.0f;
+
+    bool isInPlace = (srcReal == destReal && srcImag == destImag);
+    bool isOverlapping = Overlaps(srcReal, destReal, size) || Overlaps(srcReal, destImag, size)
+        || Overlaps(srcImag, destReal, size) || Overlaps(srcImag, destImag, size);
+    if (isInPlace || !isOverlapping)
+    {
+        FFTUtils::DoFFTSplit(srcReal, srcImag, destReal, destImag, size, isInverse, scale);
+        return true;
+    }
+
+    try
+    {
+        std::vector<float> copy(srcReal, srcReal + size);
+        copy.insert(copy.end(), srcImag, srcImag + size);
+        FFTUtils::DoFFTSplit(copy.data(), copy.data() + size, destReal, destImag, size, isInverse, scale);
+        return true;
+    }
+    catch (std::bad_alloc const &)
+    {
+        return false;
+    }
+}
+
+extern "C" __declspec(dllexport) bool FFT2D(const float* src, float* dest, int rows, int columns, bool isInverse, int threadCount)
+{
+    if (!FFTUtils::IsPowerOfTwo(rows) || !FFTUtils::IsPowerOfTwo(columns)) return false;
+    if (threadCount <= 0)
+    {
+        SYSTEM_INFO systemInfo;
+        GetSystemInfo(&systemInfo);
+        threadCount = max((int)systemInfo.dwNumberOfProcessors, 1);
+    }
+    float scale = isInverse ? 1.0f / ((float)rows * (float)columns) : 1.0f;
+
+    try
+    {
+        FFTUtils::DoFFT2D(reinterpret_cast<const Complex*>(src), reinterpret_cast<Complex*>(dest), rows, columns, isInverse, scale, threadCount);
+        return true;
+    }
+    catch (std::bad_alloc const &)
+    {
+        return false;
+    }
+}
+
+extern "C" __declspec(dllexport) int FFTGetCpuFeatures()
+{
+    return CpuFeatures();
+}
+
+extern "C" __declspec(dllexport) FFTPlanHandle FFTCreatePlan(int size, int mode)
+{
+    try
+    {
+        std::unique_ptr<FFTPlan> plan = std::unique_ptr<FFTPlan>(new FFTPlan(size));
+        if (plan == nullptr) return nullptr;
+        if (!plan->Initialize(mode)) return nullptr;
+        return plan.release();
+    }
+    catch (std::bad_alloc const &)
+    {
+        return nullptr;
+    }
+}
+
+// As with FFT, a source that partly overlaps the destination is moved into the destination first, and transformed there.
+extern "C" __declspec(dllexport) bool FFTExecutePlan(FFTPlanHandle plan, const float* src, float* dest, bool isInverse)
+{
+    if (plan == nullptr || src == nullptr || dest == nullptr) return false;
+    const FFTPlan* thePlan = static_cast<const FFTPlan*>(plan);
+    int size = thePlan->Size();
+    float scale = isInverse ? 1.0f / (float)size : 1.0f;
+    if (src != dest && Overlaps(src, dest, (size_t)size * 2))
+    {
+        memmove(dest, src, (size_t)size * 2 * sizeof(float));
+        src = dest;
+    }
+    thePlan->Execute(reinterpret_cast<const Complex*>(src), reinterpret_cast<Complex*>(dest), isInverse, scale);
+    return true;
+}
+
+extern "C" __declspec(dllexport) int FFTPlanGetKernel(FFTPlanHandle plan)
+{
+    if (plan == nullptr) return -1;
+    return static_cast<const FFTPlan*>(plan)->Kernel();
+}
+
+extern "C" __declspec(dllexport) void FFTDestroyPlan(FFTPlanHandle plan)
+{
+    delete static_cast<FFTPlan*>(plan);
+}
+
+// Returns 0 if the text could not be put together for lack of memory.
+extern "C" __declspec(dllexport) int FFTExportWisdom(char* buffer, int bufferSize)
+{
+    try
+    {
+        std::ostringstream o;
+        o << WisdomHeader() << "\n";
+        {
+            std::lock_guard<std::mutex> lock(g_wisdomLock);
+            for (std::map<int, FFTKernel>::const_iterator it = g_wisdom.cbegin(); it != g_wisdom.cend(); ++it)
+            {
+                o << it->first << " " << (int)it->second << "\n";
+            }
+        }
+
+        std::string text = o.str();
+        int required = (int)text.size() + 1;
+        if (buffer != nullptr && bufferSize >= required)
+        {
+            memcpy(buffer, text.c_str(), required);
+        }
+        return required;
+    }
+    catch (std::bad_alloc const &)
+    {
+        return 0;
+    }
+}
+
+extern "C" __declspec(dllexport) bool FFTImportWisdom(const char* wisdom)
+{
+    if (wisdom == nullptr) return false;
+
+    try
+    {
+        std::istringstream in(wisdom);
+        std::string line;
+        if (!ReadWisdomLine(in, line) || line != WisdomHeader()) return false;
+
+        // nothing is imported unless every line is good
+        std::map<int, FFTKernel> entries;
+        while (ReadWisdomLine(in, line))
+        {
+            if (line.empty()) continue;
+            std::istringstream fields(line);
+            int size;
+            int kernel;
+            std::string extra;
+            if (!(fields >> size >> kernel) || (fields >> extra)) return false;
+            if (size <= 0 || !FFTUtils::IsPowerOfTwo(size) || !IsKernelSupported(kernel)) return false;
+            entries[size] = (FFTKernel)kernel;
+        }
+
+        // the new entries take precedence over the old ones, and are merged into the table in one step
+        std::lock_guard<std::mutex> lock(g_wisdomLock);
+        entries.insert(g_wisdom.cbegin(), g_wisdom.cend());
+        g_wisdom.swap(entries);
+        return true;
+    }
+    catch (std::bad_alloc const &)
+    {
+        return false;
+    }
+}
+
+extern "C" __declspec(dllexport) void FFTForgetWisdom()
+{
+    std::lock_guard<std::mutex> lock(g_wisdomLock);
+    g_wisdom.clear();
+}
+
+extern "C" __declspec(dllexport) int STFTGetFrameCount(int sampleCount, int frameSize, int hopSize)
+{
+    if (!FFTUtils::IsValidSTFT(sampleCount, frameSize, hopSize)) return 0;
+    return FFTUtils::STFTFrameCount(sampleCount, frameSize, hopSize);
+}
+
+extern "C" __declspec(dllexport) bool STFT(const float* samples, int sampleCount, int frameSize, int hopSize, int window, float* spectra, int threadCount)
+{
+    if (samples == nullptr || spectra == nullptr || !FFTUtils::IsValidSTFT(sampleCount, frameSize, hopSize)) return false;
+    if (threadCount <= 0)
+    {
+        SYSTEM_INFO systemInfo;
+        GetSystemInfo(&systemInfo);
+        threadCount = max((int)systemInfo.dwNumberOfProcessors, 1);
+    }
+
+    try
+    {
+        std::vector<float> windowValues(frameSize);
+        if (!FFTUtils::FillWindow(window, windowValues.data(), frameSize)) return false;
+        if (!FFTUtils::WindowCoversEverySample(windowValues.data(), frameSize, hopSize)) return false;
+        FFTUtils::DoSTFT(samples, sampleCount, frameSize, hopSize, windowValues.data(), reinterpret_cast<Complex*>(spectra), threadCount);
+        return true;
+    }
+    catch (std::bad_alloc const &)
+    {
+        return false;
+    }
+}
+
+extern "C" __declspec(dllexport) bool ISTFT(const float* spectra, int frameCount, int frameSize, int hopSize, int window, float* samples, int sampleCount, int threadCount)
+{
+    if (spectra == nullptr || samples == nullptr || !FFTUtils::IsValidSTFT(sampleCount, frameSize, hopSize) || frameCount <= 0) return false;
+    if (threadCount <= 0)
+    {
+        SYSTEM_INFO systemInfo;
+        GetSystemInfo(&systemInfo);
+        threadCount = max((int)systemInfo.dwNumberOfProcessors, 1);
+    }
+
+    try
+    {
+        std::vector<float> windowValues(frameSize);
+        if (!FFTUtils::FillWindow(window, windowValues.data(), frameSize)) return false;
+        if (!FFTUtils::WindowCoversEverySample(windowValues.data(), frameSize, hopSize)) return false;
+        FFTUtils::DoISTFT(reinterpret_cast<const Complex*>(spectra), frameCount, frameSize, hopSize, windowValues.data(), samples, sampleCount, threadCount);
+        return true;
+    }
+    catch (std::bad_alloc const &)
+    {
+        return false;
+    }
+}
+
+extern "C" __declspec(dllexport) ToneDetectorHandle CreateToneDetector(const float* frequencies, int frequencyCount, float sampleRate, int windowSize, int hopSize)
+{
+    try
+    {
+        std::unique_ptr<ToneDetector> detector = std::unique_ptr<ToneDetector>(new ToneDetector(sampleRate, windowSize, hopSize));
+        if (detector == nullptr) return nullptr;
+        if (!detector->Initialize(frequencies, frequencyCount)) return nullptr;
+        return detector.release();
+    }
+    catch (std::bad_alloc const &)
+    {
+        return nullptr;
+    }
+}
+
+extern "C" __declspec(dllexport) int ToneDetectorProcess(ToneDetectorHandle detector, const float* samples, int sampleCount, float* amplitudes, int maxFrames, int* pSamplesConsumed)
+{
+    if (detector == nullptr || samples == nullptr || sampleCount <= 0 || amplitudes == nullptr || maxFrames <= 0)
+    {
+        if (pSamplesConsumed != nullptr) *pSamplesConsumed = 0;
+        return 0;
+    }
+    return static_cast<ToneDetector*>(detector)->Process(samples, sampleCount, amplitudes, maxFrames, pSamplesConsumed);
+}
+
+extern "C" __declspec(dllexport) void ToneDetectorReset(ToneDetectorHandle detector)
+{
+    if (detector == nullptr) return;
+    static_cast<ToneDetector*>(detector)->Reset();
+}
+
+extern "C" __declspec(dllexport) void DestroyToneDetector(ToneDetectorHandle detector)
+{
+    delete static_cast<ToneDetector*>(detector);
+}
+
+extern "C" __declspec(dllexport) int GetLogSize()
+{
+    std::lock_guard<std::mutex> lock(g_logReaderLock);
+    DrainLogRings();
+    return (int)g_logHistory.size();
+}
+
+extern "C" __declspec(dllexport) void GetLogEntry(int index, wchar_t* buffer, int bufferSize)
+{
+    std::lock_guard<std::mutex> lock(g_logReaderLock);
+    if (index < 0 || index >= g_logHistory.size()) return;
+    wcscpy_s(buffer, bufferSize, FormatLogRecord(g_logHistory.at(index)).c_str());
+}
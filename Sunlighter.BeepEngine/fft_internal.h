@@ -2,72 +2,119 @@
 
 #include "fft.h"
 
-extern std::unique_ptr<std::deque<std::wstring>> g_log;
+typedef std::complex<float> Complex;
+
+// Logging. A log site writes a fixed-size binary record into a ring owned by the calling thread, which never blocks
+// and never allocates (except the first time a thread logs, when its ring is created). Records are merged and turned
+// into text only when GetLogSize or GetLogEntry is called. If a thread's ring is full, its records are dropped.
+//
+// Sites below BEEP_LOG_LEVEL are removed at compile time, arguments included.
+
+#define LOG_LEVEL_TRACE 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_ERROR 2
+#define LOG_LEVEL_NONE 3
+
+#ifndef BEEP_LOG_LEVEL
+#ifdef _DEBUG
+#define BEEP_LOG_LEVEL LOG_LEVEL_INFO
+#else
+#define BEEP_LOG_LEVEL LOG_LEVEL_ERROR
+#endif
+#endif
 
-void Log(const std::wstring& message);
+#define BEEP_LOG_ENABLED(level) ((level) >= BEEP_LOG_LEVEL)
 
-void WithLogStream(std::function<void(std::wostream& o)> f);
+// The format is a string literal in which each {} is replaced by the next argument. Arguments may be integers,
+// floating-point numbers, Complex values, or string literals (only the pointer is recorded).
+#define BEEP_LOG(level, format, ...) \
+    do { if constexpr (BEEP_LOG_ENABLED(level)) { LogWrite((level), (format), ##__VA_ARGS__); } } while (false)
 
-class SomethingToWriteBase
+enum LogArgKind
 {
-public:
-    virtual ~SomethingToWriteBase();
-    virtual void WriteTo(std::wostream& o) const = 0;
+    LogArgKind_Int,
+    LogArgKind_UInt,
+    LogArgKind_Double,
+    LogArgKind_Complex,
+    LogArgKind_String,
+};
+
+struct LogArg
+{
+    LogArgKind kind;
+    union
+    {
+        INT64 i;
+        UINT64 u;
+        double d;
+        float c[2];
+        const wchar_t* s;
+    };
 };
 
 template<typename T>
-class SomethingToWrite : public SomethingToWriteBase
+LogArg MakeLogArg(T value)
 {
-public:
-    SomethingToWrite(const std::wstring& name, T value)
-        : name(name)
-        , value(value)
+    LogArg arg;
+    if constexpr (std::is_same_v<T, Complex>)
     {
+        arg.kind = LogArgKind_Complex;
+        arg.c[0] = value.real();
+        arg.c[1] = value.imag();
     }
-
-    void WriteTo(std::wostream& o) const override
+    else if constexpr (std::is_floating_point_v<T>)
     {
-        o << name << L" = [" << value << L"]";
+        arg.kind = LogArgKind_Double;
+        arg.d = value;
     }
-private:
-    const std::wstring name;
-    const T value;
-};
-
-class WriteList
-{
-public:
-    template<typename T>
-    WriteList& Add(const std::wstring& name, T value)
+    else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>)
     {
-        list.push_back(std::move(std::unique_ptr<SomethingToWriteBase>(new SomethingToWrite<T>(name, value))));
-        return *this;
+        arg.kind = LogArgKind_Int;
+        arg.i = value;
     }
-
-    void WriteToLog()
+    else if constexpr (std::is_integral_v<T> || std::is_enum_v<T>)
     {
-        WithLogStream
-        (
-            [&](std::wostream& o)
-            {
-                bool needDelim = false;
-                for (const auto& item : list)
-                {
-                    if (needDelim) o << L", ";
-                    item->WriteTo(o);
-                    needDelim = true;
-                }
-            }
-        );
-
-        list.clear();
+        arg.kind = LogArgKind_UInt;
+        arg.u = static_cast<UINT64>(value);
+    }
+    else
+    {
+        static_assert(std::is_convertible_v<T, const wchar_t*>, "unsupported log argument type");
+        arg.kind = LogArgKind_String;
+        arg.s = value;
     }
+    return arg;
+}
 
-private:
-    std::vector<std::unique_ptr<SomethingToWriteBase>> list;
+const UINT32 LOG_MAX_ARGS = 4u;
+
+struct LogRecord
+{
+    UINT64 sequence;
+    DWORD threadId;
+    UINT32 level;
+    const wchar_t* format;
+    UINT32 argCount;
+    LogArg args[LOG_MAX_ARGS];
 };
 
-typedef std::complex<float> Complex;
+void LogWriteRecord(LogRecord& record);
+
+// Creates the calling thread's log ring now, so that its first log site does not allocate.
+void LogPrepareThread();
+
+template<typename... Args>
+void LogWrite(UINT32 level, const wchar_t* format, Args... args)
+{
+    static_assert(sizeof...(Args) <= LOG_MAX_ARGS, "too many log arguments");
+
+    LogRecord record;
+    record.level = level;
+    record.format = format;
+    record.argCount = 0u;
+    ((record.args[record.argCount++] = MakeLogArg(args)), ...);
+    LogWriteRecord(record);
+}
 
 static Complex root_of_unity(int i, int size, bool isInverse);
 
@@ -104,6 +151,16 @@ std::wostream& operator<<(std::wostream& o, std::shared_ptr<Sequence<T>> const&
     return o;
 }
 
+template<typename T>
+void LogSequence(UINT32 level, const wchar_t* label, std::shared_ptr<Sequence<T>> const& seq)
+{
+    int iEnd = seq->Length();
+    for (int i = 0; i < iEnd; ++i)
+    {
+        LogWrite(level, L"{}[{}] = {}", label, i, (*seq)[i]);
+    }
+}
+
 template<typename T>
 class ArraySequence : public Sequence<T>
 {
@@ -199,4 +256,87 @@ namespace FFTUtils
     std::shared_ptr<Sequence<Complex>> LeftHalf(std::shared_ptr<Sequence<Complex>> input);
     std::shared_ptr<Sequence<Complex>> RightHalf(std::shared_ptr<Sequence<Complex>> input);
     void DoFFT(std::shared_ptr<Sequence<Complex>> const& input, std::shared_ptr<Sequence<Complex>> output, bool isInverse);
+    void DoFFTInPlace(Complex* data, int size, bool isInverse);
+    void DoFFTInPlace(Complex* data, int size, bool isInverse, float scale);
+    void DoFFTCopy(const Complex* input, Complex* output, int size, bool isInverse, float scale);
+    void DoFFTSplit(const float* inputReal, const float* inputImag, float* outputReal, float* outputImag, int size, bool isInverse, float scale);
+    void DoFFT2D(const Complex* input, Complex* output, int rows, int columns, bool isInverse, float scale, int threadCount);
+    bool FillWindow(int window, float* dest, int size);
+    int STFTFrameCount(int sampleCount, int frameSize, int hopSize);
+    void DoSTFT(const float* samples, int sampleCount, int frameSize, int hopSize, const float* window, Complex* spectra, int threadCount);
+    void DoISTFT(const Complex* spectra, int frameCount, int frameSize, int hopSize, const float* window, float* samples, int sampleCount, int threadCount);
+    void DoRealFFT(const float* input, int size, Complex* output);
+    void DoInverseRealFFT(const Complex* input, int size, float* output);
 }
+
+// One transform size, with its twiddle factors worked out once. The kernel (whether stages run one at a time or two
+// at a time, and on which instruction set) is chosen by Initialize: from wisdom if this size has been tuned before,
+// otherwise by timing every kernel the CPU supports (FFTPlanMode_Measure) or by a guess (FFTPlanMode_Estimate).
+// Execute does not allocate and may be called from several threads at once.
+
+class FFTPlan
+{
+public:
+    FFTPlan(int size);
+
+    bool Initialize(int mode);
+    int Size() const { return m_size; }
+    FFTKernel Kernel() const { return m_kernel; }
+
+    // input and output may be the same; every output value is multiplied by scale
+    void Execute(const Complex* input, Complex* output, bool isInverse, float scale) const;
+
+private:
+    const int m_size;
+    FFTKernel m_kernel;
+
+    // the twiddle factors for the stage whose butterflies are halfLength apart start at index halfLength - 1
+    std::vector<Complex> m_forwardTwiddles;
+    std::vector<Complex> m_inverseTwiddles;
+
+    void Run(FFTKernel kernel, const Complex* input, Complex* output, bool isInverse, float scale) const;
+    FFTKernel Measure() const;
+};
+
+// Measures the amplitude of a few chosen frequencies over frames of windowSize samples that start every hopSize
+// samples. When frames do not overlap, each frame is a Goertzel filter per frequency; when they do, a sliding DFT is
+// updated every sample. Either way the cost is O(frequency count) per sample. State is kept one array per quantity,
+// so the loops over frequencies vectorize.
+
+class ToneDetector
+{
+public:
+    ToneDetector(float sampleRate, int windowSize, int hopSize);
+
+    bool Initialize(const float* frequencies, int frequencyCount);
+    void Reset();
+
+    // writes frequencyCount amplitudes per completed frame, stops after maxFrames frames, and returns the number of
+    // frames written; *pSamplesConsumed, if not null, receives how many samples were used
+    int Process(const float* samples, int sampleCount, float* amplitudes, int maxFrames, int* pSamplesConsumed);
+
+private:
+    const float m_sampleRate;
+    const int m_windowSize;
+    const int m_hopSize;
+    int m_count;
+    UINT64 m_samplesSeen;
+
+    // Goertzel
+    std::vector<float> m_coefficient;
+    std::vector<float> m_s1;
+    std::vector<float> m_s2;
+
+    // sliding DFT, kept in double because the recursion never forgets its rounding errors
+    std::vector<double> m_rotateReal;
+    std::vector<double> m_rotateImag;
+    std::vector<double> m_wrapReal;
+    std::vector<double> m_wrapImag;
+    std::vector<double> m_binReal;
+    std::vector<double> m_binImag;
+    std::vector<float> m_history;
+
+    bool IsSliding() const { return m_hopSize < m_windowSize; }
+    void WriteGoertzelFrame(float* amplitudes);
+    void WriteSlidingFrame(float* amplitudes);
+};
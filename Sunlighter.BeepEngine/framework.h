@@ -19,3 +19,10 @@
 #include <deque>
 #include <sstream>
 #include <functional>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <list>
+#include <unordered_map>
+#include <immintrin.h>
+#include <intrin.h>